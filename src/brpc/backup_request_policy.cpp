@@ -0,0 +1,190 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <google/protobuf/descriptor.h>
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "bvar/reducer.h"
+#include "brpc/backup_request_policy.h"
+
+namespace brpc {
+
+// Interval of recomputing thresholds from latencies.
+static const int64_t UPDATE_INTERVAL_US = 100000;
+// Tokens are counted in thousandths.
+static const int64_t TOKEN_UNIT = 1000;
+
+struct AdaptiveBackupRequestVars {
+    bvar::Adder<int64_t> backup_count;
+    bvar::Adder<int64_t> suppressed_count;
+
+    AdaptiveBackupRequestVars()
+        : backup_count("rpc_adaptive_backup_request_count")
+        , suppressed_count("rpc_adaptive_backup_request_suppressed_count") {}
+};
+
+inline AdaptiveBackupRequestVars* get_adaptive_backup_request_vars() {
+    return butil::get_leaky_singleton<AdaptiveBackupRequestVars>();
+}
+
+BackupRequestPolicy::~BackupRequestPolicy() {}
+
+AdaptiveBackupRequestOptions::AdaptiveBackupRequestOptions()
+    : percentile(0.95)
+    , max_backup_ratio(0.05)
+    , max_burst(10)
+    , min_backup_request_ms(1)
+    , fallback_backup_request_ms(-1)
+    , min_samples(100)
+    , window_size(10) {
+}
+
+AdaptiveBackupRequestPolicy::AdaptiveBackupRequestPolicy(
+    const AdaptiveBackupRequestOptions* options)
+    : _tokens(0) {
+    if (options) {
+        _options = *options;
+    }
+    if (_options.percentile <= 0 || _options.percentile >= 1) {
+        LOG(ERROR) << "Invalid percentile=" << _options.percentile
+                   << ", use 0.95 instead";
+        _options.percentile = 0.95;
+    }
+    if (_options.window_size <= 0) {
+        _options.window_size = 10;
+    }
+    _options.max_burst = std::max(_options.max_burst, 1);
+    get_adaptive_backup_request_vars();
+}
+
+AdaptiveBackupRequestPolicy::~AdaptiveBackupRequestPolicy() {
+    butil::DoublyBufferedData<MethodMap>::ScopedPtr ptr;
+    if (_methods.Read(&ptr) == 0) {
+        for (MethodMap::const_iterator it = ptr->begin();
+             it != ptr->end(); ++it) {
+            delete it->second;
+        }
+    }
+}
+
+size_t AdaptiveBackupRequestPolicy::AddMethod(
+    MethodMap& m, const google::protobuf::MethodDescriptor* method,
+    MethodLatency* ml) {
+    m[method] = ml;
+    return 1;
+}
+
+AdaptiveBackupRequestPolicy::MethodLatency*
+AdaptiveBackupRequestPolicy::GetMethodLatency(
+    const google::protobuf::MethodDescriptor* method) const {
+    {
+        butil::DoublyBufferedData<MethodMap>::ScopedPtr ptr;
+        if (_methods.Read(&ptr) != 0) {
+            return NULL;
+        }
+        MethodMap::const_iterator it = ptr->find(method);
+        if (it != ptr->end()) {
+            return it->second;
+        }
+    }
+    BAIDU_SCOPED_LOCK(_create_mutex);
+    {
+        // Check again, another thread may have created it.
+        butil::DoublyBufferedData<MethodMap>::ScopedPtr ptr;
+        if (_methods.Read(&ptr) != 0) {
+            return NULL;
+        }
+        MethodMap::const_iterator it = ptr->find(method);
+        if (it != ptr->end()) {
+            return it->second;
+        }
+    }
+    MethodLatency* ml = new MethodLatency(_options.window_size);
+    ml->backup_request_ms.store(_options.fallback_backup_request_ms,
+                                butil::memory_order_relaxed);
+    ml->next_update_us.store(0, butil::memory_order_relaxed);
+    if (!_options.expose_prefix.empty()) {
+        ml->latency.expose(_options.expose_prefix, method->full_name());
+    }
+    _methods.Modify(AddMethod, method, ml);
+    return ml;
+}
+
+int32_t AdaptiveBackupRequestPolicy::backup_request_ms(
+    const google::protobuf::MethodDescriptor* method) const {
+    MethodLatency* ml = (method ? GetMethodLatency(method) : NULL);
+    if (ml == NULL) {
+        return _options.fallback_backup_request_ms;
+    }
+    const int64_t now = butil::gettimeofday_us();
+    int64_t next_update_us = ml->next_update_us.load(butil::memory_order_relaxed);
+    // Only one thread recomputes the threshold in each interval.
+    if (now >= next_update_us &&
+        ml->next_update_us.compare_exchange_strong(
+            next_update_us, now + UPDATE_INTERVAL_US,
+            butil::memory_order_relaxed)) {
+        int32_t ms = _options.fallback_backup_request_ms;
+        if (ml->latency.count() >= _options.min_samples) {
+            const int64_t latency_us =
+                ml->latency.latency_percentile(_options.percentile);
+            ms = std::max((int64_t)_options.min_backup_request_ms,
+                          (latency_us + 999) / 1000);
+        }
+        ml->backup_request_ms.store(ms, butil::memory_order_relaxed);
+        return ms;
+    }
+    return ml->backup_request_ms.load(butil::memory_order_relaxed);
+}
+
+void AdaptiveBackupRequestPolicy::EarnTokens() const {
+    const int64_t inc = (int64_t)(_options.max_backup_ratio * TOKEN_UNIT);
+    const int64_t cap = _options.max_burst * TOKEN_UNIT;
+    int64_t tokens = _tokens.load(butil::memory_order_relaxed);
+    while (tokens < cap &&
+           !_tokens.compare_exchange_weak(tokens, std::min(tokens + inc, cap),
+                                          butil::memory_order_relaxed)) {}
+}
+
+int32_t AdaptiveBackupRequestPolicy::GetBackupRequestMs(
+    const Controller* controller) const {
+    EarnTokens();
+    return backup_request_ms(controller->method());
+}
+
+bool AdaptiveBackupRequestPolicy::DoBackup(const Controller*) const {
+    int64_t tokens = _tokens.load(butil::memory_order_relaxed);
+    while (tokens >= TOKEN_UNIT) {
+        if (_tokens.compare_exchange_weak(tokens, tokens - TOKEN_UNIT,
+                                          butil::memory_order_relaxed)) {
+            get_adaptive_backup_request_vars()->backup_count << 1;
+            return true;
+        }
+    }
+    get_adaptive_backup_request_vars()->suppressed_count << 1;
+    return false;
+}
+
+void AdaptiveBackupRequestPolicy::OnRPCEnd(const Controller* controller) {
+    // Latencies of failed RPC (mostly timeouts) are not representative.
+    if (controller->Failed() || controller->method() == NULL) {
+        return;
+    }
+    MethodLatency* ml = GetMethodLatency(controller->method());
+    if (ml) {
+        ml->latency << controller->latency_us();
+    }
+}
+
+} // namespace brpc
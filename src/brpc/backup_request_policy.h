@@ -0,0 +1,145 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_BACKUP_REQUEST_POLICY_H
+#define BRPC_BACKUP_REQUEST_POLICY_H
+
+#include <map>
+#include <string>
+#include "butil/atomicops.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "butil/synchronization/lock.h"
+#include "bvar/latency_recorder.h"
+#include "brpc/controller.h"
+
+namespace brpc {
+
+// Inherit this class to customize when backup requests are sent.
+// Set ChannelOptions.backup_request_policy to enable.
+class BackupRequestPolicy {
+public:
+    virtual ~BackupRequestPolicy();
+
+    // Returns milliseconds after which a backup request is sent if the RPC
+    // does not finish. Negative value disables backup request of the RPC.
+    // Called before sending the RPC unless the controller has
+    // set_backup_request_ms() already.
+    virtual int32_t GetBackupRequestMs(const Controller* controller) const = 0;
+
+    // Returns true if the backup request should be sent when the time above
+    // is reached, otherwise the RPC keeps waiting for the first request.
+    virtual bool DoBackup(const Controller* controller) const = 0;
+
+    // Called when the RPC ends, before running user's done.
+    virtual void OnRPCEnd(const Controller* controller) = 0;
+};
+
+struct AdaptiveBackupRequestOptions {
+    // Constructed with default options.
+    AdaptiveBackupRequestOptions();
+
+    // Send the backup request when the RPC does not finish after this
+    // percentile of recent latencies of the method, in (0, 1).
+    // Default: 0.95
+    double percentile;
+
+    // Max ratio of RPC that send backup requests, enforced by a token
+    // bucket refilled by every RPC.
+    // Default: 0.05
+    double max_backup_ratio;
+
+    // Max burst of backup requests when tokens are accumulated.
+    // Default: 10
+    int max_burst;
+
+    // Lower bound of the computed threshold, so that backup requests are not
+    // sent too early when the latencies are tiny.
+    // Default: 1 (milliseconds)
+    int32_t min_backup_request_ms;
+
+    // Threshold used before enough latencies of the method are collected.
+    // -1 means no backup requests during the period.
+    // Default: -1
+    int32_t fallback_backup_request_ms;
+
+    // Number of successful RPC required to compute the percentile.
+    // Default: 100
+    int64_t min_samples;
+
+    // Latencies in recent so many seconds are counted.
+    // Default: 10
+    int window_size;
+
+    // Expose latencies of methods as bvars "<expose_prefix>_<method>"
+    // if this field is not empty.
+    // Default: ""
+    std::string expose_prefix;
+};
+
+// Send backup requests when the elapsed time exceeds the live percentile of
+// latencies of the method, which adapts to drifting latencies of backends
+// while a token bucket caps the extra traffic.
+// Example:
+//   brpc::AdaptiveBackupRequestOptions opt;
+//   opt.percentile = 0.99;
+//   brpc::AdaptiveBackupRequestPolicy policy(&opt);
+//   brpc::ChannelOptions options;
+//   options.backup_request_policy = &policy;  // must outlive the channel
+class AdaptiveBackupRequestPolicy : public BackupRequestPolicy {
+public:
+    // Use default options if `options' is NULL.
+    explicit AdaptiveBackupRequestPolicy(
+        const AdaptiveBackupRequestOptions* options);
+    ~AdaptiveBackupRequestPolicy();
+
+    int32_t GetBackupRequestMs(const Controller* controller) const;
+    bool DoBackup(const Controller* controller) const;
+    void OnRPCEnd(const Controller* controller);
+
+    // Current threshold of the method, -1 means no backup requests.
+    int32_t backup_request_ms(
+        const google::protobuf::MethodDescriptor* method) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(AdaptiveBackupRequestPolicy);
+
+    struct MethodLatency {
+        explicit MethodLatency(time_t window_size) : latency(window_size) {}
+        bvar::LatencyRecorder latency;
+        // Cached threshold since computing percentiles is expensive.
+        butil::atomic<int32_t> backup_request_ms;
+        butil::atomic<int64_t> next_update_us;
+    };
+    typedef std::map<const google::protobuf::MethodDescriptor*,
+                     MethodLatency*> MethodMap;
+
+    // Every RPC earns the budget of max_backup_ratio backup requests.
+    void EarnTokens() const;
+    MethodLatency* GetMethodLatency(
+        const google::protobuf::MethodDescriptor* method) const;
+    static size_t AddMethod(MethodMap& m,
+                            const google::protobuf::MethodDescriptor* method,
+                            MethodLatency* ml);
+
+    AdaptiveBackupRequestOptions _options;
+    // Held when creating MethodLatency, not in reading.
+    mutable butil::Mutex _create_mutex;
+    mutable butil::DoublyBufferedData<MethodMap> _methods;
+    // In thousandths of a token.
+    mutable butil::atomic<int64_t> _tokens;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_BACKUP_REQUEST_POLICY_H
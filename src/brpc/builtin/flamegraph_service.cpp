@@ -0,0 +1,235 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <gflags/gflags.h>
+#include "butil/string_splitter.h"
+#include "brpc/closure_guard.h"        // ClosureGuard
+#include "brpc/controller.h"           // Controller
+#include "brpc/server.h"
+#include "brpc/builtin/common.h"
+#include "brpc/details/continuous_profiler.h"
+#include "brpc/builtin/flamegraph_service.h"
+
+namespace brpc {
+
+DECLARE_int32(continuous_profiling_window);
+
+// Height of a frame in pixels.
+static const int FRAME_HEIGHT = 17;
+
+static void PrintEscaped(std::ostream& os, const std::string& s) {
+    for (size_t i = 0; i < s.size(); ++i) {
+        switch (s[i]) {
+        case '<': os << "&lt;"; break;
+        case '>': os << "&gt;"; break;
+        case '&': os << "&amp;"; break;
+        case '"': os << "&quot;"; break;
+        default: os << s[i]; break;
+        }
+    }
+}
+
+// Warm colors stable for a frame across refreshes.
+static void PrintColor(std::ostream& os, const std::string& name) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < name.size(); ++i) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    os << "rgb(" << 205 + h % 50 << ',' << (h >> 8) % 200 << ','
+       << (h >> 16) % 55 << ')';
+}
+
+struct OpenFrame {
+    std::string name;
+    int64_t start;
+};
+
+class FramePrinter {
+public:
+    FramePrinter(std::ostream& os, int64_t total) : _os(&os), _total(total) {}
+
+    void print(const std::string& name, int depth, int64_t start, int64_t end) {
+        const double width = (end - start) * 100.0 / _total;
+        if (width < 0.1) {
+            // Too narrow to be seen.
+            return;
+        }
+        *_os << "<div class=\"frame\" style=\"left:" << start * 100.0 / _total
+             << "%;width:" << width << "%;top:" << depth * FRAME_HEIGHT
+             << "px;background:";
+        PrintColor(*_os, name);
+        *_os << "\" title=\"";
+        PrintEscaped(*_os, name);
+        *_os << " (" << end - start << " samples, " << width << "%)\">";
+        PrintEscaped(*_os, name);
+        *_os << "</div>\n";
+    }
+
+private:
+    std::ostream* _os;
+    int64_t _total;
+};
+
+// Lay out folded stacks as an icicle graph: callers above callees, widths
+// proportional to samples. Stacks sharing a prefix are adjacent in `folded'
+// because it's sorted, so frames are merged by comparing with the previous
+// stack only.
+static void PrintFlameGraph(std::ostream& os,
+                            const std::map<std::string, int64_t>& folded,
+                            int64_t total) {
+    size_t max_depth = 0;
+    for (std::map<std::string, int64_t>::const_iterator
+             it = folded.begin(); it != folded.end(); ++it) {
+        size_t depth = 1;
+        for (size_t i = 0; i < it->first.size(); ++i) {
+            depth += (it->first[i] == ';');
+        }
+        max_depth = std::max(max_depth, depth);
+    }
+    os << "<div class=\"flamegraph\" style=\"height:"
+       << max_depth * FRAME_HEIGHT << "px\">\n";
+    FramePrinter printer(os, total);
+    std::vector<OpenFrame> opened;
+    std::vector<std::string> frames;
+    int64_t offset = 0;
+    for (std::map<std::string, int64_t>::const_iterator
+             it = folded.begin(); it != folded.end(); ++it) {
+        frames.clear();
+        for (butil::StringSplitter sp(it->first.c_str(), ';'); sp; ++sp) {
+            frames.push_back(std::string(sp.field(), sp.length()));
+        }
+        size_t common = 0;
+        while (common < opened.size() && common < frames.size() &&
+               opened[common].name == frames[common]) {
+            ++common;
+        }
+        while (opened.size() > common) {
+            printer.print(opened.back().name, opened.size() - 1,
+                          opened.back().start, offset);
+            opened.pop_back();
+        }
+        for (size_t i = common; i < frames.size(); ++i) {
+            OpenFrame f;
+            f.name = frames[i];
+            f.start = offset;
+            opened.push_back(f);
+        }
+        offset += it->second;
+    }
+    while (!opened.empty()) {
+        printer.print(opened.back().name, opened.size() - 1,
+                      opened.back().start, offset);
+        opened.pop_back();
+    }
+    os << "</div>\n";
+}
+
+void FlamegraphService::default_method(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::FlamegraphRequest*,
+    ::brpc::FlamegraphResponse*,
+    ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    const bool use_html = UseHTML(cntl->http_request());
+    cntl->http_response().set_content_type(
+        use_html ? "text/html" : "text/plain");
+
+    int seconds = FLAGS_continuous_profiling_window;
+    const std::string* param =
+        cntl->http_request().uri().GetQuery("seconds");
+    if (param != NULL) {
+        char* endptr = NULL;
+        seconds = strtol(param->c_str(), &endptr, 10);
+        if (endptr != param->c_str() + param->length() || seconds <= 0) {
+            cntl->SetFailed(EINVAL, "Invalid seconds=%s", param->c_str());
+            return;
+        }
+    }
+
+    // Show stacks of one bthread only, e.g. a bthread found in /bthreads.
+    bthread_t bthread_id = 0;
+    param = cntl->http_request().uri().GetQuery("bthread");
+    if (param != NULL) {
+        char* endptr = NULL;
+        bthread_id = strtoull(param->c_str(), &endptr, 10);
+        if (endptr != param->c_str() + param->length() || bthread_id == 0) {
+            cntl->SetFailed(EINVAL, "Invalid bthread=%s", param->c_str());
+            return;
+        }
+    }
+
+    std::map<std::string, int64_t> folded;
+    const int64_t total = GetFoldedStacks(seconds, bthread_id, &folded);
+
+    butil::IOBufBuilder os;
+    if (use_html) {
+        os << "<!DOCTYPE html><html><head>\n"
+           << "<script language=\"javascript\" type=\"text/javascript\" src=\"/js/jquery_min\"></script>\n"
+           << TabsHead()
+           << "<style type=\"text/css\">\n"
+              ".flamegraph { position:relative; width:100%; }\n"
+              ".frame { position:absolute; height:" << FRAME_HEIGHT - 1
+           << "px; overflow:hidden; white-space:nowrap;"
+              " font:11px monospace; line-height:" << FRAME_HEIGHT - 1
+           << "px; border-radius:2px; cursor:default; }\n"
+              "</style>\n"
+              "</head><body>";
+        cntl->server()->PrintTabsBody(os, "flamegraph");
+    }
+    if (!FLAGS_enable_continuous_profiling) {
+        if (!IsContinuousProfilingSupported()) {
+            os << "Continuous profiling is not supported on this platform\n";
+        } else if (use_html) {
+            os << "Continuous profiling is disabled, <a href=\"/flags/"
+                "enable_continuous_profiling?setvalue=true\">enable</a> it.<br>\n";
+        } else {
+            os << "Continuous profiling is disabled, turn on it by "
+                "/flags/enable_continuous_profiling?setvalue=true\n";
+        }
+    }
+    if (use_html) {
+        os << "<p>" << total << " samples in last " << seconds
+           << " seconds";
+        if (bthread_id != 0) {
+            os << " of bthread " << bthread_id;
+        }
+        os << ". Callers are above callees, hover a frame to see"
+              " details.</p>\n";
+        if (total > 0) {
+            PrintFlameGraph(os, folded, total);
+        }
+        os << "</body></html>\n";
+    } else {
+        for (std::map<std::string, int64_t>::const_iterator
+                 it = folded.begin(); it != folded.end(); ++it) {
+            os << it->first << ' ' << it->second << '\n';
+        }
+    }
+    os.move_to(cntl->response_attachment());
+}
+
+void FlamegraphService::GetTabInfo(TabInfoList* info_list) const {
+    TabInfo* info = info_list->add();
+    info->path = "/flamegraph";
+    info->tab_name = "flamegraph";
+}
+
+} // namespace brpc
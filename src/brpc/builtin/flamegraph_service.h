@@ -0,0 +1,37 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_FLAMEGRAPH_SERVICE_H
+#define BRPC_FLAMEGRAPH_SERVICE_H
+
+#include "brpc/builtin_service.pb.h"
+#include "brpc/builtin/tabbed.h"
+
+namespace brpc {
+
+// Show stacks sampled by the continuous profiler, as a flame graph in
+// browsers or folded stacks in terminals.
+class FlamegraphService : public flamegraph, public Tabbed {
+public:
+    void default_method(::google::protobuf::RpcController* cntl_base,
+                        const ::brpc::FlamegraphRequest* request,
+                        ::brpc::FlamegraphResponse* response,
+                        ::google::protobuf::Closure* done);
+
+    void GetTabInfo(TabInfoList* info_list) const;
+};
+
+} // namespace brpc
+
+#endif // BRPC_FLAMEGRAPH_SERVICE_H
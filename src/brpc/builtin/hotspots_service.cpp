@@ -36,6 +36,8 @@ void __attribute__((weak)) ProfilerStop();
 namespace bthread {
 bool ContentionProfilerStart(const char* filename);
 void ContentionProfilerStop();
+bool BlockingProfilerStart(const char* filename);
+void BlockingProfilerStop();
 }
 
 
@@ -88,13 +90,25 @@ struct ProfilingEnvironment {
 };
 
 // Different ProfilingType have different env.
-static ProfilingEnvironment g_env[4] = {
+static ProfilingEnvironment g_env[5] = {
+    { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
     { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
     { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
     { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
     { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL }
 };
 
+// Profiles of these types are sampled for a given number of seconds.
+static bool IsProfilingForSeconds(ProfilingType type) {
+    return type == PROFILING_CPU || type == PROFILING_CONTENTION ||
+        type == PROFILING_BLOCKING;
+}
+
+// Profiles of these types record durations and counts of events.
+static bool HasEventCount(ProfilingType type) {
+    return type == PROFILING_CONTENTION || type == PROFILING_BLOCKING;
+}
+
 // The `content' should be small so that it can be written into file in one
 // fwrite (at most time).
 static bool WriteSmallFile(const char* filepath_in,
@@ -551,7 +565,7 @@ static void DoProfiling(ProfilingType type,
     }
 
     const int seconds = ReadSeconds(cntl);
-    if ((type == PROFILING_CPU || type == PROFILING_CONTENTION)) {
+    if (IsProfilingForSeconds(type)) {
         if (seconds < 0) {
             os << "Invalid seconds" << (use_html ? "</body></html>" : "\n");
             os.move_to(cntl->response_attachment());
@@ -569,7 +583,7 @@ static void DoProfiling(ProfilingType type,
         client_info << "(no auth)";
     }
     client_info << " requests for profiling " << ProfilingType2String(type);
-    if (type == PROFILING_CPU || type == PROFILING_CONTENTION) {
+    if (IsProfilingForSeconds(type)) {
         LOG(INFO) << client_info.str() << " for " << seconds << " seconds";
     } else {
         LOG(INFO) << client_info.str();
@@ -683,6 +697,18 @@ static void DoProfiling(ProfilingType type,
             PLOG(WARNING) << "Profiling has been interrupted";
         }
         bthread::ContentionProfilerStop();
+    } else if (type == PROFILING_BLOCKING) {
+        if (!bthread::BlockingProfilerStart(prof_name)) {
+            os << "Another profiler (not via /hotspots/blocking) is running, "
+                "try again later" << (use_html ? "</body></html>" : "\n");
+            os.move_to(resp);
+            cntl->http_response().set_status_code(HTTP_STATUS_SERVICE_UNAVAILABLE);
+            return NotifyWaiters(type, cntl, view);
+        }
+        if (bthread_usleep(seconds * 1000000L) != 0) {
+            PLOG(WARNING) << "Profiling has been interrupted";
+        }
+        bthread::BlockingProfilerStop();
     } else if (type == PROFILING_HEAP) {
         MallocExtension* malloc_ext = MallocExtension::instance();
         if (malloc_ext == NULL || !has_TCMALLOC_SAMPLE_PARAMETER()) {
@@ -757,7 +783,7 @@ static void StartProfiling(ProfilingType type,
 
     if (type == PROFILING_CPU) {
         enabled = cpu_profiler_enabled;
-    } else if (type == PROFILING_CONTENTION) {
+    } else if (HasEventCount(type)) {
         enabled = true;
     } else if (type == PROFILING_HEAP) {
         enabled = IsHeapProfilerEnabled();
@@ -822,7 +848,7 @@ static void StartProfiling(ProfilingType type,
         "  var past_prof = document.getElementById('view_prof').value;\n"
         "  var base_prof = document.getElementById('base_prof').value;\n"
         "  var use_text = document.getElementById('text_cb').checked;\n";
-    if (type == PROFILING_CONTENTION) {
+    if (HasEventCount(type)) {
         os << "  var show_ccount = document.getElementById('ccount_cb').checked;\n";
     }
     os << "  var targetURL = '/hotspots/" << type_str << "';\n"
@@ -854,7 +880,7 @@ static void StartProfiling(ProfilingType type,
         "    }\n"
         "    targetURL += 'text';\n"
         "  }\n";
-    if (type == PROFILING_CONTENTION) {
+    if (HasEventCount(type)) {
         os <<
         "  if (show_ccount) {\n"
         "    if (first) {\n"
@@ -912,7 +938,7 @@ static void StartProfiling(ProfilingType type,
         "  }\n"
         "  $.ajax({\n"
         "    url: \"/hotspots/" << type_str << "_non_responsive?console=1";
-    if (type == PROFILING_CPU || type == PROFILING_CONTENTION) {
+    if (IsProfilingForSeconds(type)) {
         os << "&seconds=" << seconds;
     }
     if (profiling_client.id != 0) {
@@ -1006,7 +1032,7 @@ static void StartProfiling(ProfilingType type,
         "<input id='text_cb' type='checkbox'"
        << (use_text ? " checked=''" : "") <<
         " onclick='onChangedCB(this);'>text</label>";
-    if (type == PROFILING_CONTENTION) {
+    if (HasEventCount(type)) {
         os << "&nbsp;&nbsp;&nbsp;<label for='ccount_cb'>"
             "<input id='ccount_cb' type='checkbox'"
            << (show_ccount ? " checked=''" : "") <<
@@ -1036,7 +1062,7 @@ static void StartProfiling(ProfilingType type,
         return;
     }
 
-    if ((type == PROFILING_CPU || type == PROFILING_CONTENTION) && view == NULL) {
+    if (IsProfilingForSeconds(type) && view == NULL) {
         if (seconds < 0) {
             os << "Invalid seconds</body></html>";
             os.move_to(cntl->response_attachment());
@@ -1060,11 +1086,11 @@ static void StartProfiling(ProfilingType type,
                       / 1000000.0);
         os << "Your request is merged with the request from "
            << profiling_client.point;
-        if (type == PROFILING_CPU || type == PROFILING_CONTENTION) {
+        if (IsProfilingForSeconds(type)) {
             os << ", showing in about " << wait_seconds << " seconds ...";
         }
     } else {
-        if ((type == PROFILING_CPU || type == PROFILING_CONTENTION) && view == NULL) {
+        if (IsProfilingForSeconds(type) && view == NULL) {
             os << "Profiling " << ProfilingType2String(type) << " for "
                << seconds << " seconds ...";
         } else {
@@ -1114,6 +1140,14 @@ void HotspotsService::contention(
     return StartProfiling(PROFILING_CONTENTION, cntl_base, done);
 }
 
+void HotspotsService::blocking(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::HotspotsRequest*,
+    ::brpc::HotspotsResponse*,
+    ::google::protobuf::Closure* done) {
+    return StartProfiling(PROFILING_BLOCKING, cntl_base, done);
+}
+
 void HotspotsService::cpu_non_responsive(
     ::google::protobuf::RpcController* cntl_base,
     const ::brpc::HotspotsRequest*,
@@ -1146,6 +1180,14 @@ void HotspotsService::contention_non_responsive(
     return DoProfiling(PROFILING_CONTENTION, cntl_base, done);
 }
 
+void HotspotsService::blocking_non_responsive(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::HotspotsRequest*,
+    ::brpc::HotspotsResponse*,
+    ::google::protobuf::Closure* done) {
+    return DoProfiling(PROFILING_BLOCKING, cntl_base, done);
+}
+
 void HotspotsService::GetTabInfo(TabInfoList* info_list) const {
     TabInfo* info = info_list->add();
     info->path = "/hotspots/cpu";
@@ -1159,6 +1201,9 @@ void HotspotsService::GetTabInfo(TabInfoList* info_list) const {
     info = info_list->add();
     info->path = "/hotspots/contention";
     info->tab_name = "contention";
+    info = info_list->add();
+    info->path = "/hotspots/blocking";
+    info->tab_name = "blocking";
 }
 
 } // namespace brpc
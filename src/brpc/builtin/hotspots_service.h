@@ -48,6 +48,11 @@ public:
                     ::brpc::HotspotsResponse* response,
                     ::google::protobuf::Closure* done);
 
+    void blocking(::google::protobuf::RpcController* cntl_base,
+                  const ::brpc::HotspotsRequest* request,
+                  ::brpc::HotspotsResponse* response,
+                  ::google::protobuf::Closure* done);
+
     void cpu_non_responsive(::google::protobuf::RpcController* cntl_base,
                             const ::brpc::HotspotsRequest* request,
                             ::brpc::HotspotsResponse* response,
@@ -68,6 +73,11 @@ public:
                                    ::brpc::HotspotsResponse* response,
                                    ::google::protobuf::Closure* done);
 
+    void blocking_non_responsive(::google::protobuf::RpcController* cntl_base,
+                                 const ::brpc::HotspotsRequest* request,
+                                 ::brpc::HotspotsResponse* response,
+                                 ::google::protobuf::Closure* done);
+
     void GetTabInfo(brpc::TabInfoList*) const;
 };
 
@@ -14,14 +14,18 @@
 
 // Authors: Jiashun Zhu(zhujiashun@bilibili.com)
 
+#include <inttypes.h>                        // PRId64
 #include <vector>
-#include <iomanip>
+#include <algorithm>                         // std::min
 #include <map>
+#include <set>
 #include "brpc/controller.h"                // Controller
 #include "brpc/server.h"                    // Server
 #include "brpc/closure_guard.h"             // ClosureGuard
 #include "brpc/builtin/prometheus_metrics_service.h"
 #include "brpc/builtin/common.h"
+#include "butil/iobuf.h"                    // IOBufAppender
+#include "butil/string_printf.h"
 #include "bvar/bvar.h"
 
 namespace bvar {
@@ -32,85 +36,184 @@ DECLARE_int32(bvar_latency_p3);
 
 namespace brpc {
 
+// Histograms of LatencyRecorders are output with buckets whose upper bounds
+// are 2^bits-1 microseconds, 15us to about 67s.
+static const int PROMETHEUS_HISTOGRAM_MIN_BITS = 4;
+static const int PROMETHEUS_HISTOGRAM_MAX_BITS = 26;
+
 // This is a class that convert bvar result to prometheus output.
-// Currently the output only includes gauge and summary for two
-// reasons:
+// Currently the output only includes gauge, summary and histogram:
 // 1) We cannot tell gauge and counter just from name and what's
 // more counter is just another gauge.
-// 2) Histogram and summary is equivalent except that histogram
-// calculates quantiles in the server side.
+// 2) LatencyRecorders are output as summaries, or as histograms if they
+// use histograms (-bvar_latency_recorder_use_histogram), whose buckets
+// are fixed and aggregatable across instances.
+// 3) Stats of multi-dimensional bvars are output as gauges with labels.
+// Scraping a server with lots of bvars should be cheap, so integers are
+// received by dump_int() and written into the IOBuf directly instead of
+// being printed by describe() and parsed again, and all output goes
+// through IOBufAppender rather than std::ostream.
 class PrometheusMetricsDumper : public bvar::Dumper {
 public:
-    explicit PrometheusMetricsDumper(butil::IOBufBuilder* os,
-                                     const std::string& server_prefix)
-        : _os(os)
-        , _server_prefix(server_prefix) {
-    }
+    explicit PrometheusMetricsDumper(butil::IOBufAppender* out,
+                                     const std::string& server_prefix);
 
     bool dump(const std::string& name, const butil::StringPiece& desc) override;
+    bool dump_int(const std::string& name, int64_t value) override;
+
+    // Output labeled metrics buffered by DumpLabeledMetric(), called after
+    // all variables are dumped.
+    void Finish();
 
 private:
     DISALLOW_COPY_AND_ASSIGN(PrometheusMetricsDumper);
 
+    // Return true iff name has labels, namely dumped by MVariable.
+    bool DumpLabeledMetric(const butil::StringPiece& name,
+                           const butil::StringPiece& desc);
+
+    // Return true iff name is a latency histogram exposed by LatencyRecorder.
+    bool DumpLatencyHistogram(const butil::StringPiece& name,
+                              const butil::StringPiece& desc);
+
     // Return true iff name ends with suffix output by LatencyRecorder.
     bool DumpLatencyRecorderSuffix(const butil::StringPiece& name,
-                                   const butil::StringPiece& desc);
+                                   int64_t value);
+
+    void DumpGauge(const butil::StringPiece& name,
+                   const butil::StringPiece& value) {
+        Append("# HELP ");
+        Append(name);
+        Append("\n# TYPE ");
+        Append(name);
+        Append(" gauge\n");
+        Append(name);
+        _out->push_back(' ');
+        Append(value);
+        _out->push_back('\n');
+    }
+
+    void Append(const butil::StringPiece& str) { _out->append(str); }
+    void AppendInt(int64_t value);
 
     // 6 is the number of bvars in LatencyRecorder that indicating percentiles
     static const int NPERCENTILES = 6;
 
     struct SummaryItems {
-        std::string latency_percentiles[NPERCENTILES];
-        std::string latency_avg;
-        std::string count;
+        SummaryItems() : latency_avg(0), count(0) {
+            memset(latency_percentiles, 0, sizeof(latency_percentiles));
+        }
+        int64_t latency_percentiles[NPERCENTILES];
+        int64_t latency_avg;
+        int64_t count;
         std::string metric_name;
 
         bool IsComplete() const { return !metric_name.empty(); }
     };
     const SummaryItems* ProcessLatencyRecorderSuffix(const butil::StringPiece& name,
-                                                     const butil::StringPiece& desc);
+                                                     int64_t value);
 
 private:
-    butil::IOBufBuilder* _os;
+    butil::IOBufAppender* _out;
     const std::string _server_prefix;
+    // Suffixes of percentiles in LatencyRecorder and their quantiles in
+    // output, which depend on -bvar_latency_p[1-3] and are computed once
+    // in each scrape.
+    std::string _latency_names[NPERCENTILES];
+    std::string _quantiles[NPERCENTILES];
     std::map<std::string, SummaryItems> _m;
+    // LatencyRecorders output as histograms rather than summaries.
+    std::set<std::string> _histograms;
+    // Lines of labeled stats grouped by metric name. Stats of one metric
+    // are not always dumped adjacently, e.g. suffixes of a
+    // MultiDimension<LatencyRecorder> are interleaved by label sets, while
+    // prometheus requires a metric family to be contiguous and described
+    // by one TYPE line.
+    std::map<std::string, std::string> _labeled_metrics;
 };
 
+PrometheusMetricsDumper::PrometheusMetricsDumper(
+    butil::IOBufAppender* out, const std::string& server_prefix)
+    : _out(out)
+    , _server_prefix(server_prefix) {
+    const int percentiles[3] = { (int)bvar::FLAGS_bvar_latency_p1,
+                                 (int)bvar::FLAGS_bvar_latency_p2,
+                                 (int)bvar::FLAGS_bvar_latency_p3 };
+    for (int i = 0; i < 3; ++i) {
+        _latency_names[i] = butil::string_printf("_latency_%d", percentiles[i]);
+        _quantiles[i] = butil::string_printf("%g", percentiles[i] / 100.0);
+    }
+    _latency_names[3] = "_latency_999";
+    _quantiles[3] = "0.999";
+    _latency_names[4] = "_latency_9999";
+    _quantiles[4] = "0.9999";
+    _latency_names[5] = "_max_latency";
+    _quantiles[5] = "1";
+}
+
+void PrometheusMetricsDumper::AppendInt(int64_t value) {
+    char buf[24];
+    char* const end = buf + sizeof(buf);
+    char* p = end;
+    uint64_t u = (value < 0 ? -(uint64_t)value : (uint64_t)value);
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (value < 0) {
+        *--p = '-';
+    }
+    _out->append(p, end - p);
+}
+
 bool PrometheusMetricsDumper::dump(const std::string& name,
                                    const butil::StringPiece& desc) {
     if (!desc.empty() && desc[0] == '"') {
         // there is no necessary to monitor string in prometheus
         return true;
     }
-    if (DumpLatencyRecorderSuffix(name, desc)) {
+    if (DumpLabeledMetric(name, desc)) {
+        return true;
+    }
+    if (DumpLatencyHistogram(name, desc)) {
+        return true;
+    }
+    // Non-integers of LatencyRecorder (e.g. average latency) are rare, parse
+    // them into integers as before.
+    char buf[32];
+    const size_t len = std::min(desc.size(), sizeof(buf) - 1);
+    memcpy(buf, desc.data(), len);
+    buf[len] = '\0';
+    if (DumpLatencyRecorderSuffix(name, strtoll(buf, NULL, 10))) {
         // Has encountered name with suffix exposed by LatencyRecorder,
         // Leave it to DumpLatencyRecorderSuffix to output Summary.
         return true;
     }
-    *_os << "# HELP " << name << '\n'
-         << "# TYPE " << name << " gauge" << '\n'
-         << name << " " << desc << '\n';
+    DumpGauge(name, desc);
+    return true;
+}
+
+bool PrometheusMetricsDumper::dump_int(const std::string& name, int64_t value) {
+    if (DumpLatencyRecorderSuffix(name, value)) {
+        return true;
+    }
+    char buf[24];
+    const int len = snprintf(buf, sizeof(buf), "%" PRId64, value);
+    DumpGauge(name, butil::StringPiece(buf, len));
     return true;
 }
 
 const PrometheusMetricsDumper::SummaryItems*
 PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece& name,
-                                                      const butil::StringPiece& desc) {
-    static std::string latency_names[] = {
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p1),
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p2),
-        butil::string_printf("_latency_%d", (int)bvar::FLAGS_bvar_latency_p3),
-        "_latency_999", "_latency_9999", "_max_latency"
-    };
-    CHECK(NPERCENTILES == arraysize(latency_names));
+                                                      int64_t value) {
     butil::StringPiece metric_name(name);
     for (int i = 0; i < NPERCENTILES; ++i) {
-        if (!metric_name.ends_with(latency_names[i])) {
+        if (!metric_name.ends_with(_latency_names[i])) {
             continue;
         }
-        metric_name.remove_suffix(latency_names[i].size());
+        metric_name.remove_suffix(_latency_names[i].size());
         SummaryItems* si = &_m[metric_name.as_string()];
-        si->latency_percentiles[i] = desc.as_string();
+        si->latency_percentiles[i] = value;
         if (i == NPERCENTILES - 1) {
             // '_max_latency' is the last suffix name that appear in the sorted bvar
             // list, which means all related percentiles have been gathered and we are
@@ -123,54 +226,183 @@ PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece&
     if (metric_name.ends_with("_latency")) {
         metric_name.remove_suffix(8);
         SummaryItems* si = &_m[metric_name.as_string()];
-        si->latency_avg = desc.as_string();
+        si->latency_avg = value;
         return si;
     }
     if (metric_name.ends_with("_count")) {
         metric_name.remove_suffix(6);
         SummaryItems* si = &_m[metric_name.as_string()];
-        si->count = desc.as_string();
+        si->count = value;
         return si;
     }
     return NULL;
 }
 
-bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
+bool PrometheusMetricsDumper::DumpLabeledMetric(
     const butil::StringPiece& name,
     const butil::StringPiece& desc) {
+    const size_t pos = name.find('{');
+    if (pos == butil::StringPiece::npos) {
+        return false;
+    }
+    std::string& lines = _labeled_metrics[name.substr(0, pos).as_string()];
+    lines.append(name.data(), name.size());
+    lines.push_back(' ');
+    lines.append(desc.data(), desc.size());
+    lines.push_back('\n');
+    return true;
+}
+
+void PrometheusMetricsDumper::Finish() {
+    for (std::map<std::string, std::string>::const_iterator
+             it = _labeled_metrics.begin(); it != _labeled_metrics.end(); ++it) {
+        Append("# HELP ");
+        Append(it->first);
+        Append("\n# TYPE ");
+        Append(it->first);
+        Append(" gauge\n");
+        Append(it->second);
+    }
+    _labeled_metrics.clear();
+}
+
+bool PrometheusMetricsDumper::DumpLatencyHistogram(
+    const butil::StringPiece& name,
+    const butil::StringPiece& desc) {
+    const butil::StringPiece suffix("_latency_histogram");
+    if (!name.ends_with(suffix)) {
+        return false;
+    }
+    // desc is {"sum":S,"count":N,"buckets":[[max1,count1],...]}, numbers
+    // are always followed by ',' or ']' so that strtoll stops inside desc.
+    const size_t sum_pos = desc.find("\"sum\":");
+    const size_t count_pos = desc.find("\"count\":");
+    const size_t buckets_pos = desc.find("\"buckets\":[");
+    if (sum_pos == butil::StringPiece::npos ||
+        count_pos == butil::StringPiece::npos ||
+        buckets_pos == butil::StringPiece::npos) {
+        return false;
+    }
+    const long long sum = strtoll(desc.data() + sum_pos + 6, NULL, 10);
+    const long long count = strtoll(desc.data() + count_pos + 8, NULL, 10);
+    // Histograms of LatencyRecorders inside the server replace the
+    // summaries, others are named after the bvar to avoid conflicts with
+    // the "_count" bvars.
+    butil::StringPiece metric_name(name);
+    if (name.starts_with(_server_prefix)) {
+        metric_name.remove_suffix(suffix.size());
+        _histograms.insert(metric_name.as_string());
+    }
+    Append("# HELP ");
+    Append(metric_name);
+    Append("\n# TYPE ");
+    Append(metric_name);
+    Append(" histogram\n");
+    // The fine buckets in desc are non-empty ones only, which differ between
+    // instances and over time. Output cumulative counts at a fixed, coarse
+    // set of bounds instead, including empty ones, so that series of all
+    // instances share the same `le' labels. Every bound is the largest value
+    // of a fine bucket, thus the counts are exact.
+    const char* const end = desc.data() + desc.size();
+    const char* p = desc.data() + buckets_pos + 11;
+    long long cumulative = 0;
+    // Largest value and cumulative count of the fine bucket not consumed yet.
+    long long next_max = -1;
+    long long next_count = 0;
+    for (int bits = PROMETHEUS_HISTOGRAM_MIN_BITS;
+         bits <= PROMETHEUS_HISTOGRAM_MAX_BITS; ++bits) {
+        const long long le = (1LL << bits) - 1;
+        while (true) {
+            if (next_max < 0) {
+                if (p >= end || *p != '[') {
+                    break;
+                }
+                char* q = NULL;
+                const long long max = strtoll(p + 1, &q, 10);
+                if (q >= end || *q != ',') {
+                    p = end;
+                    break;
+                }
+                const long long c = strtoll(q + 1, &q, 10);
+                if (q >= end || *q != ']') {
+                    p = end;
+                    break;
+                }
+                next_max = max;
+                next_count = c;
+                p = q + 1;
+                if (p < end && *p == ',') {
+                    ++p;
+                }
+            }
+            if (next_max > le) {
+                break;
+            }
+            cumulative = next_count;
+            next_max = -1;
+        }
+        Append(metric_name);
+        Append("_bucket{le=\"");
+        AppendInt(le);
+        Append("\"} ");
+        AppendInt(cumulative);
+        _out->push_back('\n');
+    }
+    Append(metric_name);
+    Append("_bucket{le=\"+Inf\"} ");
+    AppendInt(count);
+    _out->push_back('\n');
+    Append(metric_name);
+    Append("_sum ");
+    AppendInt(sum);
+    _out->push_back('\n');
+    Append(metric_name);
+    Append("_count ");
+    AppendInt(count);
+    _out->push_back('\n');
+    return true;
+}
+
+bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
+    const butil::StringPiece& name, int64_t value) {
     if (!name.starts_with(_server_prefix)) {
         return false;
     }
-    const SummaryItems* si = ProcessLatencyRecorderSuffix(name, desc);
+    const SummaryItems* si = ProcessLatencyRecorderSuffix(name, value);
     if (!si) {
         return false;
     }
     if (!si->IsComplete()) {
         return true;
     }
-    *_os << "# HELP " << si->metric_name << '\n'
-         << "# TYPE " << si->metric_name << " summary\n"
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p1) / 100 << "\"} "
-         << si->latency_percentiles[0] << '\n'
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p2) / 100 << "\"} "
-         << si->latency_percentiles[1] << '\n'
-         << si->metric_name << "{quantile=\""
-         << (double)(bvar::FLAGS_bvar_latency_p3) / 100 << "\"} "
-         << si->latency_percentiles[2] << '\n'
-         << si->metric_name << "{quantile=\"0.999\"} "
-         << si->latency_percentiles[3] << '\n'
-         << si->metric_name << "{quantile=\"0.9999\"} "
-         << si->latency_percentiles[4] << '\n'
-         << si->metric_name << "{quantile=\"1\"} "
-         << si->latency_percentiles[5] << '\n'
-         << si->metric_name << "_sum "
-         // There is no sum of latency in bvar output, just use
-         // average * count as approximation
-         << strtoll(si->latency_avg.data(), NULL, 10) *
-                strtoll(si->count.data(), NULL, 10) << '\n'
-         << si->metric_name << "_count " << si->count << '\n';
+    if (_histograms.count(si->metric_name)) {
+        // Already output as a histogram.
+        return true;
+    }
+    const std::string& metric_name = si->metric_name;
+    Append("# HELP ");
+    Append(metric_name);
+    Append("\n# TYPE ");
+    Append(metric_name);
+    Append(" summary\n");
+    for (int i = 0; i < NPERCENTILES; ++i) {
+        Append(metric_name);
+        Append("{quantile=\"");
+        Append(_quantiles[i]);
+        Append("\"} ");
+        AppendInt(si->latency_percentiles[i]);
+        _out->push_back('\n');
+    }
+    // There is no sum of latency in bvar output, just use
+    // average * count as approximation
+    Append(metric_name);
+    Append("_sum ");
+    AppendInt(si->latency_avg * si->count);
+    _out->push_back('\n');
+    Append(metric_name);
+    Append("_count ");
+    AppendInt(si->count);
+    _out->push_back('\n');
     return true;
 }
 
@@ -181,14 +413,15 @@ void PrometheusMetricsService::default_method(::google::protobuf::RpcController*
     ClosureGuard done_guard(done);
     Controller *cntl = static_cast<Controller*>(cntl_base);
     cntl->http_response().set_content_type("text/plain");
-    butil::IOBufBuilder os;
-    PrometheusMetricsDumper dumper(&os, _server->ServerPrefix());
-    const int ndump = bvar::Variable::dump_exposed(&dumper, NULL);
-    if (ndump < 0) {
+    butil::IOBufAppender out;
+    PrometheusMetricsDumper dumper(&out, _server->ServerPrefix());
+    if (bvar::Variable::dump_exposed(&dumper, NULL) < 0 ||
+        bvar::MVariable::dump_exposed(&dumper, NULL) < 0) {
         cntl->SetFailed("Fail to dump metrics");
         return;
     }
-    os.move_to(cntl->response_attachment());
+    dumper.Finish();
+    out.move_to(cntl->response_attachment());
 }
 
 } // namespace brpc
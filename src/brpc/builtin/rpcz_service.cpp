@@ -366,7 +366,12 @@ static void PrintServerSpan(std::ostream& os, const RpczSpan& span,
     if (PrintAnnotationsAndRealTimeSpan(
             os, span.sent_real_us(),
             &last_time, extr, ARRAY_SIZE(extr))) {
-        os << " Responded(" << span.response_size() << ')' << std::endl;
+        os << " Responded(" << span.response_size() << ')';
+        if (span.has_cputime_us()) {
+            os << " cputime=" << span.cputime_us() << "us rq_wait="
+               << span.rq_wait_us() << "us";
+        }
+        os << std::endl;
     }
 
     PrintAnnotations(os, std::numeric_limits<int64_t>::max(),
@@ -17,15 +17,18 @@
 //          Zhangyi Chen(chenzhangyi01@baidu.com)
 
 #include <inttypes.h>
+#include <map>
 #include <google/protobuf/descriptor.h>
 #include <gflags/gflags.h>
 #include "butil/time.h"                              // milliseconds_from_now
 #include "butil/logging.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h"
 #include "butil/strings/string_util.h"
+#include "butil/scoped_lock.h"
 #include "bthread/unstable.h"                        // bthread_timer_add
 #include "brpc/socket_map.h"                         // SocketMapInsert
 #include "brpc/compress.h"
+#include "brpc/concurrency_limiter.h"
 #include "brpc/global.h"
 #include "brpc/span.h"
 #include "brpc/details/load_balancer_with_naming.h"
@@ -38,11 +41,13 @@ namespace brpc {
 
 DECLARE_bool(enable_rpcz);
 DECLARE_bool(usercode_in_pthread);
+DECLARE_bool(enable_latency_breakdown);
 
 ChannelOptions::ChannelOptions()
     : connect_timeout_ms(200)
     , timeout_ms(500)
     , backup_request_ms(-1)
+    , backup_request_policy(NULL)
     , max_retry(3)
     , enable_circuit_breaker(false)
     , protocol(PROTOCOL_BAIDU_STD)
@@ -52,6 +57,8 @@ ChannelOptions::ChannelOptions()
     , auth(NULL)
     , retry_policy(NULL)
     , ns_filter(NULL)
+    , enable_request_coalescing(false)
+    , response_cache(NULL)
 {}
 
 ChannelSSLOptions* ChannelOptions::mutable_ssl_options() {
@@ -64,7 +71,8 @@ ChannelSSLOptions* ChannelOptions::mutable_ssl_options() {
 static ChannelSignature ComputeChannelSignature(const ChannelOptions& opt) {
     if (opt.auth == NULL &&
         !opt.has_ssl_options() &&
-        opt.connection_group.empty()) {
+        opt.connection_group.empty() &&
+        opt.max_concurrency_per_server == AdaptiveMaxConcurrency::UNLIMITED()) {
         // Returning zeroized result by default is more intuitive for users.
         return ChannelSignature();
     }
@@ -84,6 +92,12 @@ static ChannelSignature ComputeChannelSignature(const ChannelOptions& opt) {
             buf.append("|auth=");
             buf.append((char*)&opt.auth, sizeof(opt.auth));
         }
+        if (opt.max_concurrency_per_server != AdaptiveMaxConcurrency::UNLIMITED()) {
+            // Sockets carry the limiters, don't share them between channels
+            // with different limits.
+            buf.append("|maxcc=");
+            buf.append(opt.max_concurrency_per_server.value());
+        }
         if (opt.has_ssl_options()) {
             const ChannelSSLOptions& ssl = opt.ssl_options();
             buf.push_back('|');
@@ -125,12 +139,32 @@ static ChannelSignature ComputeChannelSignature(const ChannelOptions& opt) {
     } while (true);
 }
 
+// Values of ChannelOptions.max_concurrency_per_server referenced by
+// Controllers, which may still retry after the Channel is destroyed.
+// Distinct values are few and never freed.
+static pthread_mutex_t g_max_concurrency_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, AdaptiveMaxConcurrency*>* g_max_concurrency_map = NULL;
+
+static const AdaptiveMaxConcurrency*
+GetPersistentMaxConcurrency(const AdaptiveMaxConcurrency& amc) {
+    BAIDU_SCOPED_LOCK(g_max_concurrency_map_mutex);
+    if (g_max_concurrency_map == NULL) {
+        g_max_concurrency_map = new std::map<std::string, AdaptiveMaxConcurrency*>;
+    }
+    AdaptiveMaxConcurrency*& ptr = (*g_max_concurrency_map)[amc.value()];
+    if (ptr == NULL) {
+        ptr = new AdaptiveMaxConcurrency(amc);
+    }
+    return ptr;
+}
+
 Channel::Channel(ProfilerLinker)
     : _server_id(INVALID_SOCKET_ID)
     , _serialize_request(NULL)
     , _pack_request(NULL)
     , _get_method_name(NULL)
-    , _preferred_index(-1) {
+    , _preferred_index(-1)
+    , _max_concurrency_per_server(NULL) {
 }
 
 Channel::~Channel() {
@@ -197,6 +231,22 @@ int Channel::InitChannelOptions(const ChannelOptions* options) {
     if (!cg.empty() && (::isspace(cg.front()) || ::isspace(cg.back()))) {
         butil::TrimWhitespace(cg, butil::TRIM_ALL, &cg);
     }
+    if (_options.max_concurrency_per_server != AdaptiveMaxConcurrency::UNLIMITED() &&
+        ConcurrencyLimiterExtension()->Find(
+            _options.max_concurrency_per_server.type().c_str()) == NULL) {
+        LOG(ERROR) << "Fail to find ConcurrencyLimiter by `"
+                   << _options.max_concurrency_per_server.type()
+                   << "' for max_concurrency_per_server";
+        return -1;
+    }
+    _max_concurrency_per_server = NULL;
+    if ((int)_options.max_concurrency_per_server != 0) {
+        _max_concurrency_per_server =
+            GetPersistentMaxConcurrency(_options.max_concurrency_per_server);
+    }
+    if (_options.enable_request_coalescing && _coalescer == NULL) {
+        _coalescer.reset(new RequestCoalescer);
+    }
     return 0;
 }
 
@@ -332,11 +382,6 @@ int Channel::Init(const char* ns_url,
                      NULL, &_options.mutable_ssl_options()->sni_name, NULL);
         }
     }
-    LoadBalancerWithNaming* lb = new (std::nothrow) LoadBalancerWithNaming;
-    if (NULL == lb) {
-        LOG(FATAL) << "Fail to new LoadBalancerWithNaming";
-        return -1;        
-    }
     GetNamingServiceThreadOptions ns_opt;
     ns_opt.succeed_without_server = _options.succeed_without_server;
     ns_opt.log_succeed_without_server = _options.log_succeed_without_server;
@@ -344,12 +389,11 @@ int Channel::Init(const char* ns_url,
     if (CreateSocketSSLContext(_options, &ns_opt.ssl_ctx) != 0) {
         return -1;
     }
-    if (lb->Init(ns_url, lb_name, _options.ns_filter, &ns_opt) != 0) {
+    if (GetLoadBalancerWithNaming(&_lb, ns_url, lb_name,
+                                  _options.ns_filter, &ns_opt) != 0) {
         LOG(ERROR) << "Fail to initialize LoadBalancerWithNaming";
-        delete lb;
         return -1;
     }
-    _lb.reset(lb);
     return 0;
 }
 
@@ -368,9 +412,37 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
                          const google::protobuf::Message* request,
                          google::protobuf::Message* response,
                          google::protobuf::Closure* done) {
-    const int64_t start_send_real_us = butil::gettimeofday_us();
     Controller* cntl = static_cast<Controller*>(controller_base);
+    if (_options.response_cache != NULL) {
+        return _options.response_cache->CallMethod(
+            this, method, cntl, request, response, done);
+    }
+    return CallMethodWithoutCache(method, cntl, request, response, done);
+}
+
+void Channel::CallMethodWithoutCache(
+    const google::protobuf::MethodDescriptor* method,
+    Controller* cntl,
+    const google::protobuf::Message* request,
+    google::protobuf::Message* response,
+    google::protobuf::Closure* done) {
+    if (_coalescer != NULL) {
+        return _coalescer->CallMethod(this, method, cntl, request,
+                                      response, done);
+    }
+    return DoCallMethod(method, cntl, request, response, done);
+}
+
+void Channel::DoCallMethod(const google::protobuf::MethodDescriptor* method,
+                           Controller* cntl,
+                           const google::protobuf::Message* request,
+                           google::protobuf::Message* response,
+                           google::protobuf::Closure* done) {
+    const int64_t start_send_real_us = butil::gettimeofday_us();
     cntl->OnRPCBegin(start_send_real_us);
+    if (FLAGS_enable_latency_breakdown) {
+        cntl->_rpc_begin_us = butil::cpuwide_time_us();
+    }
     // Override max_retry first to reset the range of correlation_id
     if (cntl->max_retry() == UNSET_MAGIC_NUM) {
         cntl->set_max_retry(_options.max_retry);
@@ -391,6 +463,10 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     if (_options.enable_circuit_breaker) {
         cntl->add_flag(Controller::FLAGS_ENABLED_CIRCUIT_BREAKER);
     }
+    if (_max_concurrency_per_server) {
+        cntl->add_flag(Controller::FLAGS_LIMIT_CONCURRENCY_PER_SERVER);
+        cntl->_max_concurrency_per_server = _max_concurrency_per_server;
+    }
     const CallId correlation_id = cntl->call_id();
     const int rc = bthread_id_lock_and_reset_range(
                     correlation_id, NULL, 2 + cntl->max_retry());
@@ -444,8 +520,15 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     // overriding connect_timeout_ms does not make sense, just use the
     // one in ChannelOptions
     cntl->_connect_timeout_ms = _options.connect_timeout_ms;
+    cntl->_method = method;
+    cntl->_backup_request_policy = _options.backup_request_policy;
     if (cntl->backup_request_ms() == UNSET_MAGIC_NUM) {
-        cntl->set_backup_request_ms(_options.backup_request_ms);
+        if (_options.backup_request_policy) {
+            cntl->set_backup_request_ms(
+                _options.backup_request_policy->GetBackupRequestMs(cntl));
+        } else {
+            cntl->set_backup_request_ms(_options.backup_request_ms);
+        }
     }
     if (cntl->connection_type() == CONNECTION_TYPE_UNKNOWN) {
         cntl->set_connection_type(_options.connection_type);
@@ -453,7 +536,6 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     cntl->_response = response;
     cntl->_done = done;
     cntl->_pack_request = _pack_request;
-    cntl->_method = method;
     cntl->_auth = _options.auth;
 
     if (SingleServer()) {
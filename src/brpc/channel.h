@@ -29,11 +29,15 @@
 #include "brpc/channel_base.h"              // ChannelBase
 #include "brpc/adaptive_protocol_type.h"    // AdaptiveProtocolType
 #include "brpc/adaptive_connection_type.h"  // AdaptiveConnectionType
+#include "brpc/adaptive_max_concurrency.h"  // AdaptiveMaxConcurrency
 #include "brpc/socket_id.h"                 // SocketId
 #include "brpc/controller.h"                // brpc::Controller
 #include "brpc/details/profiler_linker.h"
 #include "brpc/retry_policy.h"
+#include "brpc/backup_request_policy.h"
 #include "brpc/naming_service_filter.h"
+#include "brpc/details/request_coalescer.h"
+#include "brpc/response_cache.h"
 
 namespace brpc {
 
@@ -63,6 +67,15 @@ struct ChannelOptions {
     // Maximum: 0x7fffffff (roughly 30 days)
     int32_t backup_request_ms;
 
+    // Decide when to send backup requests dynamically, e.g.
+    // AdaptiveBackupRequestPolicy sends backup requests according to live
+    // latency percentiles of methods. Overrides backup_request_ms.
+    // The interface is defined in src/brpc/backup_request_policy.h
+    // This object is NOT owned by channel and should remain valid when
+    // channel is used.
+    // Default: NULL
+    BackupRequestPolicy* backup_request_policy;
+
     // Retry limit for RPC over this Channel. <=0 means no retry.
     // Overridable by Controller.set_max_retry().
     // Default: 3
@@ -75,6 +88,16 @@ struct ChannelOptions {
     // Default: false
     bool enable_circuit_breaker;
 
+    // Limit concurrent RPCs to each server of this channel so that a slowed
+    // server does not accumulate requests in its connection. RPCs beyond
+    // the limit fail with ELIMIT without being sent, and are retried on
+    // other servers if max_retry allows. Values are same with
+    // ServerOptions.max_concurrency: a number for a constant limit, or
+    // "auto" for a limit adapted to latencies of the server.
+    // Channels to the same server with the same value share the limit.
+    // Default: "unlimited"
+    AdaptiveMaxConcurrency max_concurrency_per_server;
+
     // Serialization protocol, defined in src/brpc/options.proto
     // NOTE: You can assign name of the protocol to this field as well, for
     // Example: options.protocol = "baidu_std";
@@ -128,6 +151,22 @@ struct ChannelOptions {
     // Default: ""
     std::string connection_group;
 
+    // Merge identical RPC (same method, serialized request, attachment and
+    // request_code) in flight at the same time: only one of them is sent
+    // and the others get copies of its response or error. Merged RPC share
+    // the timeout and retries of the sent one. RPC with streams or
+    // customized http headers are never merged.
+    // Check bvars rpc_coalescing_* for the effect.
+    // Default: false
+    bool enable_request_coalescing;
+
+    // Cache responses of methods configured in the cache, check
+    // src/brpc/response_cache.h for details.
+    // This object is NOT owned by channel and should remain valid when
+    // channel is used.
+    // Default: NULL
+    ResponseCache* response_cache;
+
 private:
     // SSLOptions is large and not often used, allocate it on heap to
     // prevent ChannelOptions from being bloated in most cases.
@@ -146,6 +185,8 @@ private:
 class Channel : public ChannelBase {
 friend class Controller;
 friend class SelectiveChannel;
+friend class RequestCoalescer;
+friend class ResponseCache;
 public:
     Channel(ProfilerLinker = ProfilerLinker());
     ~Channel();
@@ -209,6 +250,21 @@ protected:
     // therefore destroy the `controller' inside `done'
     static void CallMethodImpl(Controller* controller, SharedLoadBalancer* lb);
 
+    // Send the RPC, merge it with identical ones in flight when
+    // ChannelOptions.enable_request_coalescing is true.
+    void CallMethodWithoutCache(const google::protobuf::MethodDescriptor* method,
+                                Controller* controller,
+                                const google::protobuf::Message* request,
+                                google::protobuf::Message* response,
+                                google::protobuf::Closure* done);
+
+    // Send the RPC without coalescing.
+    void DoCallMethod(const google::protobuf::MethodDescriptor* method,
+                      Controller* controller,
+                      const google::protobuf::Message* request,
+                      google::protobuf::Message* response,
+                      google::protobuf::Closure* done);
+
     int InitChannelOptions(const ChannelOptions* options);
     int InitSingle(const butil::EndPoint& server_addr_and_port,
                    const char* raw_server_address,
@@ -224,8 +280,14 @@ protected:
     // It will be destroyed after channel's destruction and all
     // the RPC above has finished
     butil::intrusive_ptr<SharedLoadBalancer> _lb;
+    // Shared with leaders of coalesced RPC, NULL when
+    // ChannelOptions.enable_request_coalescing is false.
+    butil::intrusive_ptr<RequestCoalescer> _coalescer;
     ChannelOptions _options;
     int _preferred_index;
+    // Points to a persistent copy of _options.max_concurrency_per_server,
+    // NULL when it's unlimited.
+    const AdaptiveMaxConcurrency* _max_concurrency_per_server;
 };
 
 enum ChannelOwnership {
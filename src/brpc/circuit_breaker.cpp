@@ -15,8 +15,11 @@
 // Authors: Lei He (helei@qiyi.com)
 
 #include <cmath>
+#include <algorithm>
 #include <gflags/gflags.h>
 #include <butil/time.h>
+#include "brpc/reloadable_flags.h"
+#include "brpc/socket.h"
 #include "brpc/circuit_breaker.h"
 
 namespace brpc {
@@ -41,6 +44,28 @@ DEFINE_int32(circuit_breaker_max_isolation_duration_ms, 30000,
     "Maximum isolation duration in milliseconds");
 DEFINE_double(circuit_breaker_epsilon_value, 0.02, 
     "ema_alpha = 1 - std::pow(epsilon, 1.0 / window_size)");
+DEFINE_bool(circuit_breaker_enable_outlier_detection, false,
+    "Isolate servers whose latencies are much higher than other servers in "
+    "the same cluster. Only affects channels with enable_circuit_breaker "
+    "created after setting this flag");
+DEFINE_int32(circuit_breaker_outlier_detection_interval_ms, 10000,
+    "Interval of comparing latencies of servers in milliseconds");
+BRPC_VALIDATE_GFLAG(circuit_breaker_outlier_detection_interval_ms,
+                    PositiveInteger);
+DEFINE_double(circuit_breaker_outlier_latency_multiple, 3.0,
+    "A server is an outlier in an interval if its p99 latency is larger than "
+    "this multiple of the median p99 latency of the cluster");
+DEFINE_int32(circuit_breaker_outlier_min_samples, 100,
+    "Servers with less successful calls in an interval are not compared");
+BRPC_VALIDATE_GFLAG(circuit_breaker_outlier_min_samples, PositiveInteger);
+DEFINE_int32(circuit_breaker_outlier_consecutive_intervals, 3,
+    "Isolate a server after being an outlier in so many consecutive intervals");
+BRPC_VALIDATE_GFLAG(circuit_breaker_outlier_consecutive_intervals,
+                    PositiveInteger);
+DEFINE_int32(circuit_breaker_max_ejection_percent, 10,
+    "Maximum percent of servers in a cluster isolated by outlier detection, "
+    "counting servers failed for other reasons, rounded up");
+BRPC_VALIDATE_GFLAG(circuit_breaker_max_ejection_percent, NonNegativeInteger);
 
 namespace {
 // EPSILON is used to generate the smoothing coefficient when calculating EMA.
@@ -56,8 +81,62 @@ namespace {
 
 #define EPSILON (FLAGS_circuit_breaker_epsilon_value)
 
+// Latencies are put into log-scaled buckets: every power of 2 is divided
+// into 4 sub-buckets, making percentiles accurate within 25%.
+const int LATENCY_SUB_BUCKET_BITS = 2;
+const int LATENCY_SUB_BUCKETS = 1 << LATENCY_SUB_BUCKET_BITS;
+const int LATENCY_BUCKETS = 32 * LATENCY_SUB_BUCKETS;
+
+inline int LatencyToBucket(int64_t latency_us) {
+    if (latency_us < LATENCY_SUB_BUCKETS) {
+        return latency_us < 0 ? 0 : (int)latency_us;
+    }
+    const int msb = 63 - __builtin_clzll(latency_us);
+    const int sub = (latency_us >> (msb - LATENCY_SUB_BUCKET_BITS)) &
+        (LATENCY_SUB_BUCKETS - 1);
+    const int index = (msb - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+    return std::min(index, LATENCY_BUCKETS - 1);
+}
+
+// Middle of the latencies in the bucket.
+inline int64_t BucketToLatency(int index) {
+    if (index < LATENCY_SUB_BUCKETS) {
+        return index;
+    }
+    const int shift = index / LATENCY_SUB_BUCKETS - 1;
+    const int64_t lower =
+        (int64_t)(LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS) << shift;
+    return lower + (((int64_t)1 << shift) >> 1);
+}
+
 }  // namepace
 
+// Latencies of successful calls in the current and the last interval of
+// -circuit_breaker_outlier_detection_interval_ms, counted in slots[index
+// of the interval % 2]. The slot of an expired interval is reused by the
+// one after next instead of being cleared by readers, so that detectors
+// of different channels sharing the socket read the same samples.
+struct CircuitBreaker::LatencyWindow {
+    struct Slot {
+        butil::atomic<int64_t> interval;
+        butil::atomic<int32_t> counts[LATENCY_BUCKETS];
+    };
+    LatencyWindow() {
+        for (int i = 0; i < 2; ++i) {
+            slots[i].interval.store(-1, butil::memory_order_relaxed);
+            for (int j = 0; j < LATENCY_BUCKETS; ++j) {
+                slots[i].counts[j].store(0, butil::memory_order_relaxed);
+            }
+        }
+    }
+    Slot slots[2];
+};
+
+static int64_t CurrentLatencyInterval() {
+    return butil::cpuwide_time_ms() /
+        FLAGS_circuit_breaker_outlier_detection_interval_ms;
+}
+
 CircuitBreaker::EmaErrorRecorder::EmaErrorRecorder(int window_size,
                                                    int max_error_percent)
     : _window_size(window_size)
@@ -165,13 +244,79 @@ CircuitBreaker::CircuitBreaker()
     , _last_reset_time_ms(butil::cpuwide_time_ms())
     , _isolation_duration_ms(FLAGS_circuit_breaker_min_isolation_duration_ms)
     , _isolated_times(0) 
-    , _broken(false) {
+    , _broken(false)
+    , _latency_window(NULL) {
+}
+
+CircuitBreaker::~CircuitBreaker() {
+    delete _latency_window.load(butil::memory_order_relaxed);
+}
+
+CircuitBreaker::LatencyWindow* CircuitBreaker::GetOrNewLatencyWindow() {
+    LatencyWindow* w = _latency_window.load(butil::memory_order_consume);
+    if (w != NULL) {
+        return w;
+    }
+    LatencyWindow* new_w = new LatencyWindow;
+    if (_latency_window.compare_exchange_strong(
+            w, new_w, butil::memory_order_acq_rel)) {
+        return new_w;
+    }
+    delete new_w;
+    return w;
+}
+
+int64_t CircuitBreaker::GetLatencyPercentile(double ratio, int64_t* nsample) {
+    LatencyWindow* w = _latency_window.load(butil::memory_order_consume);
+    const int64_t last_interval = CurrentLatencyInterval() - 1;
+    const LatencyWindow::Slot* slot = NULL;
+    if (w) {
+        slot = &w->slots[last_interval & 1];
+        if (slot->interval.load(butil::memory_order_relaxed) != last_interval) {
+            slot = NULL;  // No calls in the last interval.
+        }
+    }
+    int32_t counts[LATENCY_BUCKETS];
+    int64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        counts[i] = (slot ? slot->counts[i].load(butil::memory_order_relaxed) : 0);
+        total += counts[i];
+    }
+    *nsample = total;
+    if (total == 0) {
+        return 0;
+    }
+    const int64_t rank = std::max((int64_t)1, (int64_t)std::ceil(total * ratio));
+    int64_t accumulated = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        accumulated += counts[i];
+        if (accumulated >= rank) {
+            return BucketToLatency(i);
+        }
+    }
+    return BucketToLatency(LATENCY_BUCKETS - 1);
 }
 
 bool CircuitBreaker::OnCallEnd(int error_code, int64_t latency) {
     if (_broken.load(butil::memory_order_relaxed)) {
         return false;
     }
+    if (error_code == 0 && FLAGS_circuit_breaker_enable_outlier_detection) {
+        const int64_t interval = CurrentLatencyInterval();
+        LatencyWindow::Slot& slot = GetOrNewLatencyWindow()->slots[interval & 1];
+        int64_t slot_interval = slot.interval.load(butil::memory_order_relaxed);
+        if (slot_interval != interval &&
+            slot.interval.compare_exchange_strong(
+                slot_interval, interval, butil::memory_order_relaxed)) {
+            // Calls ending at the boundary may be counted in either
+            // interval or lost, which is negligible.
+            for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+                slot.counts[i].store(0, butil::memory_order_relaxed);
+            }
+        }
+        slot.counts[LatencyToBucket(latency)].fetch_add(
+            1, butil::memory_order_relaxed);
+    }
     if (_long_window.OnCallEnd(error_code, latency) &&
         _short_window.OnCallEnd(error_code, latency)) {
         return true;
@@ -184,6 +329,14 @@ void CircuitBreaker::Reset() {
     _long_window.Reset();
     _short_window.Reset();
     _last_reset_time_ms = butil::cpuwide_time_ms();
+    LatencyWindow* w = _latency_window.load(butil::memory_order_relaxed);
+    if (w) {
+        for (int i = 0; i < 2; ++i) {
+            for (int j = 0; j < LATENCY_BUCKETS; ++j) {
+                w->slots[i].counts[j].store(0, butil::memory_order_relaxed);
+            }
+        }
+    }
     _broken.store(false, butil::memory_order_release);
 }
 
@@ -210,5 +363,52 @@ void CircuitBreaker::UpdateIsolationDuration() {
     _isolation_duration_ms.store(isolation_duration_ms, butil::memory_order_relaxed);
 }
 
+void LatencyOutlierDetector::Detect(const std::vector<SocketId>& servers) {
+    std::vector<std::pair<int64_t, SocketId> > p99s;
+    p99s.reserve(servers.size());
+    size_t nfailed = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        SocketUniquePtr ptr;
+        if (Socket::Address(servers[i], &ptr) != 0) {
+            ++nfailed;
+            continue;
+        }
+        int64_t nsample = 0;
+        const int64_t p99 = ptr->GetLatencyPercentile(0.99, &nsample);
+        if (nsample >= FLAGS_circuit_breaker_outlier_min_samples) {
+            p99s.push_back(std::make_pair(p99, servers[i]));
+        }
+    }
+    std::map<SocketId, int> last_intervals;
+    last_intervals.swap(_outlier_intervals);
+    // A median of less than 3 servers does not tell which one is abnormal.
+    if (p99s.size() < 3) {
+        return;
+    }
+    std::sort(p99s.begin(), p99s.end());
+    const int64_t median = p99s[p99s.size() / 2].first;
+    // Round up so that small clusters can eject at least one server.
+    const size_t max_ejected =
+        (servers.size() * FLAGS_circuit_breaker_max_ejection_percent + 99) / 100;
+    // Check slowest servers first so that they're isolated first when
+    // the ejection percent is reached.
+    for (size_t i = p99s.size(); i > 0 && p99s[i - 1].first >
+             median * FLAGS_circuit_breaker_outlier_latency_multiple; --i) {
+        const SocketId id = p99s[i - 1].second;
+        const int intervals = last_intervals[id] + 1;
+        if (intervals < FLAGS_circuit_breaker_outlier_consecutive_intervals ||
+            nfailed >= max_ejected) {
+            _outlier_intervals[id] = intervals;
+            continue;
+        }
+        SocketUniquePtr ptr;
+        if (Socket::Address(id, &ptr) == 0) {
+            LOG(WARNING) << "Socket[" << *ptr << "] is a latency outlier, p99="
+                         << p99s[i - 1].first << "us median=" << median << "us";
+            ptr->IsolateAsLatencyOutlier();
+        }
+        ++nfailed;
+    }
+}
 
 }  // namespace brpc
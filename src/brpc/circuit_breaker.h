@@ -17,7 +17,10 @@
 #ifndef BRPC_CIRCUIT_BREAKER_H
 #define BRPC_CIRCUIT_BREAKER_H
                                             
+#include <map>
+#include <vector>
 #include "butil/atomicops.h"
+#include "brpc/socket_id.h"
 
 namespace brpc {
 
@@ -25,7 +28,7 @@ class CircuitBreaker {
 public:
     CircuitBreaker();
 
-    ~CircuitBreaker() {}
+    ~CircuitBreaker();
 
     // Sampling the current rpc. Returns false if a node needs to 
     // be isolated. Otherwise return true.
@@ -57,9 +60,21 @@ public:
         return _isolation_duration_ms.load(butil::memory_order_relaxed);
     }
 
+    // Returns the `ratio' percentile of latencies of successful calls in
+    // the last complete interval of
+    // -circuit_breaker_outlier_detection_interval_ms. Number of the
+    // latencies is stored in `nsample'. Reading does not clear latencies,
+    // which age out with time instead. Latencies are recorded only when
+    // -circuit_breaker_enable_outlier_detection is on.
+    int64_t GetLatencyPercentile(double ratio, int64_t* nsample);
+
 private:
     void UpdateIsolationDuration();
 
+    // Log-scaled buckets of latencies, see circuit_breaker.cpp.
+    struct LatencyWindow;
+    LatencyWindow* GetOrNewLatencyWindow();
+
     class EmaErrorRecorder {
     public:
         EmaErrorRecorder(int windows_size,  int max_error_percent);
@@ -86,6 +101,25 @@ private:
     butil::atomic<int> _isolation_duration_ms;
     butil::atomic<int> _isolated_times;
     butil::atomic<bool> _broken;
+    butil::atomic<LatencyWindow*> _latency_window;
+};
+
+// Find servers whose p99 latencies are much higher than the median of
+// the cluster in consecutive intervals and isolate them just like being
+// broken by circuit breakers, namely they're revived by health checking.
+// At most -circuit_breaker_max_ejection_percent of the servers are
+// isolated at the same time, counting servers failed for other reasons.
+// Not thread-safe.
+class LatencyOutlierDetector {
+public:
+    // Called every -circuit_breaker_outlier_detection_interval_ms with
+    // main sockets of all servers in the cluster. Detectors sharing sockets
+    // read the same latencies of the last interval.
+    void Detect(const std::vector<SocketId>& servers);
+
+private:
+    // Number of consecutive intervals of being an outlier.
+    std::map<SocketId, int> _outlier_intervals;
 };
 
 }  // namespace brpc
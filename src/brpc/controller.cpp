@@ -35,10 +35,12 @@
 #include "brpc/closure_guard.h"
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/controller.h"
+#include "brpc/reloadable_flags.h"
 #include "brpc/span.h"
 #include "brpc/server.h"   // Server::_session_local_data_pool
 #include "brpc/simple_data_pool.h"
 #include "brpc/retry_policy.h"
+#include "brpc/backup_request_policy.h"
 #include "brpc/stream_impl.h"
 #include "brpc/policy/streaming_rpc_protocol.h" // FIXME
 #include "brpc/rpc_dump.pb.h"
@@ -81,6 +83,11 @@ namespace brpc {
 
 DEFINE_bool(graceful_quit_on_sigterm, false, "Register SIGTERM handle func to quit graceful");
 
+DEFINE_bool(enable_latency_breakdown, false, "Record time spent in stages of "
+            "RPCs, shown in /status and by Controller::send_latency_us() "
+            "and wait_latency_us()");
+BRPC_VALIDATE_GFLAG(enable_latency_breakdown, PassValidate);
+
 const IdlNames idl_single_req_single_res = { "req", "res" };
 const IdlNames idl_single_req_multi_res = { "req", "" };
 const IdlNames idl_multi_req_single_res = { "", "res" };
@@ -217,6 +224,8 @@ void Controller::ResetPods() {
     _request_protocol = PROTOCOL_UNKNOWN;
     _max_retry = UNSET_MAGIC_NUM;
     _retry_policy = NULL;
+    _max_concurrency_per_server = NULL;
+    _backup_request_policy = NULL;
     _correlation_id = INVALID_BTHREAD_ID;
     _connection_type = CONNECTION_TYPE_UNKNOWN;
     _timeout_ms = UNSET_MAGIC_NUM;
@@ -226,6 +235,13 @@ void Controller::ResetPods() {
     _timeout_id = 0;
     _begin_time_us = 0;
     _end_time_us = 0;
+    _begin_bthread = INVALID_BTHREAD;
+    _begin_cputime_ns = 0;
+    _begin_rq_wait_ns = 0;
+    _method_found_us = 0;
+    _rpc_begin_us = 0;
+    _request_queued_us = 0;
+    _response_parsed_us = 0;
     _tos = 0;
     _preferred_index = -1;
     _request_compress_type = COMPRESS_TYPE_NONE;
@@ -258,6 +274,8 @@ void Controller::ResetPods() {
 Controller::Call::Call(Controller::Call* rhs)
     : nretry(rhs->nretry)
     , need_feedback(rhs->need_feedback)
+    , enable_circuit_breaker(rhs->enable_circuit_breaker)
+    , limited_concurrency(rhs->limited_concurrency)
     , peer_id(rhs->peer_id)
     , begin_time_us(rhs->begin_time_us)
     , sending_sock(rhs->sending_sock.release())
@@ -266,6 +284,7 @@ Controller::Call::Call(Controller::Call* rhs)
     // setting all the fields to next call and _current_call.OnComplete
     // will behave incorrectly.
     rhs->need_feedback = false;
+    rhs->limited_concurrency = false;
     rhs->peer_id = INVALID_SOCKET_ID;
     rhs->stream_user_data = NULL;
 }
@@ -278,6 +297,7 @@ void Controller::Call::Reset() {
     nretry = 0;
     need_feedback = false;
     enable_circuit_breaker = false;
+    limited_concurrency = false;
     peer_id = INVALID_SOCKET_ID;
     begin_time_us = 0;
     sending_sock.reset(NULL);
@@ -560,6 +580,9 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
         return;
     }
 
+    if (info.responded && FLAGS_enable_latency_breakdown) {
+        _response_parsed_us = butil::cpuwide_time_us();
+    }
     if ((!_error_code && _retry_policy == NULL) ||
         _current_call.nretry >= _max_retry) {
         goto END_OF_RPC;
@@ -577,6 +600,13 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
             SetFailed(rc, "Fail to add timer");
             goto END_OF_RPC;
         }
+        if (_backup_request_policy != NULL &&
+            !_backup_request_policy->DoBackup(this)) {
+            // Keep waiting for the current call until timeout.
+            _error_code = saved_error;
+            CHECK_EQ(0, bthread_id_unlock(info.id));
+            return;
+        }
         if (!SingleServer()) {
             if (_accessed == NULL) {
                 _accessed = ExcludedServers::Create(
@@ -714,6 +744,16 @@ void Controller::Call::OnComplete(
         }
     }
 
+    if (limited_concurrency) {
+        limited_concurrency = false;
+        // The limiter is in the main socket which may be failed now.
+        SocketUniquePtr main_sock;
+        if (Socket::AddressFailedAsWell(peer_id, &main_sock) >= 0) {
+            main_sock->OnClientResponded(
+                error_code, butil::gettimeofday_us() - begin_time_us);
+        }
+    }
+
     switch (c->connection_type()) {
     case CONNECTION_TYPE_UNKNOWN:
         break;
@@ -874,6 +914,12 @@ void Controller::EndRPC(const CompletionInfo& info) {
     }
     // RPC finished, now it's safe to release `LoadBalancerWithNaming'
     _lb.reset();
+    if (_backup_request_policy) {
+        // Make latency_us() valid, synchronous RPC updates it again after
+        // being woken up.
+        OnRPCEnd(butil::gettimeofday_us());
+        _backup_request_policy->OnRPCEnd(this);
+    }
     if (_span) {
         _span->set_ending_cid(info.id);
         _span->set_async(_done);
@@ -1038,6 +1084,16 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
         // here.
         _remote_side = tmp_sock->remote_side();
     }
+    if (has_flag(FLAGS_LIMIT_CONCURRENCY_PER_SERVER) && !is_health_check_call()) {
+        if (!tmp_sock->OnClientRequested(*_max_concurrency_per_server)) {
+            tmp_sock.reset();
+            SetFailed(ELIMIT, "Reached max_concurrency_per_server=%s of %s",
+                      _max_concurrency_per_server->value().c_str(),
+                      endpoint2str(_remote_side).c_str());
+            return HandleSendFailed();
+        }
+        _current_call.limited_concurrency = true;
+    }
     if (_stream_creator) {
         _current_call.stream_user_data =
             _stream_creator->OnCreatingStream(&tmp_sock, this);
@@ -1171,6 +1227,9 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
         packet_size = packet.size();
         rc = _current_call.sending_sock->Write(&packet, &wopt);
     }
+    if (_current_call.nretry == 0 && FLAGS_enable_latency_breakdown) {
+        _request_queued_us = butil::cpuwide_time_us();
+    }
     if (span) {
         if (_current_call.nretry == 0) {
             span->set_sent_us(butil::cpuwide_time_us());
@@ -1294,6 +1353,20 @@ const Controller* Controller::sub(int index) const {
     return NULL;
 }
 
+int64_t Controller::send_latency_us() const {
+    if (_rpc_begin_us == 0 || _request_queued_us == 0) {
+        return -1;
+    }
+    return _request_queued_us - _rpc_begin_us;
+}
+
+int64_t Controller::wait_latency_us() const {
+    if (_request_queued_us == 0 || _response_parsed_us == 0) {
+        return -1;
+    }
+    return _response_parsed_us - _request_queued_us;
+}
+
 uint64_t Controller::trace_id() const { return _span ? _span->trace_id() : 0; }
 uint64_t Controller::span_id() const { return _span ? _span->span_id() : 0; }
 
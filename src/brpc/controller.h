@@ -66,6 +66,8 @@ class StreamSettings;
 class RpcDumpMeta;
 class MongoContext;
 class RetryPolicy;
+class BackupRequestPolicy;
+class AdaptiveMaxConcurrency;
 class InputMessageBase;
 class ThriftStub;
 namespace policy {
@@ -116,6 +118,8 @@ friend class ParallelChannelDone;
 friend class ControllerPrivateAccessor;
 friend class ServerPrivateAccessor;
 friend class SelectiveChannel;
+friend class RequestCoalescer;
+friend class ResponseCache;
 friend class ThriftStub;
 friend class schan::Sender;
 friend class schan::SubDone;
@@ -145,6 +149,7 @@ friend void policy::ProcessThriftRequest(InputMessageBase*);
     static const uint32_t FLAGS_ENABLED_CIRCUIT_BREAKER = (1 << 17);
     static const uint32_t FLAGS_ALWAYS_PRINT_PRIMITIVE_FIELDS = (1 << 18);
     static const uint32_t FLAGS_HEALTH_CHECK_CALL = (1 << 19);
+    static const uint32_t FLAGS_LIMIT_CONCURRENCY_PER_SERVER = (1 << 20);
     
 public:
     Controller();
@@ -195,6 +200,19 @@ public:
         return _end_time_us - _begin_time_us;
     }
 
+    // [Client] Time spent in stages of the RPC, recorded when
+    // -enable_latency_breakdown is on, -1 otherwise.
+    // send_latency_us(): from the beginning of the RPC until the request of
+    // the first try is queued into the connection: selecting the server,
+    // connecting and packing the request.
+    // wait_latency_us(): from then until the last response is parsed:
+    // writing, the network, the server and parsing the response. When the
+    // RPC was retried (retried_count() > 0) or sent a backup request, this
+    // includes all later tries as well, so that the two stages together
+    // cover the RPC until the last response.
+    int64_t send_latency_us() const;
+    int64_t wait_latency_us() const;
+
     // Response of the RPC call (passed to CallMethod)
     google::protobuf::Message* response() const { return _response; }
 
@@ -616,6 +634,8 @@ private:
         int nretry;                     // sent in nretry-th retry.
         bool need_feedback;             // The LB needs feedback.
         bool enable_circuit_breaker;    // The channel enabled circuit_breaker
+        bool limited_concurrency;       // Counted by the concurrency limiter
+                                        // of peer_id.
         bool touched_by_stream_creator; 
         SocketId peer_id;               // main server id
         int64_t begin_time_us;          // sent real time.
@@ -686,6 +706,9 @@ private:
     // after CallMethod.
     int _max_retry;
     const RetryPolicy* _retry_policy;
+    // Valid when FLAGS_LIMIT_CONCURRENCY_PER_SERVER is set, never freed.
+    const AdaptiveMaxConcurrency* _max_concurrency_per_server;
+    BackupRequestPolicy* _backup_request_policy;
     // Synchronization object for one RPC call. It remains unchanged even 
     // when retry happens. Synchronous RPC will wait on this id.
     CallId _correlation_id;
@@ -709,6 +732,22 @@ private:
     // Begin/End time of a single RPC call (since Epoch in microseconds)
     int64_t _begin_time_us;
     int64_t _end_time_us;
+    // [Server-side] The bthread processing the request and its cputime /
+    // run-queue wait when processing began, see bthread_self_stat().
+    bthread_t _begin_bthread;
+    int64_t _begin_cputime_ns;
+    int64_t _begin_rq_wait_ns;
+    // Timestamps (cpuwide) of stages when -enable_latency_breakdown is on,
+    // 0 when not recorded.
+    // [Server-side] The method of the request was found.
+    int64_t _method_found_us;
+    // [Client-side] The RPC began. Unlike _begin_time_us which is wall
+    // time, comparable with other stages.
+    int64_t _rpc_begin_us;
+    // [Client-side] The request was queued into the connection.
+    int64_t _request_queued_us;
+    // [Client-side] The (last) response was parsed.
+    int64_t _response_parsed_us;
     short _tos;    // Type of service.
     // The index of parse function which `InputMessenger' will use
     int _preferred_index;
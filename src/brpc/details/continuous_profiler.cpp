@@ -0,0 +1,589 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <set>
+#include <gflags/gflags.h>
+#include "butil/build_config.h"
+#include "butil/atomicops.h"
+#include "butil/logging.h"
+#include "butil/macros.h"
+#include "butil/scoped_lock.h"
+#include "butil/string_printf.h"
+#include "butil/thread_local.h"
+#include "butil/time.h"
+#include "butil/third_party/symbolize/symbolize.h"
+#include "bvar/reducer.h"
+#include "bthread/task_group.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/continuous_profiler.h"
+
+#if defined(OS_LINUX) && defined(ARCH_CPU_X86_64)
+#include <sys/uio.h>                    // process_vm_readv
+#include <ucontext.h>
+#define BRPC_CONTINUOUS_PROFILING_SUPPORTED 1
+#ifndef SIGEV_THREAD_ID
+#define SIGEV_THREAD_ID 4
+#endif
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#else
+#define BRPC_CONTINUOUS_PROFILING_SUPPORTED 0
+#endif
+
+namespace bthread {
+extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
+}
+
+namespace brpc {
+
+DEFINE_bool(enable_continuous_profiling, false,
+            "Sample stacks of running threads continuously, shown in "
+            "/flamegraph");
+DEFINE_int32(continuous_profiling_frequency, 99,
+             "Samples taken per cpu-second of the process");
+DEFINE_int32(continuous_profiling_window, 60,
+             "Seconds of samples kept for /flamegraph");
+
+static bool ValidateEnableContinuousProfiling(const char*, bool);
+static bool ValidateContinuousProfilingFrequency(const char*, int32_t);
+static bool ValidateContinuousProfilingWindow(const char*, int32_t value) {
+    return value > 0 && value <= 3600;
+}
+BRPC_VALIDATE_GFLAG(enable_continuous_profiling,
+                    ValidateEnableContinuousProfiling);
+BRPC_VALIDATE_GFLAG(continuous_profiling_frequency,
+                    ValidateContinuousProfilingFrequency);
+BRPC_VALIDATE_GFLAG(continuous_profiling_window,
+                    ValidateContinuousProfilingWindow);
+
+// Frames kept in one sample, including the interrupted pc.
+static const int MAX_SAMPLE_DEPTH = 32;
+// Must be a power of 2 and large enough to hold samples of all cores
+// between two rounds of the collector.
+static const size_t SAMPLE_RING_SIZE = 4096;
+static const int64_t COLLECT_INTERVAL_US = 100000;
+// Threads are listed every so many rounds of the collector to create
+// timers for new threads.
+static const int SCAN_THREADS_INTERVAL = 10;
+// Symbols of pcs are cached, the cache is cleared when it grows beyond
+// this, e.g. after lots of shared libraries are loaded and unloaded.
+static const size_t MAX_CACHED_SYMBOLS = 65536;
+// Latest samples taken in bthreads kept for /flamegraph?bthread=<id>,
+// which are not aggregated.
+static const size_t MAX_BTHREAD_SAMPLES = 16384;
+
+enum SampleState {
+    SAMPLE_EMPTY = 0,
+    SAMPLE_WRITING,
+    SAMPLE_READY
+};
+
+struct ProfilingSample {
+    butil::atomic<int> state;
+    int depth;
+    int weight;
+    // 0 when the sample was not taken in a bthread.
+    bthread_t bthread_id;
+    const char* tag;
+    void* pcs[MAX_SAMPLE_DEPTH];
+};
+
+static pthread_mutex_t s_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ProfilingSample* s_ring = NULL;
+static butil::static_atomic<uint64_t> s_write_index = BUTIL_STATIC_ATOMIC_INIT(0);
+static butil::static_atomic<int64_t> s_ndropped = BUTIL_STATIC_ATOMIC_INIT(0);
+
+#if BRPC_CONTINUOUS_PROFILING_SUPPORTED
+
+// Not SIGPROF which is used by gperftools in /hotspots/cpu.
+static int ProfilingSignal() { return SIGRTMIN + 2; }
+
+static pid_t s_pid = 0;
+static bool s_handler_installed = false;
+static bool s_sampling = false;
+static int s_frequency = 0;
+// Timers measuring cpu time of each thread, keyed by tid. Unlike a timer
+// measuring cpu time of the process, which signals an arbitrary thread,
+// a per-thread timer signals exactly the thread consuming cpu.
+static std::map<pid_t, timer_t>* s_timers = NULL;
+
+// Copy memory that may not be readable, without crashing.
+static bool SafeCopy(void* dst, uintptr_t src, size_t size) {
+    struct iovec local = { dst, size };
+    struct iovec remote = { (void*)src, size };
+    return process_vm_readv(s_pid, &local, 1, &remote, 1, 0) == (ssize_t)size;
+}
+
+// Walk frame pointers of the interrupted code. Must be async-signal-safe.
+static int WalkStack(const ucontext_t* uc, void** pcs, int max_depth) {
+    uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+    uintptr_t lo = uc->uc_mcontext.gregs[REG_RSP];
+    // Top of the stack, 0 means unknown.
+    uintptr_t hi = 0;
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g != NULL && !g->is_current_pthread_task()) {
+        const bthread::TaskMeta* m = g->current_task();
+        if (m != NULL && m->stack != NULL) {
+            // The current task is switched before jumping to its stack,
+            // read frames directly only if rsp is inside the stack.
+            const uintptr_t bottom = (uintptr_t)m->stack->storage.bottom;
+            const uintptr_t top = bottom - m->stack->storage.stacksize;
+            if (lo >= top && lo < bottom) {
+                hi = bottom;
+            }
+        }
+    }
+    int depth = 0;
+    pcs[depth++] = (void*)uc->uc_mcontext.gregs[REG_RIP];
+    uintptr_t checked_page = 0;
+    while (depth < max_depth) {
+        if (fp < lo || (fp & 7) != 0) {
+            break;
+        }
+        uintptr_t frame[2];
+        if (hi != 0) {
+            if (fp + sizeof(frame) > hi) {
+                break;
+            }
+            frame[0] = ((const uintptr_t*)fp)[0];
+            frame[1] = ((const uintptr_t*)fp)[1];
+        } else {
+            // Bounds of stacks of pthreads are unknown, check readability
+            // of every page reached.
+            if (fp - lo > (8UL << 20)) {
+                break;
+            }
+            const uintptr_t first_page = fp & ~(uintptr_t)4095;
+            const uintptr_t last_page = (fp + sizeof(frame) - 1) & ~(uintptr_t)4095;
+            if (first_page != checked_page || last_page != checked_page) {
+                if (!SafeCopy(frame, fp, sizeof(frame))) {
+                    break;
+                }
+                checked_page = last_page;
+            } else {
+                frame[0] = ((const uintptr_t*)fp)[0];
+                frame[1] = ((const uintptr_t*)fp)[1];
+            }
+        }
+        if (frame[1] == 0) {
+            break;
+        }
+        pcs[depth++] = (void*)frame[1];
+        if (frame[0] <= fp) {
+            break;
+        }
+        lo = fp;
+        fp = frame[0];
+    }
+    return depth;
+}
+
+static void HandleProfilingSignal(int, siginfo_t* info, void* context) {
+    const int saved_errno = errno;
+    const uint64_t index = s_write_index.fetch_add(1, butil::memory_order_relaxed);
+    ProfilingSample* s = &s_ring[index & (SAMPLE_RING_SIZE - 1)];
+    int expected = SAMPLE_EMPTY;
+    if (!s->state.compare_exchange_strong(
+            expected, SAMPLE_WRITING, butil::memory_order_acquire)) {
+        // The collector is too slow, drop the sample.
+        s_ndropped.fetch_add(1, butil::memory_order_relaxed);
+        errno = saved_errno;
+        return;
+    }
+    // Expirations merged into this signal are counted in this sample.
+    s->weight = 1 + (info->si_overrun > 0 ? info->si_overrun : 0);
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    s->bthread_id = ((g != NULL && !g->is_current_main_task()) ?
+                     g->current_tid() : 0);
+    s->tag = bthread::tls_bls.profiling_tag;
+    s->depth = WalkStack((const ucontext_t*)context, s->pcs, MAX_SAMPLE_DEPTH);
+    s->state.store(SAMPLE_READY, butil::memory_order_release);
+    errno = saved_errno;
+}
+
+static int ArmTimer(timer_t timer, int frequency) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (frequency > 0) {
+        spec.it_interval.tv_nsec = 1000000000L / frequency;
+        spec.it_value = spec.it_interval;
+    }
+    return timer_settime(timer, 0, &spec, NULL);
+}
+
+// Clock of cpu time of thread `tid' in this process, same as what
+// pthread_getcpuclockid() returns for the thread.
+static clockid_t ThreadCpuClock(pid_t tid) {
+    // CPUCLOCK_PERTHREAD_MASK | CPUCLOCK_SCHED in linux/posix-timers.h
+    return ((~(clockid_t)tid) << 3) | 6;
+}
+
+// Create timers for new threads and delete the ones of exited threads.
+// Must be called with s_start_mutex held.
+static void UpdateThreadTimers() {
+    DIR* dir = opendir("/proc/self/task");
+    if (dir == NULL) {
+        PLOG(ERROR) << "Fail to opendir /proc/self/task";
+        return;
+    }
+    std::set<pid_t> alive;
+    for (struct dirent* ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        const pid_t tid = atoi(ent->d_name);
+        alive.insert(tid);
+        std::map<pid_t, timer_t>::iterator it = s_timers->find(tid);
+        if (it != s_timers->end()) {
+            // A timer of an exited thread is disarmed by the kernel, the
+            // tid being listed again is reused by a new thread.
+            struct itimerspec spec;
+            if (timer_gettime(it->second, &spec) == 0 &&
+                (spec.it_value.tv_sec != 0 || spec.it_value.tv_nsec != 0)) {
+                continue;
+            }
+            timer_delete(it->second);
+            s_timers->erase(it);
+        }
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = ProfilingSignal();
+        sev.sigev_notify_thread_id = tid;
+        timer_t timer;
+        if (timer_create(ThreadCpuClock(tid), &sev, &timer) != 0) {
+            // The thread just exited.
+            continue;
+        }
+        if (ArmTimer(timer, s_frequency) != 0) {
+            timer_delete(timer);
+            continue;
+        }
+        (*s_timers)[tid] = timer;
+    }
+    closedir(dir);
+    for (std::map<pid_t, timer_t>::iterator
+             it = s_timers->begin(); it != s_timers->end();) {
+        if (alive.count(it->first)) {
+            ++it;
+        } else {
+            timer_delete(it->second);
+            s_timers->erase(it++);
+        }
+    }
+}
+
+static void DeleteThreadTimers() {
+    for (std::map<pid_t, timer_t>::iterator
+             it = s_timers->begin(); it != s_timers->end(); ++it) {
+        timer_delete(it->second);
+    }
+    s_timers->clear();
+}
+
+#endif  // BRPC_CONTINUOUS_PROFILING_SUPPORTED
+
+// Samples of one second, keyed by tag and pcs.
+struct SampleBucket {
+    int64_t second;
+    std::map<std::string, int64_t> counts;
+};
+
+// A sample taken in a bthread.
+struct BthreadSample {
+    int64_t second;
+    bthread_t bthread_id;
+    int weight;
+    std::string key;
+};
+
+static pthread_mutex_t s_bucket_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::deque<SampleBucket>* s_buckets = NULL;
+// At most MAX_BTHREAD_SAMPLES, guarded by s_bucket_mutex as well.
+static std::deque<BthreadSample>* s_bthread_samples = NULL;
+
+static void AppendKey(std::string* key, const ProfilingSample& s) {
+    key->clear();
+    if (s.tag != NULL) {
+        key->append(s.tag);
+    } else {
+        key->append(s.bthread_id != 0 ? "bthread" : "pthread");
+    }
+    key->push_back('\0');
+    key->append((const char*)s.pcs, s.depth * sizeof(void*));
+}
+
+static void* CollectSamples(void*) {
+    bvar::Adder<int64_t> nsample("rpc_continuous_profiling_sample_count");
+    bvar::Adder<int64_t> ndropped("rpc_continuous_profiling_dropped_count");
+    int64_t last_ndropped = 0;
+    std::string key;
+    std::vector<std::pair<std::string, int> > collected;
+    std::vector<BthreadSample> collected_in_bthreads;
+    for (size_t round = 1; ; ++round) {
+        usleep(COLLECT_INTERVAL_US);
+#if BRPC_CONTINUOUS_PROFILING_SUPPORTED
+        if (round % SCAN_THREADS_INTERVAL == 0) {
+            BAIDU_SCOPED_LOCK(s_start_mutex);
+            if (s_sampling) {
+                UpdateThreadTimers();
+            }
+        }
+#endif
+        collected.clear();
+        collected_in_bthreads.clear();
+        for (size_t i = 0; i < SAMPLE_RING_SIZE; ++i) {
+            ProfilingSample& s = s_ring[i];
+            if (s.state.load(butil::memory_order_acquire) != SAMPLE_READY) {
+                continue;
+            }
+            AppendKey(&key, s);
+            collected.push_back(std::make_pair(key, s.weight));
+            if (s.bthread_id != 0) {
+                BthreadSample bs;
+                bs.second = 0;
+                bs.bthread_id = s.bthread_id;
+                bs.weight = s.weight;
+                bs.key = key;
+                collected_in_bthreads.push_back(bs);
+            }
+            s.state.store(SAMPLE_EMPTY, butil::memory_order_release);
+        }
+        const int64_t cur_ndropped = s_ndropped.load(butil::memory_order_relaxed);
+        ndropped << cur_ndropped - last_ndropped;
+        last_ndropped = cur_ndropped;
+
+        const int64_t now_s = butil::gettimeofday_s();
+        const int window = FLAGS_continuous_profiling_window;
+        BAIDU_SCOPED_LOCK(s_bucket_mutex);
+        while (!s_buckets->empty() &&
+               s_buckets->front().second <= now_s - window) {
+            s_buckets->pop_front();
+        }
+        while (!s_bthread_samples->empty() &&
+               s_bthread_samples->front().second <= now_s - window) {
+            s_bthread_samples->pop_front();
+        }
+        for (size_t i = 0; i < collected_in_bthreads.size(); ++i) {
+            collected_in_bthreads[i].second = now_s;
+            s_bthread_samples->push_back(collected_in_bthreads[i]);
+        }
+        while (s_bthread_samples->size() > MAX_BTHREAD_SAMPLES) {
+            s_bthread_samples->pop_front();
+        }
+        if (collected.empty()) {
+            continue;
+        }
+        if (s_buckets->empty() || s_buckets->back().second != now_s) {
+            s_buckets->push_back(SampleBucket());
+            s_buckets->back().second = now_s;
+        }
+        std::map<std::string, int64_t>& counts = s_buckets->back().counts;
+        for (size_t i = 0; i < collected.size(); ++i) {
+            counts[collected[i].first] += collected[i].second;
+            nsample << collected[i].second;
+        }
+    }
+    return NULL;
+}
+
+static int StartSampling(int frequency) {
+#if BRPC_CONTINUOUS_PROFILING_SUPPORTED
+    BAIDU_SCOPED_LOCK(s_start_mutex);
+    if (s_sampling) {
+        return 0;
+    }
+    if (s_ring == NULL) {
+        s_ring = new ProfilingSample[SAMPLE_RING_SIZE];
+        for (size_t i = 0; i < SAMPLE_RING_SIZE; ++i) {
+            s_ring[i].state.store(SAMPLE_EMPTY, butil::memory_order_relaxed);
+        }
+        s_buckets = new std::deque<SampleBucket>;
+        s_bthread_samples = new std::deque<BthreadSample>;
+        s_timers = new std::map<pid_t, timer_t>;
+        s_pid = getpid();
+        pthread_t th;
+        if (pthread_create(&th, NULL, CollectSamples, NULL) != 0) {
+            LOG(ERROR) << "Fail to create thread to collect samples";
+            return -1;
+        }
+        pthread_detach(th);
+    }
+    if (!s_handler_installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = HandleProfilingSignal;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(ProfilingSignal(), &sa, NULL) != 0) {
+            PLOG(ERROR) << "Fail to install handler of signal="
+                        << ProfilingSignal();
+            return -1;
+        }
+        s_handler_installed = true;
+    }
+    s_frequency = frequency;
+    // Threads created later are found by the collector.
+    UpdateThreadTimers();
+    if (s_timers->empty()) {
+        LOG(ERROR) << "Fail to create timers for any thread";
+        return -1;
+    }
+    s_sampling = true;
+    return 0;
+#else
+    (void)frequency;
+    LOG(ERROR) << "Continuous profiling is not supported on this platform";
+    return -1;
+#endif
+}
+
+static void StopSampling() {
+#if BRPC_CONTINUOUS_PROFILING_SUPPORTED
+    BAIDU_SCOPED_LOCK(s_start_mutex);
+    if (s_sampling) {
+        DeleteThreadTimers();
+        s_sampling = false;
+    }
+#endif
+}
+
+static bool ValidateEnableContinuousProfiling(const char*, bool value) {
+    if (value) {
+        return StartSampling(FLAGS_continuous_profiling_frequency) == 0;
+    }
+    StopSampling();
+    return true;
+}
+
+static bool ValidateContinuousProfilingFrequency(const char*, int32_t value) {
+    if (value <= 0 || value > 1000) {
+        return false;
+    }
+#if BRPC_CONTINUOUS_PROFILING_SUPPORTED
+    BAIDU_SCOPED_LOCK(s_start_mutex);
+    if (s_sampling) {
+        s_frequency = value;
+        for (std::map<pid_t, timer_t>::iterator
+                 it = s_timers->begin(); it != s_timers->end(); ++it) {
+            ArmTimer(it->second, value);
+        }
+    }
+#endif
+    return true;
+}
+
+bool IsContinuousProfilingSupported() {
+    return BRPC_CONTINUOUS_PROFILING_SUPPORTED;
+}
+
+static pthread_mutex_t s_symbol_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<void*, std::string>* s_symbols = NULL;
+
+static void AppendSymbol(void* pc, std::string* out) {
+    BAIDU_SCOPED_LOCK(s_symbol_mutex);
+    if (s_symbols == NULL) {
+        s_symbols = new std::map<void*, std::string>;
+    }
+    std::map<void*, std::string>::iterator it = s_symbols->find(pc);
+    if (it != s_symbols->end()) {
+        out->append(it->second);
+        return;
+    }
+    if (s_symbols->size() >= MAX_CACHED_SYMBOLS) {
+        s_symbols->clear();
+    }
+    std::string& name = (*s_symbols)[pc];
+    char buf[1024];
+    if (google::Symbolize(pc, buf, sizeof(buf))) {
+        name = buf;
+        // ';' separates frames in folded stacks.
+        std::replace(name.begin(), name.end(), ';', ',');
+    } else {
+        butil::string_printf(&name, "%p", pc);
+    }
+    out->append(name);
+}
+
+int64_t GetFoldedStacks(int seconds, bthread_t bthread_id,
+                        std::map<std::string, int64_t>* folded) {
+    folded->clear();
+    std::map<std::string, int64_t> merged;
+    {
+        BAIDU_SCOPED_LOCK(s_bucket_mutex);
+        if (s_buckets == NULL) {
+            return 0;
+        }
+        const int64_t now_s = butil::gettimeofday_s();
+        if (bthread_id != 0) {
+            for (std::deque<BthreadSample>::const_iterator
+                     it = s_bthread_samples->begin();
+                 it != s_bthread_samples->end(); ++it) {
+                if (it->bthread_id == bthread_id &&
+                    (seconds <= 0 || it->second > now_s - seconds)) {
+                    merged[it->key] += it->weight;
+                }
+            }
+        } else {
+            for (std::deque<SampleBucket>::const_iterator
+                     it = s_buckets->begin(); it != s_buckets->end(); ++it) {
+                if (seconds > 0 && it->second <= now_s - seconds) {
+                    continue;
+                }
+                for (std::map<std::string, int64_t>::const_iterator
+                         it2 = it->counts.begin(); it2 != it->counts.end(); ++it2) {
+                    merged[it2->first] += it2->second;
+                }
+            }
+        }
+    }
+    int64_t total = 0;
+    std::string stack;
+    for (std::map<std::string, int64_t>::const_iterator
+             it = merged.begin(); it != merged.end(); ++it) {
+        const std::string& key = it->first;
+        const size_t pos = key.find('\0');
+        stack.assign(key.data(), pos);
+        const size_t pcs_pos = pos + 1;
+        const size_t npc = (key.size() - pcs_pos) / sizeof(void*);
+        const char* pcs = key.data() + pcs_pos;
+        // Outermost frame first.
+        for (size_t i = npc; i > 0; --i) {
+            void* pc = NULL;
+            memcpy(&pc, pcs + (i - 1) * sizeof(void*), sizeof(void*));
+            if (i > 1) {
+                // Return addresses point to the instruction after the call.
+                pc = (char*)pc - 1;
+            }
+            stack.push_back(';');
+            AppendSymbol(pc, &stack);
+        }
+        (*folded)[stack] += it->second;
+        total += it->second;
+    }
+    return total;
+}
+
+} // namespace brpc
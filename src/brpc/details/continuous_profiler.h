@@ -0,0 +1,66 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_CONTINUOUS_PROFILER_H
+#define BRPC_CONTINUOUS_PROFILER_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <gflags/gflags_declare.h>
+#include "bthread/task_meta.h"
+
+namespace bthread {
+extern __thread bthread::LocalStorage tls_bls;
+}
+
+namespace brpc {
+
+DECLARE_bool(enable_continuous_profiling);
+
+// An always-on sampling profiler, turned on by -enable_continuous_profiling.
+// A posix timer measuring cpu time of each thread sends a signal to the
+// thread every 1/-continuous_profiling_frequency cpu-seconds, the handler
+// unwinds the stack by frame pointers (bounded by the stack of the
+// running bthread) and pushes it into a lock-free ring. A background thread
+// aggregates the samples by second and keeps the latest
+// -continuous_profiling_window seconds, which are shown by /flamegraph.
+// Samples are tagged with the method being processed by the bthread, see
+// ControllerPrivateAccessor::set_method().
+// Only Linux on x86_64 is supported. Code should be compiled with
+// -fno-omit-frame-pointer to get complete stacks.
+
+// Samples taken in the calling bthread are tagged with `tag' until it's
+// reset with NULL. `tag' must be alive during the period.
+inline void SetProfilingTag(const char* tag) {
+    bthread::tls_bls.profiling_tag = tag;
+}
+
+// Returns true if the profiler works on this platform.
+bool IsContinuousProfilingSupported();
+
+// Fold stacks sampled within last `seconds' (all kept samples if `seconds'
+// is non-positive) as "root;caller;...;callee" => number of samples into
+// `folded'. The root frame is the full name of the method being processed,
+// or "bthread"/"pthread" when the sample was not taken inside a method.
+// Only samples taken in bthread `bthread_id' are folded if it's not 0,
+// which are limited to the latest ones since samples of bthreads are kept
+// separately in a bounded queue.
+// Returns total number of folded samples.
+int64_t GetFoldedStacks(int seconds, bthread_t bthread_id,
+                        std::map<std::string, int64_t>* folded);
+
+} // namespace brpc
+
+#endif // BRPC_CONTINUOUS_PROFILER_H
@@ -17,9 +17,14 @@
 
 // This is an rpc-internal file.
 
+#include <google/protobuf/descriptor.h>        // MethodDescriptor
+#include <gflags/gflags_declare.h>
+#include "bthread/bthread.h"                   // bthread_self
+#include "bthread/unstable.h"                  // bthread_self_stat
 #include "brpc/socket.h"
 #include "brpc/controller.h"
 #include "brpc/stream.h"
+#include "brpc/details/continuous_profiler.h"   // SetProfilingTag
 
 namespace google {
 namespace protobuf {
@@ -30,6 +35,8 @@ class Message;
 
 namespace brpc {
 
+DECLARE_bool(enable_latency_breakdown);
+
 class AuthContext;
 
 // A wrapper to access some private methods/fields of `Controller'
@@ -115,8 +122,14 @@ public:
     StreamId request_stream() { return _cntl->_request_stream; }
     StreamId response_stream() { return _cntl->_response_stream; }
 
-    void set_method(const google::protobuf::MethodDescriptor* method) 
-    { _cntl->_method = method; }
+    void set_method(const google::protobuf::MethodDescriptor* method) {
+        _cntl->_method = method;
+        if (FLAGS_enable_latency_breakdown) {
+            _cntl->_method_found_us = butil::cpuwide_time_us();
+        }
+        // Reset in ProcessInputMessage().
+        SetProfilingTag(method ? method->full_name().c_str() : NULL);
+    }
 
     void set_readable_progressive_attachment(ReadableProgressiveAttachment* s)
     { _cntl->_rpa.reset(s); }
@@ -132,12 +145,42 @@ public:
     // side is properly set in the RPC sending path.
     void set_deadline_us(int64_t deadline_us) { _cntl->_deadline_us = deadline_us; }
 
+    // Called by server-side protocols when processing of the request
+    // begins, in the bthread processing it.
     ControllerPrivateAccessor& set_begin_time_us(int64_t begin_time_us) {
         _cntl->_begin_time_us = begin_time_us;
         _cntl->_end_time_us = UNSET_MAGIC_NUM;
+        if (bthread_self_stat(&_cntl->_begin_cputime_ns,
+                              &_cntl->_begin_rq_wait_ns) == 0) {
+            _cntl->_begin_bthread = bthread_self();
+        } else {
+            _cntl->_begin_bthread = INVALID_BTHREAD;
+        }
         return *this;
     }
 
+    // Get microseconds that the calling bthread spent on cpu and in run
+    // queues since set_begin_time_us().
+    // Returns false if the calling bthread is not the one began processing
+    // the request, e.g. the response is sent by an asynchronous service
+    // in another bthread.
+    bool get_bthread_time_us(int64_t* cputime_us, int64_t* rq_wait_us) {
+        int64_t cputime_ns = 0;
+        int64_t rq_wait_ns = 0;
+        if (_cntl->_begin_bthread == INVALID_BTHREAD ||
+            _cntl->_begin_bthread != bthread_self() ||
+            bthread_self_stat(&cputime_ns, &rq_wait_ns) != 0) {
+            return false;
+        }
+        *cputime_us = (cputime_ns - _cntl->_begin_cputime_ns) / 1000L;
+        *rq_wait_us = (rq_wait_ns - _cntl->_begin_rq_wait_ns) / 1000L;
+        return true;
+    }
+
+    // Time when set_method() was called with -enable_latency_breakdown on,
+    // 0 otherwise.
+    int64_t method_found_us() const { return _cntl->_method_found_us; }
+
     ControllerPrivateAccessor& set_health_check_call() {
         _cntl->add_flag(Controller::FLAGS_HEALTH_CHECK_CALL);
         return *this;
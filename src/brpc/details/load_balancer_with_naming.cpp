@@ -14,12 +14,68 @@
 
 // Authors: Ge,Jun (gejun@baidu.com)
 
+#include <pthread.h>
+#include <gflags/gflags.h>
+#include "butil/containers/flat_map.h"
+#include "brpc/reloadable_flags.h"
 #include "brpc/details/load_balancer_with_naming.h"
 
 
 namespace brpc {
 
+DEFINE_bool(share_lb_among_channels, false, "Channels initialized with same "
+            "naming service url, load balancer, filter and options share one "
+            "load balancer, which saves memory and updates of servers when "
+            "there're lots of channels to same clusters");
+BRPC_VALIDATE_GFLAG(share_lb_among_channels, PassValidate);
+
+struct LoadBalancerWithNaming::SharedKey {
+    std::string ns_url;
+    std::string lb_name;
+    const NamingServiceFilter* filter;
+    ChannelSignature channel_signature;
+
+    SharedKey(const std::string& ns_url_in, const std::string& lb_name_in,
+              const NamingServiceFilter* filter_in,
+              const ChannelSignature& sig)
+        : ns_url(ns_url_in), lb_name(lb_name_in)
+        , filter(filter_in), channel_signature(sig) {
+    }
+};
+struct SharedKeyHasher {
+    size_t operator()(const LoadBalancerWithNaming::SharedKey& key) const {
+        size_t h = butil::DefaultHasher<std::string>()(key.ns_url);
+        h = h * 101 + butil::DefaultHasher<std::string>()(key.lb_name);
+        h = h * 101 + (uintptr_t)key.filter;
+        h = h * 101 + key.channel_signature.data[1];
+        return h;
+    }
+};
+inline bool operator==(const LoadBalancerWithNaming::SharedKey& k1,
+                       const LoadBalancerWithNaming::SharedKey& k2) {
+    return k1.ns_url == k2.ns_url &&
+        k1.lb_name == k2.lb_name &&
+        k1.filter == k2.filter &&
+        k1.channel_signature == k2.channel_signature;
+}
+
+typedef butil::FlatMap<LoadBalancerWithNaming::SharedKey,
+                       LoadBalancerWithNaming*, SharedKeyHasher> SharedLBMap;
+static SharedLBMap* g_shared_lb_map = NULL;
+static pthread_mutex_t g_shared_lb_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+LoadBalancerWithNaming::LoadBalancerWithNaming() {}
+
 LoadBalancerWithNaming::~LoadBalancerWithNaming() {
+    if (_shared_key) {
+        std::unique_lock<pthread_mutex_t> mu(g_shared_lb_map_mutex);
+        if (g_shared_lb_map != NULL) {
+            LoadBalancerWithNaming** ptr = g_shared_lb_map->seek(*_shared_key);
+            if (ptr != NULL && *ptr == this) {
+                g_shared_lb_map->erase(*_shared_key);
+            }
+        }
+    }
     if (_nsthread_ptr.get()) {
         _nsthread_ptr->RemoveWatcher(this);
     }
@@ -63,4 +119,94 @@ void LoadBalancerWithNaming::Describe(std::ostream& os,
     SharedLoadBalancer::Describe(os, options);
 }
 
+// Returns the shared instance of `key' with a reference added, NULL if
+// it's absent or being destructed.
+static LoadBalancerWithNaming* FindSharedLB(
+    const LoadBalancerWithNaming::SharedKey& key) {
+    BAIDU_SCOPED_LOCK(g_shared_lb_map_mutex);
+    if (g_shared_lb_map == NULL) {
+        return NULL;
+    }
+    LoadBalancerWithNaming** ptr = g_shared_lb_map->seek(key);
+    if (ptr == NULL) {
+        return NULL;
+    }
+    if (!(*ptr)->AddRefIfNonZero()) {
+        // The last reference was just released and the dtor is waiting for
+        // g_shared_lb_map_mutex. Remove the entry so that nobody finds the
+        // dying object again, the dtor skips entries not pointing to it.
+        g_shared_lb_map->erase(key);
+        return NULL;
+    }
+    return *ptr;
+}
+
+int GetLoadBalancerWithNaming(butil::intrusive_ptr<SharedLoadBalancer>* lb_out,
+                              const char* ns_url, const char* lb_name,
+                              const NamingServiceFilter* filter,
+                              const GetNamingServiceThreadOptions* options) {
+    if (!FLAGS_share_lb_among_channels) {
+        butil::intrusive_ptr<LoadBalancerWithNaming> lb(
+            new (std::nothrow) LoadBalancerWithNaming);
+        if (lb.get() == NULL) {
+            LOG(FATAL) << "Fail to new LoadBalancerWithNaming";
+            return -1;
+        }
+        if (lb->Init(ns_url, lb_name, filter, options) != 0) {
+            return -1;
+        }
+        *lb_out = lb;
+        return 0;
+    }
+    const LoadBalancerWithNaming::SharedKey key(
+        ns_url, lb_name, filter,
+        (options ? options->channel_signature : ChannelSignature()));
+    butil::intrusive_ptr<LoadBalancerWithNaming> lb;
+    LoadBalancerWithNaming* shared = FindSharedLB(key);
+    if (shared == NULL) {
+        // Init() may wait for the naming service, don't block creations of
+        // other load balancers. Concurrent creations of the same key are
+        // rare and only one of them is shared.
+        lb.reset(new (std::nothrow) LoadBalancerWithNaming);
+        if (lb.get() == NULL) {
+            LOG(FATAL) << "Fail to new LoadBalancerWithNaming";
+            return -1;
+        }
+        if (lb->Init(ns_url, lb_name, filter, options) != 0) {
+            return -1;
+        }
+        lb->_shared_key.reset(new LoadBalancerWithNaming::SharedKey(key));
+        std::unique_lock<pthread_mutex_t> mu(g_shared_lb_map_mutex);
+        if (g_shared_lb_map == NULL) {
+            g_shared_lb_map = new (std::nothrow) SharedLBMap;
+            if (NULL == g_shared_lb_map) {
+                mu.unlock();
+                LOG(ERROR) << "Fail to new g_shared_lb_map";
+                return -1;
+            }
+            if (g_shared_lb_map->init(64) != 0) {
+                mu.unlock();
+                LOG(ERROR) << "Fail to init g_shared_lb_map";
+                return -1;
+            }
+        }
+        LoadBalancerWithNaming*& ptr = (*g_shared_lb_map)[key];
+        if (ptr != NULL && ptr->AddRefIfNonZero()) {
+            shared = ptr;
+        } else {
+            // Absent or being destructed, replace it.
+            ptr = lb.get();
+        }
+    }
+    if (shared != NULL) {
+        lb.reset(shared, false);
+        // Same as channels sharing a NamingServiceThread.
+        if (lb->_nsthread_ptr->WaitForFirstBatchOfServers() != 0) {
+            return -1;
+        }
+    }
+    *lb_out = lb;
+    return 0;
+}
+
 } // namespace brpc
@@ -17,6 +17,7 @@
 #ifndef BRPC_LOAD_BALANCER_WITH_NAMING_H
 #define BRPC_LOAD_BALANCER_WITH_NAMING_H
 
+#include <memory>                                       // std::unique_ptr
 #include "butil/intrusive_ptr.hpp"
 #include "brpc/load_balancer.h"
 #include "brpc/details/naming_service_thread.h"         // NamingServiceWatcher
@@ -26,8 +27,14 @@ namespace brpc {
 
 class LoadBalancerWithNaming : public SharedLoadBalancer,
                                public NamingServiceWatcher {
+friend int GetLoadBalancerWithNaming(
+    butil::intrusive_ptr<SharedLoadBalancer>*, const char*, const char*,
+    const NamingServiceFilter*, const GetNamingServiceThreadOptions*);
 public:
-    LoadBalancerWithNaming() {}
+    // Identifies instances shared by channels.
+    struct SharedKey;
+
+    LoadBalancerWithNaming();
     ~LoadBalancerWithNaming();
 
     int Init(const char* ns_url, const char* lb_name,
@@ -41,8 +48,20 @@ public:
 
 private:
     butil::intrusive_ptr<NamingServiceThread> _nsthread_ptr;
+    // Non-NULL if this instance is shared by channels.
+    std::unique_ptr<SharedKey> _shared_key;
 };
 
+// Get a LoadBalancerWithNaming balancing servers of `ns_url' with `lb_name'.
+// If -share_lb_among_channels is on, channels with same ns_url, lb_name,
+// filter and channel signature share one instance, including servers and
+// states of the load balancer, otherwise a new one is created each time.
+// Returns 0 on success, -1 otherwise.
+int GetLoadBalancerWithNaming(butil::intrusive_ptr<SharedLoadBalancer>* lb_out,
+                              const char* ns_url, const char* lb_name,
+                              const NamingServiceFilter* filter,
+                              const GetNamingServiceThreadOptions* options);
+
 } // namespace brpc
 
 
@@ -17,6 +17,8 @@
 #include <limits>
 #include "butil/macros.h"
 #include "brpc/controller.h"
+#include "brpc/span.h"
+#include "brpc/details/controller_private_accessor.h"
 #include "brpc/details/server_private_accessor.h"
 #include "brpc/details/method_status.h"
 
@@ -39,10 +41,40 @@ MethodStatus::MethodStatus()
     , _nconcurrency_bvar(cast_int, &_nconcurrency)
     , _eps_bvar(&_nerror_bvar)
     , _max_concurrency_bvar(cast_cl, &_cl)
+    , _cputime_bvar(&_cputime_rec, -1)
+    , _rq_wait_bvar(&_rq_wait_rec, -1)
+    , _stages(NULL)
 {
 }
 
 MethodStatus::~MethodStatus() {
+    delete _stages.load(butil::memory_order_relaxed);
+}
+
+MethodStatus::StageRecorders* MethodStatus::GetOrNewStageRecorders() {
+    BAIDU_SCOPED_LOCK(_stages_mutex);
+    StageRecorders* stages = _stages.load(butil::memory_order_relaxed);
+    if (stages == NULL) {
+        stages = new StageRecorders;
+        if (!_prefix.empty()) {
+            ExposeStageRecorders(stages);
+        }
+        _stages.store(stages, butil::memory_order_release);
+    }
+    return stages;
+}
+
+int MethodStatus::ExposeStageRecorders(StageRecorders* stages) {
+    if (stages->queue.expose(_prefix, "queue") != 0) {
+        return -1;
+    }
+    if (stages->process.expose(_prefix, "process") != 0) {
+        return -1;
+    }
+    if (stages->send.expose(_prefix, "send") != 0) {
+        return -1;
+    }
+    return 0;
 }
 
 int MethodStatus::Expose(const butil::StringPiece& prefix) {
@@ -58,6 +90,20 @@ int MethodStatus::Expose(const butil::StringPiece& prefix) {
     if (_latency_rec.expose(prefix) != 0) {
         return -1;
     }
+    if (_cputime_bvar.expose_as(prefix, "cputime") != 0) {
+        return -1;
+    }
+    if (_rq_wait_bvar.expose_as(prefix, "rq_wait") != 0) {
+        return -1;
+    }
+    {
+        BAIDU_SCOPED_LOCK(_stages_mutex);
+        _prefix.assign(prefix.data(), prefix.size());
+        StageRecorders* stages = _stages.load(butil::memory_order_relaxed);
+        if (stages != NULL && ExposeStageRecorders(stages) != 0) {
+            return -1;
+        }
+    }
     if (_cl) {
         if (_max_concurrency_bvar.expose_as(prefix, "max_concurrency") != 0) {
             return -1;
@@ -94,6 +140,25 @@ void OutputValue(std::ostream& os,
     }
 }
 
+static void DescribeStage(std::ostream& os, const char* stage,
+                          const bvar::LatencyRecorder& rec,
+                          const DescribeOptions& options) {
+    if (rec.count() == 0) {
+        return;
+    }
+    const std::string prefix = std::string(stage) + "_latency";
+    OutputValue(os, (prefix + ": ").c_str(), rec.latency_name(),
+                rec.latency(), options, false);
+    if (options.use_html) {
+        OutputValue(os, (prefix + "_percentiles: ").c_str(),
+                    rec.latency_percentiles_name(),
+                    rec.latency_percentiles(), options, false);
+    } else {
+        OutputTextValue(os, (prefix + "_99: ").c_str(),
+                        rec.latency_percentile(0.99));
+    }
+}
+
 void MethodStatus::Describe(
     std::ostream &os, const DescribeOptions& options) const {
     // success requests
@@ -134,6 +199,23 @@ void MethodStatus::Describe(
     OutputValue(os, "max_latency: ", _latency_rec.max_latency_name(),
                 _latency_rec.max_latency(), options, false);
 
+    // Time of bthreads processing requests, in microseconds per request.
+    const int64_t cputime = _cputime_bvar.get_value().get_average_int();
+    OutputValue(os, "cputime: ", _cputime_bvar.name(), cputime,
+                options, false);
+    OutputValue(os, "rq_wait: ", _rq_wait_bvar.name(),
+                _rq_wait_bvar.get_value().get_average_int(), options, false);
+    // Number of cpu cores occupied by this method.
+    OutputTextValue(os, "cpu_usage: ", cputime * qps / 1000000.0);
+
+    // Stages of requests, recorded with -enable_latency_breakdown.
+    const StageRecorders* stages = _stages.load(butil::memory_order_acquire);
+    if (stages != NULL) {
+        DescribeStage(os, "queue", stages->queue, options);
+        DescribeStage(os, "process", stages->process, options);
+        DescribeStage(os, "send", stages->send, options);
+    }
+
     // Concurrency
     OutputValue(os, "concurrency: ", _nconcurrency_bvar.name(),
                 _nconcurrency, options, false);
@@ -149,6 +231,24 @@ void MethodStatus::SetConcurrencyLimiter(ConcurrencyLimiter* cl) {
 
 ConcurrencyRemover::~ConcurrencyRemover() {
     if (_status) {
+        int64_t cputime_us = 0;
+        int64_t rq_wait_us = 0;
+        if (ControllerPrivateAccessor(_c).get_bthread_time_us(
+                &cputime_us, &rq_wait_us)) {
+            _status->OnBthreadTime(cputime_us, rq_wait_us);
+            Span* span = ControllerPrivateAccessor(_c).span();
+            if (span) {
+                span->set_bthread_time_us(cputime_us, rq_wait_us);
+            }
+        }
+        const int64_t method_found_us =
+            ControllerPrivateAccessor(_c).method_found_us();
+        if (_start_send_us != 0 && method_found_us != 0) {
+            _status->OnStageLatency(
+                method_found_us - (int64_t)_received_us,
+                _start_send_us - method_found_us,
+                butil::cpuwide_time_us() - _start_send_us);
+        }
         _status->OnResponded(_c->ErrorCode(), butil::cpuwide_time_us() - _received_us);
         _status = NULL;
     }
@@ -17,7 +17,10 @@
 #ifndef  BRPC_METHOD_STATUS_H
 #define  BRPC_METHOD_STATUS_H
 
+#include <gflags/gflags_declare.h>
 #include "butil/macros.h"                  // DISALLOW_COPY_AND_ASSIGN
+#include "butil/synchronization/lock.h"    // butil::Mutex
+#include "butil/time.h"                    // cpuwide_time_us
 #include "bvar/bvar.h"                    // vars
 #include "brpc/describable.h"
 #include "brpc/concurrency_limiter.h"
@@ -25,6 +28,8 @@
 
 namespace brpc {
 
+DECLARE_bool(enable_latency_breakdown);
+
 class Controller;
 class Server;
 // Record accessing stats of a method.
@@ -46,6 +51,23 @@ public:
     // did the time keeping and the cost is better saved. 
     void OnResponded(int error_code, int64_t latency_us);
 
+    // Call this when the request was processed in one bthread from the
+    // beginning to the response.
+    // `cputime_us' : microseconds the bthread spent on cpu.
+    // `rq_wait_us' : microseconds the bthread spent in run queues after
+    // being ready to run, namely the scheduling latency.
+    void OnBthreadTime(int64_t cputime_us, int64_t rq_wait_us);
+
+    // Call this with microseconds spent in stages of a request when
+    // -enable_latency_breakdown is on.
+    // `queue_us' : from the request being cut from the connection until its
+    // method is found, namely starting the bthread and parsing the meta.
+    // `process_us' : parsing the request and running the method until the
+    // response is about to be sent.
+    // `send_us' : packing the response and queuing it into the connection,
+    // see rpc_socket_write for the time of writing it out.
+    void OnStageLatency(int64_t queue_us, int64_t process_us, int64_t send_us);
+
     // Expose internal vars.
     // Return 0 on success, -1 otherwise.
     int Expose(const butil::StringPiece& prefix);
@@ -64,6 +86,17 @@ friend class Server;
     // before the server is started. 
     void SetConcurrencyLimiter(ConcurrencyLimiter* cl);
 
+    // LatencyRecorders of stages are not cheap, they're created when
+    // -enable_latency_breakdown is seen on for the first time.
+    struct StageRecorders {
+        bvar::LatencyRecorder queue;
+        bvar::LatencyRecorder process;
+        bvar::LatencyRecorder send;
+    };
+    StageRecorders* GetOrNewStageRecorders();
+    // Must be called with _stages_mutex held.
+    int ExposeStageRecorders(StageRecorders* stages);
+
     std::unique_ptr<ConcurrencyLimiter> _cl;
     butil::atomic<int> _nconcurrency;
     bvar::Adder<int64_t>  _nerror_bvar;
@@ -71,6 +104,15 @@ friend class Server;
     bvar::PassiveStatus<int>  _nconcurrency_bvar;
     bvar::PerSecond<bvar::Adder<int64_t>> _eps_bvar;
     bvar::PassiveStatus<int32_t> _max_concurrency_bvar;
+    bvar::IntRecorder _cputime_rec;
+    bvar::Window<bvar::IntRecorder> _cputime_bvar;
+    bvar::IntRecorder _rq_wait_rec;
+    bvar::Window<bvar::IntRecorder> _rq_wait_bvar;
+    butil::atomic<StageRecorders*> _stages;
+    // Protecting creation of _stages and _prefix.
+    butil::Mutex _stages_mutex;
+    // Passed to Expose(), for exposing _stages created later.
+    std::string _prefix;
 };
 
 class ConcurrencyRemover {
@@ -78,13 +120,16 @@ public:
     ConcurrencyRemover(MethodStatus* status, Controller* c, int64_t received_us)
         : _status(status) 
         , _c(c)
-        , _received_us(received_us) {}
+        , _received_us(received_us)
+        , _start_send_us(FLAGS_enable_latency_breakdown ?
+                         butil::cpuwide_time_us() : 0) {}
     ~ConcurrencyRemover();
 private:
     DISALLOW_COPY_AND_ASSIGN(ConcurrencyRemover);
     MethodStatus* _status;
     Controller* _c;
     uint64_t _received_us;
+    int64_t _start_send_us;
 };
 
 inline bool MethodStatus::OnRequested(int* rejected_cc) {
@@ -98,6 +143,23 @@ inline bool MethodStatus::OnRequested(int* rejected_cc) {
     return false;
 }
 
+inline void MethodStatus::OnBthreadTime(int64_t cputime_us,
+                                        int64_t rq_wait_us) {
+    _cputime_rec << cputime_us;
+    _rq_wait_rec << rq_wait_us;
+}
+
+inline void MethodStatus::OnStageLatency(
+    int64_t queue_us, int64_t process_us, int64_t send_us) {
+    StageRecorders* stages = _stages.load(butil::memory_order_acquire);
+    if (stages == NULL) {
+        stages = GetOrNewStageRecorders();
+    }
+    stages->queue << queue_us;
+    stages->process << process_us;
+    stages->send << send_us;
+}
+
 inline void MethodStatus::OnResponded(int error_code, int64_t latency) {
     _nconcurrency.fetch_sub(1, butil::memory_order_relaxed);
     if (0 == error_code) {
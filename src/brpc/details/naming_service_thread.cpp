@@ -15,6 +15,7 @@
 // Authors: Ge,Jun (gejun@baidu.com)
 
 #include <set>
+#include <algorithm>
 #include <pthread.h>
 #include <gflags/gflags.h>
 #include "bthread/butex.h"
@@ -22,11 +23,16 @@
 #include "butil/logging.h"
 #include "brpc/log.h"
 #include "brpc/socket_map.h"
+#include "brpc/periodic_task.h"
+#include "brpc/circuit_breaker.h"
 #include "brpc/details/naming_service_thread.h"
 
 
 namespace brpc {
 
+DECLARE_bool(circuit_breaker_enable_outlier_detection);
+DECLARE_int32(circuit_breaker_outlier_detection_interval_ms);
+
 struct NSKey {
     std::string protocol;
     std::string service_name;
@@ -67,7 +73,7 @@ NamingServiceThread::Actions::Actions(NamingServiceThread* owner)
 
 NamingServiceThread::Actions::~Actions() {
     // Remove all sockets from SocketMap
-    for (std::vector<ServerNode>::const_iterator it = _last_servers.begin();
+    for (std::set<ServerNode>::const_iterator it = _last_servers.begin();
          it != _last_servers.end(); ++it) {
         const SocketMapKey key(*it, _owner->_options.channel_signature);
         SocketMapRemove(key);
@@ -75,32 +81,81 @@ NamingServiceThread::Actions::~Actions() {
     EndWait(0);
 }
 
+// Sort and remove duplicated servers in `nodes'.
+static void SortAndDedup(std::vector<ServerNode>* nodes) {
+    std::sort(nodes->begin(), nodes->end());
+    const size_t dedup_size = std::unique(nodes->begin(), nodes->end())
+        - nodes->begin();
+    if (dedup_size != nodes->size()) {
+        LOG(WARNING) << "Removed " << nodes->size() - dedup_size
+                     << " duplicated servers";
+        nodes->resize(dedup_size);
+    }
+}
+
+template <typename Container>
+void NamingServiceThread::ServerNodeWithId2ServerId(
+    const Container& src,
+    std::vector<ServerId>* dst, const NamingServiceFilter* filter) {
+    dst->reserve(src.size());
+    for (typename Container::const_iterator
+             it = src.begin(); it != src.end(); ++it) {
+        if (filter && !filter->Accept(it->node)) {
+            continue;
+        }
+        ServerId socket;
+        socket.id = it->id;
+        socket.tag = it->node.tag;
+        dst->push_back(socket);
+    }
+}
+
 void NamingServiceThread::Actions::AddServers(
-    const std::vector<ServerNode>&) {
-    // FIXME(gejun)
-    abort();
+    const std::vector<ServerNode>& servers) {
+    UpdateServers(servers, std::vector<ServerNode>());
 }
 
 void NamingServiceThread::Actions::RemoveServers(
-    const std::vector<ServerNode>&) {
-    // FIXME(gejun)
-    abort();
+    const std::vector<ServerNode>& servers) {
+    UpdateServers(std::vector<ServerNode>(), servers);
+}
+
+void NamingServiceThread::Actions::UpdateServers(
+    const std::vector<ServerNode>& added,
+    const std::vector<ServerNode>& removed) {
+    // Only the changed servers are sorted and searched in _last_servers,
+    // nothing is proportional to number of all servers.
+    _removed.clear();
+    for (size_t i = 0; i < removed.size(); ++i) {
+        if (_last_servers.count(removed[i])) {
+            _removed.push_back(removed[i]);
+        }
+    }
+    std::sort(_removed.begin(), _removed.end());
+    _removed.resize(std::unique(_removed.begin(), _removed.end())
+                    - _removed.begin());
+    _added.clear();
+    for (size_t i = 0; i < added.size(); ++i) {
+        // A server removed and added again in one update is kept.
+        if (!_last_servers.count(added[i])) {
+            _added.push_back(added[i]);
+        } else if (std::binary_search(_removed.begin(), _removed.end(),
+                                      added[i])) {
+            _removed.erase(std::lower_bound(
+                               _removed.begin(), _removed.end(), added[i]));
+        }
+    }
+    SortAndDedup(&_added);
+    ApplyChanges();
 }
 
 void NamingServiceThread::Actions::ResetServers(
         const std::vector<ServerNode>& servers) {
     _servers.assign(servers.begin(), servers.end());
     
-    // Diff servers with _last_servers by comparing sorted vectors.
+    // Diff servers with _last_servers by comparing sorted sequences.
     // Notice that _last_servers is always sorted.
-    std::sort(_servers.begin(), _servers.end());
-    const size_t dedup_size = std::unique(_servers.begin(), _servers.end())
-        - _servers.begin();
-    if (dedup_size != _servers.size()) {
-        LOG(WARNING) << "Removed " << _servers.size() - dedup_size
-                     << " duplicated servers";
-        _servers.resize(dedup_size);
-    }
+    SortAndDedup(&_servers);
     _added.resize(_servers.size());
     std::vector<ServerNode>::iterator _added_end = 
         std::set_difference(_servers.begin(), _servers.end(),
@@ -114,7 +169,15 @@ void NamingServiceThread::Actions::ResetServers(
                             _servers.begin(), _servers.end(),
                             _removed.begin());
     _removed.resize(_removed_end - _removed.begin());
+    ApplyChanges();
+}
 
+void NamingServiceThread::Actions::ApplyChanges() {
+    if (_added.empty() && _removed.empty()) {
+        // Periodic naming services often get same servers.
+        EndWait(_last_servers.empty() ? ENODATA : 0);
+        return;
+    }
     _added_sockets.clear();
     for (size_t i = 0; i < _added.size(); ++i) {
         ServerNodeWithId tagged_id;
@@ -125,6 +188,7 @@ void NamingServiceThread::Actions::ResetServers(
         const SocketMapKey key(_added[i], _owner->_options.channel_signature);
         CHECK_EQ(0, SocketMapInsert(key, &tagged_id.id, _owner->_options.ssl_ctx));
         _added_sockets.push_back(tagged_id);
+        _last_servers.insert(_added[i]);
     }
 
     _removed_sockets.clear();
@@ -134,36 +198,20 @@ void NamingServiceThread::Actions::ResetServers(
         const SocketMapKey key(_removed[i], _owner->_options.channel_signature);
         CHECK_EQ(0, SocketMapFind(key, &tagged_id.id));
         _removed_sockets.push_back(tagged_id);
+        _last_servers.erase(_removed[i]);
     }
 
-    // Refresh sockets
-    if (_removed_sockets.empty()) {
-        _sockets = _owner->_last_sockets;
-    } else {
-        std::sort(_removed_sockets.begin(), _removed_sockets.end());
-        _sockets.resize(_owner->_last_sockets.size());
-        std::vector<ServerNodeWithId>::iterator _sockets_end =
-            std::set_difference(
-                _owner->_last_sockets.begin(), _owner->_last_sockets.end(),
-                _removed_sockets.begin(), _removed_sockets.end(),
-                _sockets.begin());
-        _sockets.resize(_sockets_end - _sockets.begin());
-    }
-    if (!_added_sockets.empty()) {
-        const size_t before_added = _sockets.size();
-        std::sort(_added_sockets.begin(), _added_sockets.end());
-        _sockets.insert(_sockets.end(),
-                       _added_sockets.begin(), _added_sockets.end());
-        std::inplace_merge(_sockets.begin(), _sockets.begin() + before_added,
-                           _sockets.end());
-    }
     std::vector<ServerId> removed_ids;
     ServerNodeWithId2ServerId(_removed_sockets, &removed_ids, NULL);
 
     {
         BAIDU_SCOPED_LOCK(_owner->_mutex);
-        _last_servers.swap(_servers);
-        _owner->_last_sockets.swap(_sockets);
+        // Modify the sockets in place rather than copying all of them.
+        for (size_t i = 0; i < _removed_sockets.size(); ++i) {
+            _owner->_last_sockets.erase(_removed_sockets[i]);
+        }
+        _owner->_last_sockets.insert(_added_sockets.begin(),
+                                     _added_sockets.end());
         for (std::map<NamingServiceWatcher*,
                       const NamingServiceFilter*>::iterator
                  it = _owner->_watchers.begin();
@@ -200,7 +248,7 @@ void NamingServiceThread::Actions::ResetServers(
         LOG(INFO) << info.str();
     }
 
-    EndWait(servers.empty() ? ENODATA : 0);
+    EndWait(_last_servers.empty() ? ENODATA : 0);
 }
 
 void NamingServiceThread::Actions::EndWait(int error_code) {
@@ -220,6 +268,52 @@ int NamingServiceThread::Actions::WaitForFirstBatchOfServers() {
     return _wait_error;
 }
 
+struct NamingServiceThread::OutlierDetectionState {
+    // Guards `owner' which is NULL after the thread is destroyed.
+    butil::Mutex mutex;
+    NamingServiceThread* owner;
+};
+
+// Run LatencyOutlierDetector over servers of a NamingServiceThread
+// periodically until the thread is destroyed.
+class OutlierDetectionTask : public PeriodicTask {
+public:
+    explicit OutlierDetectionTask(
+        const std::shared_ptr<NamingServiceThread::OutlierDetectionState>& state)
+        : _state(state) {}
+    bool OnTriggeringTask(timespec* next_abstime);
+    void OnDestroyingTask() { delete this; }
+
+private:
+    std::shared_ptr<NamingServiceThread::OutlierDetectionState> _state;
+    LatencyOutlierDetector _detector;
+};
+
+bool OutlierDetectionTask::OnTriggeringTask(timespec* next_abstime) {
+    std::vector<SocketId> servers;
+    {
+        BAIDU_SCOPED_LOCK(_state->mutex);
+        NamingServiceThread* owner = _state->owner;
+        if (owner == NULL) {
+            return false;
+        }
+        BAIDU_SCOPED_LOCK(owner->_mutex);
+        servers.reserve(owner->_last_sockets.size());
+        for (std::set<NamingServiceThread::ServerNodeWithId>::const_iterator
+                 it = owner->_last_sockets.begin();
+             it != owner->_last_sockets.end(); ++it) {
+            servers.push_back(it->id);
+        }
+    }
+    // Same server with different tags appears more than once.
+    std::sort(servers.begin(), servers.end());
+    servers.erase(std::unique(servers.begin(), servers.end()), servers.end());
+    _detector.Detect(servers);
+    *next_abstime = butil::milliseconds_from_now(
+        FLAGS_circuit_breaker_outlier_detection_interval_ms);
+    return true;
+}
+
 NamingServiceThread::NamingServiceThread()
     : _tid(0)
     , _ns(NULL)
@@ -228,6 +322,10 @@ NamingServiceThread::NamingServiceThread()
 
 NamingServiceThread::~NamingServiceThread() {
     RPC_VLOG << "~NamingServiceThread(" << *this << ')';
+    if (_outlier_state) {
+        BAIDU_SCOPED_LOCK(_outlier_state->mutex);
+        _outlier_state->owner = NULL;
+    }
     // Remove from g_nsthread_map first
     if (!_protocol.empty()) {
         const NSKey key(_protocol, _service_name, _options.channel_signature);
@@ -284,6 +382,14 @@ int NamingServiceThread::Start(NamingService* naming_service,
         _options = *opt_in;
     }
     _last_sockets.clear();
+    if (FLAGS_circuit_breaker_enable_outlier_detection) {
+        _outlier_state.reset(new OutlierDetectionState);
+        _outlier_state->owner = this;
+        PeriodicTaskManager::StartTaskAt(
+            new OutlierDetectionTask(_outlier_state),
+            butil::milliseconds_from_now(
+                FLAGS_circuit_breaker_outlier_detection_interval_ms));
+    }
     if (_ns->RunNamingServiceReturnsQuickly()) {
         RunThis(this);
     } else {
@@ -312,22 +418,6 @@ int NamingServiceThread::WaitForFirstBatchOfServers() {
     return 0;
 }
 
-void NamingServiceThread::ServerNodeWithId2ServerId(
-    const std::vector<ServerNodeWithId>& src,
-    std::vector<ServerId>* dst, const NamingServiceFilter* filter) {
-    dst->reserve(src.size());
-    for (std::vector<ServerNodeWithId>::const_iterator
-             it = src.begin(); it != src.end(); ++it) {
-        if (filter && !filter->Accept(it->node)) {
-            continue;
-        }
-        ServerId socket;
-        socket.id = it->id;
-        socket.tag = it->node.tag;
-        dst->push_back(socket);
-    }
-}
-
 int NamingServiceThread::AddWatcher(NamingServiceWatcher* watcher,
                                     const NamingServiceFilter* filter) {
     if (watcher == NULL) {
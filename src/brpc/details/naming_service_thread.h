@@ -17,6 +17,8 @@
 #ifndef BRPC_NAMING_SERVICE_THREAD_H
 #define BRPC_NAMING_SERVICE_THREAD_H
 
+#include <memory>                               // std::shared_ptr
+#include <set>
 #include <string>
 #include "butil/intrusive_ptr.hpp"               // butil::intrusive_ptr
 #include "bthread/bthread.h"                    // bthread_t
@@ -67,19 +69,25 @@ class NamingServiceThread : public SharedObject, public Describable {
         void AddServers(const std::vector<ServerNode>& servers);
         void RemoveServers(const std::vector<ServerNode>& servers);
         void ResetServers(const std::vector<ServerNode>& servers);
+        void UpdateServers(const std::vector<ServerNode>& added,
+                           const std::vector<ServerNode>& removed);
         int WaitForFirstBatchOfServers();
         void EndWait(int error_code);
 
     private:
+        // Create or remove sockets of _added and _removed, notify watchers
+        // and apply the changes to _last_servers and _last_sockets of the
+        // owner, which costs O(changes * log(servers)).
+        void ApplyChanges();
+
         NamingServiceThread* _owner;
         bthread_id_t _wait_id;
         butil::atomic<bool> _has_wait_error;
         int _wait_error;
-        std::vector<ServerNode> _last_servers;
+        std::set<ServerNode> _last_servers;
         std::vector<ServerNode> _servers;
         std::vector<ServerNode> _added;
         std::vector<ServerNode> _removed;
-        std::vector<ServerNodeWithId> _sockets;
         std::vector<ServerNodeWithId> _added_sockets;
         std::vector<ServerNodeWithId> _removed_sockets;
     };
@@ -104,19 +112,25 @@ private:
     void Run();
     static void* RunThis(void*);
 
+    template <typename Container>
     static void ServerNodeWithId2ServerId(
-        const std::vector<ServerNodeWithId>& src,
+        const Container& src,
         std::vector<ServerId>* dst, const NamingServiceFilter* filter);
 
+    // Shared with OutlierDetectionTask which may outlive this thread.
+    struct OutlierDetectionState;
+    friend class OutlierDetectionTask;
+
     butil::Mutex _mutex;
     bthread_t _tid;
     NamingService* _ns;
     std::string _protocol;
     std::string _service_name;
     GetNamingServiceThreadOptions _options;
-    std::vector<ServerNodeWithId> _last_sockets;
+    std::set<ServerNodeWithId> _last_sockets;
     Actions _actions;
     std::map<NamingServiceWatcher*, const NamingServiceFilter*> _watchers;
+    std::shared_ptr<OutlierDetectionState> _outlier_state;
 };
 
 std::ostream& operator<<(std::ostream& os, const NamingServiceThread&);
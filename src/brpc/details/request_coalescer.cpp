@@ -0,0 +1,244 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <google/protobuf/descriptor.h>
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "bvar/bvar.h"
+#include "bthread/bthread.h"
+#include "brpc/channel.h"
+#include "brpc/details/usercode_backup_pool.h"      // RunUserCode
+#include "brpc/details/request_coalescer.h"
+
+namespace brpc {
+
+struct CoalescingVars {
+    bvar::Adder<int64_t> leader_count;
+    bvar::Adder<int64_t> follower_count;
+    bvar::PassiveStatus<double> ratio;
+
+    CoalescingVars()
+        : leader_count("rpc_coalescing_leader_count")
+        , follower_count("rpc_coalescing_follower_count")
+        , ratio("rpc_coalescing_ratio", GetRatio, this) {}
+
+    // Fraction of RPC merged into others.
+    static double GetRatio(void* arg) {
+        CoalescingVars* vars = static_cast<CoalescingVars*>(arg);
+        const int64_t nfollower = vars->follower_count.get_value();
+        const int64_t ntotal = vars->leader_count.get_value() + nfollower;
+        return ntotal > 0 ? (double)nfollower / ntotal : 0;
+    }
+};
+
+inline CoalescingVars* get_coalescing_vars() {
+    return butil::get_leaky_singleton<CoalescingVars>();
+}
+
+// Replaces `done' of the leader to wake up followers before running
+// user's done which may destroy the controller and response.
+class CoalescingLeaderDone : public google::protobuf::Closure {
+public:
+    CoalescingLeaderDone(RequestCoalescer* coalescer, const std::string& key,
+                         Controller* cntl, google::protobuf::Message* response,
+                         google::protobuf::Closure* done)
+        : _coalescer(coalescer), _key(key), _cntl(cntl)
+        , _response(response), _done(done) {}
+
+    void Run() {
+        _coalescer->Finish(_key, _cntl, _response);
+        _done->Run();
+        delete this;
+    }
+
+private:
+    butil::intrusive_ptr<RequestCoalescer> _coalescer;
+    std::string _key;
+    Controller* _cntl;
+    google::protobuf::Message* _response;
+    google::protobuf::Closure* _done;
+};
+
+RequestCoalescer::RequestCoalescer() {
+    CHECK_EQ(0, _flights.init(64));
+    get_coalescing_vars();
+}
+
+RequestCoalescer::~RequestCoalescer() {
+    // Flights keep a reference to this object, nothing should be left.
+    CHECK(_flights.empty());
+}
+
+size_t RequestCoalescer::inflight_count() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _flights.size();
+}
+
+bool RequestCoalescer::MakeKey(const google::protobuf::MethodDescriptor* method,
+                               Controller* cntl,
+                               const google::protobuf::Message* request,
+                               std::string* key) {
+    if (method == NULL || request == NULL ||
+        cntl->_request_stream != INVALID_STREAM_ID ||
+        cntl->has_http_request() ||
+        cntl->_sender != NULL ||
+        cntl->has_flag(Controller::FLAGS_DESTROY_CID_IN_DONE) ||
+        cntl->is_used_by_rpc()) {
+        return false;
+    }
+    key->append(method->full_name());
+    key->push_back('\0');
+    if (cntl->has_request_code()) {
+        const uint64_t code = cntl->request_code();
+        key->append((const char*)&code, sizeof(code));
+    }
+    key->push_back('\0');
+    const size_t request_pos = key->size();
+    if (!request->AppendToString(key)) {
+        // Missing required fields, let the channel report the error.
+        return false;
+    }
+    // Distinguish (request, attachment) pairs with the same concatenation.
+    const uint32_t request_size = key->size() - request_pos;
+    key->append((const char*)&request_size, sizeof(request_size));
+    cntl->request_attachment().append_to(key);
+    return true;
+}
+
+void RequestCoalescer::CallMethod(
+    Channel* channel,
+    const google::protobuf::MethodDescriptor* method,
+    Controller* cntl,
+    const google::protobuf::Message* request,
+    google::protobuf::Message* response,
+    google::protobuf::Closure* done) {
+    std::string key;
+    if (!MakeKey(method, cntl, request, &key)) {
+        return channel->DoCallMethod(method, cntl, request, response, done);
+    }
+    // Lock the call_id as Channel does so that Join() on it waits for the
+    // leader's response.
+    const CallId cid = cntl->call_id();
+    if (bthread_id_lock_and_reset_range(cid, NULL, 2) != 0) {
+        return channel->DoCallMethod(method, cntl, request, response, done);
+    }
+    {
+        std::unique_lock<butil::Mutex> mu(_mutex);
+        WaiterList* waiters = _flights.seek(key);
+        if (waiters != NULL) {
+            Waiter w = { cntl, response, done, cid };
+            waiters->push_back(w);
+            mu.unlock();
+            get_coalescing_vars()->follower_count << 1;
+            cntl->OnRPCBegin(butil::gettimeofday_us());
+            cntl->set_used_by_rpc();
+            if (done == NULL) {
+                bthread_id_join(cid);
+                // Same as Channel::CallMethod, count in the context-switch.
+                cntl->OnRPCEnd(butil::gettimeofday_us());
+            }
+            return;
+        }
+        _flights[key];
+    }
+    CHECK_EQ(0, bthread_id_unlock(cid));
+    get_coalescing_vars()->leader_count << 1;
+    if (done == NULL) {
+        channel->DoCallMethod(method, cntl, request, response, NULL);
+        Finish(key, cntl, response);
+    } else {
+        channel->DoCallMethod(
+            method, cntl, request, response,
+            new CoalescingLeaderDone(this, key, cntl, response, done));
+    }
+}
+
+void RequestCoalescer::Finish(const std::string& key,
+                              Controller* leader_cntl,
+                              const google::protobuf::Message* leader_response) {
+    WaiterList waiters;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        WaiterList* p = _flights.seek(key);
+        if (p == NULL) {
+            LOG(ERROR) << "Fail to find the flight to finish";
+            return;
+        }
+        waiters.swap(*p);
+        // RPC issued from now on start a new flight.
+        _flights.erase(key);
+    }
+    for (size_t i = 0; i < waiters.size(); ++i) {
+        const Waiter& w = waiters[i];
+        Controller* cntl = w.cntl;
+        cntl->_remote_side = leader_cntl->_remote_side;
+        cntl->_local_side = leader_cntl->_local_side;
+        if (leader_cntl->Failed()) {
+            cntl->_error_code = leader_cntl->_error_code;
+            cntl->_error_text = leader_cntl->_error_text;
+        } else if (w.response != NULL && leader_response != NULL) {
+            if (w.response->GetDescriptor() ==
+                leader_response->GetDescriptor()) {
+                w.response->CopyFrom(*leader_response);
+            } else {
+                cntl->SetFailed(ERESPONSE, "Unmatched type of response=%s",
+                                w.response->GetDescriptor()->full_name().c_str());
+            }
+        }
+        // IOBuf shares the blocks, no copying.
+        cntl->response_attachment() = leader_cntl->response_attachment();
+        EndFollower(w);
+    }
+}
+
+// Arguments of RunFollowerDone.
+struct FollowerDoneArg {
+    google::protobuf::Closure* done;
+    CallId cid;
+};
+
+static void RunFollowerDone(void* arg) {
+    FollowerDoneArg* a = static_cast<FollowerDoneArg*>(arg);
+    a->done->Run();
+    // NOTE: Don't touch the controller anymore, it may be deleted.
+    CHECK_EQ(0, bthread_id_unlock_and_destroy(a->cid));
+    delete a;
+}
+
+void RequestCoalescer::EndFollower(const Waiter& w) {
+    if (w.done == NULL) {
+        // Wake up the synchronous caller in CallMethod().
+        CHECK_EQ(0, bthread_id_unlock_and_destroy(w.cid));
+        return;
+    }
+    // Same sequence as Controller::OnVersionedRPCReturned and EndRPC:
+    // callid is destroyed after done which possibly takes a lot of time,
+    // stop useless locking.
+    bthread_id_about_to_destroy(w.cid);
+    if (!FLAGS_usercode_in_pthread || w.done == DoNothing()) {
+        w.cntl->OnRPCEnd(butil::gettimeofday_us());
+        w.done->Run();
+        // NOTE: Don't touch the controller anymore, it may be deleted.
+        CHECK_EQ(0, bthread_id_unlock_and_destroy(w.cid));
+    } else {
+        w.cntl->OnRPCEnd(butil::gettimeofday_us());
+        FollowerDoneArg* arg = new FollowerDoneArg;
+        arg->done = w.done;
+        arg->cid = w.cid;
+        RunUserCode(RunFollowerDone, arg);
+    }
+}
+
+} // namespace brpc
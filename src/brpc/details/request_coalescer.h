@@ -0,0 +1,85 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_REQUEST_COALESCER_H
+#define BRPC_REQUEST_COALESCER_H
+
+#include <string>
+#include <vector>
+#include <google/protobuf/message.h>
+#include "butil/containers/flat_map.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/shared_object.h"
+#include "brpc/controller.h"
+
+namespace brpc {
+
+class Channel;
+
+// Merge identical RPC (same method, request, attachment and request_code)
+// which are in flight at the same time over a Channel. The first RPC (the
+// leader) is sent as usual, others (the followers) wait for the leader and
+// get copies of its response or error when it finishes. Enabled by
+// ChannelOptions.enable_request_coalescing.
+// Notes:
+//  - Followers inherit the timeout, retries and cancelation of the leader.
+//  - RPC with streams or customized http headers are never merged.
+class RequestCoalescer : public SharedObject {
+public:
+    RequestCoalescer();
+    ~RequestCoalescer();
+
+    // Send the RPC via `channel' or wait for an identical one in flight.
+    // Arguments are same with Channel::CallMethod().
+    void CallMethod(Channel* channel,
+                    const google::protobuf::MethodDescriptor* method,
+                    Controller* cntl,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done);
+
+    // Number of distinct keys in flight.
+    size_t inflight_count();
+
+    // Serialize method, request, attachment and request_code of the RPC
+    // into `key'. Returns false if the RPC can't be merged or cached.
+    static bool MakeKey(const google::protobuf::MethodDescriptor* method,
+                        Controller* cntl,
+                        const google::protobuf::Message* request,
+                        std::string* key);
+
+private:
+friend class CoalescingLeaderDone;
+    struct Waiter {
+        Controller* cntl;
+        google::protobuf::Message* response;
+        google::protobuf::Closure* done;
+        CallId cid;
+    };
+    typedef std::vector<Waiter> WaiterList;
+
+    // Copy result of the leader into followers of `key' and wake them up.
+    void Finish(const std::string& key, Controller* leader_cntl,
+                const google::protobuf::Message* leader_response);
+
+    // Wake up or run done of a follower whose result is set.
+    static void EndFollower(const Waiter& w);
+
+    butil::Mutex _mutex;
+    butil::FlatMap<std::string, WaiterList> _flights;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_REQUEST_COALESCER_H
@@ -0,0 +1,485 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "butil/compat.h"                        // OS_LINUX
+#include <unistd.h>                              // getpid, ftruncate
+#include <algorithm>                             // std::min
+#include <fcntl.h>                               // open
+#include <sys/mman.h>                            // mmap
+#include <sys/stat.h>                            // fstat
+#include <sys/socket.h>                          // getsockopt
+#include <netinet/in.h>                          // sockaddr_in
+#include <dirent.h>                              // opendir
+#if defined(OS_LINUX)
+#include <sys/syscall.h>                         // SYS_memfd_create
+#endif
+#include "butil/logging.h"
+#include "butil/fd_utility.h"                    // make_close_on_exec
+#include "butil/fd_guard.h"                      // fd_guard
+#include "bthread/butex.h"                       // butex_*
+#include "brpc/details/shm_transport.h"
+
+// Not defined by old glibc.
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_GET_SEALS (1024 + 10)
+#endif
+#ifndef F_SEAL_SEAL
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
+namespace brpc {
+
+static const char SHM_MAGIC[4] = { 'B', 'S', 'H', 'M' };
+static const char SHM_MEMFD_NAME[] = "brpc_shm";
+static const char SHM_MEMFD_LINK[] = "/memfd:brpc_shm";
+// A sealed size can't be changed by either side, mapped pages are always
+// backed and accessing them never raises SIGBUS.
+static const int SHM_REQUIRED_SEALS = F_SEAL_SHRINK | F_SEAL_GROW;
+
+const char* ShmStateToString(ShmState s) {
+    switch (s) {
+    case SHM_UNKNOWN: return "SHM_UNKNOWN";
+    case SHM_OFF: return "SHM_OFF";
+    case SHM_CONNECTED: return "SHM_CONNECTED";
+    }
+    return "Bad ShmState";
+}
+
+size_t ShmRing::memory_size(uint32_t ring_size) {
+    return sizeof(ShmRingHeader) + ring_size;
+}
+
+void ShmRing::Init(void* mem, uint32_t ring_size) {
+    _header = static_cast<ShmRingHeader*>(mem);
+    _data = static_cast<char*>(mem) + sizeof(ShmRingHeader);
+    _size = ring_size;
+}
+
+bool ShmRing::empty() const {
+    return _header->tail.load(butil::memory_order_acquire) ==
+        _header->head.load(butil::memory_order_relaxed);
+}
+
+bool ShmRing::full() const {
+    return _header->tail.load(butil::memory_order_relaxed) -
+        _header->head.load(butil::memory_order_acquire) >= _size;
+}
+
+ssize_t ShmRing::CutFrom(butil::IOBuf* const* pieces, size_t count) {
+    const uint64_t head = _header->head.load(butil::memory_order_acquire);
+    const uint64_t tail = _header->tail.load(butil::memory_order_relaxed);
+    size_t left = _size - (size_t)(tail - head);
+    if (left == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    uint64_t pos = tail;
+    for (size_t i = 0; i < count && left > 0; ++i) {
+        butil::IOBuf* piece = pieces[i];
+        while (!piece->empty() && left > 0) {
+            const size_t offset = (size_t)(pos & (_size - 1));
+            // Copy until the end of data area, wrap around in next loop.
+            const size_t n = piece->cutn(
+                _data + offset, std::min(left, (size_t)_size - offset));
+            pos += n;
+            left -= n;
+        }
+    }
+    _header->tail.store(pos, butil::memory_order_release);
+    return (ssize_t)(pos - tail);
+}
+
+bool ShmRing::ShouldRing() {
+    // Pairs with the fence in Park(): either the consumer sees the data we
+    // just published, or we see consumer_parked.
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    return _header->consumer_parked.load(butil::memory_order_relaxed) &&
+        _header->consumer_parked.exchange(0, butil::memory_order_relaxed);
+}
+
+size_t ShmRing::CutInto(butil::IOPortal* out, size_t max_count) {
+    const uint64_t tail = _header->tail.load(butil::memory_order_acquire);
+    const uint64_t head = _header->head.load(butil::memory_order_relaxed);
+    size_t left = std::min((size_t)(tail - head), max_count);
+    uint64_t pos = head;
+    while (left > 0) {
+        const size_t offset = (size_t)(pos & (_size - 1));
+        const size_t n = std::min(left, (size_t)_size - offset);
+        out->append(_data + offset, n);
+        pos += n;
+        left -= n;
+    }
+    _header->head.store(pos, butil::memory_order_release);
+    return (size_t)(pos - head);
+}
+
+bool ShmRing::Park() {
+    _header->consumer_parked.store(1, butil::memory_order_relaxed);
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (!empty()) {
+        // If the producer already cleared the flag, a doorbell is coming
+        // and results in a spurious wakeup, which is harmless.
+        _header->consumer_parked.exchange(0, butil::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool ShmRing::ShouldRingProducer() {
+    // Pairs with the fence in ParkProducer().
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    return _header->producer_parked.load(butil::memory_order_relaxed) &&
+        _header->producer_parked.exchange(0, butil::memory_order_relaxed);
+}
+
+bool ShmRing::ParkProducer() {
+    _header->producer_parked.store(1, butil::memory_order_relaxed);
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (!full()) {
+        _header->producer_parked.exchange(0, butil::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+ShmTransport::ShmTransport()
+    : _memfd(-1)
+    , _mem(NULL)
+    , _mem_size(0)
+    , _ring_size(0)
+    , _space_butex(bthread::butex_create_checked<butil::atomic<int> >()) {
+    _space_butex->store(0, butil::memory_order_relaxed);
+}
+
+ShmTransport::~ShmTransport() {
+    CloseMemfd();
+    if (_mem) {
+        munmap(_mem, _mem_size);
+        _mem = NULL;
+    }
+    bthread::butex_destroy(_space_butex);
+    _space_butex = NULL;
+}
+
+void ShmTransport::CloseMemfd() {
+    if (_memfd >= 0) {
+        close(_memfd);
+        _memfd = -1;
+    }
+}
+
+bool ShmTransport::MaybeHello(const char* buf, size_t n) {
+    return memcmp(buf, SHM_MAGIC, std::min(n, sizeof(SHM_MAGIC))) == 0;
+}
+
+int ShmTransport::Map(int memfd, uint32_t ring_size, bool server_side) {
+    _memfd = memfd;
+    _ring_size = ring_size;
+    _mem_size = 2 * ShmRing::memory_size(ring_size);
+    void* mem = mmap(NULL, _mem_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, memfd, 0);
+    if (mem == MAP_FAILED) {
+        PLOG(WARNING) << "Fail to mmap memfd=" << memfd;
+        return -1;
+    }
+    _mem = mem;
+    char* const c2s = static_cast<char*>(mem);
+    char* const s2c = c2s + ShmRing::memory_size(ring_size);
+    if (server_side) {
+        _inbound.Init(c2s, ring_size);
+        _outbound.Init(s2c, ring_size);
+    } else {
+        _outbound.Init(c2s, ring_size);
+        _inbound.Init(s2c, ring_size);
+    }
+    return 0;
+}
+
+ShmTransport* ShmTransport::CreateForClient(uint32_t ring_size,
+                                            ShmHello* hello) {
+#if defined(OS_LINUX) && defined(SYS_memfd_create)
+    // Power of 2 makes positions in the rings cheap to compute.
+    uint32_t rounded = 4096;
+    while (rounded < ring_size && rounded < (1u << 30)) {
+        rounded <<= 1;
+    }
+    const int memfd = syscall(SYS_memfd_create, SHM_MEMFD_NAME,
+                              MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        PLOG(WARNING) << "Fail to memfd_create";
+        return NULL;
+    }
+    if (ftruncate(memfd, 2 * ShmRing::memory_size(rounded)) != 0) {
+        PLOG(WARNING) << "Fail to ftruncate memfd=" << memfd;
+        close(memfd);
+        return NULL;
+    }
+    if (fcntl(memfd, F_ADD_SEALS, SHM_REQUIRED_SEALS | F_SEAL_SEAL) != 0) {
+        PLOG(WARNING) << "Fail to seal memfd=" << memfd;
+        close(memfd);
+        return NULL;
+    }
+    ShmTransport* t = new ShmTransport;
+    // The file is zero-filled, which is a valid initial state of rings.
+    if (t->Map(memfd, rounded, false) != 0) {
+        delete t;
+        return NULL;
+    }
+    memcpy(hello->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+    hello->pid = getpid();
+    hello->memfd = memfd;
+    hello->ring_size = rounded;
+    return t;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+#if defined(OS_LINUX)
+// Find inode of the TCP socket at the other end of `fd' which is connected
+// via loopback, in /proc/net/tcp. Returns 0 when not found.
+static unsigned long FindPeerSocketInode(int fd) {
+    struct sockaddr_in local;
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(local);
+    if (getsockname(fd, (sockaddr*)&local, &len) != 0 ||
+        local.sin_family != AF_INET) {
+        return 0;
+    }
+    len = sizeof(peer);
+    if (getpeername(fd, (sockaddr*)&peer, &len) != 0 ||
+        peer.sin_family != AF_INET) {
+        return 0;
+    }
+    // The peer socket is listed with its own address as the local address.
+    // Addresses are printed as the raw u32 in host order.
+    char peer_local[32];
+    char peer_remote[32];
+    snprintf(peer_local, sizeof(peer_local), "%08X:%04X",
+             (unsigned)peer.sin_addr.s_addr, (unsigned)ntohs(peer.sin_port));
+    snprintf(peer_remote, sizeof(peer_remote), "%08X:%04X",
+             (unsigned)local.sin_addr.s_addr, (unsigned)ntohs(local.sin_port));
+    FILE* fp = fopen("/proc/net/tcp", "r");
+    if (fp == NULL) {
+        PLOG(WARNING) << "Fail to open /proc/net/tcp";
+        return 0;
+    }
+    unsigned long found = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char laddr[64];
+        char raddr[64];
+        unsigned long inode = 0;
+        if (sscanf(line, "%*s %63s %63s %*s %*s %*s %*s %*s %*s %lu",
+                   laddr, raddr, &inode) == 3 &&
+            strcmp(laddr, peer_local) == 0 &&
+            strcmp(raddr, peer_remote) == 0) {
+            found = inode;
+            break;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+// Returns true if the process `pid' is at the other end of `fd'. The pid in
+// ShmHello is chosen by the peer, mapping memory of another process on its
+// behalf must be avoided.
+static bool IsConnectedToProcess(int fd, pid_t pid) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+        cred.pid > 0) {
+        // Unix domain sockets
+        return cred.pid == pid;
+    }
+    const unsigned long inode = FindPeerSocketInode(fd);
+    if (inode == 0) {
+        return false;
+    }
+    char expected[64];
+    const int expected_len =
+        snprintf(expected, sizeof(expected), "socket:[%lu]", inode);
+    char dir_path[64];
+    snprintf(dir_path, sizeof(dir_path), "/proc/%d/fd", (int)pid);
+    DIR* dir = opendir(dir_path);
+    if (dir == NULL) {
+        return false;
+    }
+    bool found = false;
+    for (struct dirent* ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
+        char path[128];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, ent->d_name);
+        char target[64];
+        const ssize_t n = readlink(path, target, sizeof(target));
+        if (n == expected_len && memcmp(target, expected, n) == 0) {
+            found = true;
+            break;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+#endif  // OS_LINUX
+
+ShmTransport* ShmTransport::CreateForServer(const ShmHello& hello, int fd) {
+#if defined(OS_LINUX)
+    if (!MaybeHello(hello.magic, sizeof(hello.magic)) ||
+        hello.ring_size < 4096 ||
+        (hello.ring_size & (hello.ring_size - 1)) != 0) {
+        LOG(WARNING) << "Invalid ShmHello";
+        return NULL;
+    }
+    if (!IsConnectedToProcess(fd, (pid_t)hello.pid)) {
+        LOG(WARNING) << "fd=" << fd << " is not connected to pid="
+                     << hello.pid;
+        return NULL;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%u/fd/%d", hello.pid, hello.memfd);
+    // Only map memfds created by CreateForClient().
+    char target[64];
+    const ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if (len < 0 || (size_t)len < sizeof(SHM_MEMFD_LINK) - 1 ||
+        memcmp(target, SHM_MEMFD_LINK, sizeof(SHM_MEMFD_LINK) - 1) != 0) {
+        LOG(WARNING) << path << " is not a memfd of brpc";
+        return NULL;
+    }
+    butil::fd_guard memfd(open(path, O_RDWR | O_CLOEXEC));
+    if (memfd < 0) {
+        // Typically the peer is in another pid namespace or run by another
+        // user, fall back to TCP.
+        PLOG(WARNING) << "Fail to open " << path;
+        return NULL;
+    }
+    // Seals are properties of the file rather than the descriptor.
+    const int seals = fcntl(memfd, F_GET_SEALS);
+    if (seals < 0 || (seals & SHM_REQUIRED_SEALS) != SHM_REQUIRED_SEALS) {
+        LOG(WARNING) << path << " is not sealed against resizing";
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(memfd, &st) != 0 ||
+        (size_t)st.st_size < 2 * ShmRing::memory_size(hello.ring_size)) {
+        LOG(WARNING) << "Unmatched size of " << path;
+        return NULL;
+    }
+    ShmTransport* t = new ShmTransport;
+    if (t->Map(memfd.release(), hello.ring_size, true) != 0) {
+        delete t;
+        return NULL;
+    }
+    t->CloseMemfd();
+    return t;
+#else
+    (void)hello;
+    (void)fd;
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+static void RingDoorbell(int fd) {
+    const char doorbell = SHM_DOORBELL;
+    if (write(fd, &doorbell, 1) < 0 && errno != EAGAIN) {
+        // Bytes were moved into (or out of) the ring already, report the
+        // error in next write or read.
+        PLOG(WARNING) << "Fail to ring doorbell of fd=" << fd;
+    }
+}
+
+ssize_t ShmTransport::Write(int fd, butil::IOBuf* const* pieces,
+                            size_t count) {
+    const ssize_t nw = _outbound.CutFrom(pieces, count);
+    if (nw > 0 && _outbound.ShouldRing()) {
+        RingDoorbell(fd);
+    }
+    return nw;
+}
+
+void ShmTransport::WakeUpProducer() {
+    _space_butex->fetch_add(1, butil::memory_order_release);
+    bthread::butex_wake_all(_space_butex);
+}
+
+int ShmTransport::WaitForSpace(const timespec* abstime) {
+    const int expected = _space_butex->load(butil::memory_order_acquire);
+    if (!_outbound.ParkProducer()) {
+        return 0;
+    }
+    if (bthread::butex_wait(_space_butex, expected, abstime) < 0 &&
+        errno != EWOULDBLOCK && errno != EINTR) {
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t ShmTransport::Read(int fd, butil::IOPortal* out, size_t size_hint) {
+    size_t nr = _inbound.CutInto(out, size_hint);
+    if (nr > 0) {
+        if (_inbound.ShouldRingProducer()) {
+            RingDoorbell(fd);
+        }
+        return nr;
+    }
+    // The ring is empty. Drain doorbells which also tells us EOF. A
+    // doorbell may also mean that the peer released space in the outbound
+    // ring.
+    bool rung = false;
+    char buf[64];
+    while (true) {
+        const ssize_t rc = read(fd, buf, sizeof(buf));
+        if (rc == 0) {
+            return 0;
+        }
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return -1;
+            }
+            break;
+        }
+        rung = true;
+    }
+    if (rung) {
+        WakeUpProducer();
+    }
+    if (_inbound.Park()) {
+        errno = EAGAIN;
+        return -1;
+    }
+    nr = _inbound.CutInto(out, size_hint);
+    if (nr == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (_inbound.ShouldRingProducer()) {
+        RingDoorbell(fd);
+    }
+    return nr;
+}
+
+} // namespace brpc
@@ -0,0 +1,174 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_SHM_TRANSPORT_H
+#define BRPC_SHM_TRANSPORT_H
+
+#include <stdint.h>
+#include <time.h>                                // timespec
+#include "butil/atomicops.h"                     // butil::atomic
+#include "butil/iobuf.h"                         // butil::IOBuf, IOPortal
+#include "butil/macros.h"                        // DISALLOW_COPY_AND_ASSIGN
+
+namespace brpc {
+
+// Shared-memory transport for connections whose both ends are on the same
+// host. The TCP connection is established as usual, then the client sends
+// a ShmHello carrying a memfd which holds a pair of single-producer,
+// single-consumer byte rings (one per direction). The memfd is sealed
+// against resizing so that the peer can't SIGBUS us by truncating it. The
+// server checks that the connection is owned by the announced process,
+// maps the memfd by opening /proc/<pid>/fd/<fd> and acks with one byte.
+// From then on, payloads are copied through the rings and the TCP
+// connection only carries doorbells: one byte is written when the peer
+// parked on an empty ring (or on a full ring), so a busy connection does
+// not touch the kernel at all. EOF and failures are still detected via the
+// TCP connection, thus protocols and EventDispatcher work unchanged.
+
+enum ShmState {
+    SHM_UNKNOWN = 0,            // Server side, not detected yet
+    SHM_OFF = 1,                // Plain TCP
+    SHM_CONNECTED = 2,          // Payloads go through the rings
+};
+
+const char* ShmStateToString(ShmState s);
+
+// Sent by the client over the just-connected TCP connection.
+struct ShmHello {
+    char magic[4];              // "BSHM"
+    uint32_t pid;
+    int32_t memfd;
+    uint32_t ring_size;         // capacity of each ring in bytes
+};
+
+static const char SHM_ACK_OK = 'Y';
+static const char SHM_ACK_REJECTED = 'N';
+static const char SHM_DOORBELL = 'D';
+
+// Header placed before the data area of each ring. Fields modified by
+// different sides are put in different cachelines.
+struct ShmRingHeader {
+    // Bytes consumed so far, only modified by the consumer.
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<uint64_t> head;
+    // Bytes produced so far, only modified by the producer.
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<uint64_t> tail;
+    // Set by the consumer before waiting for a doorbell, cleared by whoever
+    // decides to ring (or not to ring) the doorbell.
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<uint32_t> consumer_parked;
+    // Same as above, set by the producer when the ring is full.
+    butil::atomic<uint32_t> producer_parked;
+};
+
+// One direction of the transport. Does not own the memory.
+class ShmRing {
+public:
+    ShmRing() : _header(NULL), _data(NULL), _size(0) {}
+    void Init(void* mem, uint32_t ring_size);
+
+    // [Producer] Cut at most the free space of the ring from `pieces' and
+    // copy into the ring. Returns bytes written, -1 with errno=EAGAIN when
+    // the ring is full.
+    ssize_t CutFrom(butil::IOBuf* const* pieces, size_t count);
+
+    // [Producer] Returns true if the consumer is parked and should be woken
+    // up by a doorbell. Must be called after CutFrom() published data.
+    bool ShouldRing();
+
+    // [Consumer] Append at most `max_count' bytes from the ring to `out'.
+    // Returns bytes read, 0 when the ring is empty.
+    size_t CutInto(butil::IOPortal* out, size_t max_count);
+
+    // [Consumer] Mark that the consumer is about to wait for the doorbell.
+    // Returns false (and unparks) if data arrived meanwhile.
+    bool Park();
+
+    // [Consumer] Returns true if the producer is parked on a full ring and
+    // should be woken up by a doorbell. Must be called after CutInto()
+    // released space.
+    bool ShouldRingProducer();
+
+    // [Producer] Mark that the producer is about to wait for the doorbell.
+    // Returns false (and unparks) if space was released meanwhile.
+    bool ParkProducer();
+
+    bool empty() const;
+    bool full() const;
+
+    // Memory required by a ring with `ring_size' bytes of capacity.
+    static size_t memory_size(uint32_t ring_size);
+
+private:
+    ShmRingHeader* _header;
+    char* _data;
+    uint32_t _size;
+};
+
+class ShmTransport {
+public:
+    ~ShmTransport();
+
+    // [Client] Create a memfd holding both rings and fill `hello'.
+    // Returns NULL on error.
+    static ShmTransport* CreateForClient(uint32_t ring_size, ShmHello* hello);
+
+    // [Server] Map the memfd described by `hello' which was received from
+    // the connection `fd'. Returns NULL when the memfd is not sealed, `fd'
+    // is not connected to the process announced in `hello', or on error.
+    static ShmTransport* CreateForServer(const ShmHello& hello, int fd);
+
+    // True if the first `n' bytes of `buf' may begin a ShmHello.
+    static bool MaybeHello(const char* buf, size_t n);
+
+    // Close the memfd which is only needed during the handshake. The memory
+    // stays mapped until the transport is destroyed.
+    void CloseMemfd();
+
+    // Write `pieces' into the outbound ring. Rings the doorbell via `fd'
+    // when the peer parked. Returns bytes written, -1 otherwise and errno
+    // is set.
+    ssize_t Write(int fd, butil::IOBuf* const* pieces, size_t count);
+
+    // Read inbound data into `out'. Drains doorbells from `fd' when the ring
+    // is empty and wakes up WaitForSpace(). Returns bytes read, 0 on EOF of
+    // `fd', -1 otherwise and errno is set (EAGAIN when there's nothing to
+    // read).
+    ssize_t Read(int fd, butil::IOPortal* out, size_t size_hint);
+
+    // Block until the peer released space in the outbound ring, which is
+    // noticed by Read() of the same transport, or `abstime' is reached.
+    // Returns 0 on wakeup, -1 otherwise and errno is set.
+    int WaitForSpace(const timespec* abstime);
+
+    uint32_t ring_size() const { return _ring_size; }
+
+private:
+    ShmTransport();
+    DISALLOW_COPY_AND_ASSIGN(ShmTransport);
+    int Map(int memfd, uint32_t ring_size, bool server_side);
+    void WakeUpProducer();
+
+    int _memfd;
+    void* _mem;
+    size_t _mem_size;
+    uint32_t _ring_size;
+    ShmRing _inbound;
+    ShmRing _outbound;
+    // Incremented by Read() after draining doorbells, waited by
+    // WaitForSpace().
+    butil::atomic<int>* _space_butex;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_SHM_TRANSPORT_H
@@ -37,6 +37,9 @@ public:
     // Add a server. If the internal queue is full, pop one from the queue first.
     void Add(SocketId id);
 
+    // Add all servers in `other'.
+    void AddAll(const ExcludedServers& other);
+
     // True if the server shall be excluded.
     bool IsExcluded(SocketId id) const;
     static bool IsExcluded(const ExcludedServers* s, SocketId id) {
@@ -84,6 +87,13 @@ inline void ExcludedServers::Add(SocketId id) {
     }
 }
 
+inline void ExcludedServers::AddAll(const ExcludedServers& other) {
+    BAIDU_SCOPED_LOCK(other._mutex);
+    for (size_t i = 0; i < other._l.size(); ++i) {
+        Add(*other._l.bottom(i));
+    }
+}
+
 inline bool ExcludedServers::IsExcluded(SocketId id) const {
     BAIDU_SCOPED_LOCK(_mutex);
     for (size_t i = 0; i < _l.size(); ++i) {
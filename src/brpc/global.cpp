@@ -43,6 +43,11 @@
 #include "brpc/policy/randomized_load_balancer.h"
 #include "brpc/policy/locality_aware_load_balancer.h"
 #include "brpc/policy/consistent_hashing_load_balancer.h"
+#include "brpc/policy/maglev_load_balancer.h"
+#include "brpc/policy/jump_consistent_hash_load_balancer.h"
+#include "brpc/policy/power_of_two_choices_load_balancer.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
+#include "brpc/policy/slow_start_load_balancer.h"
 #include "brpc/policy/hasher.h"
 #include "brpc/policy/dynpart_load_balancer.h"
 
@@ -134,9 +139,14 @@ struct GlobalExtensions {
     WeightedRoundRobinLoadBalancer wrr_lb;
     RandomizedLoadBalancer randomized_lb;
     LocalityAwareLoadBalancer la_lb;
+    PowerOfTwoChoicesLoadBalancer p2c_lb;
+    ZoneAwareLoadBalancer zone_aware_lb;
+    SlowStartLoadBalancer slow_start_lb;
     ConsistentHashingLoadBalancer ch_mh_lb;
     ConsistentHashingLoadBalancer ch_md5_lb;
     ConsistentHashingLoadBalancer ch_ketama_lb;
+    MaglevLoadBalancer ch_maglev_lb;
+    JumpConsistentHashLoadBalancer ch_jump_lb;
     DynPartLoadBalancer dynpart_lb;
 
     AutoConcurrencyLimiter auto_cl;
@@ -356,9 +366,14 @@ static void GlobalInitializeOrDieImpl() {
     LoadBalancerExtension()->RegisterOrDie("wrr", &g_ext->wrr_lb);
     LoadBalancerExtension()->RegisterOrDie("random", &g_ext->randomized_lb);
     LoadBalancerExtension()->RegisterOrDie("la", &g_ext->la_lb);
+    LoadBalancerExtension()->RegisterOrDie("p2c", &g_ext->p2c_lb);
+    LoadBalancerExtension()->RegisterOrDie("zone_aware", &g_ext->zone_aware_lb);
+    LoadBalancerExtension()->RegisterOrDie("slow_start", &g_ext->slow_start_lb);
     LoadBalancerExtension()->RegisterOrDie("c_murmurhash", &g_ext->ch_mh_lb);
     LoadBalancerExtension()->RegisterOrDie("c_md5", &g_ext->ch_md5_lb);
     LoadBalancerExtension()->RegisterOrDie("c_ketama", &g_ext->ch_ketama_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_maglev", &g_ext->ch_maglev_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_jump", &g_ext->ch_jump_lb);
     LoadBalancerExtension()->RegisterOrDie("_dynpart", &g_ext->dynpart_lb);
 
     // Compress Handlers
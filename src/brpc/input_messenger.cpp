@@ -26,6 +26,7 @@
 #include "brpc/reloadable_flags.h"         // BRPC_VALIDATE_GFLAG
 #include "brpc/protocol.h"                 // ListProtocols
 #include "brpc/input_messenger.h"
+#include "brpc/details/continuous_profiler.h" // SetProfilingTag
 
 
 namespace brpc {
@@ -131,6 +132,8 @@ ParseResult InputMessenger::CutInputMessage(
 void* ProcessInputMessage(void* void_arg) {
     InputMessageBase* msg = static_cast<InputMessageBase*>(void_arg);
     msg->_process(msg);
+    // The method tagged by ControllerPrivateAccessor::set_method() is done.
+    SetProfilingTag(NULL);
     return NULL;
 }
 
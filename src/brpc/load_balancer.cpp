@@ -24,9 +24,28 @@ namespace brpc {
 DEFINE_bool(show_lb_in_vars, false, "Describe LoadBalancers in vars");
 BRPC_VALIDATE_GFLAG(show_lb_in_vars, PassValidate);
 
+DEFINE_bool(lb_wait_free_read, false, "Make rr/wrr/la/p2c/c_* LoadBalancers "
+            "created from now on select servers without locking any mutex, "
+            "which scales better with lots of threads and frequent updates "
+            "of servers");
+
 // For assigning unique names for lb.
 static butil::static_atomic<int> g_lb_counter = BUTIL_STATIC_ATOMIC_INIT(0);
 
+const LoadBalancer* FindInnerLoadBalancer(const butil::StringPiece& name,
+                                          const char* wrapper) {
+    if (name == wrapper) {
+        LOG(ERROR) << wrapper << " can't be the inner LoadBalancer of itself";
+        return NULL;
+    }
+    const LoadBalancer* lb = LoadBalancerExtension()->Find(
+        name.as_string().c_str());
+    if (lb == NULL) {
+        LOG(ERROR) << "Fail to find LoadBalancer by `" << name << "'";
+    }
+    return lb;
+}
+
 void SharedLoadBalancer::DescribeLB(std::ostream& os, void* arg) {
     (static_cast<SharedLoadBalancer*>(arg))->Describe(os, DescribeOptions());
 }
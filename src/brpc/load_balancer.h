@@ -106,6 +106,7 @@ protected:
 };
 
 DECLARE_bool(show_lb_in_vars);
+DECLARE_bool(lb_wait_free_read);
 
 // A intrusively shareable load balancer created from name.
 class SharedLoadBalancer : public SharedObject, public NonConstDescribable {
@@ -181,6 +182,13 @@ inline Extension<const LoadBalancer>* LoadBalancerExtension() {
     return Extension<const LoadBalancer>::instance();
 }
 
+// Find the LoadBalancer named `name' to be wrapped by the LoadBalancer named
+// `wrapper', e.g. the value of "lb=" in parameters of zone_aware and
+// slow_start. Errors are logged and NULL is returned when `name' is not
+// registered or is `wrapper' itself.
+const LoadBalancer* FindInnerLoadBalancer(const butil::StringPiece& name,
+                                          const char* wrapper);
+
 } // namespace brpc
 
 
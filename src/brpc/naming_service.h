@@ -34,9 +34,22 @@ namespace brpc {
 class NamingServiceActions {
 public:
     virtual ~NamingServiceActions() {}
+    // Add or remove some servers. Cost is O(changes * log(servers)) rather
+    // than proportional to all servers, prefer these methods to
+    // ResetServers() if the naming service knows the changes.
     virtual void AddServers(const std::vector<ServerNode>& servers) = 0;
     virtual void RemoveServers(const std::vector<ServerNode>& servers) = 0;
+    // Replace all servers, the changes are found by diffing with the last
+    // servers.
     virtual void ResetServers(const std::vector<ServerNode>& servers) = 0;
+    // Add and remove servers in one update. A server whose tag is changed
+    // should be put in `removed' with the old tag and in `added' with the
+    // new tag.
+    virtual void UpdateServers(const std::vector<ServerNode>& added,
+                               const std::vector<ServerNode>& removed) {
+        RemoveServers(removed);
+        AddServers(added);
+    }
 };
 
 // Mapping a name to ServerNodes.
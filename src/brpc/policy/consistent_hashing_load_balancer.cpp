@@ -16,6 +16,7 @@
 
 #include <algorithm>                                           // std::set_union
 #include <array>
+#include <math.h>                                              // ceil
 #include <gflags/gflags.h>
 #include "butil/containers/flat_map.h"
 #include "butil/errno.h"
@@ -141,9 +142,12 @@ inline const ReplicaPolicy* GetReplicaPolicy(ConsistentHashingLoadBalancerType t
 
 ConsistentHashingLoadBalancer::ConsistentHashingLoadBalancer(
     ConsistentHashingLoadBalancerType type)
-    : _num_replicas(FLAGS_chash_num_replicas), _type(type) {
+    : _num_replicas(FLAGS_chash_num_replicas), _type(type)
+    , _load_factor(0), _total_inflight(0) {
     CHECK(GetReplicaPolicy(_type))
         << "Fail to find replica policy for consistency lb type: '" << _type << '\'';
+    _db_hash_ring.set_wait_free_read(FLAGS_lb_wait_free_read);
+    _db_inflight.set_wait_free_read(FLAGS_lb_wait_free_read);
 }
 
 size_t ConsistentHashingLoadBalancer::AddBatch(
@@ -214,6 +218,36 @@ size_t ConsistentHashingLoadBalancer::Remove(
     return fg.size() - bg.size();
 }
 
+size_t ConsistentHashingLoadBalancer::AddInflight(
+        InflightMap& bg, const InflightMap& fg,
+        const std::vector<SocketId>& servers) {
+    size_t n = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (bg.counters.seek(servers[i]) != NULL) {
+            continue;
+        }
+        // Both buffers must share the same counter.
+        const std::shared_ptr<InflightCounter>* p = fg.counters.seek(servers[i]);
+        if (p != NULL) {
+            bg.counters[servers[i]] = *p;
+        } else {
+            bg.counters[servers[i]] = std::make_shared<InflightCounter>(0);
+        }
+        ++n;
+    }
+    return n;
+}
+
+size_t ConsistentHashingLoadBalancer::RemoveInflight(
+        InflightMap& bg, const InflightMap& /*fg*/,
+        const std::vector<SocketId>& servers) {
+    size_t n = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        n += bg.counters.erase(servers[i]);
+    }
+    return n;
+}
+
 bool ConsistentHashingLoadBalancer::AddServer(const ServerId& server) {
     std::vector<Node> add_nodes;
     add_nodes.reserve(_num_replicas);
@@ -225,6 +259,10 @@ bool ConsistentHashingLoadBalancer::AddServer(const ServerId& server) {
     const size_t ret = _db_hash_ring.ModifyWithForeground(
                         AddBatch, add_nodes, &executed);
     CHECK(ret == 0 || ret == _num_replicas) << ret;
+    if (ret != 0 && _load_factor > 0) {
+        _db_inflight.ModifyWithForeground(
+            AddInflight, std::vector<SocketId>(1, server.id));
+    }
     return ret != 0;
 }
 
@@ -234,16 +272,21 @@ size_t ConsistentHashingLoadBalancer::AddServersInBatch(
     add_nodes.reserve(servers.size() * _num_replicas);
     std::vector<Node> replicas;
     replicas.reserve(_num_replicas);
+    std::vector<SocketId> added;
     for (size_t i = 0; i < servers.size(); ++i) {
         replicas.clear();
         if (GetReplicaPolicy(_type)->Build(servers[i], _num_replicas, &replicas)) {
             add_nodes.insert(add_nodes.end(), replicas.begin(), replicas.end());
+            added.push_back(servers[i].id);
         }
     }
     std::sort(add_nodes.begin(), add_nodes.end());
     bool executed = false;
     const size_t ret = _db_hash_ring.ModifyWithForeground(AddBatch, add_nodes, &executed);
     CHECK(ret % _num_replicas == 0);
+    if (ret != 0 && _load_factor > 0) {
+        _db_inflight.ModifyWithForeground(AddInflight, added);
+    }
     const size_t n = ret / _num_replicas;
     LOG_IF(ERROR, n != servers.size())
         << "Fail to AddServersInBatch, expected " << servers.size()
@@ -255,6 +298,10 @@ bool ConsistentHashingLoadBalancer::RemoveServer(const ServerId& server) {
     bool executed = false;
     const size_t ret = _db_hash_ring.ModifyWithForeground(Remove, server, &executed);
     CHECK(ret == 0 || ret == _num_replicas);
+    if (ret != 0 && _load_factor > 0) {
+        _db_inflight.ModifyWithForeground(
+            RemoveInflight, std::vector<SocketId>(1, server.id));
+    }
     return ret != 0;
 }
 
@@ -263,6 +310,13 @@ size_t ConsistentHashingLoadBalancer::RemoveServersInBatch(
     bool executed = false;
     const size_t ret = _db_hash_ring.ModifyWithForeground(RemoveBatch, servers, &executed);
     CHECK(ret % _num_replicas == 0);
+    if (ret != 0 && _load_factor > 0) {
+        std::vector<SocketId> removed(servers.size());
+        for (size_t i = 0; i < servers.size(); ++i) {
+            removed[i] = servers[i].id;
+        }
+        _db_inflight.ModifyWithForeground(RemoveInflight, removed);
+    }
     const size_t n = ret / _num_replicas;
     LOG_IF(ERROR, n != servers.size())
         << "Fail to RemoveServersInBatch, expected " << servers.size()
@@ -306,6 +360,9 @@ int ConsistentHashingLoadBalancer::SelectServer(
     if (choice == s->end()) {
         choice = s->begin();
     }
+    if (_load_factor > 0) {
+        return SelectServerWithBoundedLoad(in, *s, choice, out);
+    }
     for (size_t i = 0; i < s->size(); ++i) {
         if (((i + 1) == s->size() // always take last chance
              || !ExcludedServers::IsExcluded(in.excluded, choice->server_sock.id))
@@ -321,6 +378,81 @@ int ConsistentHashingLoadBalancer::SelectServer(
     return EHOSTDOWN;
 }
 
+int ConsistentHashingLoadBalancer::SelectServerWithBoundedLoad(
+    const SelectIn& in, const std::vector<Node>& ring,
+    std::vector<Node>::const_iterator choice, SelectOut* out) {
+    butil::DoublyBufferedData<InflightMap>::ScopedPtr m;
+    if (_db_inflight.Read(&m) != 0) {
+        return ENOMEM;
+    }
+    if (m->counters.empty()) {
+        return ENODATA;
+    }
+    // Count this request in as well so that the bound is at least 1.
+    const int64_t bound = (int64_t)ceil(
+        (_total_inflight.load(butil::memory_order_relaxed) + 1)
+        * _load_factor / m->counters.size());
+    // The first usable server on the ring, chosen when all usable servers
+    // reached the bound, which happens when some servers are unusable.
+    SocketUniquePtr fallback;
+    InflightCounter* fallback_counter = NULL;
+    InflightCounter* counter = NULL;
+    for (size_t i = 0; i < ring.size(); ++i) {
+        const SocketId id = choice->server_sock.id;
+        if (++choice == ring.end()) {
+            choice = ring.begin();
+        }
+        if ((i + 1) != ring.size() // always take last chance
+            && ExcludedServers::IsExcluded(in.excluded, id)) {
+            continue;
+        }
+        const std::shared_ptr<InflightCounter>* p = m->counters.seek(id);
+        if (p == NULL) {
+            continue;
+        }
+        const bool under_bound =
+            (*p)->load(butil::memory_order_relaxed) < bound;
+        if ((under_bound || fallback_counter == NULL)
+            && Socket::Address(id, out->ptr) == 0
+            && (*out->ptr)->IsAvailable()) {
+            if (under_bound) {
+                counter = p->get();
+                break;
+            }
+            fallback.reset(out->ptr->release());
+            fallback_counter = p->get();
+        }
+    }
+    if (counter == NULL) {
+        if (fallback_counter == NULL) {
+            return EHOSTDOWN;
+        }
+        out->ptr->reset(fallback.release());
+        counter = fallback_counter;
+    }
+    counter->fetch_add(1, butil::memory_order_relaxed);
+    _total_inflight.fetch_add(1, butil::memory_order_relaxed);
+    out->need_feedback = true;
+    return 0;
+}
+
+void ConsistentHashingLoadBalancer::Feedback(const CallInfo& info) {
+    if (_load_factor <= 0) {
+        return;
+    }
+    // Every successful selection is fed back exactly once, even if the
+    // server was removed in between.
+    _total_inflight.fetch_sub(1, butil::memory_order_relaxed);
+    butil::DoublyBufferedData<InflightMap>::ScopedPtr m;
+    if (_db_inflight.Read(&m) != 0) {
+        return;
+    }
+    const std::shared_ptr<InflightCounter>* p = m->counters.seek(info.server_id);
+    if (p != NULL) {
+        (*p)->fetch_sub(1, butil::memory_order_relaxed);
+    }
+}
+
 void ConsistentHashingLoadBalancer::Describe(
     std::ostream &os, const DescribeOptions& options) {
     if (!options.verbose) {
@@ -330,6 +462,11 @@ void ConsistentHashingLoadBalancer::Describe(
     os << "ConsistentHashingLoadBalancer {\n"
        << "  hash function: " << GetReplicaPolicy(_type)->name() << '\n'
        << "  replica per host: " << _num_replicas << '\n';
+    if (_load_factor > 0) {
+        os << "  load factor: " << _load_factor << '\n'
+           << "  inflight: " << _total_inflight.load(butil::memory_order_relaxed)
+           << '\n';
+    }
     std::map<butil::EndPoint, double> load_map;
     GetLoads(&load_map);
     os << "  number of hosts: " << load_map.size() << '\n';
@@ -389,6 +526,15 @@ bool ConsistentHashingLoadBalancer::SetParameters(const butil::StringPiece& para
             }
             continue;
         }
+        if (sp.key() == "load_factor") {
+            if (!butil::StringToDouble(sp.value().as_string(), &_load_factor) ||
+                _load_factor < 1.0) {
+                LOG(ERROR) << "load_factor must be a number not less than 1, "
+                           << sp.key_and_value();
+                return false;
+            }
+            continue;
+        }
         LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
     }
     return true;
@@ -19,8 +19,11 @@
 
 #include <stdint.h>                                     // uint32_t
 #include <functional>
+#include <memory>                                       // std::shared_ptr
 #include <vector>                                       // std::vector
+#include "butil/atomicops.h"
 #include "butil/endpoint.h"                              // butil::EndPoint
+#include "butil/containers/flat_map.h"
 #include "butil/containers/doubly_buffered_data.h"
 #include "brpc/load_balancer.h"
 
@@ -39,6 +42,13 @@ enum ConsistentHashingLoadBalancerType {
     CONS_HASH_LB_LAST = 3
 };
 
+// Consistent hashing on a ring of replicas of servers.
+// With "load_factor=F" (F >= 1) in parameters of the load balancer, e.g.
+// "c_murmurhash:load_factor=1.25", in-flight calls to each server are
+// bounded by F times the average as in "Consistent Hashing with Bounded
+// Loads" (Mirrokni et al., 2016): a server having reached the bound is
+// skipped and the request goes to the next server on the ring. Requests
+// of a hot key are spread to a few neighbors while others keep affinity.
 class ConsistentHashingLoadBalancer : public LoadBalancer {
 public:
     struct Node {
@@ -62,9 +72,15 @@ public:
     LoadBalancer *New(const butil::StringPiece& params) const;
     void Destroy();
     int SelectServer(const SelectIn &in, SelectOut *out);
+    void Feedback(const CallInfo& info);
     void Describe(std::ostream &os, const DescribeOptions& options);
 
 private:
+    typedef butil::atomic<int64_t> InflightCounter;
+    struct InflightMap {
+        InflightMap() { CHECK_EQ(0, counters.init(64)); }
+        butil::FlatMap<SocketId, std::shared_ptr<InflightCounter> > counters;
+    };
     bool SetParameters(const butil::StringPiece& params);
     void GetLoads(std::map<butil::EndPoint, double> *load_map);
     static size_t AddBatch(std::vector<Node> &bg, const std::vector<Node> &fg,
@@ -73,9 +89,21 @@ private:
                               const std::vector<ServerId> &servers, bool *executed);
     static size_t Remove(std::vector<Node> &bg, const std::vector<Node> &fg,
                          const ServerId& server, bool *executed);
+    static size_t AddInflight(InflightMap& bg, const InflightMap& fg,
+                              const std::vector<SocketId>& servers);
+    static size_t RemoveInflight(InflightMap& bg, const InflightMap& fg,
+                                 const std::vector<SocketId>& servers);
+    int SelectServerWithBoundedLoad(const SelectIn& in,
+                                    const std::vector<Node>& ring,
+                                    std::vector<Node>::const_iterator choice,
+                                    SelectOut* out);
     size_t _num_replicas;
     ConsistentHashingLoadBalancerType _type;
     butil::DoublyBufferedData<std::vector<Node> > _db_hash_ring;
+    // Following fields are used only when _load_factor is positive.
+    double _load_factor;
+    butil::atomic<int64_t> _total_inflight;
+    butil::DoublyBufferedData<InflightMap> _db_inflight;
 };
 
 }  // namespace policy
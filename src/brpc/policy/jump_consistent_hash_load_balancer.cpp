@@ -0,0 +1,235 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>                                    // std::sort
+#include "butil/containers/flat_map.h"
+#include "brpc/socket.h"
+#include "brpc/policy/jump_consistent_hash_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+int32_t JumpConsistentHash(uint64_t key, int32_t num_buckets) {
+    int64_t b = -1;
+    int64_t j = 0;
+    while (j < num_buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * (double(1LL << 31) / double((key >> 33) + 1));
+    }
+    return b;
+}
+
+size_t JumpConsistentHashLoadBalancer::AddBatch(
+        Buckets& bg, const Buckets& fg, const std::vector<Bucket>& servers,
+        bool* executed) {
+    if (*executed) {
+        // Hack DBD
+        return fg.num_used - bg.num_used;
+    }
+    *executed = true;
+    bg = fg;
+    butil::FlatSet<ServerId> id_set;
+    CHECK_EQ(0, id_set.init(fg.buckets.size() * 2 + servers.size() + 1));
+    for (size_t i = 0; i < fg.buckets.size(); ++i) {
+        if (fg.buckets[i].used) {
+            id_set.insert(fg.buckets[i].server_sock);
+        }
+    }
+    size_t hole = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (id_set.seek(servers[i].server_sock) != NULL) {
+            continue;
+        }
+        id_set.insert(servers[i].server_sock);
+        // Reuse empty buckets left by removed servers first.
+        while (hole < bg.buckets.size() && bg.buckets[hole].used) {
+            ++hole;
+        }
+        if (hole < bg.buckets.size()) {
+            bg.buckets[hole] = servers[i];
+        } else {
+            bg.buckets.push_back(servers[i]);
+        }
+        ++bg.num_used;
+    }
+    return bg.num_used - fg.num_used;
+}
+
+size_t JumpConsistentHashLoadBalancer::RemoveBatch(
+        Buckets& bg, const Buckets& fg, const std::vector<ServerId>& servers,
+        bool* executed) {
+    if (*executed) {
+        return bg.num_used - fg.num_used;
+    }
+    *executed = true;
+    bg = fg;
+    butil::FlatSet<ServerId> id_set;
+    CHECK_EQ(0, id_set.init(servers.size() * 2 + 1));
+    for (size_t i = 0; i < servers.size(); ++i) {
+        id_set.insert(servers[i]);
+    }
+    for (size_t i = 0; i < bg.buckets.size(); ++i) {
+        Bucket& b = bg.buckets[i];
+        if (b.used && id_set.seek(b.server_sock) != NULL) {
+            b.used = false;
+            --bg.num_used;
+        }
+    }
+    // Shrinking from the tail does not move keys of other buckets.
+    while (!bg.buckets.empty() && !bg.buckets.back().used) {
+        bg.buckets.pop_back();
+    }
+    return fg.num_used - bg.num_used;
+}
+
+static bool BuildBucket(const ServerId& server,
+                        JumpConsistentHashLoadBalancer::Bucket* bucket) {
+    SocketUniquePtr ptr;
+    if (Socket::AddressFailedAsWell(server.id, &ptr) == -1) {
+        return false;
+    }
+    bucket->server_sock = server;
+    bucket->server_addr = ptr->remote_side();
+    bucket->used = true;
+    return true;
+}
+
+bool JumpConsistentHashLoadBalancer::AddServer(const ServerId& server) {
+    std::vector<Bucket> servers(1);
+    if (!BuildBucket(server, &servers[0])) {
+        return false;
+    }
+    bool executed = false;
+    return _db_buckets.ModifyWithForeground(AddBatch, servers, &executed) != 0;
+}
+
+size_t JumpConsistentHashLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    std::vector<Bucket> add_servers;
+    add_servers.reserve(servers.size());
+    Bucket b;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (BuildBucket(servers[i], &b)) {
+            add_servers.push_back(b);
+        }
+    }
+    std::stable_sort(add_servers.begin(), add_servers.end());
+    bool executed = false;
+    const size_t n = _db_buckets.ModifyWithForeground(
+        AddBatch, add_servers, &executed);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+bool JumpConsistentHashLoadBalancer::RemoveServer(const ServerId& server) {
+    std::vector<ServerId> servers(1, server);
+    bool executed = false;
+    return _db_buckets.ModifyWithForeground(RemoveBatch, servers, &executed) != 0;
+}
+
+size_t JumpConsistentHashLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    bool executed = false;
+    const size_t n = _db_buckets.ModifyWithForeground(
+        RemoveBatch, servers, &executed);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+LoadBalancer* JumpConsistentHashLoadBalancer::New(
+    const butil::StringPiece&) const {
+    return new (std::nothrow) JumpConsistentHashLoadBalancer;
+}
+
+void JumpConsistentHashLoadBalancer::Destroy() {
+    delete this;
+}
+
+int JumpConsistentHashLoadBalancer::SelectServer(
+    const SelectIn& in, SelectOut* out) {
+    if (!in.has_request_code) {
+        LOG(ERROR) << "Controller.set_request_code() is required";
+        return EINVAL;
+    }
+    butil::DoublyBufferedData<Buckets>::ScopedPtr s;
+    if (_db_buckets.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    if (s->num_used == 0) {
+        return ENODATA;
+    }
+    const std::vector<Bucket>& buckets = s->buckets;
+    const int32_t n = buckets.size();
+    uint64_t key = in.request_code;
+    for (int32_t i = 0; i < n; ++i) {
+        const Bucket& b = buckets[JumpConsistentHash(key, n)];
+        if (b.used
+            && !ExcludedServers::IsExcluded(in.excluded, b.server_sock.id)
+            && Socket::Address(b.server_sock.id, out->ptr) == 0
+            && (*out->ptr)->IsAvailable()) {
+            return 0;
+        }
+        // Re-hash so that load of the unusable server is spread to others.
+        key = key * 2862933555777941757ULL + 1;
+    }
+    // Unlucky, walk through all buckets and take the last chance by
+    // ignoring excluded servers.
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int32_t i = 0; i < n; ++i) {
+            const Bucket& b = buckets[i];
+            if (b.used
+                && (pass == 1 ||
+                    !ExcludedServers::IsExcluded(in.excluded, b.server_sock.id))
+                && Socket::Address(b.server_sock.id, out->ptr) == 0
+                && (*out->ptr)->IsAvailable()) {
+                return 0;
+            }
+        }
+    }
+    return EHOSTDOWN;
+}
+
+void JumpConsistentHashLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "c_jump";
+        return;
+    }
+    os << "JumpConsistentHashLoadBalancer {\n";
+    butil::DoublyBufferedData<Buckets>::ScopedPtr s;
+    if (_db_buckets.Read(&s) == 0) {
+        os << "  number of buckets: " << s->buckets.size() << '\n'
+           << "  number of hosts: " << s->num_used << '\n'
+           << "  buckets: {\n";
+        for (size_t i = 0; i < s->buckets.size(); ++i) {
+            os << "    " << i << ": ";
+            if (s->buckets[i].used) {
+                os << s->buckets[i].server_addr;
+            } else {
+                os << "(empty)";
+            }
+            os << '\n';
+        }
+        os << "  }\n";
+    }
+    os << "}\n";
+}
+
+}  // namespace policy
+} // namespace brpc
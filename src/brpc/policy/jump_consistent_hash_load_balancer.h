@@ -0,0 +1,77 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRPC_POLICY_JUMP_CONSISTENT_HASH_LOAD_BALANCER_H
+#define  BRPC_POLICY_JUMP_CONSISTENT_HASH_LOAD_BALANCER_H
+
+#include <stdint.h>                                     // uint64_t
+#include <vector>                                       // std::vector
+#include "butil/endpoint.h"                             // butil::EndPoint
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Map request_code to a bucket in [0, num_buckets) with "A Fast, Minimal
+// Memory, Consistent Hash Algorithm" (Lamping & Veach, 2014). Growing
+// num_buckets by one moves only 1/num_buckets of keys to the new bucket.
+int32_t JumpConsistentHash(uint64_t key, int32_t num_buckets);
+
+// Consistent hashing with no memory besides the server list, selection is
+// O(log N). Servers are put into buckets: a removed server leaves its bucket
+// empty and the bucket is reused by the next added server, so that other
+// servers keep their buckets. Requests hashed into an empty bucket or an
+// unusable server are re-hashed. Servers added in one batch are put in the
+// order of their addresses to make buckets same among clients.
+class JumpConsistentHashLoadBalancer : public LoadBalancer {
+public:
+    struct Bucket {
+        ServerId server_sock;
+        butil::EndPoint server_addr;
+        bool used;
+        bool operator<(const Bucket& rhs) const {
+            return server_addr < rhs.server_addr;
+        }
+    };
+    struct Buckets {
+        Buckets() : num_used(0) {}
+        std::vector<Bucket> buckets;
+        size_t num_used;
+    };
+
+    bool AddServer(const ServerId& server);
+    bool RemoveServer(const ServerId& server);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    LoadBalancer* New(const butil::StringPiece& params) const;
+    void Destroy();
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Describe(std::ostream& os, const DescribeOptions& options);
+
+private:
+    static size_t AddBatch(Buckets& bg, const Buckets& fg,
+                           const std::vector<Bucket>& servers, bool* executed);
+    static size_t RemoveBatch(Buckets& bg, const Buckets& fg,
+                              const std::vector<ServerId>& servers,
+                              bool* executed);
+    butil::DoublyBufferedData<Buckets> _db_buckets;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  //BRPC_POLICY_JUMP_CONSISTENT_HASH_LOAD_BALANCER_H
@@ -41,6 +41,7 @@ static const int64_t WEIGHT_SCALE =
 
 LocalityAwareLoadBalancer::LocalityAwareLoadBalancer()
     : _total(0) {
+    _db_servers.set_wait_free_read(FLAGS_lb_wait_free_read);
 }
 
 LocalityAwareLoadBalancer::~LocalityAwareLoadBalancer() {
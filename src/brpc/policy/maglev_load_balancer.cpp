@@ -0,0 +1,342 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>                                    // std::set_union
+#include <map>
+#include <gflags/gflags.h>
+#include "butil/containers/flat_map.h"
+#include "butil/strings/string_number_conversions.h"
+#include "brpc/socket.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/hasher.h"
+#include "brpc/policy/maglev_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+static bool IsPrime(uint64_t n) {
+    if (n < 2) {
+        return false;
+    }
+    for (uint64_t i = 2; i * i <= n; ++i) {
+        if (n % i == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Smallest prime not less than `n'.
+static size_t NextPrime(size_t n) {
+    while (!IsPrime(n)) {
+        ++n;
+    }
+    return n;
+}
+
+static bool ValidateMaglevTableSize(const char*, int32_t val) {
+    return IsPrime(val);
+}
+
+DEFINE_int32(maglev_table_size, 65537,
+             "default size of lookup table in c_maglev, must be a prime. The"
+             " table is larger when there're more than 1/100 servers");
+BRPC_VALIDATE_GFLAG(maglev_table_size, ValidateMaglevTableSize);
+
+static const uint32_t EMPTY_ENTRY = (uint32_t)-1;
+
+// Recommended ratio between table_size and number of servers.
+static const size_t TABLE_SIZE_PER_SERVER = 100;
+
+MaglevLoadBalancer::MaglevLoadBalancer()
+    : _table_size(FLAGS_maglev_table_size)
+    , _fixed_table_size(false) {
+}
+
+bool MaglevLoadBalancer::BuildBackend(const ServerId& server,
+                                      Backend* backend) const {
+    SocketUniquePtr ptr;
+    if (Socket::AddressFailedAsWell(server.id, &ptr) == -1) {
+        return false;
+    }
+    const std::string name = endpoint2str(ptr->remote_side()).c_str();
+    backend->server_sock = server;
+    backend->server_addr = ptr->remote_side();
+    // Two independent hashes so that permutations of different servers
+    // are unlikely to be same.
+    backend->offset_hash = MurmurHash32(name.data(), name.size());
+    backend->skip_hash = MD5Hash32(name.data(), name.size());
+    return true;
+}
+
+size_t MaglevLoadBalancer::ChooseTableSize(
+        size_t nserver, const ModifyState& state) {
+    const size_t recommended = nserver * TABLE_SIZE_PER_SERVER;
+    if (state.fixed_table_size) {
+        LOG_IF(WARNING, recommended > state.table_size)
+            << "table_size=" << state.table_size << " of c_maglev is less"
+            " than " << TABLE_SIZE_PER_SERVER << "x of " << nserver
+            << " servers, load is less balanced";
+        return state.table_size;
+    }
+    // Depends on nothing but the current number of servers, so that clients
+    // with the same servers build the same table regardless of the order in
+    // which servers were added or removed. Rounding up to a power of 2 makes
+    // the size change only when the number of servers crosses one.
+    if (recommended <= state.table_size) {
+        return state.table_size;
+    }
+    size_t rounded = state.table_size;
+    while (rounded < recommended) {
+        rounded *= 2;
+    }
+    return NextPrime(rounded);
+}
+
+void MaglevLoadBalancer::Populate(Table& t, size_t table_size) {
+    t.entries.clear();
+    const size_t n = t.backends.size();
+    if (n == 0) {
+        return;
+    }
+    t.entries.resize(table_size, EMPTY_ENTRY);
+    // Next preferred slot of each backend. Since table_size is a prime,
+    // (offset + j * skip) % table_size for j in [0, table_size) is a
+    // permutation of all slots.
+    std::vector<uint32_t> next(n);
+    std::vector<uint32_t> skip(n);
+    for (size_t i = 0; i < n; ++i) {
+        next[i] = t.backends[i].offset_hash % table_size;
+        skip[i] = t.backends[i].skip_hash % (table_size - 1) + 1;
+    }
+    size_t filled = 0;
+    while (true) {
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t c = next[i];
+            while (t.entries[c] != EMPTY_ENTRY) {
+                c = (c + skip[i]) % table_size;
+            }
+            t.entries[c] = i;
+            next[i] = (c + skip[i]) % table_size;
+            if (++filled == table_size) {
+                return;
+            }
+        }
+    }
+}
+
+size_t MaglevLoadBalancer::AddBatch(
+        Table& bg, const Table& fg, const std::vector<Backend>& servers,
+        ModifyState* state) {
+    if (state->executed) {
+        // Hack DBD
+        return fg.backends.size() - bg.backends.size();
+    }
+    state->executed = true;
+    bg.backends.resize(fg.backends.size() + servers.size());
+    bg.backends.resize(
+        std::set_union(fg.backends.begin(), fg.backends.end(),
+                       servers.begin(), servers.end(), bg.backends.begin())
+        - bg.backends.begin());
+    if (bg.backends.size() == fg.backends.size()) {
+        bg.entries = fg.entries;
+        return 0;
+    }
+    Populate(bg, ChooseTableSize(bg.backends.size(), *state));
+    return bg.backends.size() - fg.backends.size();
+}
+
+size_t MaglevLoadBalancer::RemoveBatch(
+        Table& bg, const Table& fg, const std::vector<ServerId>& servers,
+        ModifyState* state) {
+    if (state->executed) {
+        return bg.backends.size() - fg.backends.size();
+    }
+    state->executed = true;
+    butil::FlatSet<ServerId> id_set;
+    CHECK_EQ(0, id_set.init(servers.size() * 2 + 1));
+    for (size_t i = 0; i < servers.size(); ++i) {
+        id_set.insert(servers[i]);
+    }
+    bg.backends.clear();
+    for (size_t i = 0; i < fg.backends.size(); ++i) {
+        if (id_set.seek(fg.backends[i].server_sock) == NULL) {
+            bg.backends.push_back(fg.backends[i]);
+        }
+    }
+    if (bg.backends.size() == fg.backends.size()) {
+        bg.entries = fg.entries;
+        return 0;
+    }
+    Populate(bg, ChooseTableSize(bg.backends.size(), *state));
+    return fg.backends.size() - bg.backends.size();
+}
+
+bool MaglevLoadBalancer::AddServer(const ServerId& server) {
+    std::vector<Backend> add_backends(1);
+    if (!BuildBackend(server, &add_backends[0])) {
+        return false;
+    }
+    ModifyState state = { _table_size, _fixed_table_size, false };
+    return _db_table.ModifyWithForeground(AddBatch, add_backends, &state) != 0;
+}
+
+size_t MaglevLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    std::vector<Backend> add_backends;
+    add_backends.reserve(servers.size());
+    Backend b;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (BuildBackend(servers[i], &b)) {
+            add_backends.push_back(b);
+        }
+    }
+    std::sort(add_backends.begin(), add_backends.end());
+    add_backends.erase(std::unique(add_backends.begin(), add_backends.end(),
+                                   [](const Backend& lhs, const Backend& rhs) {
+                                       return lhs.server_sock == rhs.server_sock;
+                                   }),
+                       add_backends.end());
+    ModifyState state = { _table_size, _fixed_table_size, false };
+    const size_t n = _db_table.ModifyWithForeground(AddBatch, add_backends, &state);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+bool MaglevLoadBalancer::RemoveServer(const ServerId& server) {
+    std::vector<ServerId> servers(1, server);
+    ModifyState state = { _table_size, _fixed_table_size, false };
+    return _db_table.ModifyWithForeground(RemoveBatch, servers, &state) != 0;
+}
+
+size_t MaglevLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    ModifyState state = { _table_size, _fixed_table_size, false };
+    const size_t n = _db_table.ModifyWithForeground(RemoveBatch, servers, &state);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+LoadBalancer* MaglevLoadBalancer::New(const butil::StringPiece& params) const {
+    MaglevLoadBalancer* lb = new (std::nothrow) MaglevLoadBalancer;
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        lb = NULL;
+    }
+    return lb;
+}
+
+void MaglevLoadBalancer::Destroy() {
+    delete this;
+}
+
+int MaglevLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    if (!in.has_request_code) {
+        LOG(ERROR) << "Controller.set_request_code() is required";
+        return EINVAL;
+    }
+    butil::DoublyBufferedData<Table>::ScopedPtr s;
+    if (_db_table.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    if (s->entries.empty()) {
+        return ENODATA;
+    }
+    const std::vector<uint32_t>& entries = s->entries;
+    const size_t n = s->backends.size();
+    size_t slot = in.request_code % entries.size();
+    // Probe following slots when the chosen server is unusable. Slots are
+    // filled evenly by servers in pseudo-random order, so load of a failed
+    // server is spread to others rather than to a single neighbor.
+    uint32_t last = EMPTY_ENTRY;
+    for (size_t i = 0, tried = 0; i < entries.size() && tried < n; ++i) {
+        const uint32_t index = entries[slot];
+        if (++slot == entries.size()) {
+            slot = 0;
+        }
+        if (index == last) {
+            continue;
+        }
+        last = index;
+        ++tried;
+        const Backend& b = s->backends[index];
+        if ((tried == n  // always take last chance
+             || !ExcludedServers::IsExcluded(in.excluded, b.server_sock.id))
+            && Socket::Address(b.server_sock.id, out->ptr) == 0
+            && (*out->ptr)->IsAvailable()) {
+            return 0;
+        }
+    }
+    return EHOSTDOWN;
+}
+
+void MaglevLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "c_maglev";
+        return;
+    }
+    std::map<butil::EndPoint, size_t> count_map;
+    size_t table_size = _table_size;
+    {
+        butil::DoublyBufferedData<Table>::ScopedPtr s;
+        if (_db_table.Read(&s) == 0) {
+            for (size_t i = 0; i < s->entries.size(); ++i) {
+                count_map[s->backends[s->entries[i]].server_addr] += 1;
+            }
+            if (!s->entries.empty()) {
+                table_size = s->entries.size();
+            }
+        }
+    }
+    os << "MaglevLoadBalancer {\n"
+       << "  table size: " << table_size << '\n'
+       << "  number of hosts: " << count_map.size() << '\n'
+       << "  load of hosts: {\n";
+    for (std::map<butil::EndPoint, size_t>::const_iterator
+             it = count_map.begin(); it != count_map.end(); ++it) {
+        os << "    " << it->first << ": "
+           << (double)it->second / table_size << '\n';
+    }
+    os << "  }\n}\n";
+}
+
+bool MaglevLoadBalancer::SetParameters(const butil::StringPiece& params) {
+    for (butil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+            sp; ++sp) {
+        if (sp.value().empty()) {
+            LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+            return false;
+        }
+        if (sp.key() == "table_size") {
+            if (!butil::StringToSizeT(sp.value(), &_table_size) ||
+                !IsPrime(_table_size) || _table_size > UINT32_MAX) {
+                LOG(ERROR) << "table_size of c_maglev must be a prime, "
+                           << sp.key_and_value();
+                return false;
+            }
+            _fixed_table_size = true;
+            continue;
+        }
+        LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
+    }
+    return true;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,99 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BRPC_POLICY_MAGLEV_LOAD_BALANCER_H
+#define  BRPC_POLICY_MAGLEV_LOAD_BALANCER_H
+
+#include <stdint.h>                                     // uint32_t
+#include <vector>                                       // std::vector
+#include "butil/endpoint.h"                             // butil::EndPoint
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Consistent hashing described in "Maglev: A Fast and Reliable Software
+// Network Load Balancer" (NSDI'16). Every server fills slots of a lookup
+// table of prime size in the order of its own permutation, selecting is
+// simply `table[request_code % table_size]'. Compared to the hash ring of
+// c_murmurhash, selection is O(1) and load is evenly spread with no
+// replicas, while adding or removing a server moves slightly more keys
+// than the minimum. table_size should be much larger than the number of
+// servers (100x is recommended). By default, the size is computed from
+// the current number of servers only: -maglev_table_size, doubled until
+// it's at least 100x of the servers, then rounded up to a prime. Clients
+// with the same servers always build the same table, while crossing such
+// a boundary (by adding or removing servers) remaps most keys once. Set
+// "c_maglev:table_size=N" to fix the size.
+class MaglevLoadBalancer : public LoadBalancer {
+public:
+    struct Backend {
+        ServerId server_sock;
+        butil::EndPoint server_addr;  // To make tables same among all clients
+        // Hashes of server_addr, the permutation in a table of size M starts
+        // from offset_hash % M and advances by skip_hash % (M - 1) + 1.
+        uint32_t offset_hash;
+        uint32_t skip_hash;
+        bool operator<(const Backend& rhs) const {
+            if (server_addr < rhs.server_addr) { return true; }
+            if (rhs.server_addr < server_addr) { return false; }
+            return server_sock.id < rhs.server_sock.id;
+        }
+    };
+    struct Table {
+        std::vector<Backend> backends;
+        // Index of backend in each slot.
+        std::vector<uint32_t> entries;
+    };
+
+    MaglevLoadBalancer();
+    bool AddServer(const ServerId& server);
+    bool RemoveServer(const ServerId& server);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    LoadBalancer* New(const butil::StringPiece& params) const;
+    void Destroy();
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Describe(std::ostream& os, const DescribeOptions& options);
+
+private:
+    // Tables are rebuilt from the foreground one for only once in each
+    // modification, the other buffer is overwritten in the next one.
+    struct ModifyState {
+        size_t table_size;
+        bool fixed_table_size;
+        bool executed;
+    };
+    bool SetParameters(const butil::StringPiece& params);
+    bool BuildBackend(const ServerId& server, Backend* backend) const;
+    static size_t ChooseTableSize(size_t nserver, const ModifyState& state);
+    static void Populate(Table& t, size_t table_size);
+    static size_t AddBatch(Table& bg, const Table& fg,
+                           const std::vector<Backend>& servers,
+                           ModifyState* state);
+    static size_t RemoveBatch(Table& bg, const Table& fg,
+                              const std::vector<ServerId>& servers,
+                              ModifyState* state);
+    size_t _table_size;
+    bool _fixed_table_size;
+    butil::DoublyBufferedData<Table> _db_table;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  //BRPC_POLICY_MAGLEV_LOAD_BALANCER_H
@@ -0,0 +1,286 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>                                   // std::swap
+#include "butil/macros.h"
+#include "butil/fast_rand.h"
+#include "butil/time.h"
+#include "brpc/socket.h"
+#include "brpc/policy/power_of_two_choices_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+// Weight of the newest latency in the EWMA is 1/2^EWMA_SHIFT.
+static const int EWMA_SHIFT = 3;
+// Rounds of picking two servers before falling back to a full scan.
+static const size_t MAX_PICK_ROUNDS = 3;
+
+PowerOfTwoChoicesLoadBalancer::PowerOfTwoChoicesLoadBalancer()
+    : _latency_aware(false) {
+    _db_servers.set_wait_free_read(FLAGS_lb_wait_free_read);
+}
+
+bool PowerOfTwoChoicesLoadBalancer::Add(
+    Servers& bg, const Servers& fg, const ServerId& id) {
+    if (bg.server_list.capacity() < 128) {
+        bg.server_list.reserve(128);
+    }
+    if (bg.server_map.seek(id.id) != NULL) {
+        return false;
+    }
+    Server server = { id, std::shared_ptr<Stat>() };
+    const size_t* pindex = fg.server_map.seek(id.id);
+    if (pindex != NULL) {
+        // Added into foreground in the first call, share the stat.
+        server.stat = fg.server_list[*pindex].stat;
+    } else {
+        server.stat = std::make_shared<Stat>();
+    }
+    bg.server_map[id.id] = bg.server_list.size();
+    bg.server_list.push_back(server);
+    return true;
+}
+
+bool PowerOfTwoChoicesLoadBalancer::Remove(Servers& bg, const ServerId& id) {
+    size_t* pindex = bg.server_map.seek(id.id);
+    if (pindex == NULL) {
+        return false;
+    }
+    const size_t index = *pindex;
+    bg.server_list[index] = bg.server_list.back();
+    bg.server_map[bg.server_list[index].id.id] = index;
+    bg.server_list.pop_back();
+    bg.server_map.erase(id.id);
+    return true;
+}
+
+size_t PowerOfTwoChoicesLoadBalancer::BatchAdd(
+    Servers& bg, const Servers& fg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!Add(bg, fg, servers[i]);
+    }
+    return count;
+}
+
+size_t PowerOfTwoChoicesLoadBalancer::BatchRemove(
+    Servers& bg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!Remove(bg, servers[i]);
+    }
+    return count;
+}
+
+bool PowerOfTwoChoicesLoadBalancer::AddServer(const ServerId& id) {
+    return _db_servers.ModifyWithForeground(Add, id);
+}
+
+bool PowerOfTwoChoicesLoadBalancer::RemoveServer(const ServerId& id) {
+    return _db_servers.Modify(Remove, id);
+}
+
+size_t PowerOfTwoChoicesLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.ModifyWithForeground(BatchAdd, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+size_t PowerOfTwoChoicesLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.Modify(BatchRemove, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+inline bool IsUsable(SocketId id, const LoadBalancer::SelectIn& in,
+                     bool last_chance, LoadBalancer::SelectOut* out) {
+    return (last_chance || !ExcludedServers::IsExcluded(in.excluded, id))
+        && Socket::Address(id, out->ptr) == 0
+        && (*out->ptr)->IsAvailable();
+}
+
+int PowerOfTwoChoicesLoadBalancer::SelectServer(
+    const SelectIn& in, SelectOut* out) {
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    const size_t n = s->server_list.size();
+    if (n == 0) {
+        return ENODATA;
+    }
+    const Server* chosen = NULL;
+    for (size_t i = 0; i < MAX_PICK_ROUNDS && chosen == NULL; ++i) {
+        const Server* first = &s->server_list[butil::fast_rand_less_than(n)];
+        const Server* second = first;
+        if (n > 1) {
+            // Pick another server different from the first one.
+            const size_t offset = 1 + butil::fast_rand_less_than(n - 1);
+            second = &s->server_list[((first - &s->server_list[0]) + offset) % n];
+            if (Better(*second->stat, *first->stat)) {
+                std::swap(first, second);
+            }
+        }
+        if (IsUsable(first->id.id, in, false, out)) {
+            chosen = first;
+        } else if (second != first && IsUsable(second->id.id, in, false, out)) {
+            chosen = second;
+        }
+    }
+    if (chosen == NULL) {
+        // Most servers are unusable, scan all of them.
+        size_t offset = butil::fast_rand_less_than(n);
+        for (size_t i = 0; i < n; ++i) {
+            const Server* server = &s->server_list[offset];
+            if (IsUsable(server->id.id, in, (i + 1) == n/*last chance*/, out)) {
+                chosen = server;
+                break;
+            }
+            if (++offset == n) {
+                offset = 0;
+            }
+        }
+        if (chosen == NULL) {
+            return EHOSTDOWN;
+        }
+    }
+    chosen->stat->inflight.fetch_add(1, butil::memory_order_relaxed);
+    out->need_feedback = true;
+    return 0;
+}
+
+bool PowerOfTwoChoicesLoadBalancer::Better(const Stat& a, const Stat& b) const {
+    const int64_t inflight_a = a.inflight.load(butil::memory_order_relaxed);
+    const int64_t inflight_b = b.inflight.load(butil::memory_order_relaxed);
+    if (_latency_aware) {
+        const int64_t latency_a = a.latency_us.load(butil::memory_order_relaxed);
+        const int64_t latency_b = b.latency_us.load(butil::memory_order_relaxed);
+        // New servers without latencies are compared by outstanding calls
+        // only, otherwise they would be flooded.
+        if (latency_a > 0 && latency_b > 0) {
+            return (inflight_a + 1) * latency_a < (inflight_b + 1) * latency_b;
+        }
+    }
+    return inflight_a < inflight_b;
+}
+
+void PowerOfTwoChoicesLoadBalancer::Feedback(const CallInfo& info) {
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return;
+    }
+    const size_t* pindex = s->server_map.seek(info.server_id);
+    if (pindex == NULL) {
+        // Removed.
+        return;
+    }
+    Stat& stat = *s->server_list[*pindex].stat;
+    // The call may be selected before the server was removed and added
+    // again, don't let it take a slot of the new Stat which makes the
+    // server look idle and flooded.
+    int64_t inflight = stat.inflight.load(butil::memory_order_relaxed);
+    while (inflight > 0 &&
+           !stat.inflight.compare_exchange_weak(
+               inflight, inflight - 1, butil::memory_order_relaxed)) {}
+    if (!_latency_aware) {
+        return;
+    }
+    int64_t latency = butil::gettimeofday_us() - info.begin_time_us;
+    const int64_t old_latency = stat.latency_us.load(butil::memory_order_relaxed);
+    if (info.error_code != 0) {
+        // Punish servers returning errors quickly.
+        latency = std::max(latency, old_latency * 2);
+    }
+    // Concurrent updates may lose some latencies, which is acceptable
+    // for a moving average.
+    const int64_t new_latency = (old_latency == 0 ? latency :
+        old_latency + ((latency - old_latency) >> EWMA_SHIFT));
+    stat.latency_us.store(std::max(new_latency, (int64_t)1),
+                          butil::memory_order_relaxed);
+}
+
+PowerOfTwoChoicesLoadBalancer* PowerOfTwoChoicesLoadBalancer::New(
+    const butil::StringPiece& params) const {
+    PowerOfTwoChoicesLoadBalancer* lb =
+        new (std::nothrow) PowerOfTwoChoicesLoadBalancer;
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        lb = NULL;
+    }
+    return lb;
+}
+
+void PowerOfTwoChoicesLoadBalancer::Destroy() {
+    delete this;
+}
+
+void PowerOfTwoChoicesLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "p2c";
+        return;
+    }
+    os << "PowerOfTwoChoices{latency_aware=" << _latency_aware;
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        os << " fail to read _db_servers";
+    } else {
+        os << " n=" << s->server_list.size() << ':';
+        for (size_t i = 0; i < s->server_list.size(); ++i) {
+            const Server& server = s->server_list[i];
+            os << ' ' << server.id << "(inflight="
+               << server.stat->inflight.load(butil::memory_order_relaxed);
+            if (_latency_aware) {
+                os << " latency="
+                   << server.stat->latency_us.load(butil::memory_order_relaxed);
+            }
+            os << ')';
+        }
+    }
+    os << '}';
+}
+
+bool PowerOfTwoChoicesLoadBalancer::SetParameters(
+    const butil::StringPiece& params) {
+    for (butil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+            sp; ++sp) {
+        if (sp.value().empty()) {
+            LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+            return false;
+        }
+        if (sp.key() == "latency_aware") {
+            if (sp.value() == "true") {
+                _latency_aware = true;
+            } else if (sp.value() == "false") {
+                _latency_aware = false;
+            } else {
+                LOG(ERROR) << "Invalid " << sp.key_and_value();
+                return false;
+            }
+            continue;
+        }
+        LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
+    }
+    return true;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,84 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_POLICY_POWER_OF_TWO_CHOICES_LOAD_BALANCER_H
+#define BRPC_POLICY_POWER_OF_TWO_CHOICES_LOAD_BALANCER_H
+
+#include <memory>                                      // std::shared_ptr
+#include <vector>                                      // std::vector
+#include "butil/atomicops.h"
+#include "butil/containers/flat_map.h"                 // FlatMap
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+// Pick two servers randomly and select the one with fewer outstanding
+// calls. With "p2c:latency_aware=true", outstanding calls are weighted by
+// EWMA of latencies of the servers. Compared to LocalityAwareLoadBalancer,
+// no tree is updated in SelectServer() or Feedback(): both read the
+// DoublyBufferedData (wait-free with -lb_wait_free_read), Feedback() looks
+// up the server in a FlatMap, then relaxed atomics of the server are
+// updated, which is much cheaper for clusters with thousands of servers.
+// Servers are identified by SocketId, tags are ignored.
+class PowerOfTwoChoicesLoadBalancer : public LoadBalancer {
+public:
+    PowerOfTwoChoicesLoadBalancer();
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    PowerOfTwoChoicesLoadBalancer* New(const butil::StringPiece&) const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+private:
+    struct Stat {
+        Stat() : inflight(0), latency_us(0) {}
+        // A removed-then-added server gets a new Stat, calls selected
+        // before the removal never push this below 0.
+        butil::atomic<int64_t> inflight;
+        // EWMA of latencies, 0 before the first call ends.
+        butil::atomic<int64_t> latency_us;
+    };
+    struct Server {
+        ServerId id;
+        // Shared by both buffers.
+        std::shared_ptr<Stat> stat;
+    };
+    struct Servers {
+        Servers() { CHECK_EQ(0, server_map.init(1024, 70)); }
+        std::vector<Server> server_list;
+        butil::FlatMap<SocketId, size_t> server_map;
+    };
+    bool SetParameters(const butil::StringPiece& params);
+    // Returns true if `a' is less loaded than `b'.
+    bool Better(const Stat& a, const Stat& b) const;
+    static bool Add(Servers& bg, const Servers& fg, const ServerId& id);
+    static bool Remove(Servers& bg, const ServerId& id);
+    static size_t BatchAdd(Servers& bg, const Servers& fg,
+                           const std::vector<ServerId>& servers);
+    static size_t BatchRemove(Servers& bg, const std::vector<ServerId>& servers);
+
+    bool _latency_aware;
+    butil::DoublyBufferedData<Servers> _db_servers;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+#endif  // BRPC_POLICY_POWER_OF_TWO_CHOICES_LOAD_BALANCER_H
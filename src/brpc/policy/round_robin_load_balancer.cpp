@@ -31,6 +31,10 @@ inline uint32_t GenRandomStride() {
     return prime_offset[butil::fast_rand_less_than(ARRAY_SIZE(prime_offset))];
 }
 
+RoundRobinLoadBalancer::RoundRobinLoadBalancer() {
+    _db_servers.set_wait_free_read(FLAGS_lb_wait_free_read);
+}
+
 bool RoundRobinLoadBalancer::Add(Servers& bg, const ServerId& id) {
     if (bg.server_list.capacity() < 128) {
         bg.server_list.reserve(128);
@@ -30,6 +30,7 @@ namespace policy {
 // at the same time) are very close.
 class RoundRobinLoadBalancer : public LoadBalancer {
 public:
+    RoundRobinLoadBalancer();
     bool AddServer(const ServerId& id);
     bool RemoveServer(const ServerId& id);
     size_t AddServersInBatch(const std::vector<ServerId>& servers);
@@ -0,0 +1,339 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>                                    // std::max
+#include "butil/fast_rand.h"
+#include "butil/time.h"
+#include "butil/string_splitter.h"
+#include "butil/strings/string_number_conversions.h"
+#include "brpc/excluded_servers.h"
+#include "brpc/socket.h"
+#include "brpc/periodic_task.h"
+#include "brpc/policy/slow_start_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+// Interval of checking revived servers.
+static const int64_t REVIVAL_CHECK_INTERVAL_MS = 100;
+
+struct SlowStartLoadBalancer::RevivalState {
+    RevivalState() : owner(NULL) {}
+    // Reset to NULL by the LoadBalancer before destruction.
+    butil::Mutex mutex;
+    SlowStartLoadBalancer* owner;
+};
+
+// Run WarmRevivedServers() of a SlowStartLoadBalancer periodically until
+// it's destroyed.
+class SlowStartRevivalTask : public PeriodicTask {
+public:
+    explicit SlowStartRevivalTask(
+        const std::shared_ptr<SlowStartLoadBalancer::RevivalState>& state)
+        : _state(state) {}
+    bool OnTriggeringTask(timespec* next_abstime);
+    void OnDestroyingTask() { delete this; }
+
+private:
+    std::shared_ptr<SlowStartLoadBalancer::RevivalState> _state;
+};
+
+bool SlowStartRevivalTask::OnTriggeringTask(timespec* next_abstime) {
+    BAIDU_SCOPED_LOCK(_state->mutex);
+    if (_state->owner == NULL) {
+        return false;
+    }
+    _state->owner->WarmRevivedServers();
+    *next_abstime = butil::milliseconds_from_now(REVIVAL_CHECK_INTERVAL_MS);
+    return true;
+}
+
+SlowStartLoadBalancer::SlowStartLoadBalancer()
+    : _lb(NULL)
+    , _window_us(30000000L)
+    , _min_weight(0.1)
+    , _warm_until_us(0) {
+    CHECK_EQ(0, _server_set.init(1024, 70));
+    CHECK_EQ(0, _failed_set.init(64, 70));
+}
+
+SlowStartLoadBalancer::~SlowStartLoadBalancer() {
+    if (_revival_state) {
+        BAIDU_SCOPED_LOCK(_revival_state->mutex);
+        _revival_state->owner = NULL;
+    }
+    if (_lb) {
+        _lb->Destroy();
+        _lb = NULL;
+    }
+}
+
+size_t SlowStartLoadBalancer::AddWarming(
+    Servers& bg, const std::vector<WarmingServer>& added,
+    const int64_t& expire_before_us) {
+    // Drop servers that were warmed up or are warmed up again.
+    size_t n = 0;
+    for (size_t i = 0; i < bg.warming.size(); ++i) {
+        if (bg.warming[i].start_us <= expire_before_us) {
+            continue;
+        }
+        bool restarted = false;
+        for (size_t j = 0; j < added.size() && !restarted; ++j) {
+            restarted = (added[j].id == bg.warming[i].id);
+        }
+        if (!restarted) {
+            bg.warming[n++] = bg.warming[i];
+        }
+    }
+    bg.warming.resize(n);
+    bg.warming.insert(bg.warming.end(), added.begin(), added.end());
+    return added.size();
+}
+
+size_t SlowStartLoadBalancer::RemoveWarming(
+    Servers& bg, const std::vector<ServerId>& removed) {
+    size_t count = 0;
+    for (size_t i = 0; i < removed.size(); ++i) {
+        for (size_t j = 0; j < bg.warming.size(); ++j) {
+            if (bg.warming[j].id == removed[i].id) {
+                bg.warming[j] = bg.warming.back();
+                bg.warming.pop_back();
+                ++count;
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+size_t SlowStartLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const bool was_empty = _server_set.empty();
+    const int64_t now = butil::gettimeofday_us();
+    std::vector<ServerId> fresh;
+    std::vector<WarmingServer> added;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (_server_set.seek(servers[i].id) == NULL) {
+            _server_set.insert(servers[i].id);
+            fresh.push_back(servers[i]);
+            WarmingServer w = { servers[i].id, now };
+            added.push_back(w);
+        }
+    }
+    if (fresh.empty()) {
+        return 0;
+    }
+    const size_t n = _lb->AddServersInBatch(fresh);
+    if (!was_empty) {
+        _db_servers.Modify(AddWarming, added, now - _window_us);
+        _warm_until_us.store(now + _window_us, butil::memory_order_relaxed);
+    }
+    return n;
+}
+
+size_t SlowStartLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::vector<ServerId> existing;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (_server_set.erase(servers[i].id)) {
+            _failed_set.erase(servers[i].id);
+            existing.push_back(servers[i]);
+        }
+    }
+    if (existing.empty()) {
+        return 0;
+    }
+    const size_t n = _lb->RemoveServersInBatch(existing);
+    if (_warm_until_us.load(butil::memory_order_relaxed) >
+        butil::gettimeofday_us()) {
+        _db_servers.Modify(RemoveWarming, existing);
+    }
+    return n;
+}
+
+bool SlowStartLoadBalancer::AddServer(const ServerId& id) {
+    return AddServersInBatch(std::vector<ServerId>(1, id)) == 1;
+}
+
+bool SlowStartLoadBalancer::RemoveServer(const ServerId& id) {
+    return RemoveServersInBatch(std::vector<ServerId>(1, id)) == 1;
+}
+
+void SlowStartLoadBalancer::WarmRevivedServers() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const int64_t now = butil::gettimeofday_us();
+    std::vector<WarmingServer> revived;
+    size_t navailable = 0;
+    for (butil::FlatSet<SocketId>::const_iterator
+             it = _server_set.begin(); it != _server_set.end(); ++it) {
+        SocketUniquePtr ptr;
+        if (Socket::Address(*it, &ptr) != 0 || !ptr->IsAvailable()) {
+            _failed_set.insert(*it);
+            continue;
+        }
+        ++navailable;
+        if (_failed_set.erase(*it)) {
+            WarmingServer w = { *it, now };
+            revived.push_back(w);
+        }
+    }
+    // Like adding servers into an empty LoadBalancer, don't warm up when
+    // no other servers can take the traffic.
+    if (!revived.empty() && navailable > revived.size()) {
+        _db_servers.Modify(AddWarming, revived, now - _window_us);
+        _warm_until_us.store(now + _window_us, butil::memory_order_relaxed);
+    }
+}
+
+double SlowStartLoadBalancer::WeightOf(int64_t elapsed_us) const {
+    return std::max(_min_weight, (double)elapsed_us / _window_us);
+}
+
+int SlowStartLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    const int64_t now = butil::gettimeofday_us();
+    if (now >= _warm_until_us.load(butil::memory_order_relaxed)) {
+        // Most of time.
+        return _lb->SelectServer(in, out);
+    }
+    ExcludedServers* excluded = NULL;
+    {
+        butil::DoublyBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            return ENOMEM;
+        }
+        for (size_t i = 0; i < s->warming.size(); ++i) {
+            const int64_t elapsed_us = now - s->warming[i].start_us;
+            if (elapsed_us >= _window_us ||
+                butil::fast_rand_less_than(10000) < WeightOf(elapsed_us) * 10000) {
+                continue;
+            }
+            if (excluded == NULL) {
+                excluded = ExcludedServers::Create(
+                    s->warming.size() + (in.excluded ? in.excluded->size() : 0));
+                if (excluded == NULL) {
+                    break;
+                }
+                if (in.excluded) {
+                    excluded->AddAll(*in.excluded);
+                }
+            }
+            excluded->Add(s->warming[i].id);
+        }
+    }
+    if (excluded == NULL) {
+        return _lb->SelectServer(in, out);
+    }
+    SelectIn new_in = in;
+    new_in.excluded = excluded;
+    const int rc = _lb->SelectServer(new_in, out);
+    ExcludedServers::Destroy(excluded);
+    return rc;
+}
+
+void SlowStartLoadBalancer::Feedback(const CallInfo& info) {
+    _lb->Feedback(info);
+}
+
+SlowStartLoadBalancer* SlowStartLoadBalancer::New(
+    const butil::StringPiece& params) const {
+    SlowStartLoadBalancer* lb = new (std::nothrow) SlowStartLoadBalancer;
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        return NULL;
+    }
+    if (lb) {
+        lb->_revival_state.reset(new RevivalState);
+        lb->_revival_state->owner = lb;
+        PeriodicTaskManager::StartTaskAt(
+            new SlowStartRevivalTask(lb->_revival_state),
+            butil::milliseconds_from_now(REVIVAL_CHECK_INTERVAL_MS));
+    }
+    return lb;
+}
+
+void SlowStartLoadBalancer::Destroy() {
+    delete this;
+}
+
+void SlowStartLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "slow_start";
+        return;
+    }
+    os << "SlowStart{window_ms=" << _window_us / 1000
+       << " min_weight=" << _min_weight << " warming=[";
+    const int64_t now = butil::gettimeofday_us();
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) == 0) {
+        for (size_t i = 0; i < s->warming.size(); ++i) {
+            const int64_t elapsed_us = now - s->warming[i].start_us;
+            if (elapsed_us < _window_us) {
+                os << ' ' << s->warming[i].id << "(weight="
+                   << WeightOf(elapsed_us) << ')';
+            }
+        }
+    }
+    os << " ] ";
+    _lb->Describe(os, options);
+    os << '}';
+}
+
+bool SlowStartLoadBalancer::SetParameters(const butil::StringPiece& params) {
+    std::string inner_name = "rr";
+    for (butil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+            sp; ++sp) {
+        if (sp.value().empty()) {
+            LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+            return false;
+        }
+        if (sp.key() == "lb") {
+            inner_name = sp.value().as_string();
+            continue;
+        }
+        if (sp.key() == "window_ms") {
+            int64_t window_ms = 0;
+            if (!butil::StringToInt64(sp.value(), &window_ms) || window_ms <= 0) {
+                LOG(ERROR) << "window_ms must be positive, " << sp.key_and_value();
+                return false;
+            }
+            _window_us = window_ms * 1000L;
+            continue;
+        }
+        if (sp.key() == "min_weight") {
+            if (!butil::StringToDouble(sp.value().as_string(), &_min_weight)
+                || _min_weight <= 0 || _min_weight > 1) {
+                LOG(ERROR) << "min_weight must be in (0, 1], " << sp.key_and_value();
+                return false;
+            }
+            continue;
+        }
+        LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
+    }
+    const LoadBalancer* inner = FindInnerLoadBalancer(inner_name, "slow_start");
+    if (inner == NULL) {
+        return false;
+    }
+    _lb = inner->New(butil::StringPiece());
+    if (_lb == NULL) {
+        LOG(ERROR) << "Fail to create LoadBalancer by `" << inner_name << "'";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace policy
+} // namespace brpc
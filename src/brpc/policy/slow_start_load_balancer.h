@@ -0,0 +1,96 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_POLICY_SLOW_START_LOAD_BALANCER_H
+#define BRPC_POLICY_SLOW_START_LOAD_BALANCER_H
+
+#include <memory>                                      // std::shared_ptr
+#include <vector>                                      // std::vector
+#include "butil/atomicops.h"
+#include "butil/synchronization/lock.h"                // butil::Mutex
+#include "butil/containers/flat_map.h"                 // FlatSet
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+// Ramp up traffic to newly added servers, whose caches are cold, over a
+// time window instead of giving them full traffic immediately.
+// Parameters (e.g. "slow_start:lb=la window_ms=30000"):
+//   lb          Name of the inner LoadBalancer, "rr" by default. Parameters
+//               of the inner LoadBalancer are not supported.
+//   window_ms   Length of the warm-up, 30000 by default.
+//   min_weight  Relative weight of a server just added, which grows
+//               linearly to 1 at the end of the window. 0.1 by default.
+// Warming servers are put into SelectIn.excluded with probabilities of
+// (1 - weight) before selecting by the inner LoadBalancer, which works
+// with all LoadBalancers and keeps Feedback() intact. Servers added into
+// an empty LoadBalancer are not warmed up since there're no other servers
+// to take the traffic. A server revived by health checking after being
+// failed is warmed up again, as it may be restarted with cold caches.
+class SlowStartLoadBalancer : public LoadBalancer {
+public:
+    SlowStartLoadBalancer();
+    ~SlowStartLoadBalancer();
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    SlowStartLoadBalancer* New(const butil::StringPiece&) const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+private:
+    struct WarmingServer {
+        SocketId id;
+        int64_t start_us;
+    };
+    struct Servers {
+        std::vector<WarmingServer> warming;
+    };
+
+    // Shared with SlowStartRevivalTask which may outlive this LoadBalancer.
+    struct RevivalState;
+    friend class SlowStartRevivalTask;
+
+    bool SetParameters(const butil::StringPiece& params);
+    // Find servers revived since last call and warm them up again.
+    void WarmRevivedServers();
+    // Weight of a server added `elapsed_us' ago, in [min_weight, 1].
+    double WeightOf(int64_t elapsed_us) const;
+    static size_t AddWarming(Servers& bg, const std::vector<WarmingServer>& added,
+                             const int64_t& expire_before_us);
+    static size_t RemoveWarming(Servers& bg, const std::vector<ServerId>& removed);
+
+    LoadBalancer* _lb;
+    int64_t _window_us;
+    double _min_weight;
+    // No server is warming since this time.
+    butil::atomic<int64_t> _warm_until_us;
+    // Guards _server_set, _failed_set and serializes modifications.
+    butil::Mutex _mutex;
+    butil::FlatSet<SocketId> _server_set;
+    // Servers found unavailable by WarmRevivedServers().
+    butil::FlatSet<SocketId> _failed_set;
+    std::shared_ptr<RevivalState> _revival_state;
+    butil::DoublyBufferedData<Servers> _db_servers;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+#endif  // BRPC_POLICY_SLOW_START_LOAD_BALANCER_H
@@ -71,6 +71,10 @@ uint64_t GetStride(const uint64_t weight_sum, const size_t num) {
 namespace brpc {
 namespace policy {
 
+WeightedRoundRobinLoadBalancer::WeightedRoundRobinLoadBalancer() {
+    _db_servers.set_wait_free_read(FLAGS_lb_wait_free_read);
+}
+
 bool WeightedRoundRobinLoadBalancer::Add(Servers& bg, const ServerId& id) {
     if (bg.server_list.capacity() < 128) {
         bg.server_list.reserve(128);
@@ -30,6 +30,7 @@ namespace policy {
 // Weight is got from tag of ServerId.
 class WeightedRoundRobinLoadBalancer : public LoadBalancer {
 public:
+    WeightedRoundRobinLoadBalancer();
     bool AddServer(const ServerId& id);
     bool RemoveServer(const ServerId& id);
     size_t AddServersInBatch(const std::vector<ServerId>& servers);
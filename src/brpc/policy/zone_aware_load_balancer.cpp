@@ -0,0 +1,522 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gflags/gflags.h>
+#include <algorithm>                                   // std::find
+#include <map>                                         // std::map
+#include <set>                                         // std::set
+#include "butil/fast_rand.h"
+#include "butil/time.h"
+#include "butil/string_splitter.h"
+#include "butil/strings/string_number_conversions.h"
+#include "brpc/socket.h"
+#include "brpc/periodic_task.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+DEFINE_string(local_zone, "", "Zone of this process, servers tagged with "
+              "the same zone are preferred by the zone_aware LoadBalancer");
+
+// Interval of counting available servers in zones.
+static const int64_t REFRESH_INTERVAL_MS = 100;
+// Unit of error ratios.
+static const int64_t ERROR_SCALE = 1000000;
+// Weight of the newest sample in the EWMA is 1/EWMA_FACTOR.
+static const int64_t EWMA_FACTOR = 16;
+
+butil::StringPiece GetZoneFromTag(const std::string& tag) {
+    if (tag.find('=') == std::string::npos) {
+        return tag;
+    }
+    for (butil::KeyValuePairsSplitter sp(tag, ' ', '='); sp; ++sp) {
+        if (sp.key() == "zone") {
+            return sp.value();
+        }
+    }
+    return butil::StringPiece();
+}
+
+ZoneAwareLoadBalancer::Zone::Zone()
+    : lb(NULL)
+    , nserver(0)
+    , navailable(0)
+    , weight(0)
+    , error_ratio(0)
+    , latency_us(0) {
+}
+
+struct ZoneAwareLoadBalancer::RefreshState {
+    RefreshState() : owner(NULL) {}
+    // Reset to NULL by the LoadBalancer before destruction.
+    butil::Mutex mutex;
+    ZoneAwareLoadBalancer* owner;
+};
+
+// Run Refresh() of a ZoneAwareLoadBalancer periodically until it's
+// destroyed, so that SelectServer() never locks Zone::mutex or addresses
+// sockets of all servers.
+class ZoneRefreshTask : public PeriodicTask {
+public:
+    explicit ZoneRefreshTask(
+        const std::shared_ptr<ZoneAwareLoadBalancer::RefreshState>& state)
+        : _state(state) {}
+    bool OnTriggeringTask(timespec* next_abstime);
+    void OnDestroyingTask() { delete this; }
+
+private:
+    std::shared_ptr<ZoneAwareLoadBalancer::RefreshState> _state;
+};
+
+bool ZoneRefreshTask::OnTriggeringTask(timespec* next_abstime) {
+    // Hold the mutex so that the LoadBalancer is not destroyed during
+    // Refresh().
+    BAIDU_SCOPED_LOCK(_state->mutex);
+    if (_state->owner == NULL) {
+        return false;
+    }
+    _state->owner->Refresh(true);
+    *next_abstime = butil::milliseconds_from_now(REFRESH_INTERVAL_MS);
+    return true;
+}
+
+ZoneAwareLoadBalancer::ZoneAwareLoadBalancer()
+    : _inner_lb(NULL)
+    , _min_healthy_ratio(0.8)
+    , _local_share(1000) {
+}
+
+ZoneAwareLoadBalancer::~ZoneAwareLoadBalancer() {
+    if (_refresh_state) {
+        BAIDU_SCOPED_LOCK(_refresh_state->mutex);
+        _refresh_state->owner = NULL;
+    }
+    for (std::map<std::string, Zone*>::iterator
+             it = _zone_map.begin(); it != _zone_map.end(); ++it) {
+        it->second->lb->Destroy();
+        delete it->second;
+    }
+    _zone_map.clear();
+}
+
+ZoneAwareLoadBalancer::Zone*
+ZoneAwareLoadBalancer::GetOrCreateZone(const butil::StringPiece& name) {
+    Zone*& zone = _zone_map[name.as_string()];
+    if (zone == NULL) {
+        LoadBalancer* lb = _inner_lb->New(butil::StringPiece());
+        if (lb == NULL) {
+            LOG(ERROR) << "Fail to create LoadBalancer for zone=" << name;
+            _zone_map.erase(name.as_string());
+            return NULL;
+        }
+        zone = new Zone;
+        zone->name = name.as_string();
+        zone->lb = lb;
+    }
+    return zone;
+}
+
+size_t ZoneAwareLoadBalancer::AddToZones(
+    Zones& bg, const ServerZones& servers, const std::string& local_zone) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        Zone* zone = servers[i].second;
+        if (std::find(bg.zone_list.begin(), bg.zone_list.end(), zone)
+            == bg.zone_list.end()) {
+            bg.zone_list.push_back(zone);
+            if (zone->name == local_zone) {
+                bg.local = zone;
+            }
+        }
+        bg.server_map[servers[i].first] = zone;
+        ++count;
+    }
+    return count;
+}
+
+size_t ZoneAwareLoadBalancer::RemoveFromZones(
+    Zones& bg, const ServerZones& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += bg.server_map.erase(servers[i].first);
+    }
+    return count;
+}
+
+size_t ZoneAwareLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::map<Zone*, std::vector<ServerId> > groups;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        Zone* zone = GetOrCreateZone(GetZoneFromTag(servers[i].tag));
+        if (zone != NULL) {
+            groups[zone].push_back(servers[i]);
+        }
+    }
+    ServerZones added;
+    for (std::map<Zone*, std::vector<ServerId> >::iterator
+             it = groups.begin(); it != groups.end(); ++it) {
+        Zone* zone = it->first;
+        std::vector<ServerId> fresh;
+        {
+            BAIDU_SCOPED_LOCK(zone->mutex);
+            for (size_t i = 0; i < it->second.size(); ++i) {
+                if (zone->servers.insert(it->second[i]).second) {
+                    fresh.push_back(it->second[i]);
+                }
+            }
+        }
+        if (fresh.empty()) {
+            continue;
+        }
+        // Don't modify _db_zones with zone->mutex locked, which is also
+        // locked by Refresh() inside ZoneRefreshTask.
+        zone->lb->AddServersInBatch(fresh);
+        for (size_t i = 0; i < fresh.size(); ++i) {
+            added.push_back(std::make_pair(fresh[i].id, zone));
+        }
+    }
+    if (!added.empty()) {
+        _db_zones.Modify(AddToZones, added, _local_zone);
+        // Count the new servers before next selection.
+        Refresh(false);
+    }
+    return added.size();
+}
+
+size_t ZoneAwareLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::map<Zone*, std::vector<ServerId> > groups;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        std::map<std::string, Zone*>::iterator it =
+            _zone_map.find(GetZoneFromTag(servers[i].tag).as_string());
+        if (it != _zone_map.end()) {
+            groups[it->second].push_back(servers[i]);
+        }
+    }
+    ServerZones removed;
+    for (std::map<Zone*, std::vector<ServerId> >::iterator
+             it = groups.begin(); it != groups.end(); ++it) {
+        Zone* zone = it->first;
+        std::vector<ServerId> existing;
+        {
+            BAIDU_SCOPED_LOCK(zone->mutex);
+            for (size_t i = 0; i < it->second.size(); ++i) {
+                if (zone->servers.erase(it->second[i])) {
+                    existing.push_back(it->second[i]);
+                }
+            }
+        }
+        if (existing.empty()) {
+            continue;
+        }
+        zone->lb->RemoveServersInBatch(existing);
+        for (size_t i = 0; i < existing.size(); ++i) {
+            removed.push_back(std::make_pair(existing[i].id, zone));
+        }
+    }
+    if (!removed.empty()) {
+        // Feedback() of calls to removed servers is not forwarded to
+        // inner LoadBalancers anymore, which have forgotten the servers
+        // as well. Empty zones are kept.
+        _db_zones.Modify(RemoveFromZones, removed);
+        Refresh(false);
+    }
+    return removed.size();
+}
+
+bool ZoneAwareLoadBalancer::AddServer(const ServerId& id) {
+    return AddServersInBatch(std::vector<ServerId>(1, id)) == 1;
+}
+
+bool ZoneAwareLoadBalancer::RemoveServer(const ServerId& id) {
+    return RemoveServersInBatch(std::vector<ServerId>(1, id)) == 1;
+}
+
+// Ratio of available servers multiplied by ratio of successful calls,
+// in [0, 1].
+static double Health(int64_t nserver, int64_t navailable, int64_t error_ratio) {
+    if (nserver <= 0) {
+        return 0;
+    }
+    return (double)navailable / nserver * (ERROR_SCALE - error_ratio) / ERROR_SCALE;
+}
+
+void ZoneAwareLoadBalancer::Refresh(bool decay_errors) {
+    butil::DoublyBufferedData<Zones>::ScopedPtr s;
+    if (_db_zones.Read(&s) != 0) {
+        LOG(ERROR) << "Fail to read _db_zones";
+        return;
+    }
+    Refresh(*s, decay_errors);
+}
+
+void ZoneAwareLoadBalancer::Refresh(const Zones& zones, bool decay_errors) {
+    int64_t min_latency = 0;
+    for (size_t i = 0; i < zones.zone_list.size(); ++i) {
+        Zone* zone = zones.zone_list[i];
+        int64_t nserver = 0;
+        int64_t navailable = 0;
+        {
+            BAIDU_SCOPED_LOCK(zone->mutex);
+            for (std::set<ServerId>::const_iterator it = zone->servers.begin();
+                 it != zone->servers.end(); ++it) {
+                SocketUniquePtr ptr;
+                ++nserver;
+                if (Socket::Address(it->id, &ptr) == 0 && ptr->IsAvailable()) {
+                    ++navailable;
+                }
+            }
+        }
+        zone->nserver.store(nserver, butil::memory_order_relaxed);
+        zone->navailable.store(navailable, butil::memory_order_relaxed);
+        // Decay errors so that zones without traffic recover eventually.
+        // Only done periodically, otherwise frequent changes of servers
+        // would clear errors quickly.
+        if (decay_errors) {
+            const int64_t error_ratio =
+                zone->error_ratio.load(butil::memory_order_relaxed) * 7 / 8;
+            zone->error_ratio.store(error_ratio, butil::memory_order_relaxed);
+        }
+        const int64_t latency = zone->latency_us.load(butil::memory_order_relaxed);
+        if (zone != zones.local && navailable > 0 && latency > 0 &&
+            (min_latency == 0 || latency < min_latency)) {
+            min_latency = latency;
+        }
+    }
+    // Spilled traffic prefers healthy zones with lower latencies.
+    int64_t total_remote_weight = 0;
+    for (size_t i = 0; i < zones.zone_list.size(); ++i) {
+        Zone* zone = zones.zone_list[i];
+        if (zone == zones.local) {
+            continue;
+        }
+        double weight = 1000 * Health(
+            zone->nserver.load(butil::memory_order_relaxed),
+            zone->navailable.load(butil::memory_order_relaxed),
+            zone->error_ratio.load(butil::memory_order_relaxed));
+        const int64_t latency = zone->latency_us.load(butil::memory_order_relaxed);
+        if (min_latency > 0 && latency > min_latency) {
+            weight = weight * min_latency / latency;
+        }
+        const int64_t w = (weight > 0 ? std::max((int64_t)weight, (int64_t)1) : 0);
+        zone->weight.store(w, butil::memory_order_relaxed);
+        total_remote_weight += w;
+    }
+    int64_t local_share = 1000;
+    if (zones.local != NULL && total_remote_weight > 0) {
+        Zone* local = zones.local;
+        const double health = Health(
+            local->nserver.load(butil::memory_order_relaxed),
+            local->navailable.load(butil::memory_order_relaxed),
+            local->error_ratio.load(butil::memory_order_relaxed));
+        if (health < _min_healthy_ratio) {
+            local_share = (int64_t)(1000 * health / _min_healthy_ratio);
+        }
+    } else if (zones.local == NULL) {
+        local_share = 0;
+    }
+    _local_share.store(local_share, butil::memory_order_relaxed);
+}
+
+ZoneAwareLoadBalancer::Zone*
+ZoneAwareLoadBalancer::PickRemoteZone(const Zones& zones) const {
+    int64_t total = 0;
+    for (size_t i = 0; i < zones.zone_list.size(); ++i) {
+        if (zones.zone_list[i] != zones.local) {
+            total += zones.zone_list[i]->weight.load(butil::memory_order_relaxed);
+        }
+    }
+    if (total <= 0) {
+        return NULL;
+    }
+    int64_t r = butil::fast_rand_less_than(total);
+    for (size_t i = 0; i < zones.zone_list.size(); ++i) {
+        Zone* zone = zones.zone_list[i];
+        if (zone == zones.local) {
+            continue;
+        }
+        r -= zone->weight.load(butil::memory_order_relaxed);
+        if (r < 0) {
+            return zone;
+        }
+    }
+    // Weights were changed concurrently.
+    return NULL;
+}
+
+int ZoneAwareLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    butil::DoublyBufferedData<Zones>::ScopedPtr s;
+    if (_db_zones.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    if (s->zone_list.empty()) {
+        return ENODATA;
+    }
+    Zone* first = NULL;
+    if (s->local != NULL &&
+        (int64_t)butil::fast_rand_less_than(1000) <
+        _local_share.load(butil::memory_order_relaxed)) {
+        first = s->local;
+    } else {
+        first = PickRemoteZone(*s);
+    }
+    if (first == NULL) {
+        first = (s->local != NULL ? s->local : s->zone_list[0]);
+    }
+    int rc = first->lb->SelectServer(in, out);
+    // Fallback to the local zone and then other zones.
+    int last_error = rc;
+    if (rc != 0 && s->local != NULL && s->local != first) {
+        rc = s->local->lb->SelectServer(in, out);
+        if (rc != 0 && rc != ENODATA) {
+            last_error = rc;
+        }
+    }
+    for (size_t i = 0; rc != 0 && i < s->zone_list.size(); ++i) {
+        Zone* zone = s->zone_list[i];
+        if (zone == first || zone == s->local) {
+            continue;
+        }
+        rc = zone->lb->SelectServer(in, out);
+        if (rc != 0 && rc != ENODATA) {
+            last_error = rc;
+        }
+    }
+    if (rc != 0) {
+        return last_error;
+    }
+    // Stats of zones are updated in Feedback().
+    out->need_feedback = true;
+    return 0;
+}
+
+void ZoneAwareLoadBalancer::Feedback(const CallInfo& info) {
+    Zone* zone = NULL;
+    {
+        butil::DoublyBufferedData<Zones>::ScopedPtr s;
+        if (_db_zones.Read(&s) != 0) {
+            return;
+        }
+        Zone* const* pzone = s->server_map.seek(info.server_id);
+        if (pzone == NULL) {
+            // Removed.
+            return;
+        }
+        zone = *pzone;
+    }
+    // Zones are never deleted before the LoadBalancer.
+    zone->lb->Feedback(info);
+    // Concurrent updates may lose some samples, which is acceptable for
+    // moving averages.
+    const int64_t error = (info.error_code != 0 ? ERROR_SCALE : 0);
+    const int64_t old_error = zone->error_ratio.load(butil::memory_order_relaxed);
+    zone->error_ratio.store(old_error + (error - old_error) / EWMA_FACTOR,
+                            butil::memory_order_relaxed);
+    if (info.error_code == 0) {
+        const int64_t latency = butil::gettimeofday_us() - info.begin_time_us;
+        const int64_t old_latency = zone->latency_us.load(butil::memory_order_relaxed);
+        const int64_t new_latency = (old_latency == 0 ? latency :
+            old_latency + (latency - old_latency) / EWMA_FACTOR);
+        zone->latency_us.store(std::max(new_latency, (int64_t)1),
+                               butil::memory_order_relaxed);
+    }
+}
+
+ZoneAwareLoadBalancer* ZoneAwareLoadBalancer::New(
+    const butil::StringPiece& params) const {
+    ZoneAwareLoadBalancer* lb = new (std::nothrow) ZoneAwareLoadBalancer;
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        return NULL;
+    }
+    if (lb) {
+        lb->_refresh_state.reset(new RefreshState);
+        lb->_refresh_state->owner = lb;
+        PeriodicTaskManager::StartTaskAt(
+            new ZoneRefreshTask(lb->_refresh_state),
+            butil::milliseconds_from_now(REFRESH_INTERVAL_MS));
+    }
+    return lb;
+}
+
+void ZoneAwareLoadBalancer::Destroy() {
+    delete this;
+}
+
+void ZoneAwareLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "zone_aware";
+        return;
+    }
+    os << "ZoneAware{local_zone=" << _local_zone
+       << " local_share=" << _local_share.load(butil::memory_order_relaxed) / 10.0
+       << "%";
+    butil::DoublyBufferedData<Zones>::ScopedPtr s;
+    if (_db_zones.Read(&s) != 0) {
+        os << " fail to read _db_zones";
+    } else {
+        for (size_t i = 0; i < s->zone_list.size(); ++i) {
+            Zone* zone = s->zone_list[i];
+            os << "\n  zone=" << zone->name
+               << " servers=" << zone->nserver.load(butil::memory_order_relaxed)
+               << " available=" << zone->navailable.load(butil::memory_order_relaxed)
+               << " error_ratio="
+               << (double)zone->error_ratio.load(butil::memory_order_relaxed) / ERROR_SCALE
+               << " latency=" << zone->latency_us.load(butil::memory_order_relaxed)
+               << " weight=" << zone->weight.load(butil::memory_order_relaxed)
+               << ' ';
+            zone->lb->Describe(os, options);
+        }
+    }
+    os << '}';
+}
+
+bool ZoneAwareLoadBalancer::SetParameters(const butil::StringPiece& params) {
+    _local_zone = FLAGS_local_zone;
+    std::string inner_name = "rr";
+    for (butil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+            sp; ++sp) {
+        if (sp.value().empty()) {
+            LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+            return false;
+        }
+        if (sp.key() == "lb") {
+            inner_name = sp.value().as_string();
+            continue;
+        }
+        if (sp.key() == "local_zone") {
+            _local_zone = sp.value().as_string();
+            continue;
+        }
+        if (sp.key() == "min_healthy_ratio") {
+            if (!butil::StringToDouble(sp.value().as_string(), &_min_healthy_ratio)
+                || _min_healthy_ratio <= 0 || _min_healthy_ratio > 1) {
+                LOG(ERROR) << "min_healthy_ratio must be in (0, 1], "
+                           << sp.key_and_value();
+                return false;
+            }
+            continue;
+        }
+        LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
+    }
+    _inner_lb = FindInnerLoadBalancer(inner_name, "zone_aware");
+    return _inner_lb != NULL;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,126 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
+#define BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
+
+#include <map>                                         // std::map
+#include <memory>                                      // std::shared_ptr
+#include <set>                                         // std::set
+#include <string>
+#include <vector>                                      // std::vector
+#include "butil/atomicops.h"
+#include "butil/synchronization/lock.h"                // butil::Mutex
+#include "butil/containers/flat_map.h"                 // FlatMap
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+// Returns zone of a server from its tag: value of "zone" if the tag is
+// key-value pairs like "zone=az1 idc=bj", the whole tag otherwise.
+butil::StringPiece GetZoneFromTag(const std::string& tag);
+
+// Prefer servers in the same zone with this process and spill traffic to
+// other zones only when the local zone is not healthy enough, which saves
+// cross-zone latencies and bandwidth. Servers are grouped by zones in their
+// tags and each zone is balanced by a separate inner LoadBalancer.
+// Parameters (e.g. "zone_aware:lb=la local_zone=az1"):
+//   lb                 Name of the inner LoadBalancer, "rr" by default.
+//                      Parameters of the inner LoadBalancer are not
+//                      supported.
+//   local_zone         Zone of this process, -local_zone by default.
+//   min_healthy_ratio  The local zone takes all traffic while its health
+//                      (ratio of available servers multiplied by ratio of
+//                      successful calls) is not less than this value,
+//                      otherwise it keeps a share of traffic proportional
+//                      to the health and the rest goes to other zones,
+//                      weighted by their health and latencies. 0.8 by
+//                      default.
+// Feedback() is always forwarded to the inner LoadBalancer of the zone.
+class ZoneAwareLoadBalancer : public LoadBalancer {
+public:
+    ZoneAwareLoadBalancer();
+    ~ZoneAwareLoadBalancer();
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    ZoneAwareLoadBalancer* New(const butil::StringPiece&) const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+private:
+    struct Zone {
+        Zone();
+        std::string name;
+        LoadBalancer* lb;
+        // Servers in this zone, guarded by `mutex'.
+        butil::Mutex mutex;
+        std::set<ServerId> servers;
+        // Updated by Refresh() periodically and when servers are changed.
+        butil::atomic<int64_t> nserver;
+        butil::atomic<int64_t> navailable;
+        // Weight of being chosen for the spilled traffic.
+        butil::atomic<int64_t> weight;
+        // EWMA of ratio of failed calls in 1/ERROR_SCALE and of latencies,
+        // updated by Feedback().
+        butil::atomic<int64_t> error_ratio;
+        butil::atomic<int64_t> latency_us;
+    };
+    struct Zones {
+        Zones() : local(NULL) { CHECK_EQ(0, server_map.init(1024, 70)); }
+        // Zones are never removed until the LoadBalancer is destroyed.
+        std::vector<Zone*> zone_list;
+        Zone* local;
+        butil::FlatMap<SocketId, Zone*> server_map;
+    };
+    typedef std::vector<std::pair<SocketId, Zone*> > ServerZones;
+    // Shared with ZoneRefreshTask which may outlive this LoadBalancer.
+    struct RefreshState;
+    friend class ZoneRefreshTask;
+
+    bool SetParameters(const butil::StringPiece& params);
+    Zone* GetOrCreateZone(const butil::StringPiece& name);
+    // Count available servers of zones and re-calculate the share of the
+    // local zone and weights of other zones. Called by ZoneRefreshTask
+    // and after servers are changed, never inside SelectServer(). Errors
+    // of zones are decayed only if `decay_errors' is true, which is set by
+    // ZoneRefreshTask only.
+    void Refresh(bool decay_errors);
+    void Refresh(const Zones& zones, bool decay_errors);
+    Zone* PickRemoteZone(const Zones& zones) const;
+    static size_t AddToZones(Zones& bg, const ServerZones& servers,
+                             const std::string& local_zone);
+    static size_t RemoveFromZones(Zones& bg, const ServerZones& servers);
+
+    const LoadBalancer* _inner_lb;
+    std::string _local_zone;
+    double _min_healthy_ratio;
+    // Per-mille of traffic kept in the local zone.
+    butil::atomic<int64_t> _local_share;
+    std::shared_ptr<RefreshState> _refresh_state;
+    // Guards _zone_map and serializes modifications.
+    butil::Mutex _mutex;
+    std::map<std::string, Zone*> _zone_map;
+    butil::DoublyBufferedData<Zones> _db_zones;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+#endif  // BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
@@ -0,0 +1,270 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <google/protobuf/descriptor.h>
+#include "butil/hash.h"                          // butil::Hash
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "bvar/bvar.h"
+#include "bthread/bthread.h"
+#include "brpc/channel.h"
+#include "brpc/details/request_coalescer.h"      // RequestCoalescer::MakeKey
+#include "brpc/response_cache.h"
+
+namespace brpc {
+
+struct ResponseCacheVars {
+    bvar::Adder<int64_t> hit_count;
+    bvar::Adder<int64_t> miss_count;
+    bvar::PassiveStatus<double> hit_ratio;
+
+    ResponseCacheVars()
+        : hit_count("rpc_response_cache_hit_count")
+        , miss_count("rpc_response_cache_miss_count")
+        , hit_ratio("rpc_response_cache_hit_ratio", GetHitRatio, this) {}
+
+    static double GetHitRatio(void* arg) {
+        ResponseCacheVars* vars = static_cast<ResponseCacheVars*>(arg);
+        const int64_t nhit = vars->hit_count.get_value();
+        const int64_t ntotal = nhit + vars->miss_count.get_value();
+        return ntotal > 0 ? (double)nhit / ntotal : 0;
+    }
+};
+
+inline ResponseCacheVars* get_response_cache_vars() {
+    return butil::get_leaky_singleton<ResponseCacheVars>();
+}
+
+// Put the response of a successful asynchronous RPC into the cache before
+// running user's done which may destroy the controller and response.
+class ResponseCacheFillDone : public google::protobuf::Closure {
+public:
+    ResponseCacheFillDone(ResponseCache* cache, std::string* key,
+                          int64_t ttl_ms, Controller* cntl,
+                          google::protobuf::Message* response,
+                          google::protobuf::Closure* done)
+        : _cache(cache), _ttl_ms(ttl_ms), _cntl(cntl)
+        , _response(response), _done(done) {
+        _key.swap(*key);
+    }
+
+    void Run() {
+        if (!_cntl->Failed()) {
+            _cache->Put(_key, _ttl_ms, *_response, _cntl->response_attachment());
+        }
+        _done->Run();
+        delete this;
+    }
+
+private:
+    ResponseCache* _cache;
+    std::string _key;
+    int64_t _ttl_ms;
+    Controller* _cntl;
+    google::protobuf::Message* _response;
+    google::protobuf::Closure* _done;
+};
+
+ResponseCacheOptions::ResponseCacheOptions()
+    : max_memory_bytes(64 * 1024 * 1024)
+    , shard_count(16) {
+}
+
+ResponseCache::ResponseCache(const ResponseCacheOptions* options) {
+    ResponseCacheOptions opt;
+    if (options) {
+        opt = *options;
+    }
+    _shard_count = std::max(opt.shard_count, 1);
+    _max_memory_per_shard = opt.max_memory_bytes / _shard_count;
+    _shards = new Shard[_shard_count];
+    get_response_cache_vars();
+}
+
+ResponseCache::~ResponseCache() {
+    delete [] _shards;
+    _shards = NULL;
+}
+
+size_t ResponseCache::UpdateTTL(TTLMap& m, const std::string& name,
+                                int64_t ttl_ms) {
+    if (ttl_ms > 0) {
+        m[name] = ttl_ms;
+    } else {
+        m.erase(name);
+    }
+    return 1;
+}
+
+int ResponseCache::SetTTL(const std::string& method_full_name,
+                          int64_t ttl_ms) {
+    if (method_full_name.empty()) {
+        LOG(ERROR) << "method_full_name is empty";
+        return -1;
+    }
+    _ttls.Modify(UpdateTTL, method_full_name, ttl_ms);
+    return 0;
+}
+
+int64_t ResponseCache::GetTTL(const std::string& method_full_name) {
+    butil::DoublyBufferedData<TTLMap>::ScopedPtr ptr;
+    if (_ttls.Read(&ptr) != 0) {
+        return 0;
+    }
+    TTLMap::const_iterator it = ptr->find(method_full_name);
+    return (it != ptr->end() ? it->second : 0);
+}
+
+ResponseCache::Shard& ResponseCache::GetShard(const std::string& key) const {
+    return _shards[butil::Hash(key) % _shard_count];
+}
+
+void ResponseCache::Clear() {
+    for (int i = 0; i < _shard_count; ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i].mutex);
+        _shards[i].lru.Clear();
+        _shards[i].memory = 0;
+    }
+}
+
+size_t ResponseCache::size() const {
+    size_t n = 0;
+    for (int i = 0; i < _shard_count; ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i].mutex);
+        n += _shards[i].lru.size();
+    }
+    return n;
+}
+
+size_t ResponseCache::memory_usage() const {
+    size_t n = 0;
+    for (int i = 0; i < _shard_count; ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i].mutex);
+        n += _shards[i].memory;
+    }
+    return n;
+}
+
+bool ResponseCache::Get(const std::string& key,
+                        google::protobuf::Message* response,
+                        butil::IOBuf* attachment) {
+    Shard& shard = GetShard(key);
+    std::string serialized;
+    butil::IOBuf cached_attachment;
+    {
+        BAIDU_SCOPED_LOCK(shard.mutex);
+        butil::HashingMRUCache<std::string, Entry>::iterator it =
+            shard.lru.Get(key);
+        if (it == shard.lru.end()) {
+            return false;
+        }
+        if (it->second.expire_time_us <= butil::gettimeofday_us()) {
+            shard.memory -= it->second.memory;
+            shard.lru.Erase(it);
+            return false;
+        }
+        serialized = it->second.response;
+        cached_attachment = it->second.attachment;
+    }
+    // Parse outside the lock.
+    if (!response->ParseFromString(serialized)) {
+        return false;
+    }
+    attachment->swap(cached_attachment);
+    return true;
+}
+
+void ResponseCache::Put(const std::string& key, int64_t ttl_ms,
+                        const google::protobuf::Message& response,
+                        const butil::IOBuf& attachment) {
+    Entry entry;
+    if (!response.SerializeToString(&entry.response)) {
+        return;
+    }
+    entry.attachment = attachment;
+    entry.expire_time_us = butil::gettimeofday_us() + ttl_ms * 1000L;
+    entry.memory = sizeof(Entry) + key.size() * 2/*key is stored twice*/
+        + entry.response.size() + attachment.size();
+    if (entry.memory > _max_memory_per_shard) {
+        return;
+    }
+    Shard& shard = GetShard(key);
+    BAIDU_SCOPED_LOCK(shard.mutex);
+    butil::HashingMRUCache<std::string, Entry>::iterator it =
+        shard.lru.Peek(key);
+    if (it != shard.lru.end()) {
+        shard.memory -= it->second.memory;
+        shard.lru.Erase(it);
+    }
+    shard.memory += entry.memory;
+    shard.lru.Put(key, entry);
+    while (shard.memory > _max_memory_per_shard) {
+        butil::HashingMRUCache<std::string, Entry>::reverse_iterator rit =
+            shard.lru.rbegin();
+        shard.memory -= rit->second.memory;
+        shard.lru.Erase(rit);
+    }
+}
+
+void ResponseCache::CallMethod(
+    Channel* channel,
+    const google::protobuf::MethodDescriptor* method,
+    Controller* cntl,
+    const google::protobuf::Message* request,
+    google::protobuf::Message* response,
+    google::protobuf::Closure* done) {
+    int64_t ttl_ms = 0;
+    std::string key;
+    if (method == NULL || response == NULL ||
+        (ttl_ms = GetTTL(method->full_name())) <= 0 ||
+        !RequestCoalescer::MakeKey(method, cntl, request, &key)) {
+        return channel->CallMethodWithoutCache(
+            method, cntl, request, response, done);
+    }
+    // Lock the call_id as Channel does so that Join() on it works.
+    const CallId cid = cntl->call_id();
+    if (bthread_id_lock_and_reset_range(cid, NULL, 2) == 0) {
+        if (Get(key, response, &cntl->response_attachment())) {
+            get_response_cache_vars()->hit_count << 1;
+            const int64_t now = butil::gettimeofday_us();
+            cntl->OnRPCBegin(now);
+            cntl->set_used_by_rpc();
+            if (channel->SingleServer()) {
+                cntl->_remote_side = channel->_server_address;
+            }
+            cntl->OnRPCEnd(now);
+            // `cntl' may be deleted by done.
+            if (done) {
+                done->Run();
+            }
+            CHECK_EQ(0, bthread_id_unlock_and_destroy(cid));
+            return;
+        }
+        CHECK_EQ(0, bthread_id_unlock(cid));
+    }
+    get_response_cache_vars()->miss_count << 1;
+    if (done == NULL) {
+        channel->CallMethodWithoutCache(method, cntl, request, response, NULL);
+        if (!cntl->Failed()) {
+            Put(key, ttl_ms, *response, cntl->response_attachment());
+        }
+    } else {
+        channel->CallMethodWithoutCache(
+            method, cntl, request, response,
+            new ResponseCacheFillDone(this, &key, ttl_ms, cntl, response, done));
+    }
+}
+
+} // namespace brpc
@@ -0,0 +1,131 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_RESPONSE_CACHE_H
+#define BRPC_RESPONSE_CACHE_H
+
+#include <map>
+#include <string>
+#include <google/protobuf/message.h>
+#include "butil/iobuf.h"
+#include "butil/macros.h"
+#include "butil/containers/mru_cache.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/controller.h"
+
+namespace brpc {
+
+class Channel;
+
+struct ResponseCacheOptions {
+    // Constructed with default options.
+    ResponseCacheOptions();
+
+    // Max total bytes of keys, responses and attachments in the cache.
+    // Least recently used entries are evicted when it's exceeded.
+    // Default: 64MB
+    size_t max_memory_bytes;
+
+    // Number of independently locked LRU lists, more shards reduce contention
+    // between threads at the cost of less accurate LRU.
+    // Default: 16
+    int shard_count;
+};
+
+// Client-side cache of responses of idempotent methods, keyed by the method,
+// serialized request, attachment and request_code. Set to
+// ChannelOptions.response_cache to enable, only methods given TTL by
+// SetTTL() are cached. A hit completes the RPC in-place without any I/O:
+// `done' is run before CallMethod() returns.
+// Failed RPC are never cached. Sharing one cache between channels to
+// different clusters is wrong unless the methods are different.
+// Example:
+//   brpc::ResponseCache cache(NULL);
+//   cache.SetTTL("example.ConfigService.Get", 5000/*ms*/);
+//   brpc::ChannelOptions options;
+//   options.response_cache = &cache;
+//   channel.Init("bns://config.service", "rr", &options);
+class ResponseCache {
+friend class Channel;
+friend class ResponseCacheFillDone;
+public:
+    // Use default options if `options' is NULL.
+    explicit ResponseCache(const ResponseCacheOptions* options);
+    ~ResponseCache();
+
+    // Cache responses of method `method_full_name' (e.g.
+    // "example.EchoService.Echo") for `ttl_ms' milliseconds. Non-positive
+    // `ttl_ms' stops caching the method.
+    // Returns 0 on success, -1 otherwise.
+    int SetTTL(const std::string& method_full_name, int64_t ttl_ms);
+
+    // Remove all cached responses.
+    void Clear();
+
+    // Number of cached responses.
+    size_t size() const;
+
+    // Bytes used by cached responses.
+    size_t memory_usage() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ResponseCache);
+
+    struct Entry {
+        std::string response;
+        butil::IOBuf attachment;
+        int64_t expire_time_us;
+        size_t memory;
+    };
+    struct Shard {
+        Shard() : lru(butil::HashingMRUCache<std::string, Entry>::NO_AUTO_EVICT)
+                , memory(0) {}
+        mutable butil::Mutex mutex;
+        butil::HashingMRUCache<std::string, Entry> lru;
+        size_t memory;
+    };
+    typedef std::map<std::string, int64_t> TTLMap;
+
+    // Send the RPC via `channel' unless a valid response is cached.
+    // Arguments are same with Channel::CallMethod().
+    void CallMethod(Channel* channel,
+                    const google::protobuf::MethodDescriptor* method,
+                    Controller* cntl,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done);
+
+    // Returns TTL of the method in milliseconds, 0 when it's not cached.
+    int64_t GetTTL(const std::string& method_full_name);
+
+    // Fill `response' and `attachment' with the cached result of `key'.
+    bool Get(const std::string& key, google::protobuf::Message* response,
+             butil::IOBuf* attachment);
+    void Put(const std::string& key, int64_t ttl_ms,
+             const google::protobuf::Message& response,
+             const butil::IOBuf& attachment);
+
+    Shard& GetShard(const std::string& key) const;
+    static size_t UpdateTTL(TTLMap& m, const std::string& name, int64_t ttl_ms);
+
+    size_t _max_memory_per_shard;
+    int _shard_count;
+    Shard* _shards;
+    butil::DoublyBufferedData<TTLMap> _ttls;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_RESPONSE_CACHE_H
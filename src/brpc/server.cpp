@@ -64,6 +64,7 @@
 #include "brpc/builtin/ids_service.h"          // IdsService
 #include "brpc/builtin/sockets_service.h"      // SocketsService
 #include "brpc/builtin/hotspots_service.h"     // HotspotsService
+#include "brpc/builtin/flamegraph_service.h"   // FlamegraphService
 #include "brpc/builtin/prometheus_metrics_service.h"
 #include "brpc/details/method_status.h"
 #include "brpc/load_balancer.h"
@@ -458,6 +459,10 @@ int Server::AddBuiltinServices() {
         LOG(ERROR) << "Fail to add HotspotsService";
         return -1;
     }
+    if (AddBuiltinService(new (std::nothrow) FlamegraphService)) {
+        LOG(ERROR) << "Fail to add FlamegraphService";
+        return -1;
+    }
     if (AddBuiltinService(new (std::nothrow) IndexService)) {
         LOG(ERROR) << "Fail to add IndexService";
         return -1;
@@ -950,7 +955,14 @@ int Server::StartInternal(const butil::ip_t& ip,
             }
             return -1;
         }
-        if (_listen_addr.port == 0) {
+        if (butil::is_extended_endpoint(_listen_addr)) {
+            // Unix domain socket or IPv6, update the address with the one
+            // actually listened (dynamic port of IPv6).
+            if (butil::get_local_side(sockfd, &_listen_addr) != 0) {
+                PLOG(ERROR) << "Fail to get address from fd=" << sockfd;
+                return -1;
+            }
+        } else if (_listen_addr.port == 0) {
             // port=0 makes kernel dynamically select a port from
             // https://en.wikipedia.org/wiki/Ephemeral_port
             _listen_addr.port = get_port_from_fd(sockfd);
@@ -983,6 +995,11 @@ int Server::StartInternal(const butil::ip_t& ip,
         break; // stop trying
     }
     if (_options.internal_port >= 0 && _options.has_builtin_services) {
+        if (butil::is_extended_endpoint(_listen_addr)) {
+            LOG(ERROR) << "ServerOptions.internal_port is not supported when"
+                " listening on " << _listen_addr;
+            return -1;
+        }
         if (_options.internal_port  == _listen_addr.port) {
             LOG(ERROR) << "ServerOptions.internal_port=" << _options.internal_port
                        << " is same with port=" << _listen_addr.port << " to Start()";
@@ -1030,14 +1047,23 @@ int Server::StartInternal(const butil::ip_t& ip,
     // Print tips to server launcher.
     int http_port = _listen_addr.port;
     std::ostringstream server_info;
-    server_info << "Server[" << version() << "] is serving on port="
-                << _listen_addr.port;
+    server_info << "Server[" << version() << "] is serving on ";
+    if (butil::is_extended_endpoint(_listen_addr)) {
+        server_info << _listen_addr;
+    } else {
+        server_info << "port=" << _listen_addr.port;
+    }
     if (_options.internal_port >= 0 && _options.has_builtin_services) {
         http_port = _options.internal_port;
         server_info << " and internal_port=" << _options.internal_port;
     }
     LOG(INFO) << server_info.str() << '.';
 
+    if (butil::is_extended_endpoint(_listen_addr)) {
+        // Not reachable from browsers nor from trackme.
+        revert_server.release();
+        return 0;
+    }
     if (_options.has_builtin_services) {
         LOG(INFO) << "Check out http://" << butil::my_hostname() << ':'
                   << http_port << " in web browser.";
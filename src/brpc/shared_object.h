@@ -42,6 +42,21 @@ public:
     int AddRefManually()
     { return _nref.fetch_add(1, butil::memory_order_relaxed); }
 
+    // Add ref only if the ref_count is not zero, namely the object is not
+    // being destructed. Returns true on success. The caller must make sure
+    // that the memory is still valid, e.g. by holding a lock which is also
+    // required by the dtor.
+    bool AddRefIfNonZero() {
+        int nref = _nref.load(butil::memory_order_relaxed);
+        while (nref != 0) {
+            if (_nref.compare_exchange_weak(nref, nref + 1,
+                                            butil::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     // Remove one ref, if the ref_count hit zero, delete this object.
     // Same as butil::intrusive_ptr<T>(obj, false).reset(NULL)
     void RemoveRefManually() {
@@ -25,6 +25,7 @@
 #include <mesalink/openssl/x509.h>
 #endif
 #include <netinet/tcp.h>                         // getsockopt
+#include <set>
 #include <gflags/gflags.h>
 #include "bthread/unstable.h"                    // bthread_timer_del
 #include "butil/fd_utility.h"                     // make_non_blocking
@@ -34,6 +35,7 @@
 #include "butil/logging.h"                        // CHECK
 #include "butil/macros.h"
 #include "butil/class_name.h"                     // butil::class_name
+#include "butil/scoped_lock.h"                    // BAIDU_SCOPED_LOCK
 #include "brpc/log.h"
 #include "brpc/reloadable_flags.h"          // BRPC_VALIDATE_GFLAG
 #include "brpc/errno.pb.h"
@@ -41,6 +43,7 @@
 #include "brpc/socket.h"
 #include "brpc/describable.h"               // Describable
 #include "brpc/circuit_breaker.h"           // CircuitBreaker
+#include "brpc/concurrency_limiter.h"       // ConcurrencyLimiter
 #include "brpc/input_messenger.h"
 #include "brpc/details/sparse_minute_counter.h"
 #include "brpc/stream_impl.h"
@@ -79,6 +82,15 @@ DEFINE_int32(socket_send_buffer_size, -1,
 
 DEFINE_int32(ssl_bio_buffer_size, 16*1024, "Set buffer size for SSL read/write");
 
+DEFINE_bool(shm_transport, false, "Move payloads of new baidu_std "
+            "connections to servers on the same host through shared memory "
+            "instead of TCP. Servers without the shared-memory support are "
+            "detected and skipped after the first failed connection");
+DEFINE_int32(shm_ring_size, 4 * 1024 * 1024, "Capacity of the shared-memory"
+             " ring in each direction of a connection, rounded up to power of 2");
+DEFINE_int32(shm_handshake_timeout_ms, 500,
+             "Timeout of negotiating shared memory with the server");
+
 DEFINE_int64(socket_max_unwritten_bytes, 64 * 1024 * 1024,
              "Max unwritten bytes in each socket, if the limit is reached,"
              " Socket.Write fails with EOVERCROWDED");
@@ -93,6 +105,7 @@ DEFINE_int32(connect_timeout_as_unreachable, 3,
              "fails the main socket as well when this socket is pooled.");
 
 DECLARE_int32(health_check_timeout_ms);
+DECLARE_bool(enable_latency_breakdown);
 
 static bool validate_connect_timeout_as_unreachable(const char*, int32_t v) {
     return v >= 2 && v < 1000/*large enough*/;
@@ -187,6 +200,11 @@ public:
 
     butil::atomic<uint64_t> recent_error_count;
 
+    // Client-side concurrency limiting to this server, created by the
+    // first RPC with ChannelOptions.max_concurrency_per_server.
+    butil::atomic<ConcurrencyLimiter*> client_cl;
+    butil::atomic<int> client_concurrency;
+
     explicit SharedPart(SocketId creator_socket_id);
     ~SharedPart();
 
@@ -203,10 +221,13 @@ Socket::SharedPart::SharedPart(SocketId creator_socket_id2)
     , out_size(0)
     , out_num_messages(0)
     , extended_stat(NULL)
-    , recent_error_count(0) {
+    , recent_error_count(0)
+    , client_cl(NULL)
+    , client_concurrency(0) {
 }
 
 Socket::SharedPart::~SharedPart() {
+    delete client_cl.exchange(NULL, butil::memory_order_relaxed);
     delete extended_stat;
     extended_stat = NULL;
     delete socket_pool.exchange(NULL, butil::memory_order_relaxed);
@@ -440,6 +461,8 @@ Socket::Socket(Forbidden)
     , _auth_context(NULL)
     , _ssl_state(SSL_UNKNOWN)
     , _ssl_session(NULL)
+    , _shm_state(SHM_UNKNOWN)
+    , _shm(NULL)
     , _connection_type_for_progressive_read(CONNECTION_TYPE_UNKNOWN)
     , _controller_released_socket(false)
     , _overcrowded(false)
@@ -626,6 +649,10 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
     m->_ssl_state = (options.initial_ssl_ctx == NULL ? SSL_OFF : SSL_UNKNOWN);
     m->_ssl_session = NULL;
     m->_ssl_ctx = options.initial_ssl_ctx;
+    // Accepted connections detect ShmHello on first read. Connect() turns
+    // this off for client-side sockets.
+    m->_shm_state = SHM_UNKNOWN;
+    m->_shm = NULL;
     m->_connection_type_for_progressive_read = CONNECTION_TYPE_UNKNOWN;
     m->_controller_released_socket.store(false, butil::memory_order_relaxed);
     m->_overcrowded = false;
@@ -703,6 +730,9 @@ int Socket::WaitAndReset(int32_t expected_nref) {
         _ssl_session = NULL;
     }        
     _ssl_state = SSL_UNKNOWN;
+    delete _shm;
+    _shm = NULL;
+    _shm_state = SHM_UNKNOWN;
     _nevent.store(0, butil::memory_order_relaxed);
     // parsing_context is very likely to be associated with the fd,
     // removing it is a safer choice and required by http2.
@@ -881,6 +911,64 @@ void Socket::FeedbackCircuitBreaker(int error_code, int64_t latency_us) {
     }
 }
 
+int64_t Socket::GetLatencyPercentile(double ratio, int64_t* nsample) {
+    SharedPart* sp = GetSharedPart();
+    if (sp) {
+        return sp->circuit_breaker.GetLatencyPercentile(ratio, nsample);
+    }
+    *nsample = 0;
+    return 0;
+}
+
+bool Socket::OnClientRequested(const AdaptiveMaxConcurrency& amc) {
+    SharedPart* sp = GetOrNewSharedPart();
+    ConcurrencyLimiter* cl = sp->client_cl.load(butil::memory_order_consume);
+    if (cl == NULL) {
+        const ConcurrencyLimiter* prototype =
+            ConcurrencyLimiterExtension()->Find(amc.type().c_str());
+        if (prototype == NULL) {
+            LOG(ERROR) << "Fail to find ConcurrencyLimiter by `" << amc.type() << "'";
+            return true;
+        }
+        ConcurrencyLimiter* new_cl = prototype->New(amc);
+        if (new_cl == NULL) {
+            return true;
+        }
+        if (sp->client_cl.compare_exchange_strong(
+                cl, new_cl, butil::memory_order_acq_rel)) {
+            cl = new_cl;
+        } else {
+            delete new_cl;
+        }
+    }
+    const int cc = sp->client_concurrency.fetch_add(
+        1, butil::memory_order_relaxed) + 1;
+    if (cl->OnRequested(cc)) {
+        return true;
+    }
+    sp->client_concurrency.fetch_sub(1, butil::memory_order_relaxed);
+    return false;
+}
+
+void Socket::OnClientResponded(int error_code, int64_t latency_us) {
+    SharedPart* sp = GetSharedPart();
+    if (sp == NULL) {
+        return;
+    }
+    sp->client_concurrency.fetch_sub(1, butil::memory_order_relaxed);
+    ConcurrencyLimiter* cl = sp->client_cl.load(butil::memory_order_consume);
+    if (cl) {
+        cl->OnResponded(error_code, latency_us);
+    }
+}
+
+void Socket::IsolateAsLatencyOutlier() {
+    GetOrNewSharedPart()->circuit_breaker.MarkAsBroken();
+    if (SetFailed(main_socket_id()) == 0) {
+        LOG(ERROR) << "Socket[" << *this << "] isolated by outlier detection";
+    }
+}
+
 int Socket::ReleaseReferenceIfIdle(int idle_seconds) {
     const int64_t last_active_us = last_active_time_us();
     if (butil::cpuwide_time_us() - last_active_us <= idle_seconds * 1000000L) {
@@ -989,6 +1077,9 @@ void Socket::OnRecycle() {
     }
 
     _ssl_ctx = NULL;
+
+    delete _shm;
+    _shm = NULL;
     
     delete _pipeline_q;
     _pipeline_q = NULL;
@@ -1113,7 +1204,15 @@ int Socket::Connect(const timespec* abstime,
     } else {
         _ssl_state = SSL_OFF;
     }
-    butil::fd_guard sockfd(socket(AF_INET, SOCK_STREAM, 0));
+    _shm_state = SHM_OFF;
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_size = 0;
+    if (butil::endpoint2sockaddr(remote_side(), &serv_addr,
+                                 &serv_addr_size) != 0) {
+        PLOG(ERROR) << "Fail to get sockaddr of " << remote_side();
+        return -1;
+    }
+    butil::fd_guard sockfd(socket(serv_addr.ss_family, SOCK_STREAM, 0));
     if (sockfd < 0) {
         PLOG(ERROR) << "Fail to create socket";
         return -1;
@@ -1122,13 +1221,8 @@ int Socket::Connect(const timespec* abstime,
     // We need to do async connect (to manage the timeout by ourselves).
     CHECK_EQ(0, butil::make_non_blocking(sockfd));
     
-    struct sockaddr_in serv_addr;
-    bzero((char*)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr = remote_side().ip;
-    serv_addr.sin_port = htons(remote_side().port);
     const int rc = ::connect(
-        sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+        sockfd, (struct sockaddr*)&serv_addr, serv_addr_size);
     if (rc != 0 && errno != EINPROGRESS) {
         PLOG(WARNING) << "Fail to connect to " << remote_side();
         return -1;
@@ -1215,13 +1309,12 @@ int Socket::CheckConnected(int sockfd) {
         return -1;
     }
 
-    struct sockaddr_in client;
-    socklen_t size = sizeof(client);
-    CHECK_EQ(0, getsockname(sockfd, (struct sockaddr*) &client, &size));
+    butil::EndPoint local_point;
+    CHECK_EQ(0, butil::get_local_side(sockfd, &local_point));
     LOG_IF(INFO, FLAGS_log_connected)
             << "Connected to " << remote_side()
             << " via fd=" << (int)sockfd << " SocketId=" << id()
-            << " local_port=" << ntohs(client.sin_port);
+            << " local_side=" << local_point;
     if (CreatedByConnect()) {
         g_vars->channel_conn << 1;
     }
@@ -1347,9 +1440,9 @@ static void* RunClosure(void* arg) {
 int Socket::KeepWriteIfConnected(int fd, int err, void* data) {
     WriteRequest* req = static_cast<WriteRequest*>(data);
     Socket* s = req->socket;
-    if (err == 0 && s->ssl_state() == SSL_CONNECTING) {
-        // Run ssl connect in a new bthread to avoid blocking
-        // the current bthread (thus blocking the EventDispatcher)
+    if (err == 0 && (s->ssl_state() == SSL_CONNECTING || FLAGS_shm_transport)) {
+        // Run ssl connect or shm handshake in a new bthread to avoid
+        // blocking the current bthread (thus blocking the EventDispatcher)
         bthread_t th;
         google::protobuf::Closure* thrd_func = brpc::NewCallback(
             Socket::CheckConnectedAndKeepWrite, fd, err, data);
@@ -1371,6 +1464,7 @@ void Socket::CheckConnectedAndKeepWrite(int fd, int err, void* data) {
     Socket* s = req->socket;
     CHECK_GE(sockfd, 0);
     if (err == 0 && s->CheckConnected(sockfd) == 0
+        && s->ShmHandshake(sockfd) == 0
         && s->ResetFileDescriptor(sockfd) == 0) {
         if (s->_app_connect) {
             s->_app_connect->StartConnect(req->socket, AfterAppConnected, req);
@@ -1517,6 +1611,7 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
     bthread_t th;
     SocketUniquePtr ptr_for_keep_write;
     ssize_t nw = 0;
+    int64_t begin_write_us = 0;
 
     // We've got the right to write.
     req->next = NULL;
@@ -1546,12 +1641,20 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
     
     // Write once in the calling thread. If the write is not complete,
     // continue it in KeepWrite thread.
-    if (_conn) {
+    begin_write_us = (FLAGS_enable_latency_breakdown ?
+                      butil::cpuwide_time_us() : 0);
+    if (_shm) {
+        butil::IOBuf* data_arr[1] = { &req->data };
+        nw = _shm->Write(fd(), data_arr, 1);
+    } else if (_conn) {
         butil::IOBuf* data_arr[1] = { &req->data };
         nw = _conn->CutMessageIntoFileDescriptor(fd(), data_arr, 1);
     } else {
         nw = req->data.cut_into_file_descriptor(fd());
     }
+    if (begin_write_us != 0) {
+        g_vars->write_latency << butil::cpuwide_time_us() - begin_write_us;
+    }
     if (nw < 0) {
         // RTMP may return EOVERCROWDED
         if (errno != EAGAIN && errno != EOVERCROWDED) {
@@ -1591,8 +1694,17 @@ FAIL_TO_WRITE:
 
 static const size_t DATA_LIST_MAX = 256;
 
+// Record time spent in KeepWrite since `begin_us' if it's non-zero.
+inline void RecordKeepWrite(int64_t begin_us) {
+    if (begin_us != 0) {
+        g_vars->keepwrite_latency << butil::cpuwide_time_us() - begin_us;
+    }
+}
+
 void* Socket::KeepWrite(void* void_arg) {
     g_vars->nkeepwrite << 1;
+    const int64_t begin_us = (FLAGS_enable_latency_breakdown ?
+                              butil::cpuwide_time_us() : 0);
     WriteRequest* req = static_cast<WriteRequest*>(void_arg);
     SocketUniquePtr s(req->socket);
 
@@ -1607,7 +1719,12 @@ void* Socket::KeepWrite(void* void_arg) {
             req = req->next;
             s->ReturnSuccessfulWriteRequest(saved_req);
         }
+        const int64_t begin_write_us = (begin_us != 0 ?
+                                        butil::cpuwide_time_us() : 0);
         const ssize_t nw = s->DoWrite(req);
+        if (begin_write_us != 0) {
+            g_vars->write_latency << butil::cpuwide_time_us() - begin_write_us;
+        }
         if (nw < 0) {
             if (errno != EAGAIN && errno != EOVERCROWDED) {
                 const int saved_errno = errno;
@@ -1631,7 +1748,19 @@ void* Socket::KeepWrite(void* void_arg) {
         // Update(1/8/2016, r31823): Still working.
         // Update(8/15/2017): Not working, performance downgraded.
         //if (nw <= 0 || req->data.empty()/*note*/) {
-        if (nw <= 0) {
+        if (nw <= 0 && s->_shm) {
+            // The ring is full, wait for the doorbell rung by the consumer
+            // after it released space. Timeout for the same reason as below.
+            const timespec duetime =
+                butil::milliseconds_from_now(WAIT_EPOLLOUT_TIMEOUT_MS);
+            if (s->_shm->WaitForSpace(&duetime) != 0 && errno != ETIMEDOUT) {
+                const int saved_errno = errno;
+                PLOG(WARNING) << "Fail to wait for space of " << *s;
+                s->SetFailed(saved_errno, "Fail to wait for space of %s: %s",
+                             s->description().c_str(), berror(saved_errno));
+                break;
+            }
+        } else if (nw <= 0) {
             g_vars->nwaitepollout << 1;
             bool pollin = (s->_on_edge_triggered_events != NULL);
             // NOTE: Waiting epollout within timeout is a must to force
@@ -1658,12 +1787,14 @@ void* Socket::KeepWrite(void* void_arg) {
         if (s->IsWriteComplete(cur_tail, (req == cur_tail), &cur_tail)) {
             CHECK_EQ(cur_tail, req);
             s->ReturnSuccessfulWriteRequest(req);
+            RecordKeepWrite(begin_us);
             return NULL;
         }
     } while (1);
 
     // Error occurred, release all requests until no new requests.
     s->ReleaseAllFailedWriteRequests(req);
+    RecordKeepWrite(begin_us);
     return NULL;
 }
 
@@ -1677,6 +1808,9 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
     }
 
     if (ssl_state() == SSL_OFF) {
+        if (_shm) {
+            return _shm->Write(fd(), data_list, ndata);
+        }
         // Write IOBuf in the batch array into the fd.
         if (_conn) {
             return _conn->CutMessageIntoFileDescriptor(fd(), data_list, ndata);
@@ -1801,6 +1935,158 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
     }
 }
 
+// Servers which did not answer ShmHello.
+static pthread_mutex_t g_shm_incapable_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::set<butil::EndPoint>* g_shm_incapable_servers = NULL;
+
+static bool IsShmIncapable(const butil::EndPoint& server) {
+    BAIDU_SCOPED_LOCK(g_shm_incapable_mutex);
+    return g_shm_incapable_servers != NULL &&
+        g_shm_incapable_servers->count(server) != 0;
+}
+
+static void MarkShmIncapable(const butil::EndPoint& server) {
+    BAIDU_SCOPED_LOCK(g_shm_incapable_mutex);
+    if (g_shm_incapable_servers == NULL) {
+        g_shm_incapable_servers = new std::set<butil::EndPoint>;
+    }
+    g_shm_incapable_servers->insert(server);
+}
+
+int Socket::ShmHandshake(int fd) {
+#if defined(OS_LINUX)
+    if (!FLAGS_shm_transport || _ssl_state != SSL_OFF) {
+        return 0;
+    }
+    // ShmHello is not understood by servers of other protocols. Sockets
+    // without a preferred protocol (e.g. health checking) don't send it
+    // either.
+    if (_preferred_index < 0 || _preferred_index !=
+        get_client_side_messenger()->FindProtocolIndex(PROTOCOL_BAIDU_STD)) {
+        return 0;
+    }
+    // Same host iff both ends share the ip. Unix domain sockets are local
+    // already and IPv6 connections are not handled.
+    butil::EndPoint local_side;
+    if (butil::is_extended_endpoint(remote_side()) ||
+        butil::get_local_side(fd, &local_side) != 0 ||
+        local_side.ip != remote_side().ip ||
+        IsShmIncapable(remote_side())) {
+        return 0;
+    }
+    ShmHello hello;
+    std::unique_ptr<ShmTransport> t(
+        ShmTransport::CreateForClient(FLAGS_shm_ring_size, &hello));
+    if (t == NULL) {
+        // Keep using TCP.
+        return 0;
+    }
+    const timespec duetime =
+        butil::milliseconds_from_now(FLAGS_shm_handshake_timeout_ms);
+    size_t written = 0;
+    while (written < sizeof(hello)) {
+        const ssize_t nw = write(fd, (const char*)&hello + written,
+                                 sizeof(hello) - written);
+        if (nw >= 0) {
+            written += nw;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN ||
+            bthread_fd_timedwait(fd, EPOLLOUT, &duetime) != 0) {
+            PLOG(WARNING) << "Fail to send ShmHello to " << remote_side();
+            return -1;
+        }
+    }
+    char ack = 0;
+    while (true) {
+        const ssize_t nr = read(fd, &ack, 1);
+        if (nr == 1) {
+            break;
+        }
+        if (nr == 0) {
+            // The connection is failed and the RPC is retried with a new
+            // connection without ShmHello.
+            LOG(WARNING) << remote_side() << " closed the connection during"
+                " shm handshake, is it built with the shared-memory support?";
+            MarkShmIncapable(remote_side());
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN ||
+            bthread_fd_timedwait(fd, EPOLLIN, &duetime) != 0) {
+            PLOG(WARNING) << "Fail to receive shm ack from " << remote_side();
+            if (errno == ETIMEDOUT) {
+                MarkShmIncapable(remote_side());
+            }
+            return -1;
+        }
+    }
+    if (ack != SHM_ACK_OK) {
+        RPC_VLOG << remote_side() << " rejected shared memory";
+        return 0;
+    }
+    t->CloseMemfd();
+    _shm = t.release();
+    _shm_state = SHM_CONNECTED;
+#endif
+    return 0;
+}
+
+ssize_t Socket::DoReadAndAcceptShm(size_t size_hint) {
+    // Read as usual, connections without ShmHello pay nothing more than
+    // comparing a few bytes. Bytes left in `_read_buf' are from previous
+    // calls which returned a partial ShmHello.
+    const size_t old_size = _read_buf.size();
+    const ssize_t nr = _read_buf.append_from_file_descriptor(fd(), size_hint);
+    if (nr <= 0) {
+        return nr;
+    }
+    ShmHello hello;
+    const size_t n = _read_buf.copy_to(&hello, sizeof(hello));
+    if (!ShmTransport::MaybeHello(hello.magic, n)) {
+        _shm_state = SHM_OFF;
+        return old_size + nr;
+    }
+    if (n < sizeof(hello)) {
+        errno = EAGAIN;  // Not enough data, wait for the rest.
+        return -1;
+    }
+    _read_buf.pop_front(sizeof(hello));
+    if (!_read_buf.empty()) {
+        // The client must wait for the ack before sending anything else.
+        LOG(WARNING) << "Unexpected data after ShmHello from " << remote_side();
+        errno = EPROTO;
+        return -1;
+    }
+    ShmTransport* t = NULL;
+    // Never map memory of other processes on behalf of remote peers.
+    if (!butil::is_extended_endpoint(remote_side()) &&
+        _local_side.ip == remote_side().ip) {
+        t = ShmTransport::CreateForServer(hello, fd());
+    }
+    // The connection is fresh, the byte always fits in the socket buffer.
+    const char ack = (t != NULL ? SHM_ACK_OK : SHM_ACK_REJECTED);
+    if (write(fd(), &ack, 1) != 1) {
+        PLOG(WARNING) << "Fail to ack ShmHello from " << remote_side();
+        delete t;
+        return -1;
+    }
+    _shm = t;
+    if (t == NULL) {
+        _shm_state = SHM_OFF;
+        return _read_buf.append_from_file_descriptor(fd(), size_hint);
+    }
+    _shm_state = SHM_CONNECTED;
+    // Park on the empty ring so that the client rings the doorbell.
+    return _shm->Read(fd(), &_read_buf, size_hint);
+}
+
 ssize_t Socket::DoRead(size_t size_hint) {
     if (ssl_state() == SSL_UNKNOWN) {
         int error_code = 0;
@@ -1830,6 +2116,16 @@ ssize_t Socket::DoRead(size_t size_hint) {
         }
     }
     // _ssl_state has been set
+    if (_shm_state == SHM_UNKNOWN) {
+        if (ssl_state() != SSL_OFF) {
+            _shm_state = SHM_OFF;
+        } else {
+            return DoReadAndAcceptShm(size_hint);
+        }
+    }
+    if (_shm_state == SHM_CONNECTED) {
+        return _shm->Read(fd(), &_read_buf, size_hint);
+    }
     if (ssl_state() == SSL_OFF) {
         return _read_buf.append_from_file_descriptor(fd(), size_hint);
     }
@@ -2124,7 +2420,11 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
     }
     os << "\ncid=" << ptr->_correlation_id
        << "\nwrite_head=" << ptr->_write_head.load(butil::memory_order_relaxed)
-       << "\nssl_state=" << SSLStateToString(ssl_state);
+       << "\nssl_state=" << SSLStateToString(ssl_state)
+       << "\nshm_state=" << ShmStateToString(ptr->_shm_state);
+    if (ptr->_shm) {
+        os << "\nshm_ring_size=" << ptr->_shm->ring_size();
+    }
     const SocketSSLContext* ssl_ctx = ptr->_ssl_ctx.get();
     if (ssl_ctx) {
         os << "\ninitial_ssl_ctx=" << ssl_ctx->raw_ctx;
@@ -32,6 +32,7 @@
 #include "brpc/authenticator.h"           // Authenticator
 #include "brpc/errno.pb.h"                // EFAILEDSOCKET
 #include "brpc/details/ssl_helper.h"      // SSLState
+#include "brpc/details/shm_transport.h"   // ShmState
 #include "brpc/stream.h"                  // StreamId
 #include "brpc/destroyable.h"             // Destroyable
 #include "brpc/options.pb.h"              // ConnectionType
@@ -52,6 +53,7 @@ class ChannelBalancer;
 class Socket;
 class AuthContext;
 class EventDispatcher;
+class AdaptiveMaxConcurrency;
 class Stream;
 
 // A special closure for processing the about-to-recycle socket. Socket does
@@ -136,6 +138,8 @@ struct SocketVarsCollector {
         , nkeepwrite_second("rpc_keepwrite_second", &nkeepwrite)
         , nwaitepollout("rpc_waitepollout_count")
         , nwaitepollout_second("rpc_waitepollout_second", &nwaitepollout)
+        , write_latency("rpc_socket_write")
+        , keepwrite_latency("rpc_socket_keepwrite")
     {}
 
     bvar::Adder<int64_t> nsocket;
@@ -147,6 +151,12 @@ struct SocketVarsCollector {
     bvar::PerSecond<bvar::Adder<int64_t> > nkeepwrite_second;
     bvar::Adder<int64_t> nwaitepollout;
     bvar::PerSecond<bvar::Adder<int64_t> > nwaitepollout_second;
+    // Recorded when -enable_latency_breakdown is on.
+    // Time of each write into the fd, which is usually a syscall.
+    bvar::LatencyRecorder write_latency;
+    // Time of each KeepWrite bthread, requests queued behind the writing
+    // one wait for at most so long before being written out.
+    bvar::LatencyRecorder keepwrite_latency;
 };
 
 struct PipelinedInfo {
@@ -353,6 +363,20 @@ public:
 
     void FeedbackCircuitBreaker(int error_code, int64_t latency_us);
 
+    // Percentile of latencies fed to the circuit breaker in the last
+    // interval, see CircuitBreaker::GetLatencyPercentile().
+    int64_t GetLatencyPercentile(double ratio, int64_t* nsample);
+
+    // Isolate the server by the circuit breaker as if it's broken.
+    void IsolateAsLatencyOutlier();
+
+    // Client-side concurrency limiting to the server, shared by the main
+    // socket and its pooled/short sockets. The limiter is created from
+    // `amc' at the first call. Returns false when the limit is reached,
+    // otherwise OnClientResponded() must be called after the RPC.
+    bool OnClientRequested(const AdaptiveMaxConcurrency& amc);
+    void OnClientResponded(int error_code, int64_t latency_us);
+
     bool Failed() const;
 
     bool DidReleaseAdditionalRereference() const
@@ -439,6 +463,9 @@ public:
     SSLState ssl_state() const { return _ssl_state; }
     bool is_ssl() const { return ssl_state() == SSL_CONNECTED; }
     X509* GetPeerCertificate() const;
+
+    // SHM_CONNECTED if payloads of this connection go through shared memory.
+    ShmState shm_state() const { return _shm_state; }
     
     // Print debugging inforamtion of `id' into the ostream.
     static void DebugSocket(std::ostream&, SocketId id);
@@ -546,6 +573,20 @@ friend void DereferenceSocket(Socket*);
     // Returns 0 on success, -1 otherwise
     int SSLHandshake(int fd, bool server_mode);
 
+    // [Client] Negotiate a ShmTransport over the just-connected `fd' when
+    // -shm_transport is on, the preferred protocol is baidu_std and the
+    // server is on the same host. Falls back to TCP silently if the server
+    // rejects. Servers closing the connection or not answering (built
+    // without the shared-memory support) are remembered and never
+    // negotiated with again.
+    // Returns 0 on success, -1 otherwise
+    int ShmHandshake(int fd);
+
+    // [Server] Read the first bytes of the connection into `_read_buf' and
+    // accept the ShmHello sent by ShmHandshake() if it's there. Returns
+    // same as DoRead().
+    ssize_t DoReadAndAcceptShm(size_t size_hint);
+
     // Based upon whether the underlying channel is using SSL (if
     // SSLState is SSL_UNKNOWN, try to detect at first), read data
     // using the corresponding method into `_read_buf'. Returns read
@@ -773,6 +814,9 @@ private:
     SSL* _ssl_session;               // owner
     std::shared_ptr<SocketSSLContext> _ssl_ctx;
 
+    ShmState _shm_state;
+    ShmTransport* _shm;              // owner
+
     // Pass from controller, for progressive reading.
     ConnectionType _connection_type_for_progressive_read;
     butil::atomic<bool> _controller_released_socket;
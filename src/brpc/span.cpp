@@ -15,6 +15,8 @@
 // Authors: Ge,Jun (gejun@baidu.com)
 
 #include <netinet/in.h>
+#include <fcntl.h>                            // open
+#include <limits>
 #include <gflags/gflags.h>
 #include <leveldb/db.h>
 #include <leveldb/comparator.h>
@@ -27,6 +29,8 @@
 #include "butil/object_pool.h"
 #include "butil/fast_rand.h"
 #include "butil/file_util.h"
+#include "butil/process_util.h"
+#include "bvar/reducer.h"
 #include "brpc/shared_object.h"
 #include "brpc/reloadable_flags.h"
 #include "brpc/span.h"
@@ -57,6 +61,35 @@ BRPC_VALIDATE_GFLAG(rpcz_keep_span_seconds, PositiveInteger);
 
 DEFINE_bool(rpcz_keep_span_db, false, "Don't remove DB of rpcz at program's exit");
 
+DEFINE_int64(rpcz_slow_span_us, 0,
+             "Spans of traces started by this process which succeeded within "
+             "so many microseconds are kept at the ratio of "
+             "-rpcz_fast_span_keep_ratio only, 0 means all spans are kept");
+BRPC_VALIDATE_GFLAG(rpcz_slow_span_us, NonNegativeInteger);
+
+DEFINE_double(rpcz_fast_span_keep_ratio, 0.01,
+              "Ratio of spans faster than -rpcz_slow_span_us to be kept");
+static bool validate_rpcz_fast_span_keep_ratio(const char*, double val) {
+    return val >= 0 && val <= 1;
+}
+BRPC_VALIDATE_GFLAG(rpcz_fast_span_keep_ratio,
+                    validate_rpcz_fast_span_keep_ratio);
+
+DEFINE_bool(rpcz_index_spans, true, "Index spans into DB for /rpcz, turn it "
+            "off if spans are only needed by -rpcz_export_file");
+BRPC_VALIDATE_GFLAG(rpcz_index_spans, PassValidate);
+
+DEFINE_string(rpcz_export_file, "", "Append spans to this file in batches, "
+              "each batch is a 4-byte big-endian length followed by a "
+              "serialized OpenTelemetry TracesData. Empty means not exporting");
+
+DEFINE_int32(rpcz_export_batch_size, 1024,
+             "Write a batch once so many spans are pending, or every second");
+BRPC_VALIDATE_GFLAG(rpcz_export_batch_size, PositiveInteger);
+
+// Spans queued for exporting beyond so many batches are dropped.
+static const int MAX_PENDING_EXPORT_BATCHES = 16;
+
 struct IdGen {
     bool init;
     uint16_t seq;
@@ -118,6 +151,8 @@ Span* Span::CreateClientSpan(const std::string& full_method_name,
     span->_start_callback_real_us = 0;
     span->_start_send_real_us = 0;
     span->_sent_real_us = 0;
+    span->_cputime_us = -1;
+    span->_rq_wait_us = -1;
     span->_next_client = NULL;
     span->_tls_next = NULL;
     span->_full_method_name = full_method_name;
@@ -170,6 +205,8 @@ Span* Span::CreateServerSpan(
     span->_start_callback_real_us = 0;
     span->_start_send_real_us = 0;
     span->_sent_real_us = 0;
+    span->_cputime_us = -1;
+    span->_rq_wait_us = -1;
     span->_next_client = NULL;
     span->_tls_next = NULL;
     span->_full_method_name = (!full_method_name.empty() ?
@@ -416,6 +453,27 @@ inline int GetSpanDB(butil::intrusive_ptr<SpanDB>* db) {
     return -1;
 }
 
+static bvar::Adder<int64_t> g_rpcz_dropped_fast_span(
+    "rpcz_dropped_fast_span_count");
+
+bool Span::ShouldKeep() const {
+    const int64_t slow_us = FLAGS_rpcz_slow_span_us;
+    // Spans continuing an upstream trace are always kept, otherwise traces
+    // sampled by upstream would be broken.
+    if (slow_us <= 0 || _parent_span_id != 0) {
+        return true;
+    }
+    if (GetEndRealTimeUs() - GetStartRealTimeUs() >= slow_us) {
+        return true;
+    }
+    for (const Span* p = this; p; p = p->_next_client) {
+        if (p->_error_code != 0) {
+            return true;
+        }
+    }
+    return butil::fast_rand_double() < FLAGS_rpcz_fast_span_keep_ratio;
+}
+
 void Span::Submit(Span* span, int64_t cpuwide_time_us) {
     if (span->local_parent() == NULL) {
         span->submit(cpuwide_time_us);
@@ -441,6 +499,10 @@ static void Span2Proto(const Span* span, RpczSpan* out) {
     out->set_start_callback_real_us(span->start_callback_real_us());
     out->set_start_send_real_us(span->start_send_real_us());
     out->set_sent_real_us(span->sent_real_us());
+    if (span->cputime_us() >= 0) {
+        out->set_cputime_us(span->cputime_us());
+        out->set_rq_wait_us(span->rq_wait_us());
+    }
     out->set_full_method_name(span->full_method_name());
     out->set_info(span->info());
     out->set_error_code(span->error_code());
@@ -630,9 +692,197 @@ leveldb::Status SpanDB::RemoveSpansBefore(int64_t tm) {
     return rc;
 }
 
+// Following code exports spans to -rpcz_export_file. Spans are converted in
+// the dump thread of bvar::Collector and written by a separate thread in
+// batches, so that a slow disk delays neither the collector nor indexing.
+static pthread_once_t g_export_once = PTHREAD_ONCE_INIT;
+static int g_export_fd = -1;
+static pthread_mutex_t g_export_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_export_cond = PTHREAD_COND_INITIALIZER;
+static OtlpScopeSpans* g_export_pending = NULL;  // guarded by g_export_mutex
+static bvar::Adder<int64_t> g_rpcz_exported_span(
+    "rpcz_exported_span_count");
+static bvar::Adder<int64_t> g_rpcz_export_dropped_span(
+    "rpcz_export_dropped_span_count");
+
+static void AddStringAttribute(
+    google::protobuf::RepeatedPtrField<OtlpKeyValue>* attrs,
+    const char* key, const std::string& value) {
+    OtlpKeyValue* kv = attrs->Add();
+    kv->set_key(key);
+    kv->mutable_value()->set_string_value(value);
+}
+
+static void AddIntAttribute(
+    google::protobuf::RepeatedPtrField<OtlpKeyValue>* attrs,
+    const char* key, int64_t value) {
+    OtlpKeyValue* kv = attrs->Add();
+    kv->set_key(key);
+    kv->mutable_value()->set_int_value(value);
+}
+
+static std::string OtlpId(uint64_t id, size_t len) {
+    uint32_t buf[4] = { 0, 0, 0, 0 };
+    ToBigEndian(id, buf + (len / sizeof(uint32_t) - 2));
+    return std::string((const char*)buf, len);
+}
+
+static void Span2Otlp(const Span* span, OtlpSpan* out) {
+    out->set_trace_id(OtlpId(span->trace_id(), 16));
+    out->set_span_id(OtlpId(span->span_id(), 8));
+    if (span->parent_span_id() != 0) {
+        out->set_parent_span_id(OtlpId(span->parent_span_id(), 8));
+    }
+    out->set_name(span->full_method_name());
+    out->set_kind(span->type() == SPAN_TYPE_SERVER ?
+                  OTLP_SPAN_KIND_SERVER : OTLP_SPAN_KIND_CLIENT);
+    out->set_start_time_unix_nano(span->GetStartRealTimeUs() * 1000L);
+    out->set_end_time_unix_nano(span->GetEndRealTimeUs() * 1000L);
+    AddStringAttribute(out->mutable_attributes(), "rpc.system", "brpc");
+    AddStringAttribute(out->mutable_attributes(), "net.peer.name",
+                       butil::endpoint2str(span->remote_side()).c_str());
+    AddStringAttribute(out->mutable_attributes(), "brpc.protocol",
+                       ProtocolType_Name(span->protocol()));
+    if (span->log_id() != 0) {
+        AddIntAttribute(out->mutable_attributes(), "brpc.log_id",
+                        span->log_id());
+    }
+    AddIntAttribute(out->mutable_attributes(), "brpc.request_size",
+                    span->request_size());
+    AddIntAttribute(out->mutable_attributes(), "brpc.response_size",
+                    span->response_size());
+    if (span->cputime_us() >= 0) {
+        AddIntAttribute(out->mutable_attributes(), "brpc.cputime_us",
+                        span->cputime_us());
+        AddIntAttribute(out->mutable_attributes(), "brpc.rq_wait_us",
+                        span->rq_wait_us());
+    }
+    SpanInfoExtractor extractor(span->info().c_str());
+    int64_t anno_time = 0;
+    std::string anno;
+    while (extractor.PopAnnotation(std::numeric_limits<int64_t>::max(),
+                                   &anno_time, &anno)) {
+        OtlpEvent* event = out->add_events();
+        event->set_time_unix_nano(anno_time * 1000L);
+        event->set_name(anno);
+    }
+    if (span->error_code() != 0) {
+        AddIntAttribute(out->mutable_attributes(), "brpc.error_code",
+                        span->error_code());
+        out->mutable_status()->set_code(OTLP_STATUS_CODE_ERROR);
+        out->mutable_status()->set_message(berror(span->error_code()));
+    }
+}
+
+static void* RunSpanExporter(void*) {
+    OtlpTracesData data;
+    OtlpResourceSpans* resource_spans = data.add_resource_spans();
+    char cmdline[256];
+    const ssize_t nr = butil::ReadCommandLine(cmdline, sizeof(cmdline), false);
+    if (nr > 0) {
+        AddStringAttribute(
+            resource_spans->mutable_resource()->mutable_attributes(),
+            "service.name",
+            butil::FilePath(std::string(cmdline, nr)).BaseName().value());
+    }
+    AddIntAttribute(resource_spans->mutable_resource()->mutable_attributes(),
+                    "process.pid", getpid());
+    OtlpScopeSpans* scope_spans = resource_spans->add_scope_spans();
+    scope_spans->mutable_scope()->set_name("brpc");
+    std::string buf;
+    while (true) {
+        pthread_mutex_lock(&g_export_mutex);
+        if (g_export_pending->spans_size() < FLAGS_rpcz_export_batch_size) {
+            const timespec due = butil::seconds_from_now(1);
+            pthread_cond_timedwait(&g_export_cond, &g_export_mutex, &due);
+        }
+        scope_spans->mutable_spans()->Swap(g_export_pending->mutable_spans());
+        pthread_mutex_unlock(&g_export_mutex);
+        const int nspan = scope_spans->spans_size();
+        if (nspan == 0) {
+            continue;
+        }
+        buf.resize(sizeof(uint32_t));
+        if (!data.AppendToString(&buf)) {
+            LOG(ERROR) << "Fail to serialize OtlpTracesData";
+        } else {
+            const uint32_t len = htonl(buf.size() - sizeof(uint32_t));
+            memcpy(&buf[0], &len, sizeof(len));
+            if (butil::WriteFileDescriptor(g_export_fd, buf.data(),
+                                           buf.size()) < 0) {
+                PLOG(ERROR) << "Fail to write into " << FLAGS_rpcz_export_file;
+            } else {
+                g_rpcz_exported_span << nspan;
+            }
+        }
+        scope_spans->clear_spans();
+    }
+    return NULL;
+}
+
+static void StartSpanExporter() {
+    g_export_fd = open(FLAGS_rpcz_export_file.c_str(),
+                       O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (g_export_fd < 0) {
+        PLOG(ERROR) << "Fail to open " << FLAGS_rpcz_export_file;
+        return;
+    }
+    g_export_pending = new OtlpScopeSpans;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, RunSpanExporter, NULL) != 0) {
+        LOG(ERROR) << "Fail to create thread for exporting spans";
+        close(g_export_fd);
+        g_export_fd = -1;
+        return;
+    }
+    pthread_detach(tid);
+}
+
+void Span::Export() const {
+    if (pthread_once(&g_export_once, StartSpanExporter) != 0 ||
+        g_export_fd < 0) {
+        return;
+    }
+    // Convert outside the lock.
+    OtlpScopeSpans spans;
+    for (const Span* p = this; p; p = p->_next_client) {
+        Span2Otlp(p, spans.add_spans());
+    }
+    const int nspan = spans.spans_size();
+    BAIDU_SCOPED_LOCK(g_export_mutex);
+    const int pending = g_export_pending->spans_size();
+    const int batch_size = FLAGS_rpcz_export_batch_size;
+    if (pending >= batch_size * MAX_PENDING_EXPORT_BATCHES) {
+        g_rpcz_export_dropped_span << nspan;
+        return;
+    }
+    for (int i = 0; i < nspan; ++i) {
+        g_export_pending->add_spans()->Swap(spans.mutable_spans(i));
+    }
+    if (pending < batch_size && pending + nspan >= batch_size) {
+        pthread_cond_signal(&g_export_cond);
+    }
+}
+
 // Write span into leveldb.
 void Span::dump_and_destroy(size_t /*round*/) {
+    // Spans dropped by tail sampling still went through the collector so
+    // that they're counted by the speed limit, otherwise the sampling ratio
+    // of IsTraceable() would rise until every request is traced.
+    if (!ShouldKeep()) {
+        g_rpcz_dropped_fast_span << 1;
+        destroy();
+        return;
+    }
     StartIndexingIfNeeded();
+
+    if (!FLAGS_rpcz_export_file.empty()) {
+        Export();
+    }
+    if (!FLAGS_rpcz_index_spans) {
+        destroy();
+        return;
+    }
     
     std::string value_buf;
 
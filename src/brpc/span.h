@@ -108,6 +108,10 @@ public:
     { _start_send_real_us = tm + _base_real_us; }
     void set_sent_us(int64_t tm)
     { _sent_real_us = tm + _base_real_us; }
+    // Time of the bthread processing the request, see
+    // MethodStatus::OnBthreadTime().
+    void set_bthread_time_us(int64_t cputime_us, int64_t rq_wait_us)
+    { _cputime_us = cputime_us; _rq_wait_us = rq_wait_us; }
 
     Span* local_parent() const { return _local_parent; }
     static Span* tls_parent() {
@@ -131,6 +135,9 @@ public:
     int64_t start_callback_real_us() const { return _start_callback_real_us; }
     int64_t start_send_real_us() const { return _start_send_real_us; }
     int64_t sent_real_us() const { return _sent_real_us; }
+    // -1 when unknown.
+    int64_t cputime_us() const { return _cputime_us; }
+    int64_t rq_wait_us() const { return _rq_wait_us; }
     bool async() const { return _async; }
     const std::string& full_method_name() const { return _full_method_name; }
     const std::string& info() const { return _info; }
@@ -143,6 +150,14 @@ private:
     bvar::CollectorSpeedLimit* speed_limit();
     bvar::CollectorPreprocessor* preprocessor();
 
+    // Tail-based sampling: false when this span and its client spans all
+    // succeeded within -rpcz_slow_span_us and it's not picked by
+    // -rpcz_fast_span_keep_ratio. Called in the dumping thread.
+    bool ShouldKeep() const;
+    // Queue this span and its client spans to be written into
+    // -rpcz_export_file.
+    void Export() const;
+
     void EndAsParent() {
         if (this == (Span*)bthread::tls_bls.rpcz_parent_span) {
             bthread::tls_bls.rpcz_parent_span = NULL;
@@ -168,6 +183,8 @@ private:
     int64_t _start_callback_real_us;
     int64_t _start_send_real_us;
     int64_t _sent_real_us;
+    int64_t _cputime_us;
+    int64_t _rq_wait_us;
     std::string _full_method_name;
     // Format: 
     //   time1_us \s annotation1 <SEP>
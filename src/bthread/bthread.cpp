@@ -63,6 +63,10 @@ TaskControl* g_task_control = NULL;
 extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
 extern void (*g_worker_startfn)();
 
+// Defined in mutex.cpp
+size_t blocking_sampling_range();
+void submit_blocking(size_t sampling_range, int64_t begin_ns, int64_t end_ns);
+
 inline TaskControl* get_task_control() {
     return g_task_control;
 }
@@ -227,6 +231,20 @@ bthread_t bthread_self(void) {
     return INVALID_BTHREAD;
 }
 
+int bthread_self_stat(int64_t* cputime_ns, int64_t* rq_wait_ns) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g == NULL || g->is_current_main_task()) {
+        return -1;
+    }
+    if (cputime_ns) {
+        *cputime_ns = g->current_cputime_ns();
+    }
+    if (rq_wait_ns) {
+        *rq_wait_ns = g->current_task()->stat.rq_wait_ns;
+    }
+    return 0;
+}
+
 int bthread_equal(bthread_t t1, bthread_t t2) {
     return t1 == t2;
 }
@@ -352,7 +370,7 @@ int bthread_timer_del(bthread_timer_t id) {
     return EINVAL;
 }
 
-int bthread_usleep(uint64_t microseconds) {
+static int bthread_usleep_impl(uint64_t microseconds) {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (NULL != g && !g->is_current_pthread_task()) {
         return bthread::TaskGroup::usleep(&g, microseconds);
@@ -360,6 +378,19 @@ int bthread_usleep(uint64_t microseconds) {
     return ::usleep(microseconds);
 }
 
+int bthread_usleep(uint64_t microseconds) {
+    const size_t sampling_range = bthread::blocking_sampling_range();
+    if (!sampling_range) {
+        return bthread_usleep_impl(microseconds);
+    }
+    const int64_t begin_ns = butil::cpuwide_time_ns();
+    const int rc = bthread_usleep_impl(microseconds);
+    const int saved_errno = errno;
+    bthread::submit_blocking(sampling_range, begin_ns, butil::cpuwide_time_ns());
+    errno = saved_errno;
+    return rc;
+}
+
 int bthread_yield(void) {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (NULL != g && !g->is_current_pthread_task()) {
@@ -164,6 +164,10 @@ int wait_pthread(ButexPthreadWaiter& pw, timespec* ptimeout) {
 
 extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
 
+// Defined in mutex.cpp
+size_t blocking_sampling_range();
+void submit_blocking(size_t sampling_range, int64_t begin_ns, int64_t end_ns);
+
 // Returns 0 when no need to unschedule or successfully unscheduled,
 // -1 otherwise.
 inline int unsleep_if_necessary(ButexBthreadWaiter* w,
@@ -604,7 +608,8 @@ static int butex_wait_from_pthread(TaskGroup* g, Butex* b, int expected_value,
     return rc;
 }
 
-int butex_wait(void* arg, int expected_value, const timespec* abstime) {
+static int butex_wait_impl(void* arg, int expected_value,
+                           const timespec* abstime) {
     Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
     if (b->value.load(butil::memory_order_relaxed) != expected_value) {
         errno = EWOULDBLOCK;
@@ -689,6 +694,22 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     return 0;
 }
 
+int butex_wait(void* arg, int expected_value, const timespec* abstime) {
+    const size_t sampling_range = blocking_sampling_range();
+    if (!sampling_range) {
+        return butex_wait_impl(arg, expected_value, abstime);
+    }
+    const int64_t begin_ns = butil::cpuwide_time_ns();
+    const int rc = butex_wait_impl(arg, expected_value, abstime);
+    // Unmatched values return immediately without blocking at most of time.
+    if (rc == 0 || errno != EWOULDBLOCK) {
+        const int saved_errno = errno;
+        submit_blocking(sampling_range, begin_ns, butil::cpuwide_time_ns());
+        errno = saved_errno;
+    }
+    return rc;
+}
+
 }  // namespace bthread
 
 namespace butil {
@@ -351,6 +351,84 @@ void ContentionProfilerStop() {
     LOG(ERROR) << "Contention profiler is not started!";
 }
 
+// For controlling blocking events collected per second.
+static bvar::CollectorSpeedLimit g_bp_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
+
+// Time that bthreads (or pthreads calling bthread functions) spend blocking
+// in butex_wait() or bthread_usleep(). Samples are written in the same
+// format as contentions, with the blocking function and submit_blocking()
+// skipped from the stack.
+struct SampledBlocking : public SampledContention {
+    // Implement bvar::Collected
+    void dump_and_destroy(size_t round);
+    void destroy();
+    bvar::CollectorSpeedLimit* speed_limit() { return &g_bp_sl; }
+};
+
+BAIDU_CASSERT(sizeof(SampledBlocking) == sizeof(SampledContention),
+              share_layout_with_contention);
+
+// If blocking profiler is on, this variable will be set with a valid
+// instance. NULL otherwise.
+static ContentionProfiler* BAIDU_CACHELINE_ALIGNMENT g_bp = NULL;
+// Protecting accesss to g_bp.
+static pthread_mutex_t g_bp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void SampledBlocking::dump_and_destroy(size_t /*round*/) {
+    if (g_bp) {
+        BAIDU_SCOPED_LOCK(g_bp_mutex);
+        if (g_bp) {
+            g_bp->dump_and_destroy(this);
+            return;
+        }
+    }
+    destroy();
+}
+
+void SampledBlocking::destroy() {
+    butil::return_object(this);
+}
+
+// Start profiling blocking.
+bool BlockingProfilerStart(const char* filename) {
+    if (filename == NULL) {
+        LOG(ERROR) << "Parameter [filename] is NULL";
+        return false;
+    }
+    if (g_bp) {
+        return false;
+    }
+    static bvar::DisplaySamplingRatio g_sampling_ratio_var(
+        "blocking_profiler_sampling_ratio", &g_bp_sl);
+
+    std::unique_ptr<ContentionProfiler> ctx(new ContentionProfiler(filename));
+    {
+        BAIDU_SCOPED_LOCK(g_bp_mutex);
+        if (g_bp) {
+            return false;
+        }
+        g_bp = ctx.release();
+    }
+    return true;
+}
+
+// Stop blocking profiler.
+void BlockingProfilerStop() {
+    ContentionProfiler* ctx = NULL;
+    if (g_bp) {
+        std::unique_lock<pthread_mutex_t> mu(g_bp_mutex);
+        if (g_bp) {
+            ctx = g_bp;
+            g_bp = NULL;
+            mu.unlock();
+            ctx->init_if_needed();
+            delete ctx;
+            return;
+        }
+    }
+    LOG(ERROR) << "Blocking profiler is not started!";
+}
+
 BUTIL_FORCE_INLINE bool
 is_contention_site_valid(const bthread_contention_site_t& cs) {
     return cs.sampling_range;
@@ -514,6 +592,26 @@ void submit_contention(const bthread_contention_site_t& csite, int64_t now_ns) {
     tls_inside_lock = false;
 }
 
+size_t blocking_sampling_range() {
+    if (!g_bp) {
+        return 0;
+    }
+    return bvar::is_collectable(&g_bp_sl);
+}
+
+void submit_blocking(size_t sampling_range, int64_t begin_ns, int64_t end_ns) {
+    // Locking inside is not sampled by the contention profiler.
+    tls_inside_lock = true;
+    SampledBlocking* sb = butil::get_object<SampledBlocking>();
+    // Normalized as in submit_contention().
+    sb->duration_ns = (end_ns - begin_ns) * bvar::COLLECTOR_SAMPLING_BASE
+        / sampling_range;
+    sb->count = bvar::COLLECTOR_SAMPLING_BASE / (double)sampling_range;
+    sb->nframes = backtrace(sb->stack, arraysize(sb->stack));
+    sb->submit(end_ns / 1000);
+    tls_inside_lock = false;
+}
+
 BUTIL_FORCE_INLINE int pthread_mutex_lock_impl(pthread_mutex_t* mutex) {
     // Don't change behavior of lock when profiler is off.
     if (!g_cp ||
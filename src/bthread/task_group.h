@@ -137,6 +137,12 @@ public:
     // Uptime of current task in nanoseconds.
     int64_t current_uptime_ns() const
     { return butil::cpuwide_time_ns() - _cur_meta->cpuwide_start_ns; }
+    // Time of current task running on cpu in nanoseconds, including the
+    // running slice which is not counted in stat.cputime_ns yet.
+    int64_t current_cputime_ns() const {
+        return _cur_meta->stat.cputime_ns +
+            (butil::cpuwide_time_ns() - _last_run_ns);
+    }
 
     // True iff current task is the one running run_main_task()
     bool is_current_main_task() const { return current_tid() == _main_tid; }
@@ -179,6 +185,9 @@ public:
     // process make go on indefinitely.
     void push_rq(bthread_t tid);
 
+    // Remember when the task becomes ready to run, see TaskStatistics.
+    static void mark_ready(bthread_t tid);
+
 private:
 friend class TaskControl;
 
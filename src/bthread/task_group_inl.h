@@ -75,7 +75,15 @@ inline void TaskGroup::sched_to(TaskGroup** pg, bthread_t next_tid) {
     sched_to(pg, next_meta);
 }
 
+inline void TaskGroup::mark_ready(bthread_t tid) {
+    TaskMeta* m = address_meta(tid);
+    if (m != NULL) {
+        m->ready_ns = butil::cpuwide_time_ns();
+    }
+}
+
 inline void TaskGroup::push_rq(bthread_t tid) {
+    mark_ready(tid);
     while (!_rq.push(tid)) {
         // Created too many bthreads: a promising approach is to insert the
         // task into another TaskGroup, but we don't use it because:
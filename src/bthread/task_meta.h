@@ -30,6 +30,8 @@ namespace bthread {
 struct TaskStatistics {
     int64_t cputime_ns;
     int64_t nswitch;
+    // Time spent in run queues after being ready to run.
+    int64_t rq_wait_ns;
 };
 
 class KeyTable;
@@ -39,9 +41,11 @@ struct LocalStorage {
     KeyTable* keytable;
     void* assigned_data;
     void* rpcz_parent_span;
+    // Attached to samples of the continuous profiler in brpc.
+    const char* profiling_tag;
 };
 
-#define BTHREAD_LOCAL_STORAGE_INITIALIZER { NULL, NULL, NULL }
+#define BTHREAD_LOCAL_STORAGE_INITIALIZER { NULL, NULL, NULL, NULL }
 
 const static LocalStorage LOCAL_STORAGE_INIT = BTHREAD_LOCAL_STORAGE_INITIALIZER;
 
@@ -82,6 +86,8 @@ struct TaskMeta {
     // Statistics
     int64_t cpuwide_start_ns;
     TaskStatistics stat;
+    // When the task was pushed into a run queue, 0 if it's not in any.
+    int64_t ready_ns;
 
     // bthread local storage, sync with tls_bls (defined in task_group.cpp)
     // when the bthread is created or destroyed.
@@ -94,6 +94,11 @@ extern int bthread_key_create2(bthread_key_t* key,
                                void (*destructor)(void* data, const void* dtor_arg),
                                const void* dtor_arg);
 
+// Get nanoseconds that the calling bthread spent on cpu and in run queues
+// after being ready to run, since it was created. Either pointer can be NULL.
+// Returns 0 on success, -1 when the caller is not a bthread.
+extern int bthread_self_stat(int64_t* cputime_ns, int64_t* rq_wait_ns);
+
 // CAUTION: functions marked with [PRC INTERNAL] are NOT supposed to be called
 // by RPC users.
 
@@ -0,0 +1,9 @@
+#ifndef  BUTIL_CONFIG_H
+#define  BUTIL_CONFIG_H
+
+#ifdef BRPC_WITH_GLOG
+#undef BRPC_WITH_GLOG
+#endif
+/* #undef BRPC_WITH_GLOG */
+
+#endif  // BUTIL_CONFIG_H
@@ -20,6 +20,7 @@
 
 #include <vector>                                       // std::vector
 #include <pthread.h>
+#include <sched.h>                                      // sched_yield
 #include "butil/scoped_lock.h"
 #include "butil/thread_local.h"
 #include "butil/logging.h"
@@ -46,6 +47,15 @@ namespace butil {
 // foreground and background, lock thread-local mutexes one by one to make
 // sure all existing Read() finish and later Read() see new foreground,
 // then modify background(foreground before flip) again.
+//
+// With set_wait_free_read(true), Read() does not lock any mutex: it
+// publishes a global epoch into a thread-local slot with a full fence and
+// clears the slot when the ScopedPtr is destructed. Modify() flips the
+// instances, increases the epoch and spins until slots of all threads are
+// either cleared or newer than the flip. Readers never wait and Modify()
+// does not contend with readers on their mutexes, which scales better
+// with many threads and frequent modifications.
+// Reads in one thread must not be nested in either mode.
 
 class Void { };
 
@@ -99,6 +109,12 @@ public:
     size_t ModifyWithForeground(Fn& fn, const Arg1&);
     template <typename Fn, typename Arg1, typename Arg2>
     size_t ModifyWithForeground(Fn& fn, const Arg1&, const Arg2&);
+
+    // Make Read() wait-free by epoch-based synchronization as described
+    // above. Must be called before any Read().
+    // Returns 0 on success, -1 otherwise.
+    int set_wait_free_read(bool wait_free);
+    bool wait_free_read() const { return _wait_free_read; }
     
 private:
     template <typename Fn>
@@ -170,6 +186,12 @@ private:
     // Index of foreground instance.
     butil::atomic<int> _index;
 
+    // Read() without locking thread-local mutexes.
+    bool _wait_free_read;
+
+    // Increased after each flip when _wait_free_read is true.
+    butil::atomic<uint64_t> _epoch;
+
     // Key to access thread-local wrappers.
     bool _created_key;
     pthread_key_t _wrapper_key;
@@ -204,7 +226,8 @@ class DoublyBufferedData<T, TLS>::Wrapper
     : public DoublyBufferedDataWrapperBase<T, TLS> {
 friend class DoublyBufferedData;
 public:
-    explicit Wrapper(DoublyBufferedData* c) : _control(c) {
+    explicit Wrapper(DoublyBufferedData* c)
+        : _control(c), _wait_free(c->_wait_free_read), _epoch(0) {
         pthread_mutex_init(&_mutex, NULL);
     }
     
@@ -219,11 +242,35 @@ public:
     // Most of the time, no modifications are done, so the mutex is
     // uncontended and fast.
     inline void BeginRead() {
-        pthread_mutex_lock(&_mutex);
+        if (_wait_free) {
+            _epoch.store(_control->_epoch.load(butil::memory_order_relaxed),
+                         butil::memory_order_relaxed);
+            // Either Modify() sees the epoch and waits, or this reader sees
+            // the index flipped before the epoch was increased.
+            butil::atomic_thread_fence(butil::memory_order_seq_cst);
+        } else {
+            pthread_mutex_lock(&_mutex);
+        }
     }
 
     inline void EndRead() {
-        pthread_mutex_unlock(&_mutex);
+        if (_wait_free) {
+            _epoch.store(0, butil::memory_order_release);
+        } else {
+            pthread_mutex_unlock(&_mutex);
+        }
+    }
+
+    // Wait until the read began before the flip (whose epoch is less than
+    // `epoch') is done, only used when _wait_free is true.
+    inline void WaitReadDone(uint64_t epoch) {
+        while (true) {
+            const uint64_t e = _epoch.load(butil::memory_order_acquire);
+            if (e == 0 || e >= epoch) {
+                return;
+            }
+            sched_yield();
+        }
     }
 
     inline void WaitReadDone() {
@@ -232,7 +279,10 @@ public:
     
 private:
     DoublyBufferedData* _control;
+    const bool _wait_free;
     pthread_mutex_t _mutex;
+    // Epoch when current read began, 0 when not reading.
+    butil::atomic<uint64_t> _epoch;
 };
 
 // Called when thread initializes thread-local wrapper.
@@ -272,6 +322,8 @@ void DoublyBufferedData<T, TLS>::RemoveWrapper(
 template <typename T, typename TLS>
 DoublyBufferedData<T, TLS>::DoublyBufferedData()
     : _index(0)
+    , _wait_free_read(false)
+    , _epoch(1)
     , _created_key(false)
     , _wrapper_key(0) {
     _wrappers.reserve(64);
@@ -313,6 +365,17 @@ DoublyBufferedData<T, TLS>::~DoublyBufferedData() {
     pthread_mutex_destroy(&_wrappers_mutex);
 }
 
+template <typename T, typename TLS>
+int DoublyBufferedData<T, TLS>::set_wait_free_read(bool wait_free) {
+    BAIDU_SCOPED_LOCK(_wrappers_mutex);
+    if (!_wrappers.empty()) {
+        LOG(ERROR) << "set_wait_free_read() must be called before any Read()";
+        return -1;
+    }
+    _wait_free_read = wait_free;
+    return 0;
+}
+
 template <typename T, typename TLS>
 int DoublyBufferedData<T, TLS>::Read(
     typename DoublyBufferedData<T, TLS>::ScopedPtr* ptr) {
@@ -364,7 +427,15 @@ size_t DoublyBufferedData<T, TLS>::Modify(Fn& fn) {
     
     // Wait until all threads finishes current reading. When they begin next
     // read, they should see updated _index.
-    {
+    if (_wait_free_read) {
+        const uint64_t epoch =
+            _epoch.fetch_add(1, butil::memory_order_seq_cst) + 1;
+        butil::atomic_thread_fence(butil::memory_order_seq_cst);
+        BAIDU_SCOPED_LOCK(_wrappers_mutex);
+        for (size_t i = 0; i < _wrappers.size(); ++i) {
+            _wrappers[i]->WaitReadDone(epoch);
+        }
+    } else {
         BAIDU_SCOPED_LOCK(_wrappers_mutex);
         for (size_t i = 0; i < _wrappers.size(); ++i) {
             _wrappers[i]->WaitReadDone();
@@ -23,7 +23,12 @@
 #include <string.h>                            // strcpy
 #include <stdio.h>                             // snprintf
 #include <stdlib.h>                            // strtol
+#include <stddef.h>                            // offsetof
+#include <ctype.h>                             // isspace
+#include <pthread.h>                           // pthread_mutex_t
+#include <map>
 #include <gflags/gflags.h>
+#include "butil/atomicops.h"                   // butil::atomic
 #include "butil/fd_guard.h"                    // fd_guard
 #include "butil/endpoint.h"                    // ip_t
 #include "butil/logging.h"
@@ -45,6 +50,191 @@ __END_DECLS
 
 namespace butil {
 
+static const char UNIX_PREFIX[] = "unix:";
+static const size_t UNIX_PREFIX_LEN = sizeof(UNIX_PREFIX) - 1;
+
+struct ExtendedEndPoint {
+    // Modified by add_ref_extended_endpoint() and
+    // release_extended_endpoint(), the last reference is only released
+    // with ExtendedEndPointMap::_mutex held.
+    butil::atomic<int> nref;
+    // Following fields are immutable after creation.
+    sockaddr_storage ss;
+    socklen_t size;
+    std::string str;
+};
+
+// Extended addresses referenced by EndPoints, indexed by string forms so
+// that same addresses share one ExtendedEndPoint.
+class ExtendedEndPointMap {
+public:
+    ExtendedEndPointMap() {
+        pthread_mutex_init(&_mutex, NULL);
+    }
+
+    // Returns the address with one more reference.
+    ExtendedEndPoint* find_or_create(const sockaddr_storage& ss,
+                                     socklen_t size, const std::string& str) {
+        pthread_mutex_lock(&_mutex);
+        ExtendedEndPoint*& ext = _map[str];
+        if (ext != NULL) {
+            ext->nref.fetch_add(1, butil::memory_order_relaxed);
+        } else {
+            ext = new ExtendedEndPoint;
+            ext->nref.store(1, butil::memory_order_relaxed);
+            ext->ss = ss;
+            ext->size = size;
+            ext->str = str;
+        }
+        pthread_mutex_unlock(&_mutex);
+        return ext;
+    }
+
+    // Release the last (observed) reference of `ext'.
+    void release(ExtendedEndPoint* ext) {
+        pthread_mutex_lock(&_mutex);
+        // find_or_create() may add references before we locked.
+        if (ext->nref.fetch_sub(1, butil::memory_order_acq_rel) != 1) {
+            pthread_mutex_unlock(&_mutex);
+            return;
+        }
+        _map.erase(ext->str);
+        pthread_mutex_unlock(&_mutex);
+        delete ext;
+    }
+
+    size_t size() {
+        pthread_mutex_lock(&_mutex);
+        const size_t n = _map.size();
+        pthread_mutex_unlock(&_mutex);
+        return n;
+    }
+
+private:
+    pthread_mutex_t _mutex;
+    std::map<std::string, ExtendedEndPoint*> _map;
+};
+
+void add_ref_extended_endpoint(ExtendedEndPoint* ext) {
+    // The caller already holds a reference.
+    ext->nref.fetch_add(1, butil::memory_order_relaxed);
+}
+
+void release_extended_endpoint(ExtendedEndPoint* ext) {
+    // References other than the last one are released without locking.
+    int nref = ext->nref.load(butil::memory_order_relaxed);
+    while (nref > 1) {
+        if (ext->nref.compare_exchange_weak(nref, nref - 1,
+                                            butil::memory_order_release,
+                                            butil::memory_order_relaxed)) {
+            return;
+        }
+    }
+    get_leaky_singleton<ExtendedEndPointMap>()->release(ext);
+}
+
+size_t extended_endpoint_count() {
+    return get_leaky_singleton<ExtendedEndPointMap>()->size();
+}
+
+static int intern_endpoint(const sockaddr_storage& ss, socklen_t size,
+                           const std::string& str, int port,
+                           EndPoint* point) {
+    EndPoint tmp(IP_NONE, port);
+    // Adopt the reference returned.
+    tmp.ext = get_leaky_singleton<ExtendedEndPointMap>()->find_or_create(
+        ss, size, str);
+    *point = tmp;
+    return 0;
+}
+
+static int unix2endpoint(const char* path, EndPoint* point) {
+    sockaddr_storage ss;
+    bzero(&ss, sizeof(ss));
+    sockaddr_un* un = (sockaddr_un*)&ss;
+    const size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(un->sun_path)) {
+        return -1;
+    }
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, path, len);
+    return intern_endpoint(ss, offsetof(sockaddr_un, sun_path) + len + 1,
+                           std::string(UNIX_PREFIX) + path, 0, point);
+}
+
+static int ipv62endpoint(const in6_addr& ip6, int port, EndPoint* point) {
+    sockaddr_storage ss;
+    bzero(&ss, sizeof(ss));
+    sockaddr_in6* in6 = (sockaddr_in6*)&ss;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_addr = ip6;
+    in6->sin6_port = htons(port);
+    char buf[INET6_ADDRSTRLEN + 16];
+    buf[0] = '[';
+    if (inet_ntop(AF_INET6, &ip6, buf + 1, INET6_ADDRSTRLEN) == NULL) {
+        return -1;
+    }
+    const size_t len = strlen(buf);
+    snprintf(buf + len, sizeof(buf) - len, "]:%d", port);
+    return intern_endpoint(ss, sizeof(sockaddr_in6), buf, port, point);
+}
+
+int endpoint2sockaddr(const EndPoint& point, sockaddr_storage* ss,
+                      socklen_t* size) {
+    if (is_extended_endpoint(point)) {
+        *ss = point.ext->ss;
+        *size = point.ext->size;
+        return 0;
+    }
+    bzero(ss, sizeof(*ss));
+    sockaddr_in* in = (sockaddr_in*)ss;
+    in->sin_family = AF_INET;
+    in->sin_addr = point.ip;
+    in->sin_port = htons(point.port);
+    *size = sizeof(sockaddr_in);
+    return 0;
+}
+
+int sockaddr2endpoint(const sockaddr_storage* ss, socklen_t size,
+                      EndPoint* point) {
+    switch (ss->ss_family) {
+    case AF_INET:
+        *point = EndPoint(*(const sockaddr_in*)ss);
+        return 0;
+    case AF_INET6: {
+        const sockaddr_in6* in6 = (const sockaddr_in6*)ss;
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            ip_t ip;
+            memcpy(&ip, in6->sin6_addr.s6_addr + 12, 4);
+            *point = EndPoint(ip, ntohs(in6->sin6_port));
+            return 0;
+        }
+        return ipv62endpoint(in6->sin6_addr, ntohs(in6->sin6_port), point);
+    }
+    case AF_UNIX: {
+        const sockaddr_un* un = (const sockaddr_un*)ss;
+        const size_t offset = offsetof(sockaddr_un, sun_path);
+        std::string path;
+        if (size > offset && un->sun_path[0] != '\0') {
+            path.assign(un->sun_path,
+                        strnlen(un->sun_path, size - offset));
+        }
+        if (path.empty()) {
+            // Unnamed peers of accepted connections.
+            sockaddr_storage tmp;
+            bzero(&tmp, sizeof(tmp));
+            tmp.ss_family = AF_UNIX;
+            return intern_endpoint(tmp, sizeof(sa_family_t),
+                                   UNIX_PREFIX, 0, point);
+        }
+        return unix2endpoint(path.c_str(), point);
+    }
+    default:
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+}
+
 int str2ip(const char* ip_str, ip_t* ip) {
     // ip_str can be NULL when called by EndPoint(0, ...)
     if (ip_str != NULL) {
@@ -98,6 +288,10 @@ int ip2hostname(ip_t ip, std::string* host) {
 
 EndPointStr endpoint2str(const EndPoint& point) {
     EndPointStr str;
+    if (is_extended_endpoint(point)) {
+        snprintf(str._buf, sizeof(str._buf), "%s", point.ext->str.c_str());
+        return str;
+    }
     if (inet_ntop(AF_INET, &point.ip, str._buf, INET_ADDRSTRLEN) == NULL) {
         return endpoint2str(EndPoint(IP_NONE, 0));
     }
@@ -171,6 +365,35 @@ const char* my_hostname() {
 }
 
 int str2endpoint(const char* str, EndPoint* point) {
+    for (; isspace(*str); ++str);
+    if (strncmp(str, UNIX_PREFIX, UNIX_PREFIX_LEN) == 0) {
+        std::string path(str + UNIX_PREFIX_LEN);
+        // Trailing spaces are ignored as well as ip:port below
+        while (!path.empty() && isspace(path[path.size() - 1])) {
+            path.resize(path.size() - 1);
+        }
+        return unix2endpoint(path.c_str(), point);
+    }
+    if (*str == '[') {
+        const char* const end_of_ip = strchr(str, ']');
+        if (end_of_ip == NULL || end_of_ip[1] != ':' ||
+            end_of_ip - str - 1 >= INET6_ADDRSTRLEN) {
+            return -1;
+        }
+        char ipbuf[INET6_ADDRSTRLEN];
+        memcpy(ipbuf, str + 1, end_of_ip - str - 1);
+        ipbuf[end_of_ip - str - 1] = '\0';
+        char* end = NULL;
+        const long port = strtol(end_of_ip + 2, &end, 10);
+        if (end == end_of_ip + 2) {
+            return -1;
+        }
+        for (; isspace(*end); ++end);
+        if (*end || port < 0 || port > 65535) {
+            return -1;
+        }
+        return str2endpoint(ipbuf, (int)port, point);
+    }
     // Should be enough to hold ip address
     char buf[64];
     size_t i = 0;
@@ -181,6 +404,7 @@ int str2endpoint(const char* str, EndPoint* point) {
         return -1;
     }
     buf[i] = '\0';
+    *point = EndPoint();
     if (str2ip(buf, &point->ip) != 0) {
         return -1;
     }
@@ -202,13 +426,21 @@ int str2endpoint(const char* str, EndPoint* point) {
 }
 
 int str2endpoint(const char* ip_str, int port, EndPoint* point) {
-    if (str2ip(ip_str, &point->ip) != 0) {
-        return -1;
-    }
     if (port < 0 || port > 65535) {
         return -1;
     }
-    point->port = port;
+    ip_t ip;
+    if (str2ip(ip_str, &ip) != 0) {
+        in6_addr ip6;
+        if (ip_str == NULL || inet_pton(AF_INET6, ip_str, &ip6) <= 0) {
+            return -1;
+        }
+        if (!IN6_IS_ADDR_V4MAPPED(&ip6)) {
+            return ipv62endpoint(ip6, port, point);
+        }
+        memcpy(&ip, ip6.s6_addr + 12, 4);
+    }
+    *point = EndPoint(ip, port);
     return 0;
 }
 
@@ -224,6 +456,7 @@ int hostname2endpoint(const char* str, EndPoint* point) {
     }
 
     buf[i] = '\0';
+    *point = EndPoint();
     if (hostname2ip(buf, &point->ip) != 0) {
         return -1;
     }
@@ -247,6 +480,7 @@ int hostname2endpoint(const char* str, EndPoint* point) {
 }
 
 int hostname2endpoint(const char* name_str, int port, EndPoint* point) {
+    *point = EndPoint();
     if (hostname2ip(name_str, &point->ip) != 0) {
         return -1;
     }
@@ -278,29 +512,38 @@ int endpoint2hostname(const EndPoint& point, std::string* host) {
 }
 
 int tcp_connect(EndPoint point, int* self_port) {
-    fd_guard sockfd(socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_size = 0;
+    if (endpoint2sockaddr(point, &serv_addr, &serv_addr_size) != 0) {
+        return -1;
+    }
+    fd_guard sockfd(socket(serv_addr.ss_family, SOCK_STREAM, 0));
     if (sockfd < 0) {
         return -1;
     }
-    struct sockaddr_in serv_addr;
-    bzero((char*)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr = point.ip;
-    serv_addr.sin_port = htons(point.port);
     int rc = 0;
     if (bthread_connect != NULL) {
         rc = bthread_connect(sockfd, (struct sockaddr*)&serv_addr,
-                             sizeof(serv_addr));
+                             serv_addr_size);
     } else {
-        rc = ::connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+        rc = ::connect(sockfd, (struct sockaddr*)&serv_addr, serv_addr_size);
     }
     if (rc < 0) {
         return -1;
     }
     if (self_port != NULL) {
-        EndPoint pt;
-        if (get_local_side(sockfd, &pt) == 0) {
-            *self_port = pt.port;
+        struct sockaddr_storage local_addr;
+        socklen_t local_addr_size = sizeof(local_addr);
+        if (getsockname(sockfd, (struct sockaddr*)&local_addr,
+                        &local_addr_size) == 0) {
+            if (local_addr.ss_family == AF_INET) {
+                *self_port = ntohs(((sockaddr_in*)&local_addr)->sin_port);
+            } else if (local_addr.ss_family == AF_INET6) {
+                *self_port = ntohs(((sockaddr_in6*)&local_addr)->sin6_port);
+            } else {
+                // unix domain socket has no port.
+                *self_port = 0;
+            }
         } else {
             CHECK(false) << "Fail to get the local port of sockfd=" << sockfd;
         }
@@ -309,10 +552,20 @@ int tcp_connect(EndPoint point, int* self_port) {
 }
 
 int tcp_listen(EndPoint point) {
-    fd_guard sockfd(socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_size = 0;
+    if (endpoint2sockaddr(point, &serv_addr, &serv_addr_size) != 0) {
+        return -1;
+    }
+    fd_guard sockfd(socket(serv_addr.ss_family, SOCK_STREAM, 0));
     if (sockfd < 0) {
         return -1;
     }
+    if (serv_addr.ss_family == AF_UNIX) {
+        // Same with unix_socket_listen(), remove the file left by previous
+        // process otherwise bind() fails.
+        unlink(((sockaddr_un*)&serv_addr)->sun_path);
+    }
 
     if (FLAGS_reuse_addr) {
 #if defined(SO_REUSEADDR)
@@ -327,7 +580,7 @@ int tcp_listen(EndPoint point) {
 #endif
     }
 
-    if (FLAGS_reuse_port) {
+    if (FLAGS_reuse_port && serv_addr.ss_family != AF_UNIX) {
 #if defined(SO_REUSEPORT)
         const int on = 1;
         if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
@@ -340,12 +593,7 @@ int tcp_listen(EndPoint point) {
 #endif
     }
 
-    struct sockaddr_in serv_addr;
-    bzero((char*)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr = point.ip;
-    serv_addr.sin_port = htons(point.port);
-    if (bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) != 0) {
+    if (bind(sockfd, (struct sockaddr*)&serv_addr, serv_addr_size) != 0) {
         return -1;
     }
     if (listen(sockfd, 65535) != 0) {
@@ -358,27 +606,27 @@ int tcp_listen(EndPoint point) {
 }
 
 int get_local_side(int fd, EndPoint *out) {
-    struct sockaddr addr;
+    struct sockaddr_storage addr;
     socklen_t socklen = sizeof(addr);
-    const int rc = getsockname(fd, &addr, &socklen);
+    const int rc = getsockname(fd, (struct sockaddr*)&addr, &socklen);
     if (rc != 0) {
         return rc;
     }
     if (out) {
-        *out = butil::EndPoint(*(sockaddr_in*)&addr);
+        return sockaddr2endpoint(&addr, socklen, out);
     }
     return 0;
 }
 
 int get_remote_side(int fd, EndPoint *out) {
-    struct sockaddr addr;
+    struct sockaddr_storage addr;
     socklen_t socklen = sizeof(addr);
-    const int rc = getpeername(fd, &addr, &socklen);
+    const int rc = getpeername(fd, (struct sockaddr*)&addr, &socklen);
     if (rc != 0) {
         return rc;
     }
     if (out) {
-        *out = butil::EndPoint(*(sockaddr_in*)&addr);
+        return sockaddr2endpoint(&addr, socklen, out);
     }
     return 0;
 }
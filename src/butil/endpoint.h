@@ -21,7 +21,10 @@
 #define BUTIL_ENDPOINT_H
 
 #include <netinet/in.h>                          // in_addr
+#include <sys/socket.h>                          // sockaddr_storage
+#include <sys/un.h>                              // sockaddr_un
 #include <iostream>                              // std::ostream
+#include <functional>                            // std::less
 #include "butil/containers/hash_tables.h"         // hashing functions
 
 namespace butil {
@@ -77,22 +80,77 @@ ip_t my_ip();
 // String form.
 const char* my_ip_cstr();
 
+// Unix-domain or IPv6 address referenced by EndPoint, see below.
+struct ExtendedEndPoint;
+void add_ref_extended_endpoint(ExtendedEndPoint* ext);
+void release_extended_endpoint(ExtendedEndPoint* ext);
+
 // ipv4 + port
+// Addresses that can't be represented by ipv4 + port, namely unix domain
+// sockets ("unix:/path/to/sock") and IPv6 ("[::1]:8000"), are referenced by
+// `ext' (check is_extended_endpoint()). Same addresses share one reference-
+// counted ExtendedEndPoint which is freed when no EndPoint references it,
+// thus such EndPoints are compared and hashed by the pointer. `ip' is
+// IP_NONE and `port' is the port of IPv6 or 0 for them.
 struct EndPoint {
-    EndPoint() : ip(IP_ANY), port(0) {}
-    EndPoint(ip_t ip2, int port2) : ip(ip2), port(port2) {}
+    EndPoint() : ip(IP_ANY), port(0), ext(NULL) {}
+    EndPoint(ip_t ip2, int port2) : ip(ip2), port(port2), ext(NULL) {}
     explicit EndPoint(const sockaddr_in& in)
-        : ip(in.sin_addr), port(ntohs(in.sin_port)) {}
+        : ip(in.sin_addr), port(ntohs(in.sin_port)), ext(NULL) {}
+    EndPoint(const EndPoint& rhs)
+        : ip(rhs.ip), port(rhs.port), ext(rhs.ext) {
+        if (ext) {
+            add_ref_extended_endpoint(ext);
+        }
+    }
+    ~EndPoint() {
+        if (ext) {
+            release_extended_endpoint(ext);
+        }
+    }
+    EndPoint& operator=(const EndPoint& rhs) {
+        if (rhs.ext) {
+            add_ref_extended_endpoint(rhs.ext);
+        }
+        if (ext) {
+            release_extended_endpoint(ext);
+        }
+        ip = rhs.ip;
+        port = rhs.port;
+        ext = rhs.ext;
+        return *this;
+    }
     
     ip_t ip;
     int port;
+    ExtendedEndPoint* ext;
 };
 
 struct EndPointStr {
     const char* c_str() const { return _buf; }
-    char _buf[INET_ADDRSTRLEN + 16];
+    // Long enough for "unix:" + sun_path.
+    char _buf[sizeof(((sockaddr_un*)0)->sun_path) + 8];
 };
 
+// True if `point' references an unix-domain or IPv6 address.
+inline bool is_extended_endpoint(const EndPoint& point) {
+    return point.ext != NULL;
+}
+
+// Convert `point' to sockaddr which can be passed to connect/bind directly.
+// Returns 0 on success, -1 otherwise.
+int endpoint2sockaddr(const EndPoint& point, sockaddr_storage* ss,
+                      socklen_t* size);
+
+// Convert sockaddr of AF_INET, AF_INET6 or AF_UNIX to EndPoint. IPv4-mapped
+// IPv6 addresses are converted to plain ipv4 EndPoints.
+// Returns 0 on success, -1 otherwise.
+int sockaddr2endpoint(const sockaddr_storage* ss, socklen_t size,
+                      EndPoint* point);
+
+// Number of distinct unix-domain and IPv6 addresses referenced by EndPoints.
+size_t extended_endpoint_count();
+
 // Convert EndPoint to c-style string. Notice that you can serialize 
 // EndPoint to std::ostream directly. Use this function when you don't 
 // have streaming log.
@@ -100,6 +158,7 @@ struct EndPointStr {
 EndPointStr endpoint2str(const EndPoint&);
 
 // Convert string `ip_and_port_str' to a EndPoint *point.
+// Besides "ip:port", "unix:<path>" and "[ipv6]:port" are accepted as well.
 // Returns 0 on success, -1 otherwise.
 int str2endpoint(const char* ip_and_port_str, EndPoint* point);
 int str2endpoint(const char* ip_str, int port, EndPoint* point);
@@ -114,12 +173,15 @@ int hostname2endpoint(const char* name_str, int port, EndPoint* point);
 int endpoint2hostname(const EndPoint& point, char* hostname, size_t hostname_len);
 int endpoint2hostname(const EndPoint& point, std::string* host);
 
-// Create a TCP socket and connect it to `server'. Write port of this side
-// into `self_port' if it's not NULL.
+// Create a TCP (or unix domain if `server' is "unix:<path>") socket and
+// connect it to `server'. Write port of this side into `self_port' if it's
+// not NULL.
 // Returns the socket descriptor, -1 otherwise and errno is set.
 int tcp_connect(EndPoint server, int* self_port);
 
-// Create and listen to a TCP socket bound with `ip_and_port'.
+// Create and listen to a TCP socket bound with `ip_and_port'. If
+// `ip_and_port' is "unix:<path>", an unix domain socket is created after
+// removing previous file at <path>.
 // To enable SO_REUSEADDR for the whole program, enable gflag -reuse_addr
 // To enable SO_REUSEPORT for the whole program, enable gflag -reuse_port
 // Returns the socket descriptor, -1 otherwise and errno is set.
@@ -163,26 +225,35 @@ inline std::ostream& operator<<(std::ostream& os, butil::ip_t ip) {
 
 namespace butil {
 // Overload operators for EndPoint in the same namespace due to ADL.
-inline bool operator<(EndPoint p1, EndPoint p2) {
-    return (p1.ip != p2.ip) ? (p1.ip < p2.ip) : (p1.port < p2.port);
+inline bool operator<(const EndPoint& p1, const EndPoint& p2) {
+    if (p1.ip != p2.ip) {
+        return p1.ip < p2.ip;
+    }
+    if (p1.port != p2.port) {
+        return p1.port < p2.port;
+    }
+    return std::less<ExtendedEndPoint*>()(p1.ext, p2.ext);
 }
-inline bool operator>(EndPoint p1, EndPoint p2) {
+inline bool operator>(const EndPoint& p1, const EndPoint& p2) {
     return p2 < p1;
 }
-inline bool operator<=(EndPoint p1, EndPoint p2) { 
+inline bool operator<=(const EndPoint& p1, const EndPoint& p2) { 
     return !(p2 < p1); 
 }
-inline bool operator>=(EndPoint p1, EndPoint p2) { 
+inline bool operator>=(const EndPoint& p1, const EndPoint& p2) { 
     return !(p1 < p2); 
 }
-inline bool operator==(EndPoint p1, EndPoint p2) {
-    return p1.ip == p2.ip && p1.port == p2.port;
+inline bool operator==(const EndPoint& p1, const EndPoint& p2) {
+    return p1.ip == p2.ip && p1.port == p2.port && p1.ext == p2.ext;
 }
-inline bool operator!=(EndPoint p1, EndPoint p2) {
+inline bool operator!=(const EndPoint& p1, const EndPoint& p2) {
     return !(p1 == p2);
 }
 
 inline std::ostream& operator<<(std::ostream& os, const EndPoint& ep) {
+    if (is_extended_endpoint(ep)) {
+        return os << endpoint2str(ep).c_str();
+    }
     return os << ep.ip << ':' << ep.port;
 }
 inline std::ostream& operator<<(std::ostream& os, const EndPointStr& ep_str) {
@@ -200,14 +271,16 @@ namespace BUTIL_HASH_NAMESPACE {
 #if defined(COMPILER_MSVC)
 
 inline std::size_t hash_value(const butil::EndPoint& ep) {
-    return butil::HashPair(butil::ip2int(ep.ip), ep.port);
+    return butil::HashPair(butil::ip2int(ep.ip), ep.port) +
+        reinterpret_cast<uintptr_t>(ep.ext);
 }
 
 #elif defined(COMPILER_GCC)
 template <>
 struct hash<butil::EndPoint> {
     std::size_t operator()(const butil::EndPoint& ep) const {
-        return butil::HashPair(butil::ip2int(ep.ip), ep.port);
+        return butil::HashPair(butil::ip2int(ep.ip), ep.port) +
+            reinterpret_cast<uintptr_t>(ep.ext);
     }
 };
 
@@ -23,6 +23,7 @@
 #include "bvar/status.h"
 #include "bvar/passive_status.h"
 #include "bvar/latency_recorder.h"
+#include "bvar/multi_dimension.h"
 #include "bvar/gflag.h"
 #include "bvar/scoped_timer.h"
 
@@ -0,0 +1,101 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <math.h>                       // ceil
+#include "butil/logging.h"
+#include "bvar/detail/histogram.h"
+
+namespace bvar {
+namespace detail {
+
+int64_t HistogramSamples::get_number(double ratio) const {
+    if (num == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(num * ratio);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t accumulated = 0;
+    for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        accumulated += counts[i];
+        if (accumulated >= rank) {
+            return histogram_bucket_middle(i);
+        }
+    }
+    return histogram_bucket_middle(HISTOGRAM_NUM_BUCKETS - 1);
+}
+
+void HistogramSamples::describe(std::ostream& os) const {
+    os << "{\"sum\":" << sum << ",\"count\":" << num << ",\"buckets\":[";
+    uint64_t accumulated = 0;
+    bool first = true;
+    for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        if (counts[i] == 0) {
+            continue;
+        }
+        accumulated += counts[i];
+        if (!first) {
+            os << ',';
+        }
+        first = false;
+        os << '[' << histogram_bucket_upper_bound(i) - 1 << ','
+           << accumulated << ']';
+    }
+    os << "]}";
+}
+
+class AddToHistogram {
+public:
+    explicit AddToHistogram(int64_t value) : _value(value) {}
+
+    void operator()(GlobalValue<Histogram::combiner_type>&,
+                    HistogramSamples& local_value) const {
+        local_value.add(_value);
+    }
+private:
+    int64_t _value;
+};
+
+Histogram::Histogram() : _combiner(NULL), _sampler(NULL) {
+    _combiner = new combiner_type;
+}
+
+Histogram::~Histogram() {
+    // Have to destroy sampler first to avoid the race between destruction and
+    // sampler
+    if (_sampler != NULL) {
+        _sampler->destroy();
+        _sampler = NULL;
+    }
+    delete _combiner;
+}
+
+Histogram& Histogram::operator<<(int64_t value) {
+    agent_type* agent = _combiner->get_or_create_tls_agent();
+    if (BAIDU_UNLIKELY(!agent)) {
+        LOG(FATAL) << "Fail to create agent";
+        return *this;
+    }
+    if (value < 0) {
+        LOG(WARNING) << "Input=" << value << " to Histogram("
+                     << (void*)this << ") is negative, drop";
+        return *this;
+    }
+    agent->merge_global(AddToHistogram(value));
+    return *this;
+}
+
+}  // namespace detail
+}  // namespace bvar
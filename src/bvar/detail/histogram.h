@@ -0,0 +1,179 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BVAR_DETAIL_HISTOGRAM_H
+#define  BVAR_DETAIL_HISTOGRAM_H
+
+#include <stdint.h>                     // int64_t
+#include <ostream>                      // std::ostream
+#include "butil/macros.h"
+#include "bvar/window.h"                // Window
+#include "bvar/detail/combiner.h"       // AgentCombiner
+#include "bvar/detail/sampler.h"        // ReducerSampler
+
+namespace bvar {
+namespace detail {
+
+// Counts of non-negative values in log-scaled buckets: every power of 2 is
+// divided into HISTOGRAM_SUB_BUCKETS linear sub-buckets, thus a bucket is
+// at most 1/HISTOGRAM_SUB_BUCKETS of values inside, which bounds relative
+// errors of percentiles regardless of the distribution and the number of
+// values. Unlike PercentileSamples, histograms are merged exactly by adding
+// counts, and histograms from different processes are mergeable as well
+// since the buckets are fixed.
+const int HISTOGRAM_SUB_BUCKET_BITS = 4;
+const int HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+// Values not less than 2^(HISTOGRAM_MAX_BITS) are counted in the last bucket.
+const int HISTOGRAM_MAX_BITS = 37;
+const size_t HISTOGRAM_NUM_BUCKETS =
+    (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS;
+
+// Index of the bucket containing `value'.
+inline size_t histogram_bucket_index(int64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value < 0 ? 0 : (size_t)value;
+    }
+    const int msb = 63 - __builtin_clzll(value);
+    if (msb >= HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_NUM_BUCKETS - 1;
+    }
+    const int shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+        ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Smallest value of the next bucket, namely values in the bucket are
+// less than this.
+inline int64_t histogram_bucket_upper_bound(size_t index) {
+    const int64_t shift = (int64_t)(index / HISTOGRAM_SUB_BUCKETS) - 1;
+    if (shift < 0) {
+        return index + 1;
+    }
+    return (int64_t)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS + 1)
+        << shift;
+}
+
+// Value representing the bucket in percentiles, which is the middle of
+// values inside.
+inline int64_t histogram_bucket_middle(size_t index) {
+    const int64_t shift = (int64_t)(index / HISTOGRAM_SUB_BUCKETS) - 1;
+    if (shift < 0) {
+        return index;
+    }
+    const int64_t lower =
+        (int64_t)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+    return lower + (((int64_t)1 << shift) >> 1);
+}
+
+struct HistogramSamples {
+    HistogramSamples() : counts(), num(0), sum(0) {}
+
+    void add(int64_t value) {
+        ++counts[histogram_bucket_index(value)];
+        ++num;
+        sum += value;
+    }
+
+    void merge(const HistogramSamples& rhs) {
+        for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+            counts[i] += rhs.counts[i];
+        }
+        num += rhs.num;
+        sum += rhs.sum;
+    }
+
+    void subtract(const HistogramSamples& rhs) {
+        for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+            counts[i] -= rhs.counts[i];
+        }
+        num -= rhs.num;
+        sum -= rhs.sum;
+    }
+
+    // Get the `ratio'-ile value, e.g. 0.99 means 99%-ile.
+    int64_t get_number(double ratio) const;
+
+    // Print non-empty buckets as
+    //   {"sum":S,"count":N,"buckets":[[max1,cumulative_count1],...]}
+    // where max is the largest value in the bucket. Same as Prometheus
+    // histograms, cumulative_count is number of values not greater than max.
+    void describe(std::ostream& os) const;
+
+    uint64_t counts[HISTOGRAM_NUM_BUCKETS];
+    uint64_t num;
+    int64_t sum;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const HistogramSamples& s) {
+    s.describe(os);
+    return os;
+}
+
+// A reducer-alike variable counting values into HistogramSamples. Counts
+// are accumulated from creation, windows over it diff the samples.
+class Histogram {
+public:
+    struct AddHistogramSamples {
+        void operator()(HistogramSamples& s1, const HistogramSamples& s2) const {
+            s1.merge(s2);
+        }
+    };
+    struct MinusHistogramSamples {
+        void operator()(HistogramSamples& s1, const HistogramSamples& s2) const {
+            s1.subtract(s2);
+        }
+    };
+
+    typedef HistogramSamples                                value_type;
+    typedef ReducerSampler<Histogram, HistogramSamples,
+                           AddHistogramSamples,
+                           MinusHistogramSamples>           sampler_type;
+    typedef AgentCombiner<HistogramSamples, HistogramSamples,
+                          AddHistogramSamples>              combiner_type;
+    typedef combiner_type::Agent                            agent_type;
+
+    Histogram();
+    ~Histogram();
+
+    AddHistogramSamples op() const { return AddHistogramSamples(); }
+    MinusHistogramSamples inv_op() const { return MinusHistogramSamples(); }
+
+    // The sampler for windows over histogram.
+    sampler_type* get_sampler() {
+        if (NULL == _sampler) {
+            _sampler = new sampler_type(this);
+            _sampler->schedule();
+        }
+        return _sampler;
+    }
+
+    value_type reset() { return _combiner->reset_all_agents(); }
+
+    value_type get_value() const { return _combiner->combine_agents(); }
+
+    Histogram& operator<<(int64_t value);
+
+    bool valid() const { return _combiner != NULL && _combiner->valid(); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Histogram);
+
+    combiner_type*          _combiner;
+    sampler_type*           _sampler;
+};
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  //BVAR_DETAIL_HISTOGRAM_H
@@ -18,7 +18,7 @@
 #ifndef  BVAR_DETAIL_PERCENTILE_H
 #define  BVAR_DETAIL_PERCENTILE_H
 
-#include <string.h>                     // memset memcmp
+#include <string.h>                     // memcmp
 #include <stdint.h>                     // uint32_t
 #include <limits>                       // std::numeric_limits
 #include <ostream>                      // std::ostream
@@ -241,9 +241,7 @@ friend class AddLatency;
 
     static const size_t SAMPLE_SIZE = SAMPLE_SIZE_IN;
     
-    PercentileSamples() {
-        memset(this, 0, sizeof(*this));
-    }
+    PercentileSamples() : _num_added(0), _intervals() {}
 
     ~PercentileSamples() {
         for (size_t i = 0; i < NUM_INTERVALS; ++i) {
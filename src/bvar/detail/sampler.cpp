@@ -15,6 +15,8 @@
 // Author: Ge,Jun (gejun@baidu.com)
 // Date: Tue Jul 28 18:14:40 CST 2015
 
+#include <pthread.h>
+#include <gflags/gflags.h>
 #include "butil/time.h"
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "bvar/reducer.h"
@@ -23,6 +25,28 @@
 #include "bvar/window.h"
 
 namespace bvar {
+
+DEFINE_int32(bvar_sampler_thread_num, 4,
+             "Max number of threads taking samples for Window/PerSecond,"
+             " more threads are used when a round of sampling takes longer"
+             " than -bvar_sampler_round_budget_ms");
+DEFINE_int32(bvar_sampler_round_budget_ms, 100,
+             "Expected max time of one round of sampling, which is done"
+             " every second");
+
+static bool validate_bvar_sampler_thread_num(const char*, int32_t v) {
+    return v >= 1 && v <= 64;
+}
+static bool validate_bvar_sampler_round_budget_ms(const char*, int32_t v) {
+    return v > 0 && v < 1000;
+}
+const bool ALLOW_UNUSED dummy_bvar_sampler_thread_num =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_sampler_thread_num,
+                                       validate_bvar_sampler_thread_num);
+const bool ALLOW_UNUSED dummy_bvar_sampler_round_budget_ms =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_sampler_round_budget_ms,
+                                       validate_bvar_sampler_round_budget_ms);
+
 namespace detail {
 
 const int WARN_NOSLEEP_THRESHOLD = 2;
@@ -52,9 +76,26 @@ struct CombineSampler {
 // list of Samplers. Waking through the list and call take_sample().
 // If a Sampler needs to be deleted, we just mark it as unused and the
 // deletion is taken place in the thread as well.
+// When a round of sampling takes longer than -bvar_sampler_round_budget_ms,
+// samplers are spread over more shards (up to -bvar_sampler_thread_num)
+// which are sampled by helper threads in parallel, so that samples are
+// taken at roughly the same time in each second.
 class SamplerCollector : public bvar::Reducer<Sampler*, CombineSampler> {
 public:
-    SamplerCollector() : _created(false), _stop(false), _cumulated_time_us(0) {
+    SamplerCollector()
+        : _created(false)
+        , _stop(false)
+        , _cumulated_time_us(0)
+        , _round_time_us(0)
+        , _lag_us(0)
+        , _nsampler(0)
+        , _nthread(1)
+        , _round(0)
+        , _npending(0) {
+        pthread_mutex_init(&_mutex, NULL);
+        pthread_cond_init(&_start_cond, NULL);
+        pthread_cond_init(&_done_cond, NULL);
+        _shards.push_back(new Shard);
         int rc = pthread_create(&_tid, NULL, sampling_thread, this);
         if (rc != 0) {
             LOG(FATAL) << "Fail to create sampling_thread, " << berror(rc);
@@ -68,64 +109,232 @@ public:
             pthread_join(_tid, NULL);
             _created = false;
         }
+        for (size_t i = 0; i < _shards.size(); ++i) {
+            delete _shards[i];
+        }
+        pthread_cond_destroy(&_done_cond);
+        pthread_cond_destroy(&_start_cond);
+        pthread_mutex_destroy(&_mutex);
     }
 
     static double get_cumulated_time(void* arg) {
         return ((SamplerCollector*)arg)->_cumulated_time_us / 1000.0 / 1000.0;
     }
+    static int64_t get_round_time_us(void* arg) {
+        return ((SamplerCollector*)arg)->_round_time_us;
+    }
+    static int64_t get_lag_us(void* arg) {
+        return ((SamplerCollector*)arg)->_lag_us;
+    }
+    static int64_t get_sampler_count(void* arg) {
+        return ((SamplerCollector*)arg)->_nsampler;
+    }
+    static int get_thread_num(void* arg) {
+        return ((SamplerCollector*)arg)->_nthread;
+    }
     
 private:
+    // Samplers sampled by one thread.
+    struct Shard {
+        Shard() : nsampler(0), round(0), collector(NULL) {}
+        butil::LinkNode<Sampler> root;
+        int64_t nsampler;
+        // The round that this shard was sampled last time.
+        int64_t round;
+        SamplerCollector* collector;
+        pthread_t tid;
+    };
+
     void run();
+    void run_shard(Shard* shard);
+    // Sample all samplers in the shard and delete unused ones.
+    static void sample_shard(Shard* shard);
+    // Put samplers in `list' into shards with fewest samplers.
+    void distribute(butil::LinkNode<Sampler>* list);
+    // Create one more shard and rebalance samplers among shards.
+    void add_shard();
+    void stop_shards();
     
     static void* sampling_thread(void* arg) {
         ((SamplerCollector*)arg)->run();
         return NULL;
     }
+    static void* shard_sampling_thread(void* arg) {
+        Shard* shard = (Shard*)arg;
+        shard->collector->run_shard(shard);
+        return NULL;
+    }
 
 private:
     bool _created;
     bool _stop;
     int64_t _cumulated_time_us;
+    // Time spent by the last round of sampling.
+    int64_t _round_time_us;
+    // Delay of the last round to its expected start time.
+    int64_t _lag_us;
+    int64_t _nsampler;
+    int _nthread;
     pthread_t _tid;
+
+    // Modified by the sampling thread only when helper threads are idle.
+    std::vector<Shard*> _shards;
+    // Sync the sampling thread and helper threads.
+    pthread_mutex_t _mutex;
+    pthread_cond_t _start_cond;
+    pthread_cond_t _done_cond;
+    int64_t _round;
+    int _npending;
 };
 
+void SamplerCollector::sample_shard(Shard* shard) {
+    butil::LinkNode<Sampler>* const root = &shard->root;
+    for (butil::LinkNode<Sampler>* p = root->next(); p != root;) {
+        // We may remove p from the list, save next first.
+        butil::LinkNode<Sampler>* saved_next = p->next();
+        Sampler* s = p->value();
+        s->_mutex.lock();
+        if (!s->_used) {
+            s->_mutex.unlock();
+            p->RemoveFromList();
+            delete s;
+            --shard->nsampler;
+        } else {
+            s->take_sample();
+            s->_mutex.unlock();
+        }
+        p = saved_next;
+    }
+}
+
+void SamplerCollector::distribute(butil::LinkNode<Sampler>* list) {
+    while (list->next() != list) {
+        butil::LinkNode<Sampler>* p = list->next();
+        p->RemoveFromList();
+        Shard* target = _shards[0];
+        for (size_t i = 1; i < _shards.size(); ++i) {
+            if (_shards[i]->nsampler < target->nsampler) {
+                target = _shards[i];
+            }
+        }
+        p->InsertBefore(&target->root);
+        ++target->nsampler;
+    }
+}
+
+void SamplerCollector::add_shard() {
+    Shard* shard = new Shard;
+    shard->collector = this;
+    pthread_mutex_lock(&_mutex);
+    shard->round = _round;
+    pthread_mutex_unlock(&_mutex);
+    const int rc = pthread_create(&shard->tid, NULL,
+                                  shard_sampling_thread, shard);
+    if (rc != 0) {
+        LOG(ERROR) << "Fail to create sampling thread, " << berror(rc);
+        delete shard;
+        return;
+    }
+    _shards.push_back(shard);
+    _nthread = _shards.size();
+    // Move all samplers into one list and spread them again.
+    butil::LinkNode<Sampler> all;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        butil::LinkNode<Sampler>* root = &_shards[i]->root;
+        while (root->next() != root) {
+            butil::LinkNode<Sampler>* p = root->next();
+            p->RemoveFromList();
+            p->InsertBefore(&all);
+        }
+        _shards[i]->nsampler = 0;
+    }
+    distribute(&all);
+}
+
+void SamplerCollector::run_shard(Shard* shard) {
+    pthread_mutex_lock(&_mutex);
+    while (true) {
+        while (shard->round == _round && !_stop) {
+            pthread_cond_wait(&_start_cond, &_mutex);
+        }
+        if (_stop) {
+            break;
+        }
+        shard->round = _round;
+        pthread_mutex_unlock(&_mutex);
+        sample_shard(shard);
+        pthread_mutex_lock(&_mutex);
+        if (--_npending == 0) {
+            pthread_cond_signal(&_done_cond);
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void SamplerCollector::stop_shards() {
+    pthread_mutex_lock(&_mutex);
+    pthread_cond_broadcast(&_start_cond);
+    pthread_mutex_unlock(&_mutex);
+    for (size_t i = 1; i < _shards.size(); ++i) {
+        pthread_join(_shards[i]->tid, NULL);
+    }
+}
+
 void SamplerCollector::run() {
-    butil::LinkNode<Sampler> root;
     int consecutive_nosleep = 0;
 #ifndef UNIT_TEST
     PassiveStatus<double> cumulated_time(get_cumulated_time, this);
     bvar::PerSecond<bvar::PassiveStatus<double> > usage(
             "bvar_sampler_collector_usage", &cumulated_time, 10);
+    PassiveStatus<int64_t> round_time(
+        "bvar_sampler_collector_round_time_us", get_round_time_us, this);
+    PassiveStatus<int64_t> lag(
+        "bvar_sampler_collector_lag_us", get_lag_us, this);
+    PassiveStatus<int64_t> sampler_count(
+        "bvar_sampler_collector_sampler_count", get_sampler_count, this);
+    PassiveStatus<int> thread_num(
+        "bvar_sampler_collector_thread_num", get_thread_num, this);
 #endif
+    int64_t expected_time = butil::gettimeofday_us();
     while (!_stop) {
         int64_t abstime = butil::gettimeofday_us();
+        _lag_us = abstime - expected_time;
         Sampler* s = this->reset();
         if (s) {
-            s->InsertBeforeAsList(&root);
-        }
-        int nremoved = 0;
-        int nsampled = 0;
-        for (butil::LinkNode<Sampler>* p = root.next(); p != &root;) {
-            // We may remove p from the list, save next first.
-            butil::LinkNode<Sampler>* saved_next = p->next();
-            Sampler* s = p->value();
-            s->_mutex.lock();
-            if (!s->_used) {
-                s->_mutex.unlock();
-                p->RemoveFromList();
-                delete s;
-                ++nremoved;
-            } else {
-                s->take_sample();
-                s->_mutex.unlock();
-                ++nsampled;
-            }
-            p = saved_next;
+            butil::LinkNode<Sampler> added;
+            s->InsertBeforeAsList(&added);
+            distribute(&added);
         }
+        // Wake up helper threads to sample other shards.
+        pthread_mutex_lock(&_mutex);
+        _npending = (int)_shards.size() - 1;
+        ++_round;
+        if (_npending > 0) {
+            pthread_cond_broadcast(&_start_cond);
+        }
+        pthread_mutex_unlock(&_mutex);
+        sample_shard(_shards[0]);
+        pthread_mutex_lock(&_mutex);
+        while (_npending > 0) {
+            pthread_cond_wait(&_done_cond, &_mutex);
+        }
+        pthread_mutex_unlock(&_mutex);
+
+        int64_t nsampler = 0;
+        for (size_t i = 0; i < _shards.size(); ++i) {
+            nsampler += _shards[i]->nsampler;
+        }
+        _nsampler = nsampler;
         bool slept = false;
         int64_t now = butil::gettimeofday_us();
+        _round_time_us = now - abstime;
         _cumulated_time_us += now - abstime;
+        if (_round_time_us > FLAGS_bvar_sampler_round_budget_ms * 1000L &&
+            (int)_shards.size() < FLAGS_bvar_sampler_thread_num) {
+            add_shard();
+        }
         abstime += 1000000L;
+        expected_time = abstime;
         while (abstime > now) {
             ::usleep(abstime - now);
             slept = true;
@@ -141,6 +350,7 @@ void SamplerCollector::run() {
             }
         }
     }
+    stop_shards();
 }
 
 Sampler::Sampler() : _used(true) {}
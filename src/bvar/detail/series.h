@@ -94,6 +94,25 @@ struct DivideOnAddition<Vector<T,N>, Op, typename butil::enable_if<
     }
 };
 
+// Convert a value in series to double, returns false if T is not a number.
+template <typename T, typename Enabler = void>
+struct SeriesValueToDouble {
+    static bool convert(const T&, double*) { return false; }
+};
+
+template <typename T>
+struct SeriesValueToDouble<T, typename butil::enable_if<
+                                  butil::is_integral<T>::value ||
+                                  butil::is_floating_point<T>::value>::type> {
+    static bool convert(const T& value, double* out) {
+        *out = (double)value;
+        return true;
+    }
+};
+
+// Number of values in a series: 30 days, 24 hours, 60 minutes and 60 seconds.
+static const size_t SERIES_SIZE = 30 + 24 + 60 + 60;
+
 template <typename T, typename Op>
 class SeriesBase {
 public:
@@ -114,6 +133,11 @@ public:
         return append_second(value, _op);
     }
 
+    // Put SERIES_SIZE values into `values' in the same order as describe():
+    // days, hours, minutes and seconds, the oldest first in each part.
+    // Returns false if T is not a number.
+    bool get_values(double* values) const;
+
 private:
     void append_second(const T& value, const Op& op);
     void append_minute(const T& value, const Op& op);
@@ -122,13 +146,9 @@ private:
 
     struct Data {
     public:
-        Data() {
-            // is_pod does not work for gcc 3.4
-            if (butil::is_integral<T>::value ||
-                butil::is_floating_point<T>::value) {
-                memset(_array, 0, sizeof(_array));
-            }
-        }
+        // Value-initialization zeroes integers and floating points and
+        // default-constructs others.
+        Data() : _array() {}
         
         T& second(int index) { return _array[index]; }
         const T& second(int index) const { return _array[index]; }
@@ -209,6 +229,37 @@ void SeriesBase<T, Op>::append_day(const T& value) {
     }
 }
 
+template <typename T, typename Op>
+bool SeriesBase<T, Op>::get_values(double* values) const {
+    pthread_mutex_lock(&_mutex);
+    const int second_begin = _nsecond;
+    const int minute_begin = _nminute;
+    const int hour_begin = _nhour;
+    const int day_begin = _nday;
+    // Not consistent strictly, same as describe().
+    pthread_mutex_unlock(&_mutex);
+    int c = 0;
+    for (int i = 0; i < 30; ++i, ++c) {
+        if (!SeriesValueToDouble<T>::convert(
+                _data.day((i + day_begin) % 30), &values[c])) {
+            return false;
+        }
+    }
+    for (int i = 0; i < 24; ++i, ++c) {
+        SeriesValueToDouble<T>::convert(
+            _data.hour((i + hour_begin) % 24), &values[c]);
+    }
+    for (int i = 0; i < 60; ++i, ++c) {
+        SeriesValueToDouble<T>::convert(
+            _data.minute((i + minute_begin) % 60), &values[c]);
+    }
+    for (int i = 0; i < 60; ++i, ++c) {
+        SeriesValueToDouble<T>::convert(
+            _data.second((i + second_begin) % 60), &values[c]);
+    }
+    return true;
+}
+
 template <typename T, typename Op>
 class Series : public SeriesBase<T, Op> {
     typedef SeriesBase<T, Op> Base;
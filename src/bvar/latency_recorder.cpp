@@ -26,6 +26,11 @@ namespace bvar {
 DEFINE_int32(bvar_latency_p1, 80, "First latency percentile");
 DEFINE_int32(bvar_latency_p2, 90, "Second latency percentile");
 DEFINE_int32(bvar_latency_p3, 99, "Third latency percentile");
+DEFINE_bool(bvar_latency_recorder_use_histogram, false,
+            "LatencyRecorders created after setting this flag compute "
+            "percentiles from log-scaled histograms with bounded relative "
+            "errors, which are mergeable across processes and exported as "
+            "histograms to prometheus");
 
 static bool valid_percentile(const char*, int32_t v) {
     return v > 0 && v < 100;
@@ -41,7 +46,7 @@ namespace detail {
 
 typedef PercentileSamples<1022> CombinedPercentileSamples;
 
-CDF::CDF(PercentileWindow* w) : _w(w) {}
+CDF::CDF(PercentileWindow* w, HistogramWindow* hw) : _w(w), _hw(hw) {}
 
 CDF::~CDF() {
     hide();
@@ -53,31 +58,27 @@ void CDF::describe(std::ostream& os, bool) const {
 
 int CDF::describe_series(
     std::ostream& os, const SeriesOptions& options) const {
-    if (_w == NULL) {
+    if (_w == NULL && _hw == NULL) {
         return 1;
     }
     if (options.test_only) {
         return 0;
     }
-    std::unique_ptr<CombinedPercentileSamples> cb(new CombinedPercentileSamples);
-    std::vector<GlobalPercentileSamples> buckets;
-    _w->get_samples(&buckets);
-    for (size_t i = 0; i < buckets.size(); ++i) {
-        cb->combine_of(buckets.begin(), buckets.end());
-    }
     std::pair<int, int> values[20];
-    size_t n = 0;
-    for (int i = 1; i < 10; ++i) {
-        values[n++] = std::make_pair(i*10, cb->get_number(i * 0.1));
-    }
-    for (int i = 91; i < 100; ++i) {
-        values[n++] = std::make_pair(i, cb->get_number(i * 0.01));
+    if (_hw != NULL) {
+        HistogramSamples hs = _hw->get_value();
+        fill_cdf(hs, values);
+    } else {
+        std::unique_ptr<CombinedPercentileSamples> cb(new CombinedPercentileSamples);
+        std::vector<GlobalPercentileSamples> buckets;
+        _w->get_samples(&buckets);
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            cb->combine_of(buckets.begin(), buckets.end());
+        }
+        fill_cdf(*cb, values);
     }
-    values[n++] = std::make_pair(100, cb->get_number(0.999));
-    values[n++] = std::make_pair(101, cb->get_number(0.9999));
-    CHECK_EQ(n, arraysize(values));
     os << "{\"label\":\"cdf\",\"data\":[";
-    for (size_t i = 0; i < n; ++i) {
+    for (size_t i = 0; i < arraysize(values); ++i) {
         if (i) {
             os << ',';
         }
@@ -87,6 +88,34 @@ int CDF::describe_series(
     return 0;
 }
 
+template <typename Samples>
+void CDF::fill_cdf(Samples& s, std::pair<int, int> (&values)[20]) {
+    size_t n = 0;
+    for (int i = 1; i < 10; ++i) {
+        values[n++] = std::make_pair(i*10, s.get_number(i * 0.1));
+    }
+    for (int i = 91; i < 100; ++i) {
+        values[n++] = std::make_pair(i, s.get_number(i * 0.01));
+    }
+    values[n++] = std::make_pair(100, s.get_number(0.999));
+    values[n++] = std::make_pair(101, s.get_number(0.9999));
+    CHECK_EQ(n, arraysize(values));
+}
+
+LatencyHistogram::LatencyHistogram(Histogram* h) : _h(h) {}
+
+LatencyHistogram::~LatencyHistogram() {
+    hide();
+}
+
+void LatencyHistogram::describe(std::ostream& os, bool) const {
+    if (_h == NULL) {
+        os << HistogramSamples();
+        return;
+    }
+    os << _h->get_value();
+}
+
 static int64_t get_window_recorder_qps(void* arg) {
     detail::Sample<Stat> s;
     static_cast<RecorderWindow*>(arg)->get_span(1, &s);
@@ -129,42 +158,59 @@ static int64_t get_p3(void* arg) {
     return lr->latency_percentile(FLAGS_bvar_latency_p3 / 100.0);
 }
 
-static Vector<int64_t, 4> get_latencies(void *arg) {
-    std::unique_ptr<CombinedPercentileSamples> cb(
-        combine((PercentileWindow*)arg));
+template <typename Samples>
+static Vector<int64_t, 4> get_latencies_of(Samples& s) {
     // NOTE: We don't show 99.99% since it's often significantly larger than
     // other values and make other curves on the plotted graph small and
     // hard to read.
     Vector<int64_t, 4> result;
-    result[0] = cb->get_number(FLAGS_bvar_latency_p1 / 100.0);
-    result[1] = cb->get_number(FLAGS_bvar_latency_p2 / 100.0);
-    result[2] = cb->get_number(FLAGS_bvar_latency_p3 / 100.0);
-    result[3] = cb->get_number(0.999);
+    result[0] = s.get_number(FLAGS_bvar_latency_p1 / 100.0);
+    result[1] = s.get_number(FLAGS_bvar_latency_p2 / 100.0);
+    result[2] = s.get_number(FLAGS_bvar_latency_p3 / 100.0);
+    result[3] = s.get_number(0.999);
     return result;
 }
 
+static Vector<int64_t, 4> get_latencies(void *arg) {
+    return static_cast<LatencyRecorder*>(arg)->latency_percentiles();
+}
+
 LatencyRecorderBase::LatencyRecorderBase(time_t window_size)
-    : _max_latency(0)
+    : _latency_histogram(FLAGS_bvar_latency_recorder_use_histogram ?
+                         new Histogram : NULL)
+    , _latency_histogram_window(_latency_histogram ?
+                                new HistogramWindow(_latency_histogram.get(),
+                                                    window_size) : NULL)
+    , _latency_percentile(_latency_histogram ? NULL : new Percentile)
+    , _latency_percentile_window(_latency_percentile ?
+                                 new PercentileWindow(_latency_percentile.get(),
+                                                      window_size) : NULL)
+    , _max_latency(0)
     , _latency_window(&_latency, window_size)
     , _max_latency_window(&_max_latency, window_size)
     , _count(get_recorder_count, &_latency)
     , _qps(get_window_recorder_qps, &_latency_window)
-    , _latency_percentile_window(&_latency_percentile, window_size)
     , _latency_p1(get_p1, this)
     , _latency_p2(get_p2, this)
     , _latency_p3(get_p3, this)
     , _latency_999(get_percetile<999, 1000>, this)
     , _latency_9999(get_percetile<9999, 10000>, this)
-    , _latency_cdf(&_latency_percentile_window)
-    , _latency_percentiles(get_latencies, &_latency_percentile_window)
+    , _latency_cdf(_latency_percentile_window.get(),
+                   _latency_histogram_window.get())
+    , _latency_percentiles(get_latencies, this)
+    , _latency_histogram_var(_latency_histogram.get())
 {}
 
 }  // namespace detail
 
 Vector<int64_t, 4> LatencyRecorder::latency_percentiles() const {
-    // const_cast here is just to adapt parameter type and safe.
-    return detail::get_latencies(
-        const_cast<detail::PercentileWindow*>(&_latency_percentile_window));
+    if (_latency_histogram_window) {
+        detail::HistogramSamples hs = _latency_histogram_window->get_value();
+        return detail::get_latencies_of(hs);
+    }
+    std::unique_ptr<detail::CombinedPercentileSamples> cb(
+        combine(_latency_percentile_window.get()));
+    return detail::get_latencies_of(*cb);
 }
 
 int64_t LatencyRecorder::qps(time_t window_size) const {
@@ -203,7 +249,9 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
 
     // set debug names for printing helpful error log.
     _latency.set_debug_name(prefix);
-    _latency_percentile.set_debug_name(prefix);
+    if (_latency_percentile) {
+        _latency_percentile->set_debug_name(prefix);
+    }
 
     if (_latency_window.expose_as(prefix, "latency") != 0) {
         return -1;
@@ -242,6 +290,11 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
     if (_latency_percentiles.expose_as(prefix, "latency_percentiles", DISPLAY_ON_HTML) != 0) {
         return -1;
     }
+    if (_latency_histogram &&
+        _latency_histogram_var.expose_as(prefix, "latency_histogram",
+                                         DISPLAY_ON_PLAIN_TEXT) != 0) {
+        return -1;
+    }
     snprintf(namebuf, sizeof(namebuf), "%d%%,%d%%,%d%%,99.9%%",
              (int)FLAGS_bvar_latency_p1, (int)FLAGS_bvar_latency_p2,
              (int)FLAGS_bvar_latency_p3);
@@ -250,8 +303,11 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
 }
 
 int64_t LatencyRecorder::latency_percentile(double ratio) const {
+    if (_latency_histogram_window) {
+        return _latency_histogram_window->get_value().get_number(ratio);
+    }
     std::unique_ptr<detail::CombinedPercentileSamples> cb(
-        combine((detail::PercentileWindow*)&_latency_percentile_window));
+        combine(_latency_percentile_window.get()));
     return cb->get_number(ratio);
 }
 
@@ -267,12 +323,17 @@ void LatencyRecorder::hide() {
     _latency_9999.hide();
     _latency_cdf.hide();
     _latency_percentiles.hide();
+    _latency_histogram_var.hide();
 }
 
 LatencyRecorder& LatencyRecorder::operator<<(int64_t latency) {
     _latency << latency;
     _max_latency << latency;
-    _latency_percentile << latency;
+    if (_latency_histogram) {
+        *_latency_histogram << latency;
+    } else {
+        *_latency_percentile << latency;
+    }
     return *this;
 }
 
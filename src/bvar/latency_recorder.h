@@ -18,10 +18,12 @@
 #ifndef  BVAR_LATENCY_RECORDER_H
 #define  BVAR_LATENCY_RECORDER_H
 
+#include <memory>                       // std::unique_ptr
 #include "bvar/recorder.h"
 #include "bvar/reducer.h"
 #include "bvar/passive_status.h"
 #include "bvar/detail/percentile.h"
+#include "bvar/detail/histogram.h"
 
 namespace bvar {
 namespace detail {
@@ -30,17 +32,34 @@ class Percentile;
 typedef Window<IntRecorder, SERIES_IN_SECOND> RecorderWindow;
 typedef Window<Maxer<int64_t>, SERIES_IN_SECOND> MaxWindow;
 typedef Window<Percentile, SERIES_IN_SECOND> PercentileWindow;
+typedef Window<Histogram, SERIES_IN_SECOND> HistogramWindow;
 
 // NOTE: Always use int64_t in the interfaces no matter what the impl. is.
 
 class CDF : public Variable {
 public:
-    explicit CDF(PercentileWindow* w);
+    // Either `w' or `hw' is not NULL, `hw' is used if it's not NULL.
+    CDF(PercentileWindow* w, HistogramWindow* hw);
     ~CDF();
     void describe(std::ostream& os, bool quote_string) const;
     int describe_series(std::ostream& os, const SeriesOptions& options) const;
 private:
+    template <typename Samples>
+    static void fill_cdf(Samples& s, std::pair<int, int> (&values)[20]);
+
     PercentileWindow* _w; 
+    HistogramWindow* _hw;
+};
+
+// Cumulative counts of all recorded latencies in buckets, see
+// HistogramSamples::describe() for the format.
+class LatencyHistogram : public Variable {
+public:
+    explicit LatencyHistogram(Histogram* h);
+    ~LatencyHistogram();
+    void describe(std::ostream& os, bool quote_string) const;
+private:
+    Histogram* _h;
 };
 
 // For mimic constructor inheritance.
@@ -49,15 +68,22 @@ public:
     explicit LatencyRecorderBase(time_t window_size);
     time_t window_size() const { return _latency_window.window_size(); }
 protected:
+    // Percentiles are computed from log-scaled histograms instead of
+    // reservoir samples when -bvar_latency_recorder_use_histogram is on at
+    // construction. Exactly one pair of the following is not NULL, so that
+    // the unused one costs neither memory nor sampling.
+    std::unique_ptr<Histogram> _latency_histogram;
+    std::unique_ptr<HistogramWindow> _latency_histogram_window;
+    std::unique_ptr<Percentile> _latency_percentile;
+    std::unique_ptr<PercentileWindow> _latency_percentile_window;
+
     IntRecorder _latency;
     Maxer<int64_t> _max_latency;
-    Percentile _latency_percentile;
 
     RecorderWindow _latency_window;
     MaxWindow _max_latency_window;
     PassiveStatus<int64_t> _count;
     PassiveStatus<int64_t> _qps;
-    PercentileWindow _latency_percentile_window;
     PassiveStatus<int64_t> _latency_p1;
     PassiveStatus<int64_t> _latency_p2;
     PassiveStatus<int64_t> _latency_p3;
@@ -65,6 +91,7 @@ protected:
     PassiveStatus<int64_t> _latency_9999; // 99.99%
     CDF _latency_cdf;
     PassiveStatus<Vector<int64_t, 4> > _latency_percentiles;
+    LatencyHistogram _latency_histogram_var;
 };
 } // namespace detail
 
@@ -109,6 +136,8 @@ public:
     //                                    // foo_bar_read_max_latency
     //                                    // foo_bar_read_count
     //                                    // foo_bar_read_qps
+    // foo_bar_read_latency_histogram is exposed as well if the recorder
+    // uses histograms.
     int expose(const butil::StringPiece& prefix) {
         return expose(butil::StringPiece(), prefix);
     }
@@ -149,6 +178,8 @@ public:
     const std::string& latency_percentiles_name() const
     { return _latency_percentiles.name(); }
     const std::string& latency_cdf_name() const { return _latency_cdf.name(); }
+    const std::string& latency_histogram_name() const
+    { return _latency_histogram_var.name(); }
     const std::string& max_latency_name() const
     { return _max_latency_window.name(); }
     const std::string& count_name() const { return _count.name(); }
@@ -0,0 +1,367 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BVAR_MULTI_DIMENSION_H
+#define  BVAR_MULTI_DIMENSION_H
+
+#include <inttypes.h>                                  // PRId64
+#include <new>                                         // std::nothrow
+#include <sstream>                                     // std::ostringstream
+#include <gflags/gflags_declare.h>
+#include "butil/logging.h"
+#include "butil/containers/flat_map.h"                 // butil::FlatMap
+#include "butil/containers/doubly_buffered_data.h"     // DoublyBufferedData
+#include "butil/synchronization/lock.h"                // butil::Mutex
+#include "butil/string_printf.h"                       // butil::string_printf
+#include "bvar/mvariable.h"
+#include "bvar/latency_recorder.h"
+
+namespace bvar {
+
+DECLARE_int32(bvar_latency_p1);
+DECLARE_int32(bvar_latency_p2);
+DECLARE_int32(bvar_latency_p3);
+
+// A family of stats of type T, one for each set of label values.
+// T must be default-constructible, usually one of Adder, Maxer, IntRecorder
+// or LatencyRecorder. Stats are not exposed individually.
+// Example:
+//   std::vector<std::string> labels;
+//   labels.push_back("method");
+//   labels.push_back("status");
+//   bvar::MultiDimension<bvar::LatencyRecorder> rpc("rpc", labels);
+//   ...
+//   std::vector<std::string> values;
+//   values.push_back("Echo");
+//   values.push_back("ok");
+//   bvar::LatencyRecorder* stats = rpc.get_stats(values);
+//   if (stats) {
+//       *stats << latency_us;
+//   }
+// which is dumped to /metrics as (and some other suffixes):
+//   rpc_latency{method="Echo",status="ok"} 23
+//   rpc_qps{method="Echo",status="ok"} 1024
+//
+// About performance:
+//   get_stats() of an existing label set is almost lock-free: the map from
+//   label values to stats is read through a thread-local reference of
+//   DoublyBufferedData, and writing into the stats goes to thread-local
+//   agents of T as usual. Callers on hot paths should keep the returned
+//   pointer instead of resolving labels for every value.
+//   Creating stats for a new label set modifies the map and is much slower.
+//   Number of label sets is limited by -bvar_max_multi_dimension_stats_count
+//   to bound memory when values of labels come from untrusted input.
+template <typename T>
+class MultiDimension : public MVariable {
+public:
+    typedef std::vector<std::string> key_type;
+    typedef T value_type;
+
+    explicit MultiDimension(const key_type& labels);
+    MultiDimension(const butil::StringPiece& name, const key_type& labels);
+    MultiDimension(const butil::StringPiece& prefix,
+                   const butil::StringPiece& name,
+                   const key_type& labels);
+    ~MultiDimension();
+
+    // Get stats of `label_values', create one if absent. The returned
+    // pointer is valid until delete_stats()/clear_stats() on the same label
+    // values or destruction of this family.
+    // Returns NULL when number of values mismatches number of labels, or
+    // number of label sets reaches -bvar_max_multi_dimension_stats_count.
+    T* get_stats(const key_type& label_values);
+
+    // Returns true if stats of `label_values' exist.
+    bool has_stats(const key_type& label_values);
+
+    // Destroy stats of `label_values'. Caller must make sure that no one
+    // is using the stats.
+    void delete_stats(const key_type& label_values);
+
+    // Destroy stats of all label sets, with the same caution as above.
+    void clear_stats();
+
+    // Put values of all label sets into `label_values_list'.
+    void list_stats(std::vector<key_type>* label_values_list);
+
+    size_t count_stats() override;
+
+    int dump(Dumper* dumper, const DumpOptions* options) override;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MultiDimension);
+
+    struct KeyHash {
+        size_t operator()(const key_type& key) const {
+            size_t h = 0;
+            for (size_t i = 0; i < key.size(); ++i) {
+                h = h * 101 + butil::DefaultHasher<std::string>()(key[i]);
+            }
+            return h;
+        }
+    };
+    typedef butil::FlatMap<key_type, T*, KeyHash> MetricMap;
+
+    static size_t init_map(MetricMap& m) {
+        CHECK_EQ(0, m.init(32, 80));
+        return 1;
+    }
+    static size_t insert_stats(MetricMap& m, const key_type& key,
+                               T* const& stats) {
+        m[key] = stats;
+        return 1;
+    }
+    static size_t erase_stats(MetricMap& m, const key_type& key) {
+        return m.erase(key);
+    }
+    static size_t clear_map(MetricMap& m) {
+        m.clear();
+        return 1;
+    }
+
+    // Dump plain variables as name{labels} and LatencyRecorders as
+    // name_<suffix>{labels} for each of their sub-variables.
+    bool dump_stats(Dumper* dumper, const key_type& label_values,
+                    const Variable& stats, const DumpOptions& options);
+    bool dump_stats(Dumper* dumper, const key_type& label_values,
+                    const LatencyRecorder& stats, const DumpOptions& options);
+    bool dump_one(Dumper* dumper, const char* suffix,
+                  const key_type& label_values, int64_t value);
+
+    // Serialize creations and deletions of stats.
+    butil::Mutex _mutex;
+    butil::DoublyBufferedData<MetricMap> _metric_map;
+};
+
+template <typename T>
+MultiDimension<T>::MultiDimension(const key_type& labels)
+    : MVariable(labels) {
+    _metric_map.Modify(init_map);
+}
+
+template <typename T>
+MultiDimension<T>::MultiDimension(const butil::StringPiece& name,
+                                  const key_type& labels)
+    : MVariable(labels) {
+    _metric_map.Modify(init_map);
+    expose(name);
+}
+
+template <typename T>
+MultiDimension<T>::MultiDimension(const butil::StringPiece& prefix,
+                                  const butil::StringPiece& name,
+                                  const key_type& labels)
+    : MVariable(labels) {
+    _metric_map.Modify(init_map);
+    expose_as(prefix, name);
+}
+
+template <typename T>
+MultiDimension<T>::~MultiDimension() {
+    hide();
+    clear_stats();
+}
+
+template <typename T>
+T* MultiDimension<T>::get_stats(const key_type& label_values) {
+    {
+        typename butil::DoublyBufferedData<MetricMap>::ScopedPtr ptr;
+        if (_metric_map.Read(&ptr) != 0) {
+            return NULL;
+        }
+        T** stats = ptr->seek(label_values);
+        if (stats) {
+            return *stats;
+        }
+    }
+    if (label_values.size() != count_labels()) {
+        LOG(ERROR) << "Number of label values=" << label_values.size()
+                   << " mismatches number of labels=" << count_labels()
+                   << " of `" << name() << '\'';
+        return NULL;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    size_t count = 0;
+    {
+        typename butil::DoublyBufferedData<MetricMap>::ScopedPtr ptr;
+        if (_metric_map.Read(&ptr) != 0) {
+            return NULL;
+        }
+        // Created by another thread.
+        T** stats = ptr->seek(label_values);
+        if (stats) {
+            return *stats;
+        }
+        count = ptr->size();
+    }
+    if (count >= (size_t)FLAGS_bvar_max_multi_dimension_stats_count) {
+        LOG_EVERY_SECOND(ERROR) << "Too many label sets in `" << name()
+                                << "', max="
+                                << FLAGS_bvar_max_multi_dimension_stats_count;
+        return NULL;
+    }
+    T* stats = new (std::nothrow) T;
+    if (stats == NULL) {
+        return NULL;
+    }
+    _metric_map.Modify(insert_stats, label_values, stats);
+    return stats;
+}
+
+template <typename T>
+bool MultiDimension<T>::has_stats(const key_type& label_values) {
+    typename butil::DoublyBufferedData<MetricMap>::ScopedPtr ptr;
+    if (_metric_map.Read(&ptr) != 0) {
+        return false;
+    }
+    return ptr->seek(label_values) != NULL;
+}
+
+template <typename T>
+void MultiDimension<T>::delete_stats(const key_type& label_values) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    T* stats = NULL;
+    {
+        typename butil::DoublyBufferedData<MetricMap>::ScopedPtr ptr;
+        if (_metric_map.Read(&ptr) != 0) {
+            return;
+        }
+        T** p = ptr->seek(label_values);
+        if (p == NULL) {
+            return;
+        }
+        stats = *p;
+    }
+    // No reader sees `stats' after Modify() returns.
+    _metric_map.Modify(erase_stats, label_values);
+    delete stats;
+}
+
+template <typename T>
+void MultiDimension<T>::clear_stats() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::vector<T*> all_stats;
+    {
+        typename butil::DoublyBufferedData<MetricMap>::ScopedPtr ptr;
+        if (_metric_map.Read(&ptr) != 0) {
+            return;
+        }
+        all_stats.reserve(ptr->size());
+        for (typename MetricMap::const_iterator it = ptr->begin();
+             it != ptr->end(); ++it) {
+            all_stats.push_back(it->second);
+        }
+    }
+    _metric_map.Modify(clear_map);
+    for (size_t i = 0; i < all_stats.size(); ++i) {
+        delete all_stats[i];
+    }
+}
+
+template <typename T>
+void MultiDimension<T>::list_stats(std::vector<key_type>* label_values_list) {
+    if (label_values_list == NULL) {
+        return;
+    }
+    label_values_list->clear();
+    typename butil::DoublyBufferedData<MetricMap>::ScopedPtr ptr;
+    if (_metric_map.Read(&ptr) != 0) {
+        return;
+    }
+    label_values_list->reserve(ptr->size());
+    for (typename MetricMap::const_iterator it = ptr->begin();
+         it != ptr->end(); ++it) {
+        label_values_list->push_back(it->first);
+    }
+}
+
+template <typename T>
+size_t MultiDimension<T>::count_stats() {
+    typename butil::DoublyBufferedData<MetricMap>::ScopedPtr ptr;
+    if (_metric_map.Read(&ptr) != 0) {
+        return 0;
+    }
+    return ptr->size();
+}
+
+template <typename T>
+int MultiDimension<T>::dump(Dumper* dumper, const DumpOptions* options) {
+    DumpOptions opt;
+    if (options) {
+        opt = *options;
+    }
+    // Stats are not deleted before the reading ends, see delete_stats().
+    typename butil::DoublyBufferedData<MetricMap>::ScopedPtr ptr;
+    if (_metric_map.Read(&ptr) != 0) {
+        return 0;
+    }
+    int count = 0;
+    for (typename MetricMap::const_iterator it = ptr->begin();
+         it != ptr->end(); ++it) {
+        if (!dump_stats(dumper, it->first, *it->second, opt)) {
+            return -1;
+        }
+        ++count;
+    }
+    return count;
+}
+
+template <typename T>
+bool MultiDimension<T>::dump_stats(Dumper* dumper,
+                                   const key_type& label_values,
+                                   const Variable& stats,
+                                   const DumpOptions& options) {
+    std::string labeled_name;
+    append_labeled_name(&labeled_name, name(), label_values);
+    std::ostringstream os;
+    stats.describe(os, options.quote_string);
+    return dumper->dump(labeled_name, os.str());
+}
+
+template <typename T>
+bool MultiDimension<T>::dump_one(Dumper* dumper, const char* suffix,
+                                 const key_type& label_values,
+                                 int64_t value) {
+    std::string labeled_name;
+    append_labeled_name(&labeled_name, name() + suffix, label_values);
+    char buf[32];
+    const int len = snprintf(buf, sizeof(buf), "%" PRId64, value);
+    return dumper->dump(labeled_name, butil::StringPiece(buf, len));
+}
+
+template <typename T>
+bool MultiDimension<T>::dump_stats(Dumper* dumper,
+                                   const key_type& label_values,
+                                   const LatencyRecorder& stats,
+                                   const DumpOptions&) {
+    const Vector<int64_t, 4> latencies = stats.latency_percentiles();
+    const std::string p1 =
+        butil::string_printf("_latency_%d", (int)FLAGS_bvar_latency_p1);
+    const std::string p2 =
+        butil::string_printf("_latency_%d", (int)FLAGS_bvar_latency_p2);
+    const std::string p3 =
+        butil::string_printf("_latency_%d", (int)FLAGS_bvar_latency_p3);
+    return dump_one(dumper, "_count", label_values, stats.count())
+        && dump_one(dumper, "_latency", label_values, stats.latency())
+        && dump_one(dumper, p1.c_str(), label_values, latencies[0])
+        && dump_one(dumper, p2.c_str(), label_values, latencies[1])
+        && dump_one(dumper, p3.c_str(), label_values, latencies[2])
+        && dump_one(dumper, "_latency_999", label_values, latencies[3])
+        && dump_one(dumper, "_max_latency", label_values, stats.max_latency())
+        && dump_one(dumper, "_qps", label_values, stats.qps());
+}
+
+}  // namespace bvar
+
+#endif  // BVAR_MULTI_DIMENSION_H
@@ -0,0 +1,216 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pthread.h>
+#include <algorithm>                            // std::sort
+#include <gflags/gflags.h>
+#include "butil/containers/flat_map.h"          // butil::FlatMap
+#include "butil/scoped_lock.h"                  // BAIDU_SCOPED_LOCK
+#include "butil/logging.h"
+#include "bvar/detail/wildcard_matcher.h"
+#include "bvar/mvariable.h"
+
+namespace bvar {
+
+DEFINE_int32(bvar_max_multi_dimension_stats_count, 20000,
+             "Max number of label sets in one multi-dimensional bvar, stats"
+             " of new label sets are not created beyond this limit");
+static bool validate_bvar_max_multi_dimension_stats_count(const char*,
+                                                          int32_t v) {
+    return v > 0;
+}
+const bool ALLOW_UNUSED dummy_bvar_max_multi_dimension_stats_count =
+    ::GFLAGS_NS::RegisterFlagValidator(
+        &FLAGS_bvar_max_multi_dimension_stats_count,
+        validate_bvar_max_multi_dimension_stats_count);
+
+typedef butil::FlatMap<std::string, MVariable*> MVarMap;
+
+struct MVarMapWithLock : public MVarMap {
+    pthread_mutex_t mutex;
+
+    MVarMapWithLock() {
+        CHECK_EQ(0, init(256, 80));
+        pthread_mutex_init(&mutex, NULL);
+    }
+};
+
+// Families are much fewer than variables, a single map is enough.
+static pthread_once_t s_mvar_map_once = PTHREAD_ONCE_INIT;
+static MVarMapWithLock* s_mvar_map = NULL;
+
+static void init_mvar_map() {
+    s_mvar_map = new MVarMapWithLock;
+}
+
+inline MVarMapWithLock& get_mvar_map() {
+    pthread_once(&s_mvar_map_once, init_mvar_map);
+    return *s_mvar_map;
+}
+
+MVariable::MVariable(const std::vector<std::string>& labels)
+    : _labels(labels) {
+}
+
+MVariable::~MVariable() {
+    CHECK(!hide()) << "Subclass of MVariable MUST call hide() manually in"
+        " their dtors to avoid dumping a variable that is just destructing";
+}
+
+void MVariable::describe(std::ostream& os) {
+    os << "{\"labels\":[";
+    for (size_t i = 0; i < _labels.size(); ++i) {
+        if (i) {
+            os << ',';
+        }
+        os << '"' << _labels[i] << '"';
+    }
+    os << "],\"stats_count\":" << count_stats() << '}';
+}
+
+int MVariable::expose_impl(const butil::StringPiece& prefix,
+                           const butil::StringPiece& name) {
+    if (name.empty()) {
+        LOG(ERROR) << "Parameter[name] is empty";
+        return -1;
+    }
+    hide();
+
+    _name.clear();
+    _name.reserve((prefix.size() + name.size()) * 5 / 4);
+    if (!prefix.empty()) {
+        to_underscored_name(&_name, prefix);
+        if (!_name.empty() && butil::back_char(_name) != '_') {
+            _name.push_back('_');
+        }
+    }
+    to_underscored_name(&_name, name);
+
+    MVarMapWithLock& m = get_mvar_map();
+    {
+        BAIDU_SCOPED_LOCK(m.mutex);
+        if (m.seek(_name) == NULL) {
+            m[_name] = this;
+            return 0;
+        }
+    }
+    LOG(ERROR) << "Already exposed multi-dimensional bvar `" << _name << '\'';
+    _name.clear();
+    return -1;
+}
+
+bool MVariable::hide() {
+    if (_name.empty()) {
+        return false;
+    }
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    CHECK_EQ(1UL, m.erase(_name)) << "`" << _name << "' must exist";
+    _name.clear();
+    return true;
+}
+
+void MVariable::append_labeled_name(
+    std::string* out, const butil::StringPiece& name,
+    const std::vector<std::string>& label_values) const {
+    out->append(name.data(), name.size());
+    out->push_back('{');
+    for (size_t i = 0; i < _labels.size() && i < label_values.size(); ++i) {
+        if (i) {
+            out->push_back(',');
+        }
+        out->append(_labels[i]);
+        out->append("=\"");
+        const std::string& value = label_values[i];
+        for (size_t j = 0; j < value.size(); ++j) {
+            switch (value[j]) {
+            case '\\':
+                out->append("\\\\");
+                break;
+            case '"':
+                out->append("\\\"");
+                break;
+            case '\n':
+                out->append("\\n");
+                break;
+            default:
+                out->push_back(value[j]);
+                break;
+            }
+        }
+        out->push_back('"');
+    }
+    out->push_back('}');
+}
+
+void MVariable::list_exposed(std::vector<std::string>* names) {
+    if (names == NULL) {
+        return;
+    }
+    names->clear();
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    names->reserve(m.size());
+    for (MVarMap::const_iterator it = m.begin(); it != m.end(); ++it) {
+        names->push_back(it->first);
+    }
+}
+
+size_t MVariable::count_exposed() {
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    return m.size();
+}
+
+int MVariable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
+    if (NULL == dumper) {
+        LOG(ERROR) << "Parameter[dumper] is NULL";
+        return -1;
+    }
+    DumpOptions opt;
+    if (poptions) {
+        opt = *poptions;
+    }
+    WildcardMatcher black_matcher(opt.black_wildcards,
+                                  opt.question_mark,
+                                  false);
+    WildcardMatcher white_matcher(opt.white_wildcards,
+                                  opt.question_mark,
+                                  true);
+    std::vector<std::string> names;
+    list_exposed(&names);
+    std::sort(names.begin(), names.end());
+    MVarMapWithLock& m = get_mvar_map();
+    int count = 0;
+    for (size_t i = 0; i < names.size(); ++i) {
+        const std::string& name = names[i];
+        if (!white_matcher.match(name) || black_matcher.match(name)) {
+            continue;
+        }
+        // Hold the lock so that the family is not destroyed during dumping.
+        BAIDU_SCOPED_LOCK(m.mutex);
+        MVariable** mvar = m.seek(name);
+        if (mvar == NULL) {
+            continue;
+        }
+        const int n = (*mvar)->dump(dumper, &opt);
+        if (n < 0) {
+            return -1;
+        }
+        count += n;
+    }
+    return count;
+}
+
+}  // namespace bvar
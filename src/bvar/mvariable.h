@@ -0,0 +1,114 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BVAR_MVARIABLE_H
+#define  BVAR_MVARIABLE_H
+
+#include <ostream>                      // std::ostream
+#include <string>                       // std::string
+#include <vector>                       // std::vector
+#include <gflags/gflags_declare.h>
+#include "butil/macros.h"               // DISALLOW_COPY_AND_ASSIGN
+#include "butil/strings/string_piece.h" // butil::StringPiece
+#include "bvar/variable.h"              // Dumper, DumpOptions
+
+namespace bvar {
+
+DECLARE_int32(bvar_max_multi_dimension_stats_count);
+
+// Base class of multi-dimensional (labeled) variables, namely a family of
+// stats sharing one name and distinguished by values of labels, e.g. qps
+// of rpc with labels "method" and "status".
+// Different from Variable, stats inside are not exposed individually, so
+// that creating a stat for a new label set does not touch the global
+// registry of Variable, and the family is dumped with labels natively:
+//   name{label1="value1",label2="value2"} description
+class MVariable {
+public:
+    explicit MVariable(const std::vector<std::string>& labels);
+    virtual ~MVariable();
+
+    // Names of labels.
+    const std::vector<std::string>& labels() const { return _labels; }
+    size_t count_labels() const { return _labels.size(); }
+
+    // Number of label sets having stats.
+    virtual size_t count_stats() = 0;
+
+    // Send stats of all label sets to `dumper'.
+    // Returns number of dumped stats, -1 when dumper->dump() fails.
+    virtual int dump(Dumper* dumper, const DumpOptions* options) = 0;
+
+    // Print names of labels and number of stats into the stream.
+    virtual void describe(std::ostream& os);
+
+    // Expose this family globally so that it's counted in *_exposed
+    // functions of MVariable. Families and Variables are in different
+    // namespaces, however a family should not be named same with any
+    // Variable to avoid conflicts in monitoring systems.
+    // Returns 0 on success, -1 otherwise.
+    int expose(const butil::StringPiece& name) {
+        return expose_impl(butil::StringPiece(), name);
+    }
+
+    // Expose this family with a prefix, see Variable::expose_as().
+    // Returns 0 on success, -1 otherwise.
+    int expose_as(const butil::StringPiece& prefix,
+                  const butil::StringPiece& name) {
+        return expose_impl(prefix, name);
+    }
+
+    // Hide this family so that it's not counted in *_exposed functions.
+    // Returns false if this family is already hidden.
+    // CAUTION!! Subclasses must call hide() manually in their dtors.
+    bool hide();
+
+    // Get exposed name. If this family is not exposed, the name is empty.
+    const std::string& name() const { return _name; }
+
+    // ====================================================================
+
+    // Put names of all exposed families into `names'.
+    static void list_exposed(std::vector<std::string>* names);
+
+    // Get number of exposed families.
+    static size_t count_exposed();
+
+    // Dump stats of all exposed families matching `white_wildcards' but
+    // `black_wildcards' of `options' to `dumper'. Names passed to the
+    // dumper contain labels, e.g. rpc_qps{method="Echo",status="ok"}.
+    // Use default options when `options' is NULL.
+    // Returns number of dumped stats, -1 on error.
+    static int dump_exposed(Dumper* dumper, const DumpOptions* options);
+
+protected:
+    int expose_impl(const butil::StringPiece& prefix,
+                    const butil::StringPiece& name);
+
+    // Append `name' with labels to `out', values are escaped as required
+    // by Prometheus.
+    void append_labeled_name(std::string* out,
+                             const butil::StringPiece& name,
+                             const std::vector<std::string>& label_values) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MVariable);
+
+    std::vector<std::string> _labels;
+    std::string _name;
+};
+
+}  // namespace bvar
+
+#endif  // BVAR_MVARIABLE_H
@@ -59,6 +59,7 @@ public:
         }
         void take_sample() { _series.append(_owner->get_value()); }
         void describe(std::ostream& os) { _series.describe(os, _vector_names); }
+        bool get_values(double* values) { return _series.get_values(values); }
         void set_vector_names(const std::string& names) {
             if (_vector_names == NULL) {
                 _vector_names = new std::string;
@@ -124,6 +125,10 @@ public:
         os << get_value();
     }
 
+    bool get_int_value(int64_t* value) const {
+        return detail::IntValue<Tp>::get(*this, value);
+    }
+
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const {
         if (_getfn) {
@@ -159,6 +164,13 @@ public:
         return 0;
     }
 
+    int get_series(double* values) const {
+        if (_series_sampler == NULL) {
+            return 1;
+        }
+        return _series_sampler->get_values(values) ? 0 : 1;
+    }
+
     Tp reset() {
         CHECK(false) << "PassiveStatus::reset() should never be called, abort";
         abort();
@@ -76,6 +76,7 @@ public:
         ~SeriesSampler() {}
         void take_sample() { _series.append(_owner->get_value()); }
         void describe(std::ostream& os) { _series.describe(os, NULL); }
+        bool get_values(double* values) { return _series.get_values(values); }
     private:
         Reducer* _owner;
         detail::Series<T, Op> _series;
@@ -133,6 +134,10 @@ public:
             os << get_value();
         }
     }
+
+    bool get_int_value(int64_t* value) const {
+        return detail::IntValue<T>::get(*this, value);
+    }
     
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const { *value = get_value(); }
@@ -162,6 +167,13 @@ public:
         }
         return 0;
     }
+
+    int get_series(double* values) const {
+        if (_series_sampler == NULL) {
+            return 1;
+        }
+        return _series_sampler->get_values(values) ? 0 : 1;
+    }
     
 protected:
     int expose_impl(const butil::StringPiece& prefix,
@@ -0,0 +1,473 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pthread.h>
+#include <fcntl.h>                              // open
+#include <unistd.h>                             // ftruncate
+#include <stdlib.h>                             // strtoll, strtod
+#include <stdio.h>                              // rename
+#include <string.h>                             // memcpy
+#include <sys/mman.h>                           // mmap
+#include <sys/stat.h>                           // fstat
+#include <gflags/gflags.h>
+#include "butil/errno.h"                         // berror
+#include "butil/fd_guard.h"                      // butil::fd_guard
+#include "butil/file_util.h"                     // butil::FilePath
+#include "butil/logging.h"
+#include "butil/time.h"                          // milliseconds_from_now
+#include "bvar/mvariable.h"
+#include "bvar/snapshot.h"
+
+namespace bvar {
+
+std::string read_command_name();
+
+// Referenced by variable.cpp so that -bvar_snapshot is always linked.
+int do_link_snapshot = 0;
+
+BAIDU_CASSERT(sizeof(SnapshotFileHeader) == 32, sizeof_file_header_must_be_32);
+BAIDU_CASSERT(sizeof(SnapshotSlotHeader) == 32, sizeof_slot_header_must_be_32);
+
+DEFINE_bool(bvar_snapshot, false,
+            "Create a background thread writing binary snapshots of all bvar"
+            " into -bvar_snapshot_file periodically, all bvar_snapshot_*"
+            " flags are not effective when this flag is off");
+DEFINE_int32(bvar_snapshot_interval, 10,
+             "Seconds between consecutive snapshots");
+DEFINE_string(bvar_snapshot_file, "monitor/bvar.<app>.snapshot",
+              "Write binary snapshots of bvar into this memory-mapped file");
+DEFINE_string(bvar_snapshot_include, "", "Snapshot bvar matching these "
+              "wildcards, separated by semicolon(;), empty means including all");
+DEFINE_string(bvar_snapshot_exclude, "", "Snapshot bvar excluded from these "
+              "wildcards, separated by semicolon(;), empty means no exclusion");
+DEFINE_bool(bvar_snapshot_series, true,
+            "Include series (trends of last 30 days) of bvar in snapshots");
+DEFINE_int32(bvar_snapshot_slots, 4,
+             "Number of latest snapshots kept in -bvar_snapshot_file");
+DEFINE_int32(bvar_snapshot_slot_size_kb, 8192,
+             "Max size of one snapshot in KB, larger snapshots are dropped");
+
+SnapshotDumper::SnapshotDumper(bool with_series)
+    : _with_series(with_series)
+    , _count(0) {
+}
+
+void SnapshotDumper::clear() {
+    _count = 0;
+    _payload.clear();
+}
+
+void SnapshotDumper::append_record(const std::string& name, uint8_t flags,
+                                   const void* value) {
+    if (name.size() > 0xFFFF) {
+        return;
+    }
+    if (_with_series) {
+        _series.resize(SNAPSHOT_SERIES_SIZE);
+        if (Variable::get_series_exposed(name, &_series[0]) == 0) {
+            flags |= SNAPSHOT_HAS_SERIES;
+        }
+    }
+    const uint16_t name_size = name.size();
+    _payload.append((const char*)&name_size, sizeof(name_size));
+    _payload.append(name);
+    _payload.push_back((char)flags);
+    _payload.append((const char*)value, 8);
+    if (flags & SNAPSHOT_HAS_SERIES) {
+        _payload.append((const char*)&_series[0],
+                        SNAPSHOT_SERIES_SIZE * sizeof(double));
+    }
+    ++_count;
+}
+
+bool SnapshotDumper::dump_int(const std::string& name, int64_t value) {
+    append_record(name, SNAPSHOT_INT_VALUE, &value);
+    return true;
+}
+
+bool SnapshotDumper::dump(const std::string& name,
+                          const butil::StringPiece& desc) {
+    // Values are not null-terminated, copy them before parsing. Long
+    // descriptions are not numbers.
+    char buf[64];
+    if (desc.empty() || desc.size() >= sizeof(buf)) {
+        return true;
+    }
+    memcpy(buf, desc.data(), desc.size());
+    buf[desc.size()] = '\0';
+    char* endptr = NULL;
+    const int64_t int_value = strtoll(buf, &endptr, 10);
+    if (*endptr == '\0') {
+        append_record(name, SNAPSHOT_INT_VALUE, &int_value);
+        return true;
+    }
+    const double value = strtod(buf, &endptr);
+    if (*endptr == '\0') {
+        append_record(name, 0, &value);
+    }
+    // Skip non-numbers silently.
+    return true;
+}
+
+SnapshotFile::SnapshotFile()
+    : _nslot(0)
+    , _slot_size(0)
+    , _seq(0)
+    , _addr(NULL)
+    , _length(0) {
+}
+
+void SnapshotFile::close() {
+    if (_addr) {
+        munmap(_addr, _length);
+        _addr = NULL;
+        _length = 0;
+    }
+    _path.clear();
+}
+
+int SnapshotFile::open(const std::string& path, uint32_t nslot,
+                       uint64_t slot_size) {
+    close();
+    if (nslot == 0 || slot_size == 0) {
+        LOG(ERROR) << "Invalid nslot=" << nslot << " slot_size=" << slot_size;
+        return -1;
+    }
+    butil::File::Error error;
+    butil::FilePath dir = butil::FilePath(path).DirName();
+    if (!butil::CreateDirectoryAndGetError(dir, &error)) {
+        LOG(ERROR) << "Fail to create directory=`" << dir.value()
+                   << "', " << error;
+        return -1;
+    }
+    // Slots are aligned by 8 bytes so that headers in them are aligned.
+    slot_size = (slot_size + 7) / 8 * 8;
+    const size_t length = sizeof(SnapshotFileHeader) +
+        nslot * (sizeof(SnapshotSlotHeader) + slot_size);
+    const std::string tmp_path = path + ".tmp";
+    butil::fd_guard fd(::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                              0644));
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << tmp_path;
+        return -1;
+    }
+    if (ftruncate(fd, length) != 0) {
+        PLOG(ERROR) << "Fail to resize " << tmp_path << " to " << length;
+        return -1;
+    }
+    void* addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "Fail to mmap " << tmp_path;
+        return -1;
+    }
+    // The file is zeroed by ftruncate(), namely all slots are empty.
+    SnapshotFileHeader* header = (SnapshotFileHeader*)addr;
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->nslot = nslot;
+    header->slot_size = slot_size;
+    header->latest_seq.store(0, butil::memory_order_release);
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        PLOG(ERROR) << "Fail to rename " << tmp_path << " to " << path;
+        munmap(addr, length);
+        return -1;
+    }
+    _path = path;
+    _nslot = nslot;
+    _slot_size = slot_size;
+    _seq = 0;
+    _addr = (char*)addr;
+    _length = length;
+    return 0;
+}
+
+int SnapshotFile::write(const butil::StringPiece& payload, uint32_t nvar,
+                        int64_t time_us) {
+    if (_addr == NULL) {
+        LOG(ERROR) << "SnapshotFile is not opened";
+        return -1;
+    }
+    if (payload.size() > _slot_size) {
+        LOG(ERROR) << "Snapshot of " << nvar << " bvar is " << payload.size()
+                   << " bytes, larger than slot_size=" << _slot_size
+                   << " of " << _path;
+        return -1;
+    }
+    const uint64_t seq = ++_seq;
+    SnapshotFileHeader* header = (SnapshotFileHeader*)_addr;
+    SnapshotSlotHeader* slot = (SnapshotSlotHeader*)
+        (_addr + sizeof(SnapshotFileHeader) +
+         (seq % _nslot) * (sizeof(SnapshotSlotHeader) + _slot_size));
+    // Invalidate the slot before overwriting, readers copying this slot
+    // concurrently will see the change of seq and retry.
+    slot->seq.store(0, butil::memory_order_relaxed);
+    butil::atomic_thread_fence(butil::memory_order_release);
+    slot->size = payload.size();
+    slot->time_us = time_us;
+    slot->nvar = nvar;
+    memcpy(slot + 1, payload.data(), payload.size());
+    slot->seq.store(seq, butil::memory_order_release);
+    header->latest_seq.store(seq, butil::memory_order_release);
+    return 0;
+}
+
+int read_latest_snapshot(const std::string& path, std::string* payload,
+                         int64_t* time_us, uint64_t* seq_out) {
+    butil::fd_guard fd(::open(path.c_str(), O_RDONLY));
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(SnapshotFileHeader)) {
+        return -1;
+    }
+    const size_t length = st.st_size;
+    void* addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+    const char* base = (const char*)addr;
+    const SnapshotFileHeader* header = (const SnapshotFileHeader*)base;
+    int rc = -1;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+        header->version == SNAPSHOT_VERSION && header->nslot != 0 &&
+        sizeof(SnapshotFileHeader) + header->nslot *
+        (sizeof(SnapshotSlotHeader) + header->slot_size) <= length) {
+        // The writer may overwrite the slot during copying, retry a few
+        // times with the latest sequence number.
+        for (int i = 0; i < 8 && rc != 0; ++i) {
+            const uint64_t seq =
+                header->latest_seq.load(butil::memory_order_acquire);
+            if (seq == 0) {
+                break;
+            }
+            const SnapshotSlotHeader* slot = (const SnapshotSlotHeader*)
+                (base + sizeof(SnapshotFileHeader) + (seq % header->nslot) *
+                 (sizeof(SnapshotSlotHeader) + header->slot_size));
+            if (slot->seq.load(butil::memory_order_acquire) != seq) {
+                continue;
+            }
+            const uint64_t size = slot->size;
+            const int64_t t = slot->time_us;
+            if (size > header->slot_size) {
+                continue;
+            }
+            payload->assign((const char*)(slot + 1), size);
+            butil::atomic_thread_fence(butil::memory_order_acquire);
+            if (slot->seq.load(butil::memory_order_relaxed) != seq) {
+                continue;
+            }
+            if (time_us) {
+                *time_us = t;
+            }
+            if (seq_out) {
+                *seq_out = seq;
+            }
+            rc = 0;
+        }
+    }
+    munmap(addr, length);
+    return rc;
+}
+
+int parse_snapshot(const butil::StringPiece& payload,
+                   std::vector<SnapshotEntry>* entries) {
+    entries->clear();
+    const char* p = payload.data();
+    const char* const end = payload.data() + payload.size();
+    while (p != end) {
+        uint16_t name_size = 0;
+        if ((size_t)(end - p) < sizeof(name_size)) {
+            return -1;
+        }
+        memcpy(&name_size, p, sizeof(name_size));
+        p += sizeof(name_size);
+        if ((size_t)(end - p) < name_size + 1UL + 8UL) {
+            return -1;
+        }
+        entries->push_back(SnapshotEntry());
+        SnapshotEntry& e = entries->back();
+        e.name.assign(p, name_size);
+        p += name_size;
+        const uint8_t flags = *p++;
+        e.is_int = (flags & SNAPSHOT_INT_VALUE);
+        if (e.is_int) {
+            memcpy(&e.int_value, p, 8);
+            e.value = (double)e.int_value;
+        } else {
+            memcpy(&e.value, p, 8);
+        }
+        p += 8;
+        if (flags & SNAPSHOT_HAS_SERIES) {
+            const size_t nbytes = SNAPSHOT_SERIES_SIZE * sizeof(double);
+            if ((size_t)(end - p) < nbytes) {
+                return -1;
+            }
+            e.series.resize(SNAPSHOT_SERIES_SIZE);
+            memcpy(&e.series[0], p, nbytes);
+            p += nbytes;
+        }
+    }
+    return 0;
+}
+
+// ============= the background thread ==============
+
+static pthread_once_t snapshot_thread_once = PTHREAD_ONCE_INIT;
+static bool created_snapshot_thread = false;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+
+static void* snapshot_thread(void*) {
+    const std::string command_name = read_command_name();
+    SnapshotFile file;
+    SnapshotDumper dumper(true);
+    while (1) {
+        // We can't access string flags directly because it's thread-unsafe.
+        std::string filename;
+        DumpOptions options;
+        if (!GFLAGS_NS::GetCommandLineOption("bvar_snapshot_file", &filename)) {
+            LOG(ERROR) << "Fail to get gflag bvar_snapshot_file";
+            return NULL;
+        }
+        if (!GFLAGS_NS::GetCommandLineOption("bvar_snapshot_include",
+                                             &options.white_wildcards)) {
+            LOG(ERROR) << "Fail to get gflag bvar_snapshot_include";
+            return NULL;
+        }
+        if (!GFLAGS_NS::GetCommandLineOption("bvar_snapshot_exclude",
+                                             &options.black_wildcards)) {
+            LOG(ERROR) << "Fail to get gflag bvar_snapshot_exclude";
+            return NULL;
+        }
+        if (FLAGS_bvar_snapshot && !filename.empty()) {
+            const size_t pos = filename.find("<app>");
+            if (pos != std::string::npos) {
+                filename.replace(pos, 5/*<app>*/, command_name);
+            }
+            const uint32_t nslot = FLAGS_bvar_snapshot_slots;
+            const uint64_t slot_size =
+                (uint64_t)FLAGS_bvar_snapshot_slot_size_kb * 1024;
+            if (file.path() != filename || file.nslot() != nslot ||
+                file.slot_size() != slot_size) {
+                if (file.open(filename, nslot, slot_size) == 0) {
+                    LOG(INFO) << "Write snapshots of all bvar to " << filename
+                              << " every " << FLAGS_bvar_snapshot_interval
+                              << " seconds.";
+                }
+            }
+            if (!file.path().empty()) {
+                dumper.clear();
+                dumper.set_with_series(FLAGS_bvar_snapshot_series);
+                const int64_t now = butil::gettimeofday_us();
+                Variable::dump_exposed(&dumper, &options);
+                // Labeled stats do not save series.
+                dumper.set_with_series(false);
+                MVariable::dump_exposed(&dumper, &options);
+                file.write(dumper.payload(), dumper.count(), now);
+            }
+        } else {
+            file.close();
+        }
+
+        // Same as dumping_thread, see comments there.
+        const int post_sleep_ms = 50;
+        int cond_sleep_ms = FLAGS_bvar_snapshot_interval * 1000 - post_sleep_ms;
+        if (cond_sleep_ms < 0) {
+            LOG(ERROR) << "Bad cond_sleep_ms=" << cond_sleep_ms;
+            cond_sleep_ms = 10000;
+        }
+        timespec deadline = butil::milliseconds_from_now(cond_sleep_ms);
+        pthread_mutex_lock(&snapshot_mutex);
+        pthread_cond_timedwait(&snapshot_cond, &snapshot_mutex, &deadline);
+        pthread_mutex_unlock(&snapshot_mutex);
+        usleep(post_sleep_ms * 1000);
+    }
+}
+
+static void launch_snapshot_thread() {
+    pthread_t thread_id;
+    int rc = pthread_create(&thread_id, NULL, snapshot_thread, NULL);
+    if (rc != 0) {
+        LOG(FATAL) << "Fail to launch snapshot thread: " << berror(rc);
+        return;
+    }
+    // Detach the thread because no one would join it.
+    CHECK_EQ(0, pthread_detach(thread_id));
+    created_snapshot_thread = true;
+}
+
+static bool validate_bvar_snapshot(const char*, bool enabled) {
+    if (enabled) {
+        pthread_once(&snapshot_thread_once, launch_snapshot_thread);
+        return created_snapshot_thread;
+    }
+    return true;
+}
+const bool ALLOW_UNUSED dummy_bvar_snapshot = ::GFLAGS_NS::RegisterFlagValidator(
+    &FLAGS_bvar_snapshot, validate_bvar_snapshot);
+
+static bool validate_bvar_snapshot_interval(const char*, int32_t v) {
+    if (v < 1) {
+        LOG(ERROR) << "Invalid bvar_snapshot_interval=" << v;
+        return false;
+    }
+    return true;
+}
+const bool ALLOW_UNUSED dummy_bvar_snapshot_interval =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_snapshot_interval,
+                                       validate_bvar_snapshot_interval);
+
+static bool validate_bvar_snapshot_slots(const char*, int32_t v) {
+    if (v < 1 || v > 1024) {
+        LOG(ERROR) << "Invalid bvar_snapshot_slots=" << v;
+        return false;
+    }
+    pthread_cond_signal(&snapshot_cond);
+    return true;
+}
+const bool ALLOW_UNUSED dummy_bvar_snapshot_slots =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_snapshot_slots,
+                                       validate_bvar_snapshot_slots);
+
+static bool validate_bvar_snapshot_slot_size_kb(const char*, int32_t v) {
+    if (v < 1 || v > 1024 * 1024) {
+        LOG(ERROR) << "Invalid bvar_snapshot_slot_size_kb=" << v;
+        return false;
+    }
+    pthread_cond_signal(&snapshot_cond);
+    return true;
+}
+const bool ALLOW_UNUSED dummy_bvar_snapshot_slot_size_kb =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_snapshot_slot_size_kb,
+                                       validate_bvar_snapshot_slot_size_kb);
+
+static bool wakeup_snapshot_thread(const char*, const std::string&) {
+    // We're modifying a flag, wake up snapshot_thread to write a new
+    // snapshot soon.
+    pthread_cond_signal(&snapshot_cond);
+    return true;
+}
+const bool ALLOW_UNUSED dummy_bvar_snapshot_file =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_snapshot_file,
+                                       wakeup_snapshot_thread);
+const bool ALLOW_UNUSED dummy_bvar_snapshot_include =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_snapshot_include,
+                                       wakeup_snapshot_thread);
+const bool ALLOW_UNUSED dummy_bvar_snapshot_exclude =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_snapshot_exclude,
+                                       wakeup_snapshot_thread);
+
+}  // namespace bvar
@@ -0,0 +1,160 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BVAR_SNAPSHOT_H
+#define  BVAR_SNAPSHOT_H
+
+#include <stdint.h>                     // uint64_t
+#include <string>                       // std::string
+#include <vector>                       // std::vector
+#include <gflags/gflags_declare.h>
+#include "butil/atomicops.h"            // butil::atomic
+#include "butil/macros.h"               // DISALLOW_COPY_AND_ASSIGN
+#include "butil/strings/string_piece.h" // butil::StringPiece
+#include "bvar/variable.h"              // Dumper
+
+namespace bvar {
+
+DECLARE_bool(bvar_snapshot);
+
+// Binary snapshots of exposed bvar, written by a background thread into a
+// memory-mapped ring file when -bvar_snapshot is on. Agents on the same
+// host read values and series of all bvar from the file directly, instead
+// of scraping the http port or parsing text written by -bvar_dump.
+//
+// Layout of the file (native byte order):
+//   SnapshotFileHeader
+//   nslot * (SnapshotSlotHeader + slot_size bytes of payload)
+// The snapshot with sequence number `seq' (starting from 1) is written into
+// slot `seq % nslot'. A slot is valid when its `seq' equals the one read
+// before and after copying the payload out, see read_latest_snapshot().
+//
+// Payload of a snapshot is a sequence of records:
+//   uint16_t name_size | name | uint8_t flags | 8-byte value
+//   | SNAPSHOT_SERIES_SIZE doubles if flags has SNAPSHOT_HAS_SERIES
+// The value is an int64_t if flags has SNAPSHOT_INT_VALUE, a double
+// otherwise. Variables whose values are not numbers are not included.
+
+const char SNAPSHOT_MAGIC[8] = { 'B', 'V', 'A', 'R', 'S', 'N', 'A', 'P' };
+const uint32_t SNAPSHOT_VERSION = 1;
+// Same as Variable::get_series(): 30 days, 24 hours, 60 minutes, 60 seconds.
+const size_t SNAPSHOT_SERIES_SIZE = 174;
+
+const uint8_t SNAPSHOT_INT_VALUE = 1;
+const uint8_t SNAPSHOT_HAS_SERIES = 2;
+
+struct SnapshotFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nslot;
+    uint64_t slot_size;
+    // Sequence number of the latest complete snapshot, 0 means none.
+    butil::atomic<uint64_t> latest_seq;
+};
+
+struct SnapshotSlotHeader {
+    // 0 when the slot is being written.
+    butil::atomic<uint64_t> seq;
+    uint64_t size;
+    int64_t time_us;
+    uint32_t nvar;
+    uint32_t reserved;
+};
+
+// Serialize variables sent by Variable::dump_exposed() into the payload.
+class SnapshotDumper : public Dumper {
+public:
+    // Series are looked up by Variable::get_series_exposed() when
+    // `with_series' is true.
+    explicit SnapshotDumper(bool with_series);
+
+    bool dump(const std::string& name, const butil::StringPiece& desc);
+    bool dump_int(const std::string& name, int64_t value);
+
+    void set_with_series(bool with_series) { _with_series = with_series; }
+
+    const std::string& payload() const { return _payload; }
+    // Number of variables in the payload.
+    uint32_t count() const { return _count; }
+    void clear();
+
+private:
+    void append_record(const std::string& name, uint8_t flags,
+                       const void* value);
+
+    bool _with_series;
+    uint32_t _count;
+    std::string _payload;
+    std::vector<double> _series;
+};
+
+// Writer of the ring file.
+class SnapshotFile {
+public:
+    SnapshotFile();
+    ~SnapshotFile() { close(); }
+
+    // Create the file at `path' with `nslot' slots holding payloads up to
+    // `slot_size' bytes. An existing file is replaced atomically so that
+    // readers still mapping it are not broken.
+    // Returns 0 on success, -1 otherwise.
+    int open(const std::string& path, uint32_t nslot, uint64_t slot_size);
+    void close();
+
+    // Write a snapshot into the next slot.
+    // Returns 0 on success, -1 otherwise (not opened or payload too large).
+    int write(const butil::StringPiece& payload, uint32_t nvar,
+              int64_t time_us);
+
+    const std::string& path() const { return _path; }
+    uint32_t nslot() const { return _nslot; }
+    uint64_t slot_size() const { return _slot_size; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SnapshotFile);
+
+    std::string _path;
+    uint32_t _nslot;
+    uint64_t _slot_size;
+    uint64_t _seq;
+    char* _addr;
+    size_t _length;
+};
+
+struct SnapshotEntry {
+    SnapshotEntry() : is_int(false), int_value(0), value(0) {}
+
+    std::string name;
+    bool is_int;
+    int64_t int_value;
+    double value;
+    // Empty if the variable does not save series.
+    std::vector<double> series;
+};
+
+// Copy the latest complete snapshot in the ring file `path' into `payload'.
+// `time_us' and `seq' are optional.
+// Returns 0 on success, -1 otherwise (no such file, bad format or no
+// snapshot yet).
+int read_latest_snapshot(const std::string& path, std::string* payload,
+                         int64_t* time_us, uint64_t* seq);
+
+// Parse `payload' of a snapshot into `entries'.
+// Returns 0 on success, -1 when the payload is malformed.
+int parse_snapshot(const butil::StringPiece& payload,
+                   std::vector<SnapshotEntry>* entries);
+
+}  // namespace bvar
+
+#endif  // BVAR_SNAPSHOT_H
@@ -101,6 +101,10 @@ public:
     void describe(std::ostream& os, bool /*quote_string*/) const {
         os << get_value();
     }
+
+    bool get_int_value(int64_t* value) const {
+        return detail::IntValue<T>::get(*this, value);
+    }
     
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const {
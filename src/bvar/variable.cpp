@@ -16,6 +16,7 @@
 // Date: 2014/09/22 19:04:47
 
 #include <pthread.h>
+#include <inttypes.h>                           // PRId64
 #include <set>                                  // std::set
 #include <fstream>                              // std::ifstream
 #include <sstream>                              // std::ostringstream
@@ -29,6 +30,7 @@
 #include "butil/file_util.h"                     // butil::FilePath
 #include "bvar/gflag.h"
 #include "bvar/variable.h"
+#include "bvar/detail/wildcard_matcher.h"
 
 namespace bvar {
 
@@ -292,6 +294,16 @@ int Variable::describe_series_exposed(const std::string& name,
     return p->var->describe_series(os, options);
 }
 
+int Variable::get_series_exposed(const std::string& name, double* values) {
+    VarMapWithLock& m = get_var_map(name);
+    BAIDU_SCOPED_LOCK(m.mutex);
+    VarEntry* p = m.seek(name);
+    if (p == NULL) {
+        return -1;
+    }
+    return p->var->get_series(values);
+}
+
 #ifdef BAIDU_INTERNAL
 int Variable::get_exposed(const std::string& name, boost::any* value) {
     VarMapWithLock& m = get_var_map(name);
@@ -362,99 +374,56 @@ void CharArrayStreamBuf::reset() {
 }
 
 
-// Written by Jack Handy
-// <A href="mailto:jakkhandy@hotmail.com">jakkhandy@hotmail.com</A>
-inline bool wildcmp(const char* wild, const char* str, char question_mark) {
-    const char* cp = NULL;
-    const char* mp = NULL;
-
-    while (*str && *wild != '*') {
-        if (*wild != *str && *wild != question_mark) {
-            return false;
-        }
-        ++wild;
-        ++str;
-    }
-
-    while (*str) {
-        if (*wild == '*') {
-            if (!*++wild) {
-                return true;
-            }
-            mp = wild;
-            cp = str+1;
-        } else if (*wild == *str || *wild == question_mark) {
-            ++wild;
-            ++str;
-        } else {
-            wild = mp;
-            str = cp++;
-        }
-    }
+DumpOptions::DumpOptions()
+    : quote_string(true)
+    , question_mark('?')
+    , display_filter(DISPLAY_ON_PLAIN_TEXT)
+{}
 
-    while (*wild == '*') {
-        ++wild;
-    }
-    return !*wild;
+bool Dumper::dump_int(const std::string& name, int64_t value) {
+    char buf[32];
+    const int len = snprintf(buf, sizeof(buf), "%" PRId64, value);
+    return dump(name, butil::StringPiece(buf, len));
 }
 
-class WildcardMatcher {
-public:
-    WildcardMatcher(const std::string& wildcards,
-                    char question_mark,
-                    bool on_both_empty)
-        : _question_mark(question_mark)
-        , _on_both_empty(on_both_empty) {
-        if (wildcards.empty()) {
-            return;
+// Send the exposed variable `name' to `dumper'. Integral values are sent
+// by Dumper::dump_int() without being described into `streambuf'.
+// Returns 1 on dumped, 0 if the variable is not found, -1 if `dumper' fails.
+static int dump_exposed_variable(const std::string& name,
+                                 Dumper* dumper,
+                                 const DumpOptions& opt,
+                                 CharArrayStreamBuf* streambuf,
+                                 std::ostream& os,
+                                 std::ostringstream* dumpped_info) {
+    int64_t int_value = 0;
+    bool is_int = false;
+    {
+        VarMapWithLock& m = get_var_map(name);
+        BAIDU_SCOPED_LOCK(m.mutex);
+        VarEntry* p = m.seek(name);
+        if (p == NULL || !(opt.display_filter & p->display_filter)) {
+            return 0;
         }
-        std::string name;
-        const char wc_pattern[3] = { '*', question_mark, '\0' };
-        for (butil::StringMultiSplitter sp(wildcards.c_str(), ",;");
-             sp != NULL; ++sp) {
-            name.assign(sp.field(), sp.length());
-            if (name.find_first_of(wc_pattern) != std::string::npos) {
-                if (_wcs.empty()) {
-                    _wcs.reserve(8);
-                }
-                _wcs.push_back(name);
-            } else {
-                _exact.insert(name);
-            }
+        is_int = p->var->get_int_value(&int_value);
+        if (!is_int) {
+            p->var->describe(os, opt.quote_string);
         }
     }
-    
-    bool match(const std::string& name) const {
-        if (!_exact.empty()) {
-            if (_exact.find(name) != _exact.end()) {
-                return true;
-            }
-        } else if (_wcs.empty()) {
-            return _on_both_empty;
-        }
-        for (size_t i = 0; i < _wcs.size(); ++i) {
-            if (wildcmp(_wcs[i].c_str(), name.c_str(), _question_mark)) {
-                return true;
-            }
+    if (is_int) {
+        if (dumpped_info) {
+            *dumpped_info << '\n' << name << ": " << int_value;
         }
-        return false;
+        return dumper->dump_int(name, int_value) ? 1 : -1;
     }
-
-    const std::vector<std::string>& wildcards() const { return _wcs; }
-    const std::set<std::string>& exact_names() const { return _exact; }
-
-private:
-    char _question_mark;
-    bool _on_both_empty;
-    std::vector<std::string> _wcs;
-    std::set<std::string> _exact;
-};
-
-DumpOptions::DumpOptions()
-    : quote_string(true)
-    , question_mark('?')
-    , display_filter(DISPLAY_ON_PLAIN_TEXT)
-{}
+    if (dumpped_info) {
+        *dumpped_info << '\n' << name << ": " << streambuf->data();
+    }
+    if (!dumper->dump(name, streambuf->data())) {
+        return -1;
+    }
+    streambuf->reset();
+    return 1;
+}
 
 int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
     if (NULL == dumper) {
@@ -476,7 +445,7 @@ int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
                                   true);
 
     std::ostringstream dumpped_info;
-    const bool log_dummped = FLAGS_bvar_log_dumpped;
+    std::ostringstream* pinfo = (FLAGS_bvar_log_dumpped ? &dumpped_info : NULL);
 
     if (white_matcher.wildcards().empty() &&
         !white_matcher.exact_names().empty()) {
@@ -485,18 +454,12 @@ int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
              it != white_matcher.exact_names().end(); ++it) {
             const std::string& name = *it;
             if (!black_matcher.match(name)) {
-                if (bvar::Variable::describe_exposed(
-                        name, os, opt.quote_string, opt.display_filter) != 0) {
-                    continue;
-                }
-                if (log_dummped) {
-                    dumpped_info << '\n' << name << ": " << streambuf.data();
-                }
-                if (!dumper->dump(name, streambuf.data())) {
+                const int rc = dump_exposed_variable(
+                    name, dumper, opt, &streambuf, os, pinfo);
+                if (rc < 0) {
                     return -1;
                 }
-                streambuf.reset();
-                ++count;
+                count += rc;
             }
         }
     } else {
@@ -509,22 +472,16 @@ int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
                  it = varnames.begin(); it != varnames.end(); ++it) {
             const std::string& name = *it;
             if (white_matcher.match(name) && !black_matcher.match(name)) {
-                if (bvar::Variable::describe_exposed(
-                        name, os, opt.quote_string, opt.display_filter) != 0) {
-                    continue;
-                }
-                if (log_dummped) {
-                    dumpped_info << '\n' << name << ": " << streambuf.data();
-                }
-                if (!dumper->dump(name, streambuf.data())) {
+                const int rc = dump_exposed_variable(
+                    name, dumper, opt, &streambuf, os, pinfo);
+                if (rc < 0) {
                     return -1;
                 }
-                streambuf.reset();
-                ++count;
+                count += rc;
             }
         }
     }
-    if (log_dummped) {
+    if (pinfo) {
         LOG(INFO) << "Dumpped variables:" << dumpped_info.str();
     }
     return count;
@@ -858,6 +815,8 @@ void to_underscored_name(std::string* name, const butil::StringPiece& src) {
 // At least working in gcc 4.8
 extern int do_link_default_variables;
 int dummy = do_link_default_variables;
+extern int do_link_snapshot;
+int dummy_snapshot = do_link_snapshot;
 #endif
 
 }  // namespace bvar
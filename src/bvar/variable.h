@@ -18,11 +18,14 @@
 #ifndef  BVAR_VARIABLE_H
 #define  BVAR_VARIABLE_H
 
+#include <stdint.h>                    // int64_t
 #include <ostream>                     // std::ostream
+#include <limits>                      // std::numeric_limits
 #include <string>                      // std::string
 #include <vector>                      // std::vector
 #include <gflags/gflags_declare.h>
 #include "butil/macros.h"               // DISALLOW_COPY_AND_ASSIGN
+#include "butil/type_traits.h"          // butil::is_integral
 #include "butil/strings/string_piece.h" // butil::StringPiece
 
 #ifdef BAIDU_INTERNAL
@@ -51,6 +54,12 @@ public:
     virtual ~Dumper() { }
     virtual bool dump(const std::string& name,
                       const butil::StringPiece& description) = 0;
+
+    // Called by Variable::dump_exposed() instead of dump() for variables
+    // whose values are integers, see Variable::get_int_value(). Override
+    // this method to write the value without printing and parsing it.
+    // The default implementation prints the value and calls dump().
+    virtual bool dump_int(const std::string& name, int64_t value);
 };
 
 // Options for Variable::dump_exposed().
@@ -105,6 +114,11 @@ public:
     // string form of describe().
     std::string get_description() const;
 
+    // Put the value into `value' if it's an integer and return true, so
+    // that Dumper can get the value without describe(). Subclasses with
+    // integral values should override this method.
+    virtual bool get_int_value(int64_t* /*value*/) const { return false; }
+
 #ifdef BAIDU_INTERNAL
     // Get value.
     // If subclass does not override this method, the value is the description
@@ -118,6 +132,12 @@ public:
     virtual int describe_series(std::ostream&, const SeriesOptions&) const
     { return 1; }
 
+    // Put saved series into `values' which has 174 slots, in the same order
+    // as describe_series(): 30 days, 24 hours, 60 minutes and 60 seconds.
+    // Returns 0 on success, 1 otherwise(this variable does not save series
+    // or values are not numbers).
+    virtual int get_series(double* /*values*/) const { return 1; }
+
     // Expose this variable globally so that it's counted in following
     // functions:
     //   list_exposed
@@ -191,6 +211,11 @@ public:
                                        std::ostream&,
                                        const SeriesOptions&);
 
+    // Put saved series of variable `name' into `values', see get_series().
+    // Returns 0 on success, 1 when the variable does not save series, -1
+    // otherwise (no variable named so).
+    static int get_series_exposed(const std::string& name, double* values);
+
 #ifdef BAIDU_INTERNAL
     // Find an exposed variable by `name' and put its value into `value'.
     // Returns 0 on found, -1 otherwise.
@@ -216,6 +241,32 @@ private:
     DISALLOW_COPY_AND_ASSIGN(Variable);
 };
 
+namespace detail {
+// Implement Variable::get_int_value() for variables whose values are of
+// type T, which are printed as numbers by describe().
+template <typename T, bool = (butil::is_integral<T>::value && sizeof(T) > 1)>
+struct IntValue {
+    template <typename V>
+    static bool get(const V&, int64_t*) { return false; }
+};
+
+template <typename T>
+struct IntValue<T, true> {
+    template <typename V>
+    static bool get(const V& var, int64_t* value) {
+        const T v = var.get_value();
+        // Unsigned values beyond int64_t are described as text instead of
+        // being shown as negative numbers.
+        if (!std::numeric_limits<T>::is_signed &&
+            (uint64_t)v > (uint64_t)std::numeric_limits<int64_t>::max()) {
+            return false;
+        }
+        *value = (int64_t)v;
+        return true;
+    }
+};
+}  // namespace detail
+
 // Make name only use lowercased alphabets / digits / underscores, and append
 // the result to `out'.
 // Examples:
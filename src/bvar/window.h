@@ -69,6 +69,7 @@ public:
             }
         }
         void describe(std::ostream& os) { _series.describe(os, NULL); }
+        bool get_values(double* values) { return _series.get_values(values); }
     private:
         WindowBase* _owner;
         detail::Series<value_type, Op> _series;
@@ -116,6 +117,10 @@ public:
             os << get_value();
         }
     }
+
+    bool get_int_value(int64_t* value) const {
+        return detail::IntValue<value_type>::get(*this, value);
+    }
     
 #ifdef BAIDU_INTERNAL
     void get_value(boost::any* value) const { *value = get_value(); }
@@ -133,6 +138,13 @@ public:
         return 0;
     }
 
+    int get_series(double* values) const {
+        if (_series_sampler == NULL) {
+            return 1;
+        }
+        return _series_sampler->get_values(values) ? 0 : 1;
+    }
+
     void get_samples(std::vector<value_type> *samples) const {
         samples->clear();
         samples->reserve(_window_size);
@@ -0,0 +1,66 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2014 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include "brpc/backup_request_policy.h"
+#include "echo.pb.h"
+
+namespace {
+
+const google::protobuf::MethodDescriptor* echo_method() {
+    return test::EchoService::descriptor()->FindMethodByName("Echo");
+}
+
+TEST(BackupRequestPolicyTest, percentile_threshold) {
+    brpc::AdaptiveBackupRequestOptions options;
+    options.percentile = 0.9;
+    options.min_samples = 100;
+    options.fallback_backup_request_ms = 7;
+    brpc::AdaptiveBackupRequestPolicy policy(&options);
+    const google::protobuf::MethodDescriptor* method = echo_method();
+    // Not enough samples.
+    ASSERT_EQ(7, policy.backup_request_ms(method));
+    ASSERT_EQ(7, policy.backup_request_ms(NULL));
+
+    brpc::AdaptiveBackupRequestPolicy::MethodLatency* ml =
+        policy.GetMethodLatency(method);
+    ASSERT_TRUE(ml != NULL);
+    ASSERT_EQ(ml, policy.GetMethodLatency(method));
+    // 90% of RPC finish in 2ms, others take 50ms.
+    for (int i = 0; i < 1000; ++i) {
+        ml->latency << (i % 10 == 0 ? 50000 : 2000);
+    }
+    usleep(2100000);  // wait for the window to be updated.
+    ml->next_update_us.store(0);
+    const int32_t ms = policy.backup_request_ms(method);
+    ASSERT_GE(ms, 2);
+    ASSERT_LE(ms, 50);
+    // Cached until next update.
+    for (int i = 0; i < 1000; ++i) {
+        ml->latency << 100000;
+    }
+    ASSERT_EQ(ms, policy.backup_request_ms(method));
+}
+
+TEST(BackupRequestPolicyTest, token_bucket) {
+    brpc::AdaptiveBackupRequestOptions options;
+    options.max_backup_ratio = 0.1;
+    options.max_burst = 2;
+    brpc::AdaptiveBackupRequestPolicy policy(&options);
+    ASSERT_FALSE(policy.DoBackup(NULL));
+    // Every RPC earns 0.1 token.
+    for (int i = 0; i < 10; ++i) {
+        policy.EarnTokens();
+    }
+    ASSERT_TRUE(policy.DoBackup(NULL));
+    ASSERT_FALSE(policy.DoBackup(NULL));
+    // Capped by max_burst.
+    for (int i = 0; i < 100; ++i) {
+        policy.EarnTokens();
+    }
+    ASSERT_TRUE(policy.DoBackup(NULL));
+    ASSERT_TRUE(policy.DoBackup(NULL));
+    ASSERT_FALSE(policy.DoBackup(NULL));
+}
+
+} // namespace
@@ -5,6 +5,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>                         // ntohl
 #include <fstream>
 #include <gtest/gtest.h>
 #include <gflags/gflags.h>
@@ -12,6 +13,8 @@
 #include "butil/gperftools_profiler.h"
 #include "butil/time.h"
 #include "butil/macros.h"
+#include "butil/file_util.h"
+#include "butil/files/temp_file.h"
 #include "brpc/socket.h"
 #include "brpc/server.h"
 #include "brpc/channel.h"
@@ -34,6 +37,8 @@
 #include "brpc/builtin/bthreads_service.h"     // BthreadsService
 #include "brpc/builtin/ids_service.h"          // IdsService
 #include "brpc/builtin/sockets_service.h"      // SocketsService
+#include "brpc/builtin/flamegraph_service.h"   // FlamegraphService
+#include "brpc/details/continuous_profiler.h"
 #include "brpc/builtin/common.h"
 #include "brpc/builtin/bad_method_service.h"
 #include "echo.pb.h"
@@ -44,6 +49,11 @@ BRPC_VALIDATE_GFLAG(foo, brpc::PassValidate);
 namespace brpc {
 DECLARE_bool(enable_rpcz);
 DECLARE_bool(rpcz_hex_log_id);
+DECLARE_int64(rpcz_slow_span_us);
+DECLARE_double(rpcz_fast_span_keep_ratio);
+DECLARE_bool(rpcz_index_spans);
+DECLARE_string(rpcz_export_file);
+DECLARE_int32(rpcz_export_batch_size);
 DECLARE_int32(idle_timeout_second);
 } // namespace rpc
 
@@ -631,6 +641,127 @@ TEST_F(BuiltinServiceTest, rpcz) {
     }
 }
 
+TEST_F(BuiltinServiceTest, rpcz_tail_sampling) {
+    const int64_t base_real_us = butil::gettimeofday_us();
+    brpc::Span* span = brpc::Span::CreateServerSpan(
+        "test.EchoService.Echo", 0, 0, 0, base_real_us);
+    ASSERT_TRUE(span != NULL);
+    span->set_received_us(0);
+    span->set_sent_us(100);
+    // All spans are kept by default.
+    EXPECT_TRUE(span->ShouldKeep());
+
+    brpc::FLAGS_rpcz_slow_span_us = 1000;
+    brpc::FLAGS_rpcz_fast_span_keep_ratio = 0;
+    EXPECT_FALSE(span->ShouldKeep());
+    brpc::FLAGS_rpcz_fast_span_keep_ratio = 1;
+    EXPECT_TRUE(span->ShouldKeep());
+    brpc::FLAGS_rpcz_fast_span_keep_ratio = 0;
+
+    // Slow spans are kept.
+    span->set_sent_us(1000);
+    EXPECT_TRUE(span->ShouldKeep());
+    span->set_sent_us(100);
+
+    // Spans with failed client spans are kept.
+    span->AsParent();
+    brpc::Span* client_span =
+        brpc::Span::CreateClientSpan("test.EchoService.Echo", base_real_us);
+    ASSERT_TRUE(client_span != NULL);
+    EXPECT_EQ(span, client_span->local_parent());
+    EXPECT_FALSE(span->ShouldKeep());
+    client_span->set_error_code(brpc::ERPCTIMEDOUT);
+    EXPECT_TRUE(span->ShouldKeep());
+
+    // Spans continuing upstream traces are kept.
+    brpc::Span* span2 = brpc::Span::CreateServerSpan(
+        "test.EchoService.Echo", 1, 2, 3, base_real_us);
+    ASSERT_TRUE(span2 != NULL);
+    span2->set_received_us(0);
+    span2->set_sent_us(100);
+    EXPECT_TRUE(span2->ShouldKeep());
+
+    brpc::FLAGS_rpcz_slow_span_us = 0;
+    brpc::FLAGS_rpcz_fast_span_keep_ratio = 0.01;
+    span->destroy();
+    span2->destroy();
+}
+
+// Id of `len' bytes with `id' at the lower 8 bytes in big-endian.
+static std::string OtlpIdOf(uint64_t id, size_t len) {
+    std::string s(len, '\0');
+    for (size_t i = 0; i < sizeof(id); ++i) {
+        s[len - 1 - i] = (char)(id >> (8 * i));
+    }
+    return s;
+}
+
+TEST_F(BuiltinServiceTest, rpcz_export) {
+    butil::TempFile export_file;
+    brpc::FLAGS_rpcz_export_file = export_file.fname();
+    brpc::FLAGS_rpcz_export_batch_size = 1;
+    brpc::FLAGS_rpcz_index_spans = false;
+
+    const int64_t base_real_us = butil::gettimeofday_us();
+    brpc::Span* span = brpc::Span::CreateServerSpan(
+        "test.EchoService.Echo", 0, 0, 0, base_real_us);
+    ASSERT_TRUE(span != NULL);
+    span->set_received_us(0);
+    span->set_sent_us(100);
+    span->AsParent();
+    brpc::Span* client_span =
+        brpc::Span::CreateClientSpan("test.EchoService.Echo", base_real_us);
+    ASSERT_TRUE(client_span != NULL);
+    client_span->set_error_code(brpc::ERPCTIMEDOUT);
+    const uint64_t trace_id = span->trace_id();
+    const uint64_t span_id = span->span_id();
+    const uint64_t client_span_id = client_span->span_id();
+    span->dump_and_destroy(1);
+
+    // Written by the exporting thread within a second.
+    std::string content;
+    for (int i = 0; i < 30 && content.size() <= sizeof(uint32_t); ++i) {
+        usleep(100000);
+        ASSERT_TRUE(butil::ReadFileToString(
+                        butil::FilePath(export_file.fname()), &content));
+    }
+    brpc::FLAGS_rpcz_export_file.clear();
+    brpc::FLAGS_rpcz_export_batch_size = 1024;
+    brpc::FLAGS_rpcz_index_spans = true;
+
+    ASSERT_LT(sizeof(uint32_t), content.size());
+    uint32_t len = 0;
+    memcpy(&len, content.data(), sizeof(len));
+    len = ntohl(len);
+    ASSERT_EQ(sizeof(uint32_t) + len, content.size());
+    brpc::OtlpTracesData data;
+    ASSERT_TRUE(data.ParseFromArray(content.data() + sizeof(uint32_t), len));
+    ASSERT_EQ(1, data.resource_spans_size());
+    ASSERT_EQ(1, data.resource_spans(0).scope_spans_size());
+    const brpc::OtlpScopeSpans& scope_spans =
+        data.resource_spans(0).scope_spans(0);
+    ASSERT_EQ("brpc", scope_spans.scope().name());
+    ASSERT_EQ(2, scope_spans.spans_size());
+
+    const brpc::OtlpSpan& server = scope_spans.spans(0);
+    ASSERT_EQ(OtlpIdOf(trace_id, 16), server.trace_id());
+    ASSERT_EQ(OtlpIdOf(span_id, 8), server.span_id());
+    ASSERT_FALSE(server.has_parent_span_id());
+    ASSERT_EQ("test.EchoService.Echo", server.name());
+    ASSERT_EQ(brpc::OTLP_SPAN_KIND_SERVER, server.kind());
+    ASSERT_EQ((uint64_t)base_real_us * 1000, server.start_time_unix_nano());
+    ASSERT_EQ((uint64_t)(base_real_us + 100) * 1000,
+              server.end_time_unix_nano());
+    ASSERT_FALSE(server.has_status());
+
+    const brpc::OtlpSpan& client = scope_spans.spans(1);
+    ASSERT_EQ(OtlpIdOf(trace_id, 16), client.trace_id());
+    ASSERT_EQ(OtlpIdOf(client_span_id, 8), client.span_id());
+    ASSERT_EQ(OtlpIdOf(span_id, 8), client.parent_span_id());
+    ASSERT_EQ(brpc::OTLP_SPAN_KIND_CLIENT, client.kind());
+    ASSERT_EQ(brpc::OTLP_STATUS_CODE_ERROR, client.status().code());
+}
+
 TEST_F(BuiltinServiceTest, pprof) {
     brpc::PProfService service;
     {
@@ -817,3 +948,95 @@ TEST_F(BuiltinServiceTest, sockets) {
         CheckContent(cntl, "fd=-1");
     }    
 }
+
+static void* burn_cpu_with_tag(void*) {
+    brpc::SetProfilingTag("test.Burn");
+    const int64_t end_time = butil::cpuwide_time_us() + 1000000;
+    volatile uint64_t x = 0;
+    while (butil::cpuwide_time_us() < end_time) {
+        for (int i = 0; i < 1000; ++i) {
+            x = x * 31 + i;
+        }
+    }
+    brpc::SetProfilingTag(NULL);
+    return NULL;
+}
+
+TEST_F(BuiltinServiceTest, flamegraph) {
+    if (!brpc::IsContinuousProfilingSupported()) {
+        return;
+    }
+    ASSERT_TRUE(GFLAGS_NS::SetCommandLineOption(
+                    "continuous_profiling_frequency", "0").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "enable_continuous_profiling", "true").empty());
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, burn_cpu_with_tag, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    // Wait for the collector.
+    usleep(300000);
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "enable_continuous_profiling", "false").empty());
+
+    std::map<std::string, int64_t> folded;
+    ASSERT_LT(0, brpc::GetFoldedStacks(0, 0, &folded));
+    int64_t ntagged = 0;
+    for (std::map<std::string, int64_t>::const_iterator
+             it = folded.begin(); it != folded.end(); ++it) {
+        if (it->first.compare(0, 10, "test.Burn;") == 0) {
+            ntagged += it->second;
+        }
+    }
+    // ~99 samples are expected.
+    ASSERT_LT(50, ntagged);
+
+    // Tagged samples are all taken in the bthread.
+    ASSERT_LE(ntagged, brpc::GetFoldedStacks(0, th, &folded));
+    int64_t ntagged_in_bthread = 0;
+    for (std::map<std::string, int64_t>::const_iterator
+             it = folded.begin(); it != folded.end(); ++it) {
+        if (it->first.compare(0, 10, "test.Burn;") == 0) {
+            ntagged_in_bthread += it->second;
+        }
+    }
+    ASSERT_EQ(ntagged, ntagged_in_bthread);
+
+    brpc::FlamegraphService service;
+    brpc::FlamegraphRequest req;
+    brpc::FlamegraphResponse res;
+    {
+        ClosureChecker done;
+        brpc::Controller cntl;
+        SetUpController(&cntl, false);
+        service.default_method(&cntl, &req, &res, &done);
+        EXPECT_FALSE(cntl.Failed());
+        CheckContent(cntl, "test.Burn;");
+    }
+    {
+        ClosureChecker done;
+        brpc::Controller cntl;
+        SetUpController(&cntl, true);
+        service.default_method(&cntl, &req, &res, &done);
+        EXPECT_FALSE(cntl.Failed());
+        CheckContent(cntl, "class=\"frame\"");
+        CheckContent(cntl, "test.Burn");
+    }
+    {
+        ClosureChecker done;
+        brpc::Controller cntl;
+        SetUpController(&cntl, false);
+        cntl.http_request().uri().SetQuery("seconds", "abc");
+        service.default_method(&cntl, &req, &res, &done);
+        EXPECT_TRUE(cntl.Failed());
+    }    {
+        ClosureChecker done;
+        brpc::Controller cntl;
+        SetUpController(&cntl, false);
+        std::string id_string;
+        butil::string_printf(&id_string, "%llu", (unsigned long long)th);
+        cntl.http_request().uri().SetQuery("bthread", id_string);
+        service.default_method(&cntl, &req, &res, &done);
+        EXPECT_FALSE(cntl.Failed());
+        CheckContent(cntl, "test.Burn;");
+    }
+}
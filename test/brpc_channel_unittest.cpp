@@ -30,6 +30,7 @@
 namespace brpc {
 DECLARE_int32(idle_timeout_second);
 DECLARE_int32(max_connection_pool_size);
+DECLARE_bool(share_lb_among_channels);
 class Server;
 class MethodStatus;
 namespace policy {
@@ -115,6 +116,8 @@ static bool VerifyMyRequest(const brpc::InputMessageBase* msg_base) {
     return true;
 }
 
+butil::atomic<int> g_echo_count(0);
+
 class MyEchoService : public ::test::EchoService {
     void Echo(google::protobuf::RpcController* cntl_base,
               const ::test::EchoRequest* req,
@@ -123,6 +126,7 @@ class MyEchoService : public ::test::EchoService {
         brpc::Controller* cntl =
             static_cast<brpc::Controller*>(cntl_base);
         brpc::ClosureGuard done_guard(done);
+        g_echo_count.fetch_add(1, butil::memory_order_relaxed);
         if (req->server_fail()) {
             cntl->SetFailed(req->server_fail(), "Server fail1");
             cntl->SetFailed(req->server_fail(), "Server fail2");
@@ -1942,6 +1946,46 @@ TEST_F(ChannelTest, init_using_naming_service) {
     // `lb' should be destroyed after
 }
 
+TEST_F(ChannelTest, share_lb_among_channels) {
+    butil::TempFile server_list;
+    ASSERT_EQ(0, server_list.save("127.0.0.1:8888\n127.0.0.1:8889"));
+    const std::string naming_url = std::string("file://") + server_list.fname();
+    brpc::FLAGS_share_lb_among_channels = true;
+    brpc::SharedLoadBalancer* shared_lb = NULL;
+    {
+        const int NUM = 10;
+        brpc::Channel channels[NUM];
+        for (int i = 0; i < NUM; ++i) {
+            ASSERT_EQ(0, channels[i].Init(naming_url.c_str(), "rr", NULL));
+            if (shared_lb == NULL) {
+                shared_lb = channels[i]._lb.get();
+            }
+            ASSERT_EQ(shared_lb, channels[i]._lb.get());
+        }
+        ASSERT_EQ(NUM, shared_lb->_nref.load());
+        ASSERT_EQ(2, shared_lb->Weight());
+
+        // Different load balancers or options are not shared.
+        brpc::Channel la_channel;
+        ASSERT_EQ(0, la_channel.Init(naming_url.c_str(), "la", NULL));
+        ASSERT_NE(shared_lb, la_channel._lb.get());
+        brpc::ChannelOptions options;
+        options.connection_group = "other";
+        brpc::Channel other_channel;
+        ASSERT_EQ(0, other_channel.Init(naming_url.c_str(), "rr", &options));
+        ASSERT_NE(shared_lb, other_channel._lb.get());
+    }
+    // A new instance is created after all channels are destroyed.
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(naming_url.c_str(), "rr", NULL));
+    ASSERT_EQ(1, channel._lb->_nref.load());
+
+    brpc::FLAGS_share_lb_among_channels = false;
+    brpc::Channel channel2;
+    ASSERT_EQ(0, channel2.Init(naming_url.c_str(), "rr", NULL));
+    ASSERT_NE(channel._lb.get(), channel2._lb.get());
+}
+
 TEST_F(ChannelTest, connection_failed) {
     for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
         for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
@@ -2586,4 +2630,272 @@ TEST_F(ChannelTest, adaptive_protocol_type) {
     ASSERT_EQ("", ptype.param());
 }
 
+struct CoalescedCall {
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    bthread_t tid;
+    brpc::Channel* channel;
+};
+
+static void* RunCoalescedCall(void* arg) {
+    CoalescedCall* c = static_cast<CoalescedCall*>(arg);
+    test::EchoService::Stub(c->channel).Echo(&c->cntl, &c->req, &c->res, NULL);
+    return NULL;
+}
+
+TEST_F(ChannelTest, request_coalescing) {
+    ASSERT_EQ(0, StartAccept(_ep));
+    brpc::ChannelOptions opt;
+    opt.enable_request_coalescing = true;
+    opt.timeout_ms = 2000;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(_ep, &opt));
+
+    const int N = 8;
+    CoalescedCall sync_calls[N];
+    CoalescedCall async_calls[N];
+    g_echo_count.store(0);
+    for (int i = 0; i < N; ++i) {
+        sync_calls[i].channel = &channel;
+        sync_calls[i].req.set_message("coalesced");
+        // The first RPC keeps others in flight.
+        sync_calls[i].req.set_sleep_us(200000);
+        ASSERT_EQ(0, bthread_start_background(
+                      &sync_calls[i].tid, NULL, RunCoalescedCall, &sync_calls[i]));
+        async_calls[i].req.set_message("coalesced");
+        async_calls[i].req.set_sleep_us(200000);
+        async_calls[i].cntl.request_attachment().append("attached");
+        test::EchoService::Stub(&channel).Echo(
+            &async_calls[i].cntl, &async_calls[i].req,
+            &async_calls[i].res, brpc::DoNothing());
+    }
+    // A different request is never merged.
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message("not coalesced");
+    CallMethod(&channel, &cntl, &req, &res, false);
+    EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+    EXPECT_EQ("received not coalesced", res.message());
+
+    for (int i = 0; i < N; ++i) {
+        bthread_join(sync_calls[i].tid, NULL);
+        brpc::Join(async_calls[i].cntl.call_id());
+        EXPECT_EQ(0, sync_calls[i].cntl.ErrorCode())
+            << sync_calls[i].cntl.ErrorText();
+        EXPECT_EQ("received coalesced", sync_calls[i].res.message());
+        EXPECT_EQ(_ep, sync_calls[i].cntl.remote_side());
+        EXPECT_EQ(0, async_calls[i].cntl.ErrorCode())
+            << async_calls[i].cntl.ErrorText();
+        EXPECT_EQ("received coalesced", async_calls[i].res.message());
+    }
+    // The sync ones and the async ones (which have a different attachment)
+    // are merged separately, plus the different request. Async calls join
+    // the flight before CallMethod() returns, a sync one may take one more
+    // round only if its bthread started after the 200ms leader returned.
+    EXPECT_GE(g_echo_count.load(), 3);
+    EXPECT_LE(g_echo_count.load(), 4);
+    EXPECT_EQ(0u, channel._coalescer->inflight_count());
+
+    // Errors are copied as well.
+    CoalescedCall failed_calls[2];
+    for (int i = 0; i < 2; ++i) {
+        failed_calls[i].channel = &channel;
+        failed_calls[i].req.set_message("fail");
+        failed_calls[i].req.set_sleep_us(100000);
+        failed_calls[i].cntl.set_timeout_ms(50);
+        ASSERT_EQ(0, bthread_start_background(
+                      &failed_calls[i].tid, NULL, RunCoalescedCall,
+                      &failed_calls[i]));
+    }
+    for (int i = 0; i < 2; ++i) {
+        bthread_join(failed_calls[i].tid, NULL);
+        EXPECT_EQ(brpc::ERPCTIMEDOUT, failed_calls[i].cntl.ErrorCode());
+    }
+    StopAndJoin();
+}
+
+TEST_F(ChannelTest, response_cache) {
+    ASSERT_EQ(0, StartAccept(_ep));
+    brpc::ResponseCache cache(NULL);
+    ASSERT_EQ(0, cache.SetTTL("test.EchoService.Echo", 200));
+    brpc::ChannelOptions opt;
+    opt.response_cache = &cache;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(_ep, &opt));
+
+    g_echo_count.store(0);
+    for (int i = 0; i < 3; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message("cached");
+        CallMethod(&channel, &cntl, &req, &res, i % 2);
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_EQ("received cached", res.message());
+        EXPECT_EQ(_ep, cntl.remote_side());
+    }
+    EXPECT_EQ(1, g_echo_count.load());
+    EXPECT_EQ(1u, cache.size());
+
+    // Different requests and failed RPC are not cached.
+    for (int i = 0; i < 2; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message("failed");
+        req.set_server_fail(brpc::EINTERNAL);
+        CallMethod(&channel, &cntl, &req, &res, false);
+        EXPECT_EQ(brpc::EINTERNAL, cntl.ErrorCode());
+    }
+    EXPECT_EQ(3, g_echo_count.load());
+    EXPECT_EQ(1u, cache.size());
+
+    // Expired.
+    bthread_usleep(250000);
+    {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message("cached");
+        CallMethod(&channel, &cntl, &req, &res, false);
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_EQ("received cached", res.message());
+    }
+    EXPECT_EQ(4, g_echo_count.load());
+    StopAndJoin();
+}
+
+TEST_F(ChannelTest, adaptive_backup_request) {
+    ASSERT_EQ(0, StartAccept(_ep));
+    for (int budget = 0; budget < 2; ++budget) {
+        brpc::AdaptiveBackupRequestOptions policy_opt;
+        // Always use the fallback threshold.
+        policy_opt.min_samples = 1000000;
+        policy_opt.fallback_backup_request_ms = 10;
+        policy_opt.max_backup_ratio = budget;
+        brpc::AdaptiveBackupRequestPolicy policy(&policy_opt);
+        brpc::ChannelOptions opt;
+        opt.backup_request_policy = &policy;
+        opt.max_retry = 1;
+        opt.timeout_ms = 1000;
+        brpc::Channel channel;
+        ASSERT_EQ(0, channel.Init(_ep, &opt));
+
+        g_echo_count.store(0);
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(__FUNCTION__);
+        req.set_sleep_us(50000);
+        CallMethod(&channel, &cntl, &req, &res, false);
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_EQ(10, cntl.backup_request_ms());
+        // Wait for the backup request, if any, to reach the server.
+        bthread_usleep(100000);
+        // No budget, the backup request is suppressed.
+        EXPECT_EQ(budget ? 2 : 1, g_echo_count.load());
+        EXPECT_EQ(budget ? 1 : 0, cntl.retried_count());
+    }
+    StopAndJoin();
+}
+
+// Echo after sleeping for req->sleep_us().
+class SleepyEchoService : public ::test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController*,
+              const ::test::EchoRequest* req,
+              ::test::EchoResponse* res,
+              google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        if (req->sleep_us() > 0) {
+            bthread_usleep(req->sleep_us());
+        }
+        res->set_message(req->message());
+    }
+};
+
+TEST_F(ChannelTest, max_concurrency_per_server) {
+    SleepyEchoService svc;
+    brpc::Server servers[2];
+    for (int i = 0; i < 2; ++i) {
+        ASSERT_EQ(0, servers[i].AddService(&svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+        ASSERT_EQ(0, servers[i].Start(8931 + i, NULL));
+    }
+    brpc::ChannelOptions opt;
+    opt.max_concurrency_per_server = 1;
+    opt.timeout_ms = 2000;
+    opt.max_retry = 0;
+    test::EchoRequest slow_req;
+    slow_req.set_message("slow");
+    slow_req.set_sleep_us(300000);
+    test::EchoRequest req;
+    req.set_message("fast");
+
+    // Calls beyond the limit fail with ELIMIT without being sent.
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:8931", &opt));
+    ASSERT_TRUE(channel._max_concurrency_per_server != NULL);
+    brpc::Controller slow_cntl;
+    test::EchoResponse slow_res;
+    test::EchoService::Stub(&channel).Echo(
+        &slow_cntl, &slow_req, &slow_res, brpc::DoNothing());
+    brpc::Controller cntl;
+    test::EchoResponse res;
+    test::EchoService::Stub(&channel).Echo(&cntl, &req, &res, NULL);
+    ASSERT_EQ(brpc::ELIMIT, cntl.ErrorCode()) << cntl.ErrorText();
+    brpc::Join(slow_cntl.call_id());
+    ASSERT_EQ(0, slow_cntl.ErrorCode()) << slow_cntl.ErrorText();
+    // The slot is released when the call completes.
+    cntl.Reset();
+    test::EchoService::Stub(&channel).Echo(&cntl, &req, &res, NULL);
+    ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+
+    // Calls rejected by a busy server are retried on other servers.
+    opt.max_retry = 3;
+    brpc::Channel lb_channel;
+    ASSERT_EQ(0, lb_channel.Init("list://127.0.0.1:8931,127.0.0.1:8932",
+                                 "rr", &opt));
+    slow_cntl.Reset();
+    test::EchoService::Stub(&lb_channel).Echo(
+        &slow_cntl, &slow_req, &slow_res, brpc::DoNothing());
+    const butil::EndPoint busy = slow_cntl.remote_side();
+    for (int i = 0; i < 4; ++i) {
+        cntl.Reset();
+        test::EchoService::Stub(&lb_channel).Echo(&cntl, &req, &res, NULL);
+        ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        ASSERT_NE(busy, cntl.remote_side());
+    }
+    brpc::Join(slow_cntl.call_id());
+    ASSERT_EQ(0, slow_cntl.ErrorCode()) << slow_cntl.ErrorText();
+
+    // Slots of both the original call and the backup request are released
+    // when the RPC ends, even if the other server is still processing.
+    opt.backup_request_ms = 50;
+    brpc::Channel backup_channel;
+    ASSERT_EQ(0, backup_channel.Init("list://127.0.0.1:8931,127.0.0.1:8932",
+                                     "rr", &opt));
+    cntl.Reset();
+    req.set_sleep_us(200000);
+    test::EchoService::Stub(&backup_channel).Echo(&cntl, &req, &res, NULL);
+    ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+    ASSERT_EQ(1, cntl.retried_count());
+    brpc::Controller cntls[2];
+    test::EchoResponse responses[2];
+    for (int i = 0; i < 2; ++i) {
+        test::EchoService::Stub(&lb_channel).Echo(
+            &cntls[i], &slow_req, &responses[i], brpc::DoNothing());
+    }
+    for (int i = 0; i < 2; ++i) {
+        brpc::Join(cntls[i].call_id());
+        ASSERT_EQ(0, cntls[i].ErrorCode()) << cntls[i].ErrorText();
+    }
+    ASSERT_NE(cntls[0].remote_side(), cntls[1].remote_side());
+    for (int i = 0; i < 2; ++i) {
+        servers[i].Stop(0);
+        servers[i].Join();
+    }
+}
+
 } //namespace
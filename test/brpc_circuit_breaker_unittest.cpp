@@ -7,6 +7,7 @@
 #include <gtest/gtest.h>
 #include <gflags/gflags.h>
 #include "butil/macros.h"
+#include "butil/time.h"
 #include "bthread/bthread.h"
 #include "brpc/circuit_breaker.h"
 #include "brpc/socket.h"
@@ -38,6 +39,11 @@ DECLARE_int32(circuit_breaker_short_window_error_percent);
 DECLARE_int32(circuit_breaker_long_window_error_percent);
 DECLARE_int32(circuit_breaker_min_isolation_duration_ms);
 DECLARE_int32(circuit_breaker_max_isolation_duration_ms);
+DECLARE_bool(circuit_breaker_enable_outlier_detection);
+DECLARE_int32(circuit_breaker_outlier_min_samples);
+DECLARE_int32(circuit_breaker_outlier_consecutive_intervals);
+DECLARE_int32(circuit_breaker_outlier_detection_interval_ms);
+DECLARE_int32(circuit_breaker_max_ejection_percent);
 } // namespace brpc
 
 int main(int argc, char* argv[]) {
@@ -185,3 +191,107 @@ TEST_F(CircuitBreakerTest, isolation_duration_grow) {
     }
     EXPECT_EQ(_circuit_breaker.isolation_duration_ms(), kMinIsolationDurationMs);
 }
+
+// Sleep until the next interval of latencies of circuit breakers begins.
+static void WaitForNextLatencyInterval() {
+    const int64_t interval_ms =
+        brpc::FLAGS_circuit_breaker_outlier_detection_interval_ms;
+    bthread_usleep((interval_ms - butil::cpuwide_time_ms() % interval_ms + 1)
+                   * 1000L);
+}
+
+TEST_F(CircuitBreakerTest, latency_percentile) {
+    brpc::FLAGS_circuit_breaker_enable_outlier_detection = true;
+    const int32_t saved_interval =
+        brpc::FLAGS_circuit_breaker_outlier_detection_interval_ms;
+    brpc::FLAGS_circuit_breaker_outlier_detection_interval_ms = 100;
+    brpc::CircuitBreaker cb;
+    WaitForNextLatencyInterval();
+    for (int i = 1; i <= 1000; ++i) {
+        EXPECT_TRUE(cb.OnCallEnd(kErrorCodeForSucc, i * 10));
+    }
+    // Failed calls are not counted.
+    cb.OnCallEnd(kErrorCodeForFailed, 1000000);
+    int64_t nsample = 0;
+    // Latencies of the current interval are not read.
+    EXPECT_EQ(0, cb.GetLatencyPercentile(0.99, &nsample));
+    EXPECT_EQ(0, nsample);
+    WaitForNextLatencyInterval();
+    const int64_t p99 = cb.GetLatencyPercentile(0.99, &nsample);
+    EXPECT_EQ(1000, nsample);
+    EXPECT_LE(9900 * 3 / 4, p99);
+    EXPECT_GE(9900 * 5 / 4, p99);
+    // Reading does not clear latencies, so that detectors sharing the
+    // socket get the same result.
+    EXPECT_EQ(p99, cb.GetLatencyPercentile(0.99, &nsample));
+    EXPECT_EQ(1000, nsample);
+    // Aged out after another interval.
+    WaitForNextLatencyInterval();
+    EXPECT_EQ(0, cb.GetLatencyPercentile(0.99, &nsample));
+    EXPECT_EQ(0, nsample);
+    brpc::FLAGS_circuit_breaker_outlier_detection_interval_ms = saved_interval;
+    brpc::FLAGS_circuit_breaker_enable_outlier_detection = false;
+}
+
+TEST_F(CircuitBreakerTest, latency_outlier_detection) {
+    brpc::FLAGS_circuit_breaker_enable_outlier_detection = true;
+    const int32_t saved_percent = brpc::FLAGS_circuit_breaker_max_ejection_percent;
+    // 10% of 5 servers is rounded up to 1.
+    brpc::FLAGS_circuit_breaker_max_ejection_percent = 10;
+    const int32_t saved_interval =
+        brpc::FLAGS_circuit_breaker_outlier_detection_interval_ms;
+    brpc::FLAGS_circuit_breaker_outlier_detection_interval_ms = 100;
+    std::vector<brpc::SocketId> ids;
+    for (int i = 0; i < 5; ++i) {
+        brpc::SocketOptions options;
+        options.remote_side = butil::EndPoint(butil::my_ip(), 7000 + i);
+        brpc::SocketId id;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+        ids.push_back(id);
+    }
+    // Another detector sharing the sockets, e.g. of another channel, does
+    // not drain latencies read by `detector'.
+    brpc::LatencyOutlierDetector detector;
+    brpc::LatencyOutlierDetector other_detector;
+    for (int round = 0;
+         round < brpc::FLAGS_circuit_breaker_outlier_consecutive_intervals;
+         ++round) {
+        WaitForNextLatencyInterval();
+        for (size_t i = 0; i < ids.size(); ++i) {
+            brpc::SocketUniquePtr ptr;
+            ASSERT_EQ(0, brpc::Socket::Address(ids[i], &ptr));
+            // The first two servers are much slower than others.
+            const int64_t latency = (i < 2 ? kLatency * 10 : kLatency);
+            for (int j = 0; j < brpc::FLAGS_circuit_breaker_outlier_min_samples; ++j) {
+                ptr->FeedbackCircuitBreaker(kErrorCodeForSucc, latency);
+            }
+        }
+        WaitForNextLatencyInterval();
+        other_detector.Detect(ids);
+        detector.Detect(ids);
+        int nisolated = 0;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            brpc::SocketUniquePtr ptr;
+            if (brpc::Socket::Address(ids[i], &ptr) != 0) {
+                EXPECT_LT(i, 2ul);
+                ++nisolated;
+            }
+        }
+        // Only one of the slow servers is isolated due to the ejection
+        // percent.
+        if (round + 1 < brpc::FLAGS_circuit_breaker_outlier_consecutive_intervals) {
+            ASSERT_EQ(0, nisolated);
+        } else {
+            ASSERT_EQ(1, nisolated);
+        }
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        brpc::SocketUniquePtr ptr;
+        if (brpc::Socket::Address(ids[i], &ptr) == 0) {
+            ptr->SetFailed();
+        }
+    }
+    brpc::FLAGS_circuit_breaker_outlier_detection_interval_ms = saved_interval;
+    brpc::FLAGS_circuit_breaker_max_ejection_percent = saved_percent;
+    brpc::FLAGS_circuit_breaker_enable_outlier_detection = false;
+}
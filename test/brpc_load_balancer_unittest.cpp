@@ -5,7 +5,9 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <deque>
 #include <map>
+#include <set>
 #include <gtest/gtest.h>
 #include "bthread/bthread.h"
 #include "butil/gperftools_profiler.h"
@@ -21,12 +23,18 @@
 #include "brpc/policy/randomized_load_balancer.h"
 #include "brpc/policy/locality_aware_load_balancer.h"
 #include "brpc/policy/consistent_hashing_load_balancer.h"
+#include "brpc/policy/maglev_load_balancer.h"
+#include "brpc/policy/jump_consistent_hash_load_balancer.h"
+#include "brpc/policy/power_of_two_choices_load_balancer.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
+#include "brpc/policy/slow_start_load_balancer.h"
 #include "brpc/policy/hasher.h"
 #include "brpc/errno.pb.h"
 #include "echo.pb.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
 #include "brpc/server.h"
+#include "brpc/global.h"
 
 namespace brpc {
 DECLARE_int32(health_check_interval);
@@ -108,6 +116,148 @@ TEST_F(LoadBalancerTest, doubly_buffered_data) {
     }
 }
 
+struct Bar {
+    Bar() : x(0) {}
+    int64_t x;
+};
+
+size_t IncBar(Bar& b) {
+    ++b.x;
+    return 1;
+}
+
+struct ReadArg {
+    butil::DoublyBufferedData<Bar>* d;
+    volatile bool stop;
+    // Give up CPU in the middle of reading to make modifications more
+    // likely to overlap with reading.
+    bool yield_in_read;
+    butil::atomic<size_t> nread;
+    size_t nviolation;
+};
+
+void* read_and_check(void* void_arg) {
+    ReadArg* arg = (ReadArg*)void_arg;
+    size_t nviolation = 0;
+    while (!arg->stop) {
+        const size_t nread = arg->nread.fetch_add(1, butil::memory_order_relaxed);
+        {
+            butil::DoublyBufferedData<Bar>::ScopedPtr ptr;
+            if (arg->d->Read(&ptr) != 0) {
+                ++nviolation;
+                break;
+            }
+            // The instance must not be modified before `ptr' is destructed.
+            const int64_t x = ptr->x;
+            if (arg->yield_in_read && (nread & 0xFF) == 0) {
+                sched_yield();
+            }
+            if (*(volatile int64_t*)&ptr->x != x) {
+                ++nviolation;
+            }
+        }
+        if ((nread & 0xFF) == 0) {
+            sched_yield();
+        }
+    }
+    arg->nviolation = nviolation;
+    return NULL;
+}
+
+TEST_F(LoadBalancerTest, doubly_buffered_data_wait_free_read) {
+    butil::DoublyBufferedData<Bar> d;
+    ASSERT_FALSE(d.wait_free_read());
+    ASSERT_EQ(0, d.set_wait_free_read(true));
+    ASSERT_TRUE(d.wait_free_read());
+    {
+        butil::DoublyBufferedData<Bar>::ScopedPtr ptr;
+        ASSERT_EQ(0, d.Read(&ptr));
+        ASSERT_EQ(0, ptr->x);
+    }
+    // Too late to change the mode.
+    ASSERT_EQ(-1, d.set_wait_free_read(false));
+    ASSERT_TRUE(d.wait_free_read());
+
+    ReadArg args[8];
+    pthread_t th[ARRAY_SIZE(args)];
+    for (size_t i = 0; i < ARRAY_SIZE(args); ++i) {
+        args[i].d = &d;
+        args[i].stop = false;
+        args[i].yield_in_read = true;
+        args[i].nread = 0;
+        args[i].nviolation = 0;
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, read_and_check, &args[i]));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(args); ++i) {
+        while (args[i].nread.load(butil::memory_order_relaxed) == 0) {
+            usleep(1000);
+        }
+    }
+    const size_t NMODIFY = 10000;
+    for (size_t i = 0; i < NMODIFY; ++i) {
+        ASSERT_EQ(1u, d.Modify(IncBar));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(args); ++i) {
+        args[i].stop = true;
+        ASSERT_EQ(0, pthread_join(th[i], NULL));
+        ASSERT_EQ(0u, args[i].nviolation);
+    }
+    butil::DoublyBufferedData<Bar>::ScopedPtr ptr;
+    ASSERT_EQ(0, d.Read(&ptr));
+    ASSERT_EQ((int64_t)NMODIFY, ptr->x);
+}
+
+// Compare read throughput and latency of Modify() with or without
+// wait-free read as the number of reading threads grows.
+TEST_F(LoadBalancerTest, doubly_buffered_data_benchmark) {
+    const size_t nthreads[] = { 1, 4, 16, 64 };
+    for (int wait_free = 0; wait_free < 2; ++wait_free) {
+        for (size_t t = 0; t < ARRAY_SIZE(nthreads); ++t) {
+            butil::DoublyBufferedData<Bar> d;
+            ASSERT_EQ(0, d.set_wait_free_read(wait_free));
+            std::vector<ReadArg> args(nthreads[t]);
+            std::vector<pthread_t> th(nthreads[t]);
+            for (size_t i = 0; i < args.size(); ++i) {
+                args[i].d = &d;
+                args[i].stop = false;
+                args[i].yield_in_read = false;
+                args[i].nread = 0;
+                args[i].nviolation = 0;
+                ASSERT_EQ(0, pthread_create(&th[i], NULL, read_and_check, &args[i]));
+            }
+            // Update servers every millisecond as naming services with
+            // frequent changes do.
+            butil::Timer total_tm;
+            total_tm.start();
+            int64_t modify_sum_us = 0;
+            int64_t modify_max_us = 0;
+            size_t nmodify = 0;
+            for (; nmodify < 200; ++nmodify) {
+                butil::Timer tm;
+                tm.start();
+                d.Modify(IncBar);
+                tm.stop();
+                modify_sum_us += tm.u_elapsed();
+                modify_max_us = std::max(modify_max_us, tm.u_elapsed());
+                usleep(1000);
+            }
+            size_t nread = 0;
+            for (size_t i = 0; i < args.size(); ++i) {
+                args[i].stop = true;
+                ASSERT_EQ(0, pthread_join(th[i], NULL));
+                ASSERT_EQ(0u, args[i].nviolation);
+                nread += args[i].nread.load(butil::memory_order_relaxed);
+            }
+            total_tm.stop();
+            std::cout << (wait_free ? "wait_free" : "mutex")
+                      << " nthread=" << nthreads[t]
+                      << " read_qps=" << nread * 1000000 / total_tm.u_elapsed()
+                      << " modify_avg=" << modify_sum_us / nmodify << "us"
+                      << " modify_max=" << modify_max_us << "us" << std::endl;
+        }
+    }
+}
+
 typedef brpc::policy::LocalityAwareLoadBalancer LALB;
 
 static void ValidateWeightTree(
@@ -600,6 +750,645 @@ TEST_F(LoadBalancerTest, consistent_hashing) {
     }
 }
 
+void CreateServers(size_t n, std::vector<brpc::ServerId>* ids) {
+    for (size_t i = 0; i < n; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "10.%d.%d.%d:8080",
+                 (int)(i >> 16) & 0xFF, (int)(i >> 8) & 0xFF, (int)i & 0xFF);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids->push_back(id);
+    }
+}
+
+void SelectAll(brpc::LoadBalancer* lb, size_t nkeys,
+               std::vector<brpc::SocketId>* selected) {
+    selected->clear();
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, true, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    for (size_t i = 0; i < nkeys; ++i) {
+        in.request_code = brpc::policy::MurmurHash32(&i, sizeof(i));
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        selected->push_back(ptr->id());
+    }
+}
+
+TEST_F(LoadBalancerTest, maglev_and_jump) {
+    const size_t N = 20;
+    const size_t NKEYS = 100000;
+    brpc::LoadBalancer* lbs[] = {
+        new brpc::policy::MaglevLoadBalancer,
+        new brpc::policy::JumpConsistentHashLoadBalancer
+    };
+    for (size_t round = 0; round < ARRAY_SIZE(lbs); ++round) {
+        brpc::LoadBalancer* lb = lbs[round];
+        std::vector<brpc::ServerId> ids;
+        CreateServers(N, &ids);
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        ASSERT_EQ(EINVAL, lb->SelectServer(in, &out));
+        in.has_request_code = true;
+        ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+        ASSERT_EQ(N, lb->AddServersInBatch(ids));
+        // Adding existing servers is no-op.
+        ASSERT_FALSE(lb->AddServer(ids[0]));
+
+        std::vector<brpc::SocketId> before;
+        SelectAll(lb, NKEYS, &before);
+        std::map<brpc::SocketId, size_t> count;
+        for (size_t i = 0; i < before.size(); ++i) {
+            ++count[before[i]];
+        }
+        ASSERT_EQ(N, count.size());
+        for (std::map<brpc::SocketId, size_t>::const_iterator
+                 it = count.begin(); it != count.end(); ++it) {
+            ASSERT_GT(it->second, NKEYS / N / 2);
+            ASSERT_LT(it->second, NKEYS / N * 2);
+        }
+
+        // Only keys of the removed server should be moved.
+        const brpc::SocketId removed = ids[N / 2].id;
+        ASSERT_TRUE(lb->RemoveServer(ids[N / 2]));
+        std::vector<brpc::SocketId> after;
+        SelectAll(lb, NKEYS, &after);
+        size_t nmoved = 0;
+        for (size_t i = 0; i < NKEYS; ++i) {
+            ASSERT_NE(removed, after[i]);
+            if (before[i] != removed && before[i] != after[i]) {
+                ++nmoved;
+            }
+        }
+        std::cout << butil::class_name_str(*lb) << " moved " << nmoved
+                  << " keys of remaining servers" << std::endl;
+        ASSERT_LT(nmoved, NKEYS / 100);
+
+        // Destinations are restored after adding the server back.
+        ASSERT_TRUE(lb->AddServer(ids[N / 2]));
+        SelectAll(lb, NKEYS, &after);
+        ASSERT_TRUE(before == after);
+
+        // Excluded or failed servers are skipped.
+        brpc::ExcludedServers* excluded = brpc::ExcludedServers::Create(1);
+        excluded->Add(before[0]);
+        size_t zero = 0;
+        in.request_code = brpc::policy::MurmurHash32(&zero, sizeof(zero));
+        in.excluded = excluded;
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_NE(before[0], ptr->id());
+        in.excluded = NULL;
+        brpc::ExcludedServers::Destroy(excluded);
+        ASSERT_EQ(0, brpc::Socket::SetFailed(before[0]));
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_NE(before[0], ptr->id());
+
+        ASSERT_EQ(N, lb->RemoveServersInBatch(ids));
+        ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+        for (size_t i = 0; i < ids.size(); ++i) {
+            brpc::Socket::SetFailed(ids[i].id);
+        }
+        lb->Destroy();
+    }
+}
+
+TEST_F(LoadBalancerTest, maglev_table_size) {
+    const size_t N = 1000;
+    std::vector<brpc::ServerId> ids;
+    CreateServers(N, &ids);
+    brpc::policy::MaglevLoadBalancer lb;
+    ASSERT_EQ(N / 2, lb.AddServersInBatch(
+                  std::vector<brpc::ServerId>(ids.begin(), ids.begin() + N / 2)));
+    size_t table_size = 0;
+    {
+        butil::DoublyBufferedData<
+            brpc::policy::MaglevLoadBalancer::Table>::ScopedPtr s;
+        ASSERT_EQ(0, lb._db_table.Read(&s));
+        table_size = s->entries.size();
+    }
+    ASSERT_GE(table_size, N / 2 * 100);
+    ASSERT_EQ(N / 2, lb.AddServersInBatch(
+                  std::vector<brpc::ServerId>(ids.begin() + N / 2, ids.end())));
+    {
+        butil::DoublyBufferedData<
+            brpc::policy::MaglevLoadBalancer::Table>::ScopedPtr s;
+        ASSERT_EQ(0, lb._db_table.Read(&s));
+        ASSERT_GE(s->entries.size(), N * 100);
+    }
+    // Depends on the current servers only, no matter what the history is.
+    ASSERT_EQ(N / 2, lb.RemoveServersInBatch(
+                  std::vector<brpc::ServerId>(ids.begin(), ids.begin() + N / 2)));
+    brpc::policy::MaglevLoadBalancer lb2;
+    ASSERT_EQ(N / 2, lb2.AddServersInBatch(
+                  std::vector<brpc::ServerId>(ids.begin() + N / 2, ids.end())));
+    {
+        butil::DoublyBufferedData<
+            brpc::policy::MaglevLoadBalancer::Table>::ScopedPtr s;
+        ASSERT_EQ(0, lb._db_table.Read(&s));
+        butil::DoublyBufferedData<
+            brpc::policy::MaglevLoadBalancer::Table>::ScopedPtr s2;
+        ASSERT_EQ(0, lb2._db_table.Read(&s2));
+        ASSERT_EQ(table_size, s->entries.size());
+        ASSERT_EQ(s2->entries.size(), s->entries.size());
+        for (size_t i = 0; i < s->entries.size(); ++i) {
+            ASSERT_EQ(s2->backends[s2->entries[i]].server_addr,
+                      s->backends[s->entries[i]].server_addr);
+        }
+    }
+
+    // Specified size is fixed.
+    brpc::LoadBalancer* fixed_lb = lb.New("table_size=65537");
+    ASSERT_TRUE(fixed_lb != NULL);
+    ASSERT_EQ(N, fixed_lb->AddServersInBatch(ids));
+    {
+        butil::DoublyBufferedData<
+            brpc::policy::MaglevLoadBalancer::Table>::ScopedPtr s;
+        ASSERT_EQ(0, static_cast<brpc::policy::MaglevLoadBalancer*>(
+                      fixed_lb)->_db_table.Read(&s));
+        ASSERT_EQ(65537u, s->entries.size());
+    }
+    fixed_lb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        brpc::Socket::SetFailed(ids[i].id);
+    }
+}
+
+TEST_F(LoadBalancerTest, consistent_hashing_benchmark) {
+    const size_t N = 1000;
+    const size_t NSELECT = 1000000;
+    std::vector<brpc::ServerId> ids;
+    CreateServers(N, &ids);
+    brpc::LoadBalancer* lbs[] = {
+        new brpc::policy::ConsistentHashingLoadBalancer(
+            brpc::policy::CONS_HASH_LB_MURMUR3),
+        new brpc::policy::MaglevLoadBalancer,
+        new brpc::policy::JumpConsistentHashLoadBalancer
+    };
+    for (size_t round = 0; round < ARRAY_SIZE(lbs); ++round) {
+        brpc::LoadBalancer* lb = lbs[round];
+        butil::Timer tm;
+        tm.start();
+        ASSERT_EQ(N, lb->AddServersInBatch(ids));
+        tm.stop();
+        const int64_t add_batch_us = tm.u_elapsed();
+
+        // Servers added one by one, as they are brought up gradually.
+        tm.start();
+        ASSERT_EQ(N / 10, lb->RemoveServersInBatch(
+                      std::vector<brpc::ServerId>(ids.begin(), ids.begin() + N / 10)));
+        for (size_t i = 0; i < N / 10; ++i) {
+            ASSERT_TRUE(lb->AddServer(ids[i]));
+        }
+        tm.stop();
+        const int64_t add_one_us = tm.u_elapsed() / (N / 10);
+
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = { 0, false, true, 0u, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        tm.start();
+        for (size_t i = 0; i < NSELECT; ++i) {
+            in.request_code = brpc::policy::MurmurHash32(&i, sizeof(i));
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+        }
+        tm.stop();
+        std::cout << butil::class_name_str(*lb)
+                  << ": AddServersInBatch(" << N << ")=" << add_batch_us
+                  << "us AddServer=" << add_one_us
+                  << "us SelectServer=" << tm.n_elapsed() / NSELECT
+                  << "ns" << std::endl;
+        ASSERT_EQ(N, lb->RemoveServersInBatch(ids));
+        lb->Destroy();
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        brpc::Socket::SetFailed(ids[i].id);
+    }
+}
+
+TEST_F(LoadBalancerTest, consistent_hashing_with_bounded_load) {
+    brpc::policy::ConsistentHashingLoadBalancer factory(
+        brpc::policy::CONS_HASH_LB_MURMUR3);
+    ASSERT_TRUE(NULL == factory.New("load_factor=0.5"));
+    ASSERT_TRUE(NULL == factory.New("load_factor=abc"));
+    brpc::LoadBalancer* lb = factory.New("load_factor=1.25");
+    ASSERT_TRUE(lb);
+    const size_t N = 8;
+    std::vector<brpc::ServerId> ids;
+    CreateServers(N, &ids);
+    ASSERT_EQ(N, lb->AddServersInBatch(ids));
+
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, true, 12345u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    ASSERT_EQ(0, lb->SelectServer(in, &out));
+    ASSERT_TRUE(out.need_feedback);
+    const brpc::SocketId home = ptr->id();
+
+    // Requests of a hot key spill over to other servers and in-flight
+    // calls of each server are bounded.
+    const size_t NCALL = 100;
+    std::vector<brpc::SocketId> selected(1, home);
+    std::map<brpc::SocketId, size_t> inflight;
+    inflight[home] = 1;
+    for (size_t i = 1; i < NCALL; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        selected.push_back(ptr->id());
+        ++inflight[ptr->id()];
+    }
+    ASSERT_GT(inflight.size(), 1ul);
+    const size_t bound = ceil(NCALL * 1.25 / N);
+    for (std::map<brpc::SocketId, size_t>::const_iterator
+             it = inflight.begin(); it != inflight.end(); ++it) {
+        ASSERT_LE(it->second, bound);
+    }
+    ASSERT_GE(inflight[home], bound - 1);
+
+    // Affinity is back after calls are done.
+    for (size_t i = 0; i < selected.size(); ++i) {
+        brpc::LoadBalancer::CallInfo info = { 0, selected[i], 0, NULL };
+        lb->Feedback(info);
+    }
+    for (size_t i = 0; i < 10; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_EQ(home, ptr->id());
+        brpc::LoadBalancer::CallInfo info = { 0, home, 0, NULL };
+        lb->Feedback(info);
+    }
+
+    // Removed servers are never selected.
+    ASSERT_TRUE(lb->RemoveServer(brpc::ServerId(home)));
+    ASSERT_EQ(0, lb->SelectServer(in, &out));
+    ASSERT_NE(home, ptr->id());
+    ASSERT_EQ(N - 1, lb->RemoveServersInBatch(ids));
+    ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+    lb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        brpc::Socket::SetFailed(ids[i].id);
+    }
+}
+
+TEST_F(LoadBalancerTest, p2c_sanity) {
+    brpc::policy::PowerOfTwoChoicesLoadBalancer factory;
+    ASSERT_TRUE(NULL == factory.New("latency_aware=yes"));
+    const size_t N = 10;
+    std::vector<brpc::ServerId> ids;
+    CreateServers(N, &ids);
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+
+    // Outstanding calls are balanced when no call ends.
+    brpc::LoadBalancer* lb = factory.New("");
+    ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+    ASSERT_EQ(N, lb->AddServersInBatch(ids));
+    ASSERT_FALSE(lb->AddServer(ids[0]));
+    std::map<brpc::SocketId, size_t> inflight;
+    for (size_t i = 0; i < 100 * N; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        ++inflight[ptr->id()];
+    }
+    ASSERT_EQ(N, inflight.size());
+    size_t min_inflight = (size_t)-1;
+    size_t max_inflight = 0;
+    for (std::map<brpc::SocketId, size_t>::const_iterator
+             it = inflight.begin(); it != inflight.end(); ++it) {
+        min_inflight = std::min(min_inflight, it->second);
+        max_inflight = std::max(max_inflight, it->second);
+    }
+    ASSERT_LE(max_inflight - min_inflight, 10ul);
+
+    // Calls selected before a server is removed and added again don't
+    // drive outstanding calls of the new server negative.
+    const brpc::SocketId readded = ids[1].id;
+    ASSERT_TRUE(lb->RemoveServer(ids[1]));
+    ASSERT_TRUE(lb->AddServer(ids[1]));
+    for (size_t i = 0; i < inflight[readded]; ++i) {
+        brpc::LoadBalancer::CallInfo info =
+            { butil::gettimeofday_us(), readded, 0, NULL };
+        lb->Feedback(info);
+    }
+    {
+        brpc::policy::PowerOfTwoChoicesLoadBalancer* p2c =
+            static_cast<brpc::policy::PowerOfTwoChoicesLoadBalancer*>(lb);
+        butil::DoublyBufferedData<
+            brpc::policy::PowerOfTwoChoicesLoadBalancer::Servers>::ScopedPtr s;
+        ASSERT_EQ(0, p2c->_db_servers.Read(&s));
+        const size_t* pindex = s->server_map.seek(readded);
+        ASSERT_TRUE(pindex != NULL);
+        ASSERT_EQ(0, s->server_list[*pindex].stat->inflight.load());
+    }
+    ASSERT_EQ(N, lb->RemoveServersInBatch(ids));
+    lb->Destroy();
+
+    // Slow servers get fewer calls when latencies are considered.
+    lb = factory.New("latency_aware=true");
+    ASSERT_EQ(N, lb->AddServersInBatch(ids));
+    const brpc::SocketId slow = ids[0].id;
+    inflight.clear();
+    for (size_t i = 0; i < 1000 * N; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ++inflight[ptr->id()];
+        const int64_t latency_us = (ptr->id() == slow ? 10000 : 1000);
+        brpc::LoadBalancer::CallInfo info =
+            { butil::gettimeofday_us() - latency_us, ptr->id(), 0, NULL };
+        lb->Feedback(info);
+    }
+    std::cout << *lb << std::endl;
+    ASSERT_LT(inflight[slow], 1000ul / 2);
+    ASSERT_EQ(N, lb->RemoveServersInBatch(ids));
+    lb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        brpc::Socket::SetFailed(ids[i].id);
+    }
+}
+
+struct FeedbackArg {
+    brpc::LoadBalancer* lb;
+    size_t nselect;
+    int64_t elapsed_ns;
+    CountMap selected_count;
+};
+
+// Keep a few calls outstanding and end the oldest one after each selection
+// so that load balancers considering outstanding calls work.
+void* select_and_feedback(void* void_arg) {
+    FeedbackArg* arg = (FeedbackArg*)void_arg;
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    const size_t WINDOW = 8;
+    std::deque<brpc::LoadBalancer::CallInfo> calls;
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < arg->nselect; ++i) {
+        in.begin_time_us = butil::gettimeofday_us();
+        out.need_feedback = false;
+        if (arg->lb->SelectServer(in, &out) != 0) {
+            break;
+        }
+        ++arg->selected_count[ptr->id()];
+        if (out.need_feedback) {
+            brpc::LoadBalancer::CallInfo info =
+                { in.begin_time_us, ptr->id(), 0, NULL };
+            calls.push_back(info);
+            if (calls.size() > WINDOW) {
+                arg->lb->Feedback(calls.front());
+                calls.pop_front();
+            }
+        }
+    }
+    tm.stop();
+    for (; !calls.empty(); calls.pop_front()) {
+        arg->lb->Feedback(calls.front());
+    }
+    arg->elapsed_ns = tm.n_elapsed();
+    return NULL;
+}
+
+TEST_F(LoadBalancerTest, p2c_benchmark) {
+    const size_t N = 1000;
+    const size_t NTHREAD = 8;
+    std::vector<brpc::ServerId> ids;
+    CreateServers(N, &ids);
+    brpc::LoadBalancer* lbs[] = {
+        new brpc::policy::RoundRobinLoadBalancer,
+        new brpc::policy::RandomizedLoadBalancer,
+        new brpc::policy::LocalityAwareLoadBalancer,
+        new brpc::policy::PowerOfTwoChoicesLoadBalancer
+    };
+    for (size_t round = 0; round < ARRAY_SIZE(lbs); ++round) {
+        brpc::LoadBalancer* lb = lbs[round];
+        ASSERT_EQ(N, lb->AddServersInBatch(ids));
+        FeedbackArg args[NTHREAD];
+        pthread_t th[NTHREAD];
+        for (size_t i = 0; i < NTHREAD; ++i) {
+            args[i].lb = lb;
+            args[i].nselect = 200000;
+            args[i].elapsed_ns = 0;
+            ASSERT_EQ(0, pthread_create(&th[i], NULL, select_and_feedback, &args[i]));
+        }
+        CountMap total_count;
+        int64_t elapsed_ns = 0;
+        size_t nselect = 0;
+        for (size_t i = 0; i < NTHREAD; ++i) {
+            ASSERT_EQ(0, pthread_join(th[i], NULL));
+            elapsed_ns += args[i].elapsed_ns;
+            nselect += args[i].nselect;
+            for (CountMap::const_iterator it = args[i].selected_count.begin();
+                 it != args[i].selected_count.end(); ++it) {
+                total_count[it->first] += it->second;
+            }
+        }
+        double count_sum = 0;
+        double count_squared_sum = 0;
+        for (size_t i = 0; i < N; ++i) {
+            const double count = total_count[ids[i].id];
+            count_sum += count;
+            count_squared_sum += count * count;
+        }
+        std::cout << butil::class_name_str(*lb)
+                  << ": select+feedback=" << elapsed_ns / nselect << "ns"
+                  << " average=" << count_sum / N
+                  << " deviation=" << sqrt(count_squared_sum * N
+                                           - count_sum * count_sum) / N
+                  << std::endl;
+        ASSERT_EQ(N, lb->RemoveServersInBatch(ids));
+        lb->Destroy();
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        brpc::Socket::SetFailed(ids[i].id);
+    }
+}
+
+TEST_F(LoadBalancerTest, zone_aware) {
+    brpc::GlobalInitializeOrDie();
+    ASSERT_EQ("az1", brpc::policy::GetZoneFromTag("az1"));
+    ASSERT_EQ("az2", brpc::policy::GetZoneFromTag("idc=bj zone=az2"));
+    ASSERT_EQ("", brpc::policy::GetZoneFromTag("idc=bj"));
+    brpc::policy::ZoneAwareLoadBalancer factory;
+    ASSERT_TRUE(NULL == factory.New("lb=not_exist"));
+    ASSERT_TRUE(NULL == factory.New("lb=zone_aware"));
+    ASSERT_TRUE(NULL == factory.New("min_healthy_ratio=1.5"));
+
+    const size_t N = 4;
+    std::vector<brpc::ServerId> ids;
+    CreateServers(2 * N, &ids);
+    std::set<brpc::SocketId> local_ids;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (i < N) {
+            ids[i].tag = "zone=az1";
+            local_ids.insert(ids[i].id);
+        } else {
+            ids[i].tag = "az2";
+        }
+    }
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    const size_t total = 10000;
+
+    // All traffic stays in the healthy local zone.
+    brpc::LoadBalancer* lb = factory.New("lb=rr local_zone=az1");
+    ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+    ASSERT_EQ(2 * N, lb->AddServersInBatch(ids));
+    ASSERT_FALSE(lb->AddServer(ids[0]));
+    for (size_t i = 0; i < total; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        ASSERT_TRUE(local_ids.count(ptr->id()));
+    }
+
+    // Spill when calls to the local zone fail.
+    size_t nlocal = 0;
+    for (size_t i = 0; i < total; ++i) {
+        if (i % 100 == 0) {
+            usleep(10000);
+        }
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        const bool is_local = local_ids.count(ptr->id());
+        nlocal += is_local;
+        brpc::LoadBalancer::CallInfo info =
+            { butil::gettimeofday_us() - 1000, ptr->id(),
+              (is_local ? brpc::EINTERNAL : 0), NULL };
+        lb->Feedback(info);
+    }
+    std::cout << *lb << std::endl;
+    ASSERT_LT(nlocal, total / 2);
+    ASSERT_EQ(2 * N, lb->RemoveServersInBatch(ids));
+    lb->Destroy();
+
+    // Spill a share proportional to health when most local servers are
+    // down: 1/4 available servers keeps 1/4/0.5=50% of traffic.
+    lb = factory.New("local_zone=az1 min_healthy_ratio=0.5");
+    ASSERT_EQ(2 * N, lb->AddServersInBatch(ids));
+    for (size_t i = 1; i < N; ++i) {
+        brpc::Socket::SetFailed(ids[i].id);
+    }
+    usleep(200000);
+    nlocal = 0;
+    for (size_t i = 0; i < total; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        nlocal += local_ids.count(ptr->id());
+    }
+    std::cout << *lb << std::endl;
+    ASSERT_GT(nlocal, total * 4 / 10);
+    ASSERT_LT(nlocal, total * 6 / 10);
+
+    // Fallback to other zones when the local zone has no servers.
+    ASSERT_EQ(N, lb->RemoveServersInBatch(
+                  std::vector<brpc::ServerId>(ids.begin(), ids.begin() + N)));
+    for (size_t i = 0; i < 100; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_FALSE(local_ids.count(ptr->id()));
+    }
+    lb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        brpc::Socket::SetFailed(ids[i].id);
+    }
+}
+
+// Servers using this user are always revived by health checking.
+class HealthyUser : public brpc::SocketUser {
+public:
+    int CheckHealth(brpc::Socket*) { return 0; }
+    void AfterRevived(brpc::Socket*) {}
+};
+static HealthyUser g_healthy_user;
+
+TEST_F(LoadBalancerTest, slow_start) {
+    brpc::GlobalInitializeOrDie();
+    brpc::policy::SlowStartLoadBalancer factory;
+    ASSERT_TRUE(NULL == factory.New("lb=slow_start"));
+    ASSERT_TRUE(NULL == factory.New("window_ms=0"));
+    ASSERT_TRUE(NULL == factory.New("min_weight=0"));
+
+    const size_t N = 10;
+    std::vector<brpc::ServerId> ids;
+    CreateServers(N, &ids);
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    const size_t total = 10000;
+    brpc::LoadBalancer* lb = factory.New("lb=rr window_ms=1000 min_weight=0.1");
+    ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+
+    // Servers added into an empty load balancer are not warmed up.
+    ASSERT_EQ(N - 1, lb->AddServersInBatch(
+                  std::vector<brpc::ServerId>(ids.begin(), ids.end() - 1)));
+    std::map<brpc::SocketId, size_t> count;
+    for (size_t i = 0; i < total; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ++count[ptr->id()];
+    }
+    ASSERT_EQ(N - 1, count.size());
+    for (size_t i = 0; i + 1 < N; ++i) {
+        ASSERT_LE(count[ids[i].id], total / (N - 1) + 1);
+    }
+
+    // The new server gets much less traffic at the beginning.
+    const brpc::SocketId new_id = ids[N - 1].id;
+    ASSERT_TRUE(lb->AddServer(ids[N - 1]));
+    ASSERT_FALSE(lb->AddServer(ids[N - 1]));
+    count.clear();
+    for (size_t i = 0; i < total; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ++count[ptr->id()];
+    }
+    ASSERT_LT(count[new_id], total / N / 2);
+
+    // And same traffic after the window.
+    usleep(1100000);
+    count.clear();
+    for (size_t i = 0; i < total; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ++count[ptr->id()];
+    }
+    ASSERT_EQ(total / N, count[new_id]);
+    ASSERT_EQ(N, lb->RemoveServersInBatch(ids));
+    lb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        brpc::Socket::SetFailed(ids[i].id);
+    }
+
+    // A server revived by health checking is warmed up again.
+    ids.clear();
+    CreateServers(N - 1, &ids);
+    brpc::ServerId revived_id(8888);
+    brpc::SocketOptions options;
+    ASSERT_EQ(0, butil::str2endpoint("10.255.0.1:8080", &options.remote_side));
+    options.health_check_interval_s = 1;
+    options.user = &g_healthy_user;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &revived_id.id));
+    ids.push_back(revived_id);
+    lb = factory.New("lb=rr window_ms=5000 min_weight=0.1");
+    ASSERT_EQ(N, lb->AddServersInBatch(ids));
+    // Health checking waits for references to the socket to be released.
+    ptr.reset();
+    ASSERT_EQ(0, brpc::Socket::SetFailed(revived_id.id));
+    for (int i = 0; i < 50 &&
+             brpc::Socket::Address(revived_id.id, &ptr) != 0; ++i) {
+        usleep(100000);
+    }
+    ASSERT_EQ(0, brpc::Socket::Address(revived_id.id, &ptr));
+    // Wait for the revival to be noticed.
+    usleep(300000);
+    count.clear();
+    for (size_t i = 0; i < total; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ++count[ptr->id()];
+    }
+    ASSERT_LT(count[revived_id.id], total / N / 2);
+    ASSERT_EQ(N, lb->RemoveServersInBatch(ids));
+    lb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        brpc::Socket::SetFailed(ids[i].id);
+    }
+}
+
 TEST_F(LoadBalancerTest, weighted_round_robin) {
     const char* servers[] = { 
             "10.92.115.19:8831", 
@@ -0,0 +1,168 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2014 Baidu, Inc.
+
+// Compare latencies of RPC between processes on the same host over TCP,
+// unix domain socket and the shared-memory transport.
+
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/endpoint.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_bool(shm_transport);
+}
+
+DEFINE_int32(local_transport_rounds, 5000, "Number of RPC in each case");
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    return RUN_ALL_TESTS();
+}
+
+namespace {
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    virtual void Echo(google::protobuf::RpcController*,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        response->set_message(request->message());
+    }
+};
+
+class LocalTransportTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        snprintf(_unix_path, sizeof(_unix_path),
+                 "/tmp/brpc_local_transport_unittest_%d.sock", (int)getpid());
+    }
+    virtual void TearDown() {
+        brpc::FLAGS_shm_transport = false;
+        unlink(_unix_path);
+    }
+
+    // Returns average latency in microseconds.
+    int64_t RunEcho(const butil::EndPoint& server_addr,
+                    size_t payload_size, const char* name) {
+        brpc::Channel channel;
+        brpc::ChannelOptions options;
+        options.timeout_ms = 2000;
+        EXPECT_EQ(0, channel.Init(server_addr, &options));
+        test::EchoService_Stub stub(&channel);
+        test::EchoRequest req;
+        req.set_message(std::string(payload_size, 'x'));
+        // Warm up, the first RPC also establishes the connection.
+        for (int i = 0; i < 100; ++i) {
+            brpc::Controller cntl;
+            test::EchoResponse res;
+            stub.Echo(&cntl, &req, &res, NULL);
+            EXPECT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        }
+        butil::Timer tm;
+        tm.start();
+        for (int i = 0; i < FLAGS_local_transport_rounds; ++i) {
+            brpc::Controller cntl;
+            test::EchoResponse res;
+            stub.Echo(&cntl, &req, &res, NULL);
+            EXPECT_FALSE(cntl.Failed()) << cntl.ErrorText();
+            EXPECT_EQ(payload_size, res.message().size());
+        }
+        tm.stop();
+        const int64_t avg = tm.u_elapsed() / FLAGS_local_transport_rounds;
+        LOG(INFO) << name << " payload=" << payload_size
+                  << " avg_latency=" << avg << "us";
+        return avg;
+    }
+
+    EchoServiceImpl _echo_svc;
+    char _unix_path[128];
+};
+
+TEST_F(LocalTransportTest, unix_domain_socket) {
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&_echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    std::string addr = std::string("unix:") + _unix_path;
+    ASSERT_EQ(0, server.Start(addr.c_str(), NULL));
+    ASSERT_TRUE(butil::is_extended_endpoint(server.listen_address()));
+    ASSERT_EQ(addr, butil::endpoint2str(server.listen_address()).c_str());
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(addr.c_str(), NULL));
+    test::EchoService_Stub stub(&channel);
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message("hello");
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ("hello", res.message());
+    ASSERT_EQ(server.listen_address(), cntl.remote_side());
+
+    // Unix domain socket does not support internal_port.
+    server.Stop(0);
+    server.Join();
+    brpc::ServerOptions opt;
+    opt.internal_port = 8923;
+    ASSERT_EQ(-1, server.Start(addr.c_str(), &opt));
+}
+
+TEST_F(LocalTransportTest, ipv6) {
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&_echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    if (server.Start("[::1]:0", NULL) != 0) {
+        LOG(WARNING) << "IPv6 is not supported in this environment";
+        return;
+    }
+    const butil::EndPoint addr = server.listen_address();
+    ASSERT_TRUE(butil::is_extended_endpoint(addr));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(butil::endpoint2str(addr).c_str(), NULL));
+    test::EchoService_Stub stub(&channel);
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message("hello");
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ("hello", res.message());
+}
+
+TEST_F(LocalTransportTest, latency) {
+    brpc::Server tcp_server;
+    brpc::Server unix_server;
+    brpc::Server shm_server;
+    ASSERT_EQ(0, tcp_server.AddService(&_echo_svc,
+                                       brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, unix_server.AddService(&_echo_svc,
+                                        brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, shm_server.AddService(&_echo_svc,
+                                       brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, tcp_server.Start("127.0.0.1:0", NULL));
+    ASSERT_EQ(0, unix_server.Start(
+                  (std::string("unix:") + _unix_path).c_str(), NULL));
+    // Connections are shared by channels to the same address, use another
+    // server so that the shared-memory connection is a new one.
+    ASSERT_EQ(0, shm_server.Start("127.0.0.1:0", NULL));
+
+    const size_t payload_sizes[] = { 16, 4096, 65536 };
+    for (size_t i = 0; i < ARRAY_SIZE(payload_sizes); ++i) {
+        RunEcho(tcp_server.listen_address(), payload_sizes[i], "tcp");
+        RunEcho(unix_server.listen_address(), payload_sizes[i], "unix");
+        brpc::FLAGS_shm_transport = true;
+        RunEcho(shm_server.listen_address(), payload_sizes[i], "shm");
+        brpc::FLAGS_shm_transport = false;
+    }
+}
+
+} // namespace
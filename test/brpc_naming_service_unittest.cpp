@@ -18,6 +18,7 @@
 #include "brpc/policy/discovery_naming_service.h"
 #include "echo.pb.h"
 #include "brpc/server.h"
+#include "brpc/details/naming_service_thread.h"
 
 
 namespace brpc {
@@ -109,6 +110,99 @@ TEST(NamingServiceTest, sanity) {
     }
 }
 
+class StaticNamingService : public brpc::NamingService {
+public:
+    explicit StaticNamingService(const std::vector<brpc::ServerNode>& servers)
+        : _servers(servers) {}
+    int RunNamingService(const char*, brpc::NamingServiceActions* actions) {
+        actions->ResetServers(_servers);
+        return 0;
+    }
+    bool RunNamingServiceReturnsQuickly() { return true; }
+    brpc::NamingService* New() const { return new StaticNamingService(_servers); }
+    void Destroy() { delete this; }
+private:
+    std::vector<brpc::ServerNode> _servers;
+};
+
+class CountingWatcher : public brpc::NamingServiceWatcher {
+public:
+    CountingWatcher() : nadded(0), nremoved(0) {}
+    void OnAddedServers(const std::vector<brpc::ServerId>& servers) {
+        nadded += servers.size();
+    }
+    void OnRemovedServers(const std::vector<brpc::ServerId>& servers) {
+        nremoved += servers.size();
+    }
+    size_t nadded;
+    size_t nremoved;
+};
+
+TEST(NamingServiceTest, incremental_update) {
+    std::vector<brpc::ServerNode> servers;
+    for (int i = 0; i < 10; ++i) {
+        brpc::ServerNode node;
+        ASSERT_EQ(0, butil::str2endpoint("127.0.0.1", 8000 + i, &node.addr));
+        servers.push_back(node);
+    }
+    butil::intrusive_ptr<brpc::NamingServiceThread> nsthread(
+        new brpc::NamingServiceThread);
+    ASSERT_EQ(0, nsthread->Start(
+                  new StaticNamingService(std::vector<brpc::ServerNode>(
+                          servers.begin(), servers.begin() + 5)),
+                  "static", "dummy", NULL));
+    CountingWatcher watcher;
+    ASSERT_EQ(0, nsthread->AddWatcher(&watcher));
+    ASSERT_EQ(5u, watcher.nadded);
+    brpc::NamingServiceActions* actions = &nsthread->_actions;
+
+    // Existing servers are not added again.
+    std::vector<brpc::ServerNode> nodes(servers.begin() + 4, servers.begin() + 7);
+    actions->AddServers(nodes);
+    ASSERT_EQ(7u, watcher.nadded);
+    ASSERT_EQ(7u, nsthread->_last_sockets.size());
+
+    // Non-existing servers are not removed.
+    nodes.clear();
+    nodes.push_back(servers[0]);
+    nodes.push_back(servers[9]);
+    actions->RemoveServers(nodes);
+    ASSERT_EQ(1u, watcher.nremoved);
+    ASSERT_EQ(6u, nsthread->_last_sockets.size());
+
+    // Change tag of a server.
+    brpc::ServerNode tagged = servers[1];
+    tagged.tag = "new";
+    actions->UpdateServers(std::vector<brpc::ServerNode>(1, tagged),
+                           std::vector<brpc::ServerNode>(1, servers[1]));
+    ASSERT_EQ(8u, watcher.nadded);
+    ASSERT_EQ(2u, watcher.nremoved);
+    ASSERT_EQ(6u, nsthread->_last_sockets.size());
+
+    // Removed and added again in one update.
+    actions->UpdateServers(std::vector<brpc::ServerNode>(1, servers[2]),
+                           std::vector<brpc::ServerNode>(1, servers[2]));
+    ASSERT_EQ(8u, watcher.nadded);
+    ASSERT_EQ(2u, watcher.nremoved);
+
+    std::vector<brpc::ServerNode> expected(servers.begin() + 2, servers.begin() + 7);
+    expected.push_back(tagged);
+    std::sort(expected.begin(), expected.end());
+    ASSERT_TRUE(expected == std::vector<brpc::ServerNode>(
+                    nsthread->_actions._last_servers.begin(),
+                    nsthread->_actions._last_servers.end()));
+
+    // Reset is consistent with the incremental updates.
+    actions->ResetServers(servers);
+    ASSERT_EQ(13u, watcher.nadded);
+    ASSERT_EQ(3u, watcher.nremoved);
+    ASSERT_EQ(servers.size(), nsthread->_last_sockets.size());
+    actions->ResetServers(servers);
+    ASSERT_EQ(13u, watcher.nadded);
+    ASSERT_EQ(3u, watcher.nremoved);
+    ASSERT_EQ(0, nsthread->RemoveWatcher(&watcher));
+}
+
 TEST(NamingServiceTest, invalid_port) {
     std::vector<brpc::ServerNode> servers;
 
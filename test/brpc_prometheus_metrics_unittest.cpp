@@ -3,13 +3,21 @@
 // Author: Jiashun Zhu(zhujiashun@bilibili.com)
 // Date: Tue Dec 3 11:27:18 CST 2018
 
+#include <map>
+#include <vector>
 #include <gtest/gtest.h>
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
 #include "butil/strings/string_piece.h"
+#include "bvar/latency_recorder.h"
+#include "bvar/multi_dimension.h"
 #include "echo.pb.h"
 
+namespace bvar {
+DECLARE_bool(bvar_latency_recorder_use_histogram);
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -123,3 +131,120 @@ TEST(PrometheusMetrics, sanity) {
     ASSERT_EQ(0, server.Stop(0));
     ASSERT_EQ(0, server.Join());
 }
+
+TEST(PrometheusMetrics, histogram_buckets_are_fixed) {
+    const bool saved_flag = bvar::FLAGS_bvar_latency_recorder_use_histogram;
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = true;
+    bvar::LatencyRecorder rec("prometheus_histogram_test");
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = saved_flag;
+    rec << 10 << 100 << 1000;
+
+    brpc::Server server;
+    DummyEchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(&echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start("127.0.0.1:8615", NULL));
+    brpc::Channel channel;
+    brpc::ChannelOptions channel_opts;
+    channel_opts.protocol = "http";
+    ASSERT_EQ(0, channel.Init("127.0.0.1:8615", &channel_opts));
+    brpc::Controller cntl;
+    cntl.http_request().uri() = "/metrics";
+    channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl.Failed());
+    const std::string res = cntl.response_attachment().to_string();
+
+    const std::string prefix =
+        "prometheus_histogram_test_latency_histogram_bucket{le=\"";
+    std::vector<std::pair<std::string, int> > buckets;
+    size_t pos = 0;
+    while ((pos = res.find(prefix, pos)) != std::string::npos) {
+        const size_t le_end = res.find('"', pos + prefix.size());
+        ASSERT_NE(std::string::npos, le_end);
+        buckets.push_back(std::make_pair(
+                res.substr(pos + prefix.size(), le_end - pos - prefix.size()),
+                atoi(res.c_str() + le_end + 3)));
+        pos = le_end;
+    }
+    // 2^4-1 ... 2^26-1 and +Inf, empty buckets included.
+    ASSERT_EQ(24u, buckets.size());
+    ASSERT_EQ("15", buckets[0].first);
+    ASSERT_EQ(1, buckets[0].second);
+    ASSERT_EQ("31", buckets[1].first);
+    ASSERT_EQ(1, buckets[1].second);
+    ASSERT_EQ("127", buckets[3].first);
+    ASSERT_EQ(2, buckets[3].second);
+    ASSERT_EQ("1023", buckets[6].first);
+    ASSERT_EQ(3, buckets[6].second);
+    ASSERT_EQ("67108863", buckets[22].first);
+    ASSERT_EQ(3, buckets[22].second);
+    ASSERT_EQ("+Inf", buckets[23].first);
+    ASSERT_EQ(3, buckets[23].second);
+    ASSERT_NE(std::string::npos,
+              res.find("\nprometheus_histogram_test_latency_histogram_sum 1110\n"));
+    ASSERT_NE(std::string::npos,
+              res.find("\nprometheus_histogram_test_latency_histogram_count 3\n"));
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+TEST(PrometheusMetrics, labeled_metrics_are_grouped_by_family) {
+    std::vector<std::string> labels;
+    labels.push_back("method");
+    bvar::MultiDimension<bvar::LatencyRecorder> md("prometheus_md_test", labels);
+    const char* const methods[] = { "Echo", "Ping", "Pong" };
+    for (size_t i = 0; i < arraysize(methods); ++i) {
+        std::vector<std::string> values;
+        values.push_back(methods[i]);
+        bvar::LatencyRecorder* rec = md.get_stats(values);
+        ASSERT_TRUE(rec != NULL);
+        *rec << 10;
+    }
+
+    brpc::Server server;
+    DummyEchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(&echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start("127.0.0.1:8616", NULL));
+    brpc::Channel channel;
+    brpc::ChannelOptions channel_opts;
+    channel_opts.protocol = "http";
+    ASSERT_EQ(0, channel.Init("127.0.0.1:8616", &channel_opts));
+    brpc::Controller cntl;
+    cntl.http_request().uri() = "/metrics";
+    channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl.Failed());
+    const std::string res = cntl.response_attachment().to_string();
+
+    // Every family has exactly one TYPE line followed by stats of all
+    // label sets.
+    std::map<std::string, int> ntype;
+    std::map<std::string, int> nstats;
+    std::string current_family;
+    size_t start_pos = 0;
+    size_t end_pos = 0;
+    while ((end_pos = res.find('\n', start_pos)) != std::string::npos) {
+        const std::string line = res.substr(start_pos, end_pos - start_pos);
+        start_pos = end_pos + 1;
+        char family[128];
+        if (sscanf(line.c_str(), "# TYPE %127s", family) == 1) {
+            current_family = family;
+            ++ntype[current_family];
+            continue;
+        }
+        if (line.compare(0, 18, "prometheus_md_test") != 0) {
+            continue;
+        }
+        const size_t brace = line.find('{');
+        ASSERT_NE(std::string::npos, brace) << line;
+        ASSERT_EQ(current_family, line.substr(0, brace)) << line;
+        ++nstats[current_family];
+    }
+    const char* const families[] = {
+        "prometheus_md_test_count", "prometheus_md_test_latency",
+        "prometheus_md_test_max_latency", "prometheus_md_test_qps" };
+    for (size_t i = 0; i < arraysize(families); ++i) {
+        ASSERT_EQ(1, ntype[families[i]]) << families[i];
+        ASSERT_EQ(3, nstats[families[i]]) << families[i];
+    }
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
@@ -0,0 +1,87 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2014 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "brpc/response_cache.h"
+#include "echo.pb.h"
+
+namespace {
+
+TEST(ResponseCacheTest, ttl) {
+    brpc::ResponseCache cache(NULL);
+    ASSERT_EQ(0, cache.GetTTL("test.EchoService.Echo"));
+    ASSERT_EQ(0, cache.SetTTL("test.EchoService.Echo", 100));
+    ASSERT_EQ(100, cache.GetTTL("test.EchoService.Echo"));
+    ASSERT_EQ(0, cache.SetTTL("test.EchoService.Echo", 0));
+    ASSERT_EQ(0, cache.GetTTL("test.EchoService.Echo"));
+    ASSERT_EQ(-1, cache.SetTTL("", 100));
+}
+
+TEST(ResponseCacheTest, get_and_put) {
+    brpc::ResponseCache cache(NULL);
+    test::EchoResponse res;
+    res.set_message("cached");
+    butil::IOBuf attachment;
+    attachment.append("attached");
+    cache.Put("key1", 50, res, attachment);
+    ASSERT_EQ(1u, cache.size());
+    ASSERT_GT(cache.memory_usage(), 0u);
+
+    test::EchoResponse res2;
+    butil::IOBuf attachment2;
+    ASSERT_TRUE(cache.Get("key1", &res2, &attachment2));
+    ASSERT_EQ("cached", res2.message());
+    ASSERT_EQ("attached", attachment2.to_string());
+    ASSERT_FALSE(cache.Get("key2", &res2, &attachment2));
+
+    // Replace the entry.
+    res.set_message("cached2");
+    cache.Put("key1", 50, res, butil::IOBuf());
+    ASSERT_EQ(1u, cache.size());
+    attachment2.clear();
+    ASSERT_TRUE(cache.Get("key1", &res2, &attachment2));
+    ASSERT_EQ("cached2", res2.message());
+    ASSERT_TRUE(attachment2.empty());
+
+    // Expired entries are removed.
+    usleep(60000);
+    ASSERT_FALSE(cache.Get("key1", &res2, &attachment2));
+    ASSERT_EQ(0u, cache.size());
+    ASSERT_EQ(0u, cache.memory_usage());
+
+    cache.Put("key1", 1000, res, butil::IOBuf());
+    cache.Clear();
+    ASSERT_EQ(0u, cache.size());
+}
+
+TEST(ResponseCacheTest, evict_lru) {
+    brpc::ResponseCacheOptions options;
+    options.shard_count = 1;
+    options.max_memory_bytes = 4096;
+    brpc::ResponseCache cache(&options);
+    test::EchoResponse res;
+    res.set_message(std::string(1000, 'x'));
+    char key[32];
+    for (int i = 0; i < 10; ++i) {
+        snprintf(key, sizeof(key), "key%d", i);
+        cache.Put(key, 1000, res, butil::IOBuf());
+        test::EchoResponse res2;
+        butil::IOBuf attachment;
+        // Keep key0 recently used.
+        ASSERT_TRUE(cache.Get("key0", &res2, &attachment));
+        ASSERT_LE(cache.memory_usage(), options.max_memory_bytes);
+    }
+    ASSERT_LT(cache.size(), 10u);
+    test::EchoResponse res2;
+    butil::IOBuf attachment;
+    ASSERT_TRUE(cache.Get("key9", &res2, &attachment));
+    ASSERT_FALSE(cache.Get("key1", &res2, &attachment));
+
+    // Responses larger than a shard are never cached.
+    res.set_message(std::string(8192, 'x'));
+    cache.Put("large", 1000, res, butil::IOBuf());
+    ASSERT_FALSE(cache.Get("large", &res2, &attachment));
+}
+
+} // namespace
@@ -35,6 +35,7 @@
 #include "brpc/channel.h"
 #include "brpc/socket_map.h"
 #include "brpc/controller.h"
+#include "brpc/details/method_status.h"
 #include "echo.pb.h"
 #include "v1.pb.h"
 #include "v2.pb.h"
@@ -48,6 +49,7 @@ int main(int argc, char* argv[]) {
 namespace brpc {
 DECLARE_bool(enable_threads_service);
 DECLARE_bool(enable_dir_service);
+DECLARE_bool(enable_latency_breakdown);
 }
 
 namespace {
@@ -1350,4 +1352,59 @@ TEST_F(ServerTest, max_concurrency) {
     stub.Echo(&cntl4, &req, NULL, NULL);
     ASSERT_FALSE(cntl4.Failed()) << cntl4.ErrorText();
 }
+
+TEST_F(ServerTest, latency_breakdown) {
+    const int port = 9201;
+    brpc::Server server;
+    EchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, NULL));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    test::EchoService_Stub stub(&channel);
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message("hello");
+    req.set_sleep_us(10000);
+
+    // Not recorded by default.
+    brpc::Controller cntl;
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    EXPECT_EQ(-1, cntl.send_latency_us());
+    EXPECT_EQ(-1, cntl.wait_latency_us());
+    const brpc::Server::MethodProperty* mp =
+        server.FindMethodPropertyByFullName("test.EchoService.Echo");
+    ASSERT_TRUE(mp != NULL);
+    ASSERT_TRUE(mp->status->_stages.load(butil::memory_order_relaxed) == NULL);
+
+    brpc::FLAGS_enable_latency_breakdown = true;
+    cntl.Reset();
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    EXPECT_GE(cntl.send_latency_us(), 0);
+    EXPECT_GE(cntl.wait_latency_us(), req.sleep_us());
+    EXPECT_LE(cntl.send_latency_us() + cntl.wait_latency_us(),
+              cntl.latency_us());
+    brpc::FLAGS_enable_latency_breakdown = false;
+
+    // Stages of server are recorded after the response is written, the
+    // recorders are created by the first request with the flag on.
+    brpc::MethodStatus::StageRecorders* stages = NULL;
+    for (int i = 0; i < 100; ++i) {
+        stages = mp->status->_stages.load(butil::memory_order_acquire);
+        if (stages != NULL && stages->send.count() != 0) {
+            break;
+        }
+        bthread_usleep(1000);
+    }
+    ASSERT_TRUE(stages != NULL);
+    ASSERT_EQ(1, stages->process.count());
+    EXPECT_GE(stages->process.max_latency(), req.sleep_us());
+    EXPECT_EQ(1, stages->queue.count());
+    EXPECT_EQ(1, stages->send.count());
+    EXPECT_FALSE(stages->send.latency_name().empty());
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
 } //namespace
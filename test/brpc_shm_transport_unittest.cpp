@@ -0,0 +1,223 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2014 Baidu, Inc.
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/fd_utility.h"
+#include "butil/fd_guard.h"
+#include "butil/time.h"
+#include "brpc/details/shm_transport.h"
+#include "brpc/socket.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_bool(shm_transport);
+}
+
+namespace {
+
+class ShmTransportTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, _fds));
+        ASSERT_EQ(0, butil::make_non_blocking(_fds[0]));
+        ASSERT_EQ(0, butil::make_non_blocking(_fds[1]));
+    }
+    virtual void TearDown() {
+        close(_fds[0]);
+        close(_fds[1]);
+    }
+    int _fds[2];
+};
+
+TEST_F(ShmTransportTest, handshake_and_transfer) {
+    brpc::ShmHello hello;
+    std::unique_ptr<brpc::ShmTransport> client(
+        brpc::ShmTransport::CreateForClient(5000, &hello));
+    ASSERT_TRUE(client != NULL);
+    ASSERT_EQ(8192u, hello.ring_size);
+    ASSERT_TRUE(brpc::ShmTransport::MaybeHello(hello.magic, 2));
+    std::unique_ptr<brpc::ShmTransport> server(
+        brpc::ShmTransport::CreateForServer(hello, _fds[1]));
+    ASSERT_TRUE(server != NULL);
+    client->CloseMemfd();
+
+    // Nothing to read, the server parks.
+    butil::IOPortal in;
+    ASSERT_EQ(-1, server->Read(_fds[1], &in, 1024));
+    ASSERT_EQ(EAGAIN, errno);
+
+    butil::IOBuf out;
+    out.append("hello shm");
+    butil::IOBuf* pieces[1] = { &out };
+    ASSERT_EQ(9, client->Write(_fds[0], pieces, 1));
+    ASSERT_TRUE(out.empty());
+    // The parked server was woken up by a doorbell.
+    char doorbell = 0;
+    ASSERT_EQ(1, recv(_fds[1], &doorbell, 1, MSG_PEEK));
+    ASSERT_EQ(brpc::SHM_DOORBELL, doorbell);
+    ASSERT_EQ(9, server->Read(_fds[1], &in, 1024));
+    ASSERT_EQ("hello shm", in.to_string());
+
+    // Write more than the capacity, the ring wraps around.
+    std::string large;
+    for (int i = 0; i < 20000; ++i) {
+        large.push_back('a' + i % 26);
+    }
+    out.append(large);
+    std::string received;
+    while (!out.empty()) {
+        const ssize_t nw = client->Write(_fds[0], pieces, 1);
+        ASSERT_GT(nw, 0);
+        in.clear();
+        ASSERT_EQ(nw, server->Read(_fds[1], &in, large.size()));
+        received.append(in.to_string());
+    }
+    ASSERT_EQ(large, received);
+    server.reset();
+    client.reset();
+}
+
+TEST_F(ShmTransportTest, full_ring) {
+    brpc::ShmHello hello;
+    std::unique_ptr<brpc::ShmTransport> client(
+        brpc::ShmTransport::CreateForClient(4096, &hello));
+    ASSERT_TRUE(client != NULL);
+    std::unique_ptr<brpc::ShmTransport> server(
+        brpc::ShmTransport::CreateForServer(hello, _fds[1]));
+    ASSERT_TRUE(server != NULL);
+    butil::IOBuf out;
+    out.append(std::string(5000, 'x'));
+    butil::IOBuf* pieces[1] = { &out };
+    ASSERT_EQ(4096, client->Write(_fds[0], pieces, 1));
+    ASSERT_EQ(-1, client->Write(_fds[0], pieces, 1));
+    ASSERT_EQ(EAGAIN, errno);
+    // Server to client is a separate ring.
+    butil::IOBuf reply;
+    reply.append("ok");
+    butil::IOBuf* reply_pieces[1] = { &reply };
+    ASSERT_EQ(2, server->Write(_fds[1], reply_pieces, 1));
+    butil::IOPortal in;
+    ASSERT_EQ(2, client->Read(_fds[0], &in, 1024));
+    ASSERT_EQ("ok", in.to_string());
+
+    // The client parks on the full ring and times out.
+    timespec abstime = butil::milliseconds_from_now(10);
+    ASSERT_EQ(-1, client->WaitForSpace(&abstime));
+    ASSERT_EQ(ETIMEDOUT, errno);
+    // The server releases space and rings the doorbell for the parked client.
+    in.clear();
+    ASSERT_EQ(4096, server->Read(_fds[1], &in, 8192));
+    char doorbell = 0;
+    ASSERT_EQ(1, recv(_fds[0], &doorbell, 1, MSG_PEEK));
+    ASSERT_EQ(brpc::SHM_DOORBELL, doorbell);
+    // Reading the doorbell wakes up the client, the next wait returns
+    // immediately since the ring is not full anymore.
+    in.clear();
+    ASSERT_EQ(-1, client->Read(_fds[0], &in, 1024));
+    ASSERT_EQ(EAGAIN, errno);
+    abstime = butil::milliseconds_from_now(10);
+    ASSERT_EQ(0, client->WaitForSpace(&abstime));
+    ASSERT_EQ(904, client->Write(_fds[0], pieces, 1));
+    ASSERT_TRUE(out.empty());
+}
+
+TEST_F(ShmTransportTest, reject_bad_hello) {
+    brpc::ShmHello hello;
+    memcpy(hello.magic, "BSHM", 4);
+    hello.pid = getpid();
+    hello.memfd = _fds[0];  // not a memfd
+    hello.ring_size = 4096;
+    ASSERT_TRUE(brpc::ShmTransport::CreateForServer(hello, _fds[1]) == NULL);
+    ASSERT_FALSE(brpc::ShmTransport::MaybeHello("PRPC", 4));
+
+    std::unique_ptr<brpc::ShmTransport> client(
+        brpc::ShmTransport::CreateForClient(4096, &hello));
+    ASSERT_TRUE(client != NULL);
+    // The memfd can't be resized by either side.
+    ASSERT_NE(0, ftruncate(hello.memfd, 0));
+    ASSERT_NE(0, ftruncate(hello.memfd, 1 << 20));
+    ASSERT_TRUE(FD_CLOEXEC & fcntl(hello.memfd, F_GETFD));
+    // The connection is not owned by the announced process.
+    hello.pid = getppid();
+    ASSERT_TRUE(brpc::ShmTransport::CreateForServer(hello, _fds[1]) == NULL);
+    hello.pid = getpid();
+    std::unique_ptr<brpc::ShmTransport> server(
+        brpc::ShmTransport::CreateForServer(hello, _fds[1]));
+    ASSERT_TRUE(server != NULL);
+}
+
+TEST_F(ShmTransportTest, eof) {
+    brpc::ShmHello hello;
+    std::unique_ptr<brpc::ShmTransport> client(
+        brpc::ShmTransport::CreateForClient(4096, &hello));
+    ASSERT_TRUE(client != NULL);
+    std::unique_ptr<brpc::ShmTransport> server(
+        brpc::ShmTransport::CreateForServer(hello, _fds[1]));
+    ASSERT_TRUE(server != NULL);
+    ASSERT_EQ(0, shutdown(_fds[0], SHUT_WR));
+    butil::IOPortal in;
+    ASSERT_EQ(0, server->Read(_fds[1], &in, 1024));
+}
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    virtual void Echo(google::protobuf::RpcController*,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        response->set_message(request->message());
+    }
+};
+
+// Returns shm_state of the connection used by `channel'.
+static brpc::ShmState CallAndGetShmState(brpc::Channel* channel) {
+    test::EchoService_Stub stub(channel);
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(std::string(100000, 'x'));
+    stub.Echo(&cntl, &req, &res, NULL);
+    EXPECT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    EXPECT_EQ(req.message(), res.message());
+    brpc::SocketUniquePtr sock;
+    EXPECT_EQ(0, brpc::Socket::Address(channel->_server_id, &sock));
+    return sock->shm_state();
+}
+
+TEST_F(ShmTransportTest, rpc) {
+    EchoServiceImpl echo_svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start("127.0.0.1:0", NULL));
+    brpc::FLAGS_shm_transport = true;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(server.listen_address(), NULL));
+    ASSERT_EQ(brpc::SHM_CONNECTED, CallAndGetShmState(&channel));
+    // Larger than the rings.
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ(brpc::SHM_CONNECTED, CallAndGetShmState(&channel));
+    }
+
+    // Protocols other than baidu_std don't negotiate. Use another server
+    // since connections are shared by channels to the same address.
+    brpc::Server http_server;
+    ASSERT_EQ(0, http_server.AddService(&echo_svc,
+                                        brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, http_server.Start("127.0.0.1:0", NULL));
+    brpc::ChannelOptions options;
+    options.protocol = "http";
+    brpc::Channel http_channel;
+    ASSERT_EQ(0, http_channel.Init(http_server.listen_address(), &options));
+    ASSERT_EQ(brpc::SHM_OFF, CallAndGetShmState(&http_channel));
+    brpc::FLAGS_shm_transport = false;
+}
+
+} // namespace
@@ -24,6 +24,8 @@
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
+#include "brpc/global.h"
+#include "brpc/adaptive_max_concurrency.h"
 #include "health_check.pb.h"
 #if defined(OS_MACOSX)
 #include <sys/event.h>
@@ -532,6 +534,34 @@ TEST_F(SocketTest, not_health_check_when_nref_hits_0) {
     ASSERT_EQ(-1, brpc::Socket::Status(id));
 }
 
+TEST_F(SocketTest, client_concurrency_limit) {
+    brpc::GlobalInitializeOrDie();
+    brpc::SocketOptions options;
+    options.remote_side = butil::EndPoint(butil::my_ip(), 7777);
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    const brpc::AdaptiveMaxConcurrency amc(2);
+    ASSERT_TRUE(s->OnClientRequested(amc));
+    ASSERT_TRUE(s->OnClientRequested(amc));
+    // Rejected calls are not counted.
+    ASSERT_FALSE(s->OnClientRequested(amc));
+    ASSERT_FALSE(s->OnClientRequested(amc));
+    s->OnClientResponded(0, 1000);
+    ASSERT_TRUE(s->OnClientRequested(amc));
+    ASSERT_FALSE(s->OnClientRequested(amc));
+    s->OnClientResponded(0, 1000);
+    s->OnClientResponded(0, 1000);
+    // The limiter is created by the first call and shared afterwards.
+    const brpc::AdaptiveMaxConcurrency amc2(1);
+    ASSERT_TRUE(s->OnClientRequested(amc2));
+    ASSERT_TRUE(s->OnClientRequested(amc2));
+    s->OnClientResponded(0, 1000);
+    s->OnClientResponded(0, 1000);
+    ASSERT_EQ(0, s->SetFailed());
+}
+
 class HealthCheckTestServiceImpl : public test::HealthCheckTestService {
 public:
     HealthCheckTestServiceImpl()
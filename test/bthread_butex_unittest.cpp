@@ -2,6 +2,8 @@
 // Author: Ge,Jun (gejun@baidu.com)
 // Date: Sun Jul 13 15:04:18 CST 2014
 
+#include <fstream>
+#include <sstream>
 #include <gtest/gtest.h>
 #include "butil/atomicops.h"
 #include "butil/time.h"
@@ -14,6 +16,8 @@
 #include "bthread/unstable.h"
 
 namespace bthread {
+bool BlockingProfilerStart(const char* filename);
+void BlockingProfilerStop();
 extern butil::atomic<TaskControl*> g_task_control;
 inline TaskControl* get_task_control() {
     return g_task_control.load(butil::memory_order_consume);
@@ -381,4 +385,29 @@ TEST(ButexTest, stop_before_sleeping) {
         ASSERT_EQ(EINVAL, bthread_stop(th));
     }
 }
+
+TEST(ButexTest, blocking_profiler) {
+    const char* filename = "blocking_profiler_test.prof";
+    ASSERT_TRUE(bthread::BlockingProfilerStart(filename));
+    ASSERT_FALSE(bthread::BlockingProfilerStart(filename));
+    bthread_t th[8];
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, bthread_start_urgent(&th[i], NULL, sleeper,
+                                          (void*)10000L));
+    }
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    // Wait for the collector to dump the samples.
+    usleep(1000000);
+    bthread::BlockingProfilerStop();
+
+    std::ifstream ifs(filename);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    const std::string content = ss.str();
+    ASSERT_EQ(0u, content.find("--- contention\ncycles/second=1000000000\n"));
+    ASSERT_NE(std::string::npos, content.find(" @ ")) << content;
+    unlink(filename);
+}
 } // namespace
@@ -215,6 +215,32 @@ TEST_F(BthreadTest, bthread_self) {
     ASSERT_EQ(0, bthread_join(bth, NULL));
 }
 
+void* spin_and_check_stat(void*) {
+    int64_t cputime_ns = 0;
+    int64_t rq_wait_ns = 0;
+    EXPECT_EQ(0, bthread_self_stat(&cputime_ns, &rq_wait_ns));
+    EXPECT_GE(rq_wait_ns, 0);
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    while (butil::cpuwide_time_ns() - start_ns < 20000000L) {}
+    int64_t cputime2_ns = 0;
+    // The running slice is counted in.
+    EXPECT_EQ(0, bthread_self_stat(&cputime2_ns, NULL));
+    EXPECT_GE(cputime2_ns - cputime_ns, 20000000L);
+    // Time in sleeping is not cputime.
+    bthread_usleep(20000);
+    int64_t cputime3_ns = 0;
+    EXPECT_EQ(0, bthread_self_stat(&cputime3_ns, NULL));
+    EXPECT_LT(cputime3_ns - cputime2_ns, 10000000L);
+    return NULL;
+}
+
+TEST_F(BthreadTest, bthread_self_stat) {
+    ASSERT_EQ(-1, bthread_self_stat(NULL, NULL));
+    bthread_t bth;
+    ASSERT_EQ(0, bthread_start_background(&bth, NULL, spin_and_check_stat, NULL));
+    ASSERT_EQ(0, bthread_join(bth, NULL));
+}
+
 void* join_self(void*) {
     EXPECT_EQ(EINVAL, bthread_join(bthread_self(), NULL));
     return NULL;
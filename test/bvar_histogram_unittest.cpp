@@ -0,0 +1,121 @@
+// Copyright (c) 2014 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <math.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "bvar/variable.h"
+#include "bvar/latency_recorder.h"
+#include "bvar/detail/histogram.h"
+
+namespace bvar {
+DECLARE_bool(bvar_latency_recorder_use_histogram);
+}
+
+namespace {
+
+TEST(HistogramTest, bucket_bounds) {
+    using namespace bvar::detail;
+    int64_t last_upper = 0;
+    for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS - 1; ++i) {
+        const int64_t upper = histogram_bucket_upper_bound(i);
+        ASSERT_GT(upper, last_upper) << "i=" << i;
+        // Values at both ends of the bucket must be mapped into it.
+        ASSERT_EQ(i, histogram_bucket_index(last_upper)) << "i=" << i;
+        ASSERT_EQ(i, histogram_bucket_index(upper - 1)) << "i=" << i;
+        const int64_t middle = histogram_bucket_middle(i);
+        ASSERT_GE(middle, last_upper);
+        ASSERT_LT(middle, upper);
+        // Width of a bucket is at most 1/HISTOGRAM_SUB_BUCKETS of its values.
+        ASSERT_LE((upper - last_upper) * HISTOGRAM_SUB_BUCKETS,
+                  std::max(last_upper, (int64_t)HISTOGRAM_SUB_BUCKETS));
+        last_upper = upper;
+    }
+    ASSERT_EQ(0u, histogram_bucket_index(-1));
+    ASSERT_EQ(HISTOGRAM_NUM_BUCKETS - 1,
+              histogram_bucket_index((int64_t)1 << HISTOGRAM_MAX_BITS));
+    ASSERT_EQ(HISTOGRAM_NUM_BUCKETS - 1,
+              histogram_bucket_index(std::numeric_limits<int64_t>::max()));
+}
+
+TEST(HistogramTest, percentiles) {
+    bvar::detail::Histogram h;
+    for (int i = 1; i <= 100000; ++i) {
+        h << i;
+    }
+    bvar::detail::HistogramSamples s = h.get_value();
+    ASSERT_EQ(100000u, s.num);
+    ASSERT_EQ(100000LL * 100001 / 2, s.sum);
+    for (int k = 1; k <= 99; ++k) {
+        const double expected = k * 1000;
+        const int64_t actual = s.get_number(k / 100.0);
+        EXPECT_LT(fabs(actual - expected) / expected,
+                  1.0 / bvar::detail::HISTOGRAM_SUB_BUCKETS)
+            << "k=" << k << " actual=" << actual;
+    }
+}
+
+TEST(HistogramTest, merge_and_subtract) {
+    bvar::detail::HistogramSamples a;
+    bvar::detail::HistogramSamples b;
+    for (int i = 0; i < 1000; ++i) {
+        a.add(i);
+        b.add(i * 1000);
+    }
+    bvar::detail::HistogramSamples c = a;
+    c.merge(b);
+    ASSERT_EQ(2000u, c.num);
+    ASSERT_EQ(a.sum + b.sum, c.sum);
+    c.subtract(a);
+    ASSERT_EQ(0, memcmp(&c, &b, sizeof(c)));
+}
+
+TEST(HistogramTest, describe) {
+    bvar::detail::HistogramSamples s;
+    s.add(1);
+    s.add(1);
+    s.add(20);
+    std::ostringstream os;
+    os << s;
+    ASSERT_EQ("{\"sum\":22,\"count\":3,\"buckets\":[[1,2],[20,3]]}", os.str());
+}
+
+TEST(HistogramTest, latency_recorder) {
+    const bool saved = bvar::FLAGS_bvar_latency_recorder_use_histogram;
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = true;
+    {
+        bvar::LatencyRecorder rec("histogram_test");
+        ASSERT_EQ("histogram_test_latency_histogram",
+                  rec.latency_histogram_name());
+        for (int i = 1; i <= 10000; ++i) {
+            rec << i;
+        }
+        std::string desc = bvar::Variable::describe_exposed(
+            rec.latency_histogram_name());
+        ASSERT_EQ(0u, desc.find("{\"sum\":50005000,\"count\":10000,"))
+            << desc;
+        usleep(1100000);
+        const int64_t p99 = rec.latency_percentile(0.99);
+        EXPECT_LT(fabs(p99 - 9900) / 9900.0,
+                  1.0 / bvar::detail::HISTOGRAM_SUB_BUCKETS) << p99;
+    }
+    bvar::FLAGS_bvar_latency_recorder_use_histogram = saved;
+}
+
+} // namespace
@@ -0,0 +1,116 @@
+// Copyright (c) 2014 Baidu, Inc.
+
+#include <map>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "bvar/bvar.h"
+
+namespace {
+
+class MapDumper : public bvar::Dumper {
+public:
+    bool dump(const std::string& name, const butil::StringPiece& desc) {
+        values[name] = desc.as_string();
+        return true;
+    }
+    std::map<std::string, std::string> values;
+};
+
+std::vector<std::string> make_key(const char* v1, const char* v2) {
+    std::vector<std::string> key;
+    key.push_back(v1);
+    key.push_back(v2);
+    return key;
+}
+
+TEST(MultiDimensionTest, get_stats) {
+    bvar::MultiDimension<bvar::Adder<int> > md(make_key("method", "status"));
+    ASSERT_EQ(2u, md.count_labels());
+    ASSERT_EQ(0u, md.count_stats());
+    ASSERT_FALSE(md.has_stats(make_key("Echo", "ok")));
+
+    bvar::Adder<int>* ok = md.get_stats(make_key("Echo", "ok"));
+    ASSERT_TRUE(ok != NULL);
+    ASSERT_EQ(ok, md.get_stats(make_key("Echo", "ok")));
+    bvar::Adder<int>* fail = md.get_stats(make_key("Echo", "fail"));
+    ASSERT_TRUE(fail != NULL);
+    ASSERT_NE(ok, fail);
+    ASSERT_EQ(2u, md.count_stats());
+    ASSERT_TRUE(md.has_stats(make_key("Echo", "ok")));
+    // Stats are not exposed as Variables.
+    ASSERT_TRUE(ok->name().empty());
+
+    // Number of values must match number of labels.
+    ASSERT_TRUE(md.get_stats(std::vector<std::string>(1, "Echo")) == NULL);
+
+    std::vector<std::vector<std::string> > keys;
+    md.list_stats(&keys);
+    ASSERT_EQ(2u, keys.size());
+
+    md.delete_stats(make_key("Echo", "fail"));
+    ASSERT_EQ(1u, md.count_stats());
+    ASSERT_FALSE(md.has_stats(make_key("Echo", "fail")));
+    md.clear_stats();
+    ASSERT_EQ(0u, md.count_stats());
+}
+
+TEST(MultiDimensionTest, max_stats_count) {
+    const int32_t saved = bvar::FLAGS_bvar_max_multi_dimension_stats_count;
+    bvar::FLAGS_bvar_max_multi_dimension_stats_count = 3;
+    bvar::MultiDimension<bvar::Maxer<int> > md(make_key("a", "b"));
+    ASSERT_TRUE(md.get_stats(make_key("1", "1")) != NULL);
+    ASSERT_TRUE(md.get_stats(make_key("1", "2")) != NULL);
+    ASSERT_TRUE(md.get_stats(make_key("1", "3")) != NULL);
+    ASSERT_TRUE(md.get_stats(make_key("1", "4")) == NULL);
+    // Existing stats are still available.
+    ASSERT_TRUE(md.get_stats(make_key("1", "1")) != NULL);
+    ASSERT_EQ(3u, md.count_stats());
+    bvar::FLAGS_bvar_max_multi_dimension_stats_count = saved;
+}
+
+TEST(MultiDimensionTest, expose_and_dump) {
+    const size_t nexposed = bvar::MVariable::count_exposed();
+    bvar::MultiDimension<bvar::Adder<int> > md(
+        "md_test", "request", make_key("method", "status"));
+    ASSERT_EQ("md_test_request", md.name());
+    ASSERT_EQ(nexposed + 1, bvar::MVariable::count_exposed());
+    // Families are not counted in Variables.
+    ASSERT_EQ("", bvar::Variable::describe_exposed("md_test_request"));
+    bvar::MultiDimension<bvar::Adder<int> > md2(
+        "md_test_request", make_key("method", "status"));
+    ASSERT_TRUE(md2.name().empty());
+
+    *md.get_stats(make_key("Echo", "ok")) << 1 << 2;
+    *md.get_stats(make_key("Echo", "a\"b")) << 3;
+    MapDumper dumper;
+    bvar::DumpOptions options;
+    options.white_wildcards = "md_test_*";
+    ASSERT_EQ(2, bvar::MVariable::dump_exposed(&dumper, &options));
+    ASSERT_EQ(2u, dumper.values.size());
+    ASSERT_EQ("3", dumper.values["md_test_request{method=\"Echo\",status=\"ok\"}"]);
+    ASSERT_EQ("3", dumper.values["md_test_request{method=\"Echo\",status=\"a\\\"b\"}"]);
+
+    ASSERT_TRUE(md.hide());
+    ASSERT_EQ(nexposed, bvar::MVariable::count_exposed());
+}
+
+TEST(MultiDimensionTest, latency_recorder) {
+    bvar::MultiDimension<bvar::LatencyRecorder> md(
+        "md_test_rpc", make_key("method", "status"));
+    bvar::LatencyRecorder* rec = md.get_stats(make_key("Echo", "ok"));
+    ASSERT_TRUE(rec != NULL);
+    *rec << 10 << 20;
+    ASSERT_EQ(2, rec->count());
+    MapDumper dumper;
+    bvar::DumpOptions options;
+    options.white_wildcards = "md_test_rpc";
+    ASSERT_EQ(1, bvar::MVariable::dump_exposed(&dumper, &options));
+    ASSERT_EQ("2", dumper.values["md_test_rpc_count{method=\"Echo\",status=\"ok\"}"]);
+    ASSERT_EQ(1u, dumper.values.count(
+                  "md_test_rpc_max_latency{method=\"Echo\",status=\"ok\"}"));
+    ASSERT_EQ(1u, dumper.values.count(
+                  "md_test_rpc_qps{method=\"Echo\",status=\"ok\"}"));
+}
+
+} // namespace
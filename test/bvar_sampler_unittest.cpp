@@ -1,11 +1,20 @@
 // Copyright (c) 2014 Baidu, Inc.
 
 #include <limits>                           //std::numeric_limits
+#include <set>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/synchronization/lock.h"
 #include "bvar/detail/sampler.h"
 #include "butil/time.h"
 #include "butil/logging.h"
 #include <gtest/gtest.h>
 
+namespace bvar {
+DECLARE_int32(bvar_sampler_thread_num);
+DECLARE_int32(bvar_sampler_round_budget_ms);
+}
+
 namespace {
 
 TEST(SamplerTest, linked_list) {
@@ -121,4 +130,58 @@ TEST(SamplerTest, multi_threaded) {
     }
 #endif
 }
+
+class SlowSampler : public bvar::detail::Sampler {
+public:
+    SlowSampler() : _ncalled(0) {}
+    ~SlowSampler() {
+        _s_ndestroy.fetch_add(1);
+    }
+    void take_sample() {
+        usleep(1000);
+        _ncalled.fetch_add(1);
+        BAIDU_SCOPED_LOCK(_s_mutex);
+        _s_threads.insert(pthread_self());
+    }
+    int called_count() const { return _ncalled.load(); }
+
+    static butil::atomic<int> _s_ndestroy;
+    static butil::Mutex _s_mutex;
+    static std::set<pthread_t> _s_threads;
+private:
+    butil::atomic<int> _ncalled;
+};
+butil::atomic<int> SlowSampler::_s_ndestroy(0);
+butil::Mutex SlowSampler::_s_mutex;
+std::set<pthread_t> SlowSampler::_s_threads;
+
+TEST(SamplerTest, sharded_when_over_budget) {
+    const int32_t saved_thread_num = bvar::FLAGS_bvar_sampler_thread_num;
+    const int32_t saved_budget = bvar::FLAGS_bvar_sampler_round_budget_ms;
+    bvar::FLAGS_bvar_sampler_thread_num = 4;
+    bvar::FLAGS_bvar_sampler_round_budget_ms = 50;
+    // A round of sampling takes ~200ms with one thread.
+    const int N = 200;
+    SlowSampler* s[N];
+    for (int i = 0; i < N; ++i) {
+        s[i] = new SlowSampler;
+        s[i]->schedule();
+    }
+    sleep(4);
+    for (int i = 0; i < N; ++i) {
+        EXPECT_LE(3, s[i]->called_count()) << "i=" << i;
+    }
+    {
+        BAIDU_SCOPED_LOCK(SlowSampler::_s_mutex);
+        ASSERT_LT(1UL, SlowSampler::_s_threads.size());
+        ASSERT_GE(4UL, SlowSampler::_s_threads.size());
+    }
+    for (int i = 0; i < N; ++i) {
+        s[i]->destroy();
+    }
+    sleep(2);
+    EXPECT_EQ(N, SlowSampler::_s_ndestroy.load());
+    bvar::FLAGS_bvar_sampler_thread_num = saved_thread_num;
+    bvar::FLAGS_bvar_sampler_round_budget_ms = saved_budget;
+}
 } // namespace
@@ -0,0 +1,110 @@
+// Copyright (c) 2014 Baidu, Inc.
+
+#include <unistd.h>
+#include <map>
+#include <gtest/gtest.h>
+#include "butil/logging.h"
+#include "bvar/bvar.h"
+#include "bvar/snapshot.h"
+
+namespace {
+
+TEST(SnapshotTest, dumper) {
+    bvar::SnapshotDumper dumper(false);
+    ASSERT_TRUE(dumper.dump_int("a", -3));
+    ASSERT_TRUE(dumper.dump("b", "1.5"));
+    ASSERT_TRUE(dumper.dump("c", "12"));
+    // Non-numbers are skipped.
+    ASSERT_TRUE(dumper.dump("d", "\"hello\""));
+    ASSERT_TRUE(dumper.dump("e", "[1,2]"));
+    ASSERT_EQ(3u, dumper.count());
+
+    std::vector<bvar::SnapshotEntry> entries;
+    ASSERT_EQ(0, bvar::parse_snapshot(dumper.payload(), &entries));
+    ASSERT_EQ(3u, entries.size());
+    ASSERT_EQ("a", entries[0].name);
+    ASSERT_TRUE(entries[0].is_int);
+    ASSERT_EQ(-3, entries[0].int_value);
+    ASSERT_EQ("b", entries[1].name);
+    ASSERT_FALSE(entries[1].is_int);
+    ASSERT_DOUBLE_EQ(1.5, entries[1].value);
+    ASSERT_TRUE(entries[2].is_int);
+    ASSERT_EQ(12, entries[2].int_value);
+    ASSERT_TRUE(entries[2].series.empty());
+
+    // Truncated payloads are rejected.
+    const std::string& payload = dumper.payload();
+    ASSERT_EQ(-1, bvar::parse_snapshot(
+                  butil::StringPiece(payload.data(), payload.size() - 1),
+                  &entries));
+}
+
+TEST(SnapshotTest, series) {
+    bvar::Adder<int> adder("snapshot_test_adder");
+    adder << 7;
+    double values[bvar::SNAPSHOT_SERIES_SIZE];
+    ASSERT_EQ(0, bvar::Variable::get_series_exposed(
+                  "snapshot_test_adder", values));
+    ASSERT_EQ(-1, bvar::Variable::get_series_exposed(
+                  "snapshot_test_not_exist", values));
+    bvar::Status<std::string> str("snapshot_test_str", "x");
+    ASSERT_EQ(1, bvar::Variable::get_series_exposed(
+                  "snapshot_test_str", values));
+
+    usleep(1100000);
+    ASSERT_EQ(0, bvar::Variable::get_series_exposed(
+                  "snapshot_test_adder", values));
+    // The latest second is the last one.
+    ASSERT_DOUBLE_EQ(7, values[bvar::SNAPSHOT_SERIES_SIZE - 1]);
+
+    bvar::SnapshotDumper dumper(true);
+    bvar::DumpOptions options;
+    options.white_wildcards = "snapshot_test_*";
+    ASSERT_EQ(2, bvar::Variable::dump_exposed(&dumper, &options));
+    ASSERT_EQ(1u, dumper.count());
+    std::vector<bvar::SnapshotEntry> entries;
+    ASSERT_EQ(0, bvar::parse_snapshot(dumper.payload(), &entries));
+    ASSERT_EQ(1u, entries.size());
+    ASSERT_EQ("snapshot_test_adder", entries[0].name);
+    ASSERT_EQ(7, entries[0].int_value);
+    ASSERT_EQ(bvar::SNAPSHOT_SERIES_SIZE, entries[0].series.size());
+    ASSERT_DOUBLE_EQ(7, entries[0].series.back());
+}
+
+TEST(SnapshotTest, ring_file) {
+    const std::string path = "snapshot_test_dir/ring.snapshot";
+    std::string payload;
+    ASSERT_EQ(-1, bvar::read_latest_snapshot(
+                  "snapshot_test_dir/not_exist", &payload, NULL, NULL));
+
+    bvar::SnapshotFile file;
+    ASSERT_EQ(0, file.open(path, 3, 64));
+    // No snapshot yet.
+    ASSERT_EQ(-1, bvar::read_latest_snapshot(path, &payload, NULL, NULL));
+    ASSERT_EQ(-1, file.write(std::string(65, 'x'), 1, 0));
+
+    for (int i = 1; i <= 5; ++i) {
+        bvar::SnapshotDumper dumper(false);
+        dumper.dump_int("seq", i);
+        ASSERT_EQ(0, file.write(dumper.payload(), dumper.count(), i * 10));
+        int64_t time_us = 0;
+        uint64_t seq = 0;
+        ASSERT_EQ(0, bvar::read_latest_snapshot(path, &payload,
+                                                &time_us, &seq));
+        ASSERT_EQ(i * 10, time_us);
+        ASSERT_EQ((uint64_t)i, seq);
+        std::vector<bvar::SnapshotEntry> entries;
+        ASSERT_EQ(0, bvar::parse_snapshot(payload, &entries));
+        ASSERT_EQ(1u, entries.size());
+        ASSERT_EQ(i, entries[0].int_value);
+    }
+
+    // Reopening replaces the file.
+    ASSERT_EQ(0, file.open(path, 2, 128));
+    ASSERT_EQ(-1, bvar::read_latest_snapshot(path, &payload, NULL, NULL));
+    file.close();
+    unlink(path.c_str());
+    rmdir("snapshot_test_dir");
+}
+
+} // namespace
@@ -297,6 +297,69 @@ TEST_F(VariableTest, dump) {
     ASSERT_EQ(0UL, d._list.size());
 }
 
+class MyIntDumper : public MyDumper {
+public:
+    bool dump_int(const std::string& name, int64_t value) {
+        _int_list.push_back(std::make_pair(name, value));
+        return true;
+    }
+
+    std::vector<std::pair<std::string, int64_t> > _int_list;
+};
+
+TEST_F(VariableTest, dump_int) {
+    bvar::Adder<int> v1("var1");
+    v1 << 1;
+    bvar::Maxer<int64_t> v2("var2");
+    v2 << -2;
+    bvar::Status<std::string> v3("var3", "3");
+    bvar::Status<double> v4("var4", 4.5);
+    bvar::PassiveStatus<int> v5("var5", print_int, NULL);
+    bvar::Window<bvar::Adder<int> > v6("var6", &v1, 1);
+    bvar::IntRecorder v7("var7");
+
+    // Integers are sent by dump_int().
+    MyIntDumper d;
+    ASSERT_EQ(7, bvar::Variable::dump_exposed(&d, NULL));
+    ASSERT_EQ(3UL, d._list.size());
+    ASSERT_EQ("var3", d._list[0].first);
+    ASSERT_EQ("\"3\"", d._list[0].second);
+    ASSERT_EQ("var4", d._list[1].first);
+    ASSERT_EQ("4.5", d._list[1].second);
+    ASSERT_EQ("var7", d._list[2].first);
+    ASSERT_EQ(4UL, d._int_list.size());
+    ASSERT_EQ("var1", d._int_list[0].first);
+    ASSERT_EQ(1, d._int_list[0].second);
+    ASSERT_EQ("var2", d._int_list[1].first);
+    ASSERT_EQ(-2, d._int_list[1].second);
+    ASSERT_EQ("var5", d._int_list[2].first);
+    ASSERT_EQ(5, d._int_list[2].second);
+    ASSERT_EQ("var6", d._int_list[3].first);
+
+    // Dumpers not overriding dump_int() get integers printed.
+    MyDumper d2;
+    ASSERT_EQ(7, bvar::Variable::dump_exposed(&d2, NULL));
+    ASSERT_EQ(7UL, d2._list.size());
+    ASSERT_EQ("var1", d2._list[0].first);
+    ASSERT_EQ("1", d2._list[0].second);
+    ASSERT_EQ("var2", d2._list[1].first);
+    ASSERT_EQ("-2", d2._list[1].second);
+}
+
+TEST_F(VariableTest, dump_large_unsigned_int) {
+    bvar::Status<uint64_t> v1("var1", 1);
+    bvar::Status<uint64_t> v2("var2", 18446744073709551615ULL);
+    MyIntDumper d;
+    ASSERT_EQ(2, bvar::Variable::dump_exposed(&d, NULL));
+    ASSERT_EQ(1UL, d._int_list.size());
+    ASSERT_EQ("var1", d._int_list[0].first);
+    ASSERT_EQ(1, d._int_list[0].second);
+    // Not fitting in int64_t, described as text.
+    ASSERT_EQ(1UL, d._list.size());
+    ASSERT_EQ("var2", d._list[0].first);
+    ASSERT_EQ("18446744073709551615", d._list[0].second);
+}
+
 TEST_F(VariableTest, latency_recorder) {
     bvar::LatencyRecorder rec;
     rec << 1 << 2 << 3;
@@ -3,10 +3,12 @@
 // Author: Ge,Jun (gejun@baidu.com)
 // Date: 2010-12-04 11:59
 
+#include <vector>
 #include <gtest/gtest.h>
 #include "butil/errno.h"
 #include "butil/endpoint.h"
 #include "butil/logging.h"
+#include "butil/fd_guard.h"
 
 namespace {
 
@@ -109,4 +111,122 @@ TEST(EndPointTest, hash_table) {
     ASSERT_EQ(2u, m.size());
 }
 
+TEST(EndPointTest, unix_domain_socket) {
+    butil::EndPoint p1;
+    ASSERT_EQ(0, butil::str2endpoint("unix:/tmp/endpoint_unittest.sock", &p1));
+    ASSERT_TRUE(butil::is_extended_endpoint(p1));
+    ASSERT_STREQ("unix:/tmp/endpoint_unittest.sock",
+                 butil::endpoint2str(p1).c_str());
+    // Same address is interned to the same EndPoint.
+    butil::EndPoint p2;
+    ASSERT_EQ(0, butil::str2endpoint(" unix:/tmp/endpoint_unittest.sock ", &p2));
+    ASSERT_EQ(p1, p2);
+    butil::EndPoint p3;
+    ASSERT_EQ(0, butil::str2endpoint("unix:/tmp/endpoint_unittest2.sock", &p3));
+    ASSERT_NE(p1, p3);
+    ASSERT_EQ(-1, butil::str2endpoint("unix:", &p3));
+    ASSERT_EQ(-1, butil::str2endpoint(
+                  ("unix:/" + std::string(200, 'a')).c_str(), &p3));
+
+    butil::fd_guard listen_fd(butil::tcp_listen(p1));
+    ASSERT_GE(listen_fd, 0);
+    butil::fd_guard client_fd(butil::tcp_connect(p1, NULL));
+    ASSERT_GE(client_fd, 0);
+    butil::EndPoint remote;
+    ASSERT_EQ(0, butil::get_remote_side(client_fd, &remote));
+    ASSERT_EQ(p1, remote);
+    // Listening again on the path succeeds because the file is removed.
+    listen_fd.reset(butil::tcp_listen(p1));
+    ASSERT_GE(listen_fd, 0);
+    unlink("/tmp/endpoint_unittest.sock");
+}
+
+TEST(EndPointTest, ipv6) {
+    butil::EndPoint p1;
+    ASSERT_EQ(0, butil::str2endpoint("[::1]:8765", &p1));
+    ASSERT_TRUE(butil::is_extended_endpoint(p1));
+    ASSERT_STREQ("[::1]:8765", butil::endpoint2str(p1).c_str());
+    std::ostringstream os;
+    os << p1;
+    ASSERT_EQ("[::1]:8765", os.str());
+    butil::EndPoint p2;
+    ASSERT_EQ(0, butil::str2endpoint("::1", 8765, &p2));
+    ASSERT_EQ(p1, p2);
+    ASSERT_EQ(0, butil::str2endpoint("[0:0::1]:8765", &p2));
+    ASSERT_EQ(p1, p2);
+    ASSERT_EQ(-1, butil::str2endpoint("[::1]", &p2));
+    ASSERT_EQ(-1, butil::str2endpoint("[::1]:65536", &p2));
+    ASSERT_EQ(-1, butil::str2endpoint("[zz::1]:80", &p2));
+    // v4-mapped addresses are plain EndPoints.
+    ASSERT_EQ(0, butil::str2endpoint("[::ffff:1.2.3.4]:80", &p2));
+    ASSERT_FALSE(butil::is_extended_endpoint(p2));
+    ASSERT_STREQ("1.2.3.4:80", butil::endpoint2str(p2).c_str());
+
+    sockaddr_storage ss;
+    socklen_t size = 0;
+    ASSERT_EQ(0, butil::endpoint2sockaddr(p1, &ss, &size));
+    ASSERT_EQ(AF_INET6, ss.ss_family);
+    ASSERT_EQ(sizeof(sockaddr_in6), size);
+    butil::EndPoint p3;
+    ASSERT_EQ(0, butil::sockaddr2endpoint(&ss, size, &p3));
+    ASSERT_EQ(p1, p3);
+
+    butil::EndPoint any;
+    ASSERT_EQ(0, butil::str2endpoint("[::1]:0", &any));
+    butil::fd_guard listen_fd(butil::tcp_listen(any));
+    if (listen_fd < 0) {
+        LOG(WARNING) << "IPv6 is not supported in this environment";
+        return;
+    }
+    butil::EndPoint listened;
+    ASSERT_EQ(0, butil::get_local_side(listen_fd, &listened));
+    ASSERT_TRUE(butil::is_extended_endpoint(listened));
+    butil::fd_guard client_fd(butil::tcp_connect(listened, NULL));
+    ASSERT_GE(client_fd, 0);
+    butil::EndPoint remote;
+    ASSERT_EQ(0, butil::get_remote_side(client_fd, &remote));
+    ASSERT_EQ(listened, remote);
+}
+
+TEST(EndPointTest, extended_endpoint_lifetime) {
+    const size_t count0 = butil::extended_endpoint_count();
+    {
+        butil::EndPoint p1;
+        ASSERT_EQ(0, butil::str2endpoint("unix:/tmp/endpoint_lifetime.sock",
+                                         &p1));
+        ASSERT_EQ(count0 + 1, butil::extended_endpoint_count());
+        std::vector<butil::EndPoint> copies(100, p1);
+        butil::EndPoint p2;
+        ASSERT_EQ(0, butil::str2endpoint("unix:/tmp/endpoint_lifetime.sock",
+                                         &p2));
+        ASSERT_EQ(p1, p2);
+        ASSERT_EQ(count0 + 1, butil::extended_endpoint_count());
+        // Plain EndPoints never alias extended ones.
+        const butil::EndPoint none(butil::IP_NONE, p1.port);
+        ASSERT_FALSE(butil::is_extended_endpoint(none));
+        ASSERT_NE(none, p1);
+        // Overwriting drops the reference.
+        ASSERT_EQ(0, butil::str2endpoint("1.2.3.4:5", &p2));
+        ASSERT_FALSE(butil::is_extended_endpoint(p2));
+        copies.clear();
+        ASSERT_EQ(count0 + 1, butil::extended_endpoint_count());
+    }
+    ASSERT_EQ(count0, butil::extended_endpoint_count());
+
+    // Not limited by range of port.
+    std::vector<butil::EndPoint> points;
+    for (int i = 0; i < 70000; ++i) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "unix:/tmp/endpoint_lifetime_%d.sock", i);
+        butil::EndPoint pt;
+        ASSERT_EQ(0, butil::str2endpoint(buf, &pt));
+        points.push_back(pt);
+    }
+    ASSERT_EQ(count0 + 70000, butil::extended_endpoint_count());
+    ASSERT_STREQ("unix:/tmp/endpoint_lifetime_69999.sock",
+                 butil::endpoint2str(points.back()).c_str());
+    points.clear();
+    ASSERT_EQ(count0, butil::extended_endpoint_count());
+}
+
 }